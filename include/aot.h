@@ -0,0 +1,223 @@
+#ifndef aot_h
+#define aot_h
+
+/*
+ * Runtime support for C code emitted by bin/aot.
+ *
+ * Each icode becomes a call to one of these helpers, or to an exec handler
+ * directly, so there is no dispatch on icode type left at run time. The
+ * helpers return 0 on success and -1 on error, like the generated functions.
+ *
+ * Compares, increments and "x = a + b" on ints are C expressions instead,
+ * on values held in C locals of the generated function. A local is looked
+ * up once, by aot_int(), and stays valid until a tail call rebinds the
+ * frame; the helpers here are the fallback for other types and overflow.
+ */
+
+#include <assert.h>
+#include "exec.h"
+#include "corelib.h"
+
+static inline int aot_push(struct t_exec *exec, struct t_value *value)
+{
+  list_push(&exec->stack, value);
+  return 0;
+}
+
+/*
+ * Call a handler that pops its own operands, such as ASSIGN or POP.
+ */
+static inline int aot_op0(struct t_exec *exec, struct t_value * (*op)(struct t_exec *exec, struct t_icode *icode))
+{
+  return op(exec, NULL) ? 0 : -1;
+}
+
+/*
+ * Pop two operands, resolve variables, and push the handler's result.
+ * icode is only needed for an ADD that may append in place.
+ */
+static inline int aot_op2(struct t_exec *exec, struct t_value * (*op)(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2), struct t_icode *icode)
+{
+  struct t_value *opnd1, *opnd2, *val1, *val2, *ret;
+
+  opnd2 = list_pop(&exec->stack);
+  opnd1 = list_pop(&exec->stack);
+  assert(opnd1 && opnd2);
+  val1 = exec_operand(exec, opnd1);
+  val2 = exec_operand(exec, opnd2);
+  if (!val1 || !val2) {
+    fprintf(stderr, "Error: Undefined variable %s\n", val1 ? opnd2->name : opnd1->name);
+    return -1;
+  }
+  ret = op(exec, icode, val1, val2);
+  if (!ret) {
+    return -1;
+  }
+  list_push(&exec->stack, ret);
+
+  return 0;
+}
+
+/*
+ * A variable's value, if it is an int. The value is kept in a C local of
+ * the generated function, so the variable is looked up only once.
+ */
+static inline struct t_value * aot_int(struct t_exec *exec, struct t_value **local, char *name)
+{
+  struct t_var *var;
+
+  if (!*local) {
+    var = var_lookup(exec, name);
+    if (!var) {
+      return NULL;
+    }
+    *local = var->value;
+  }
+  return (*local)->type == VAL_INT ? *local : NULL;
+}
+
+/*
+ * Pop the condition of a JZ. Returns 1 when the jump is taken.
+ */
+static inline int aot_jz(struct t_exec *exec)
+{
+  struct t_value *cond;
+  int taken;
+
+  cond = list_pop(&exec->stack);
+  assert(cond);
+  taken = cond->type == VAL_FLOAT ? cond->floatval == 0 : cond->intval == 0;
+  exec_settle(exec);
+  return taken;
+}
+
+/*
+ * Compare and jump, as CMPJZ: returns 1 when the jump is taken, or -1 on
+ * error. Operands other than two ints go through the generic handler.
+ */
+static inline int aot_cmpjz(struct t_exec *exec, struct t_value *a, struct t_value *b, int cmp, struct t_value * (*op)(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2))
+{
+  struct t_value *val1, *val2;
+
+  val1 = exec_operand(exec, a);
+  val2 = exec_operand(exec, b);
+  if (val1 && val2 && val1->type == VAL_INT && val2->type == VAL_INT) {
+    switch (cmp) {
+    case I_EQ: return !(val1->intval == val2->intval);
+    case I_NE: return !(val1->intval != val2->intval);
+    case I_LT: return !(val1->intval < val2->intval);
+    case I_GT: return !(val1->intval > val2->intval);
+    case I_LE: return !(val1->intval <= val2->intval);
+    default:   return !(val1->intval >= val2->intval);
+    }
+  }
+
+  aot_push(exec, a);
+  aot_push(exec, b);
+  if (aot_op2(exec, op, NULL) < 0) {
+    return -1;
+  }
+  return aot_jz(exec);
+}
+
+/*
+ * Add a constant to a variable in place, as INCR. Overflow goes through
+ * the generic handler, which reports it.
+ */
+static inline int aot_incr(struct t_exec *exec, struct t_value *var, struct t_value *n, struct t_value * (*op)(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2), int sign)
+{
+  struct t_var *v;
+  long long sum;
+
+  v = var_lookup(exec, var->name);
+  if (v && v->value->type == VAL_INT && !v->value->frozen && !__builtin_add_overflow(v->value->intval, sign * n->intval, &sum)) {
+    v->value->intval = sum;
+    return 0;
+  }
+
+  aot_push(exec, var);
+  aot_push(exec, var);
+  aot_push(exec, n);
+  if (aot_op2(exec, op, NULL) < 0 || aot_op0(exec, &exec_i_assign) < 0 || aot_op0(exec, &exec_i_pop) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * x = a op b, through the handlers: PUSH x; PUSH a; PUSH b; op; ASSIGN; POP
+ */
+static inline int aot_arith(struct t_exec *exec, struct t_value *x, struct t_value *a, struct t_value *b, struct t_value * (*op)(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2), struct t_icode *icode)
+{
+  aot_push(exec, x);
+  aot_push(exec, a);
+  aot_push(exec, b);
+  if (aot_op2(exec, op, icode) < 0 || aot_op0(exec, &exec_i_assign) < 0 || aot_op0(exec, &exec_i_pop) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static inline int aot_native(struct t_exec *exec, struct t_func *func, int argc)
+{
+  return exec_call_native(exec, func, argc) ? 0 : -1;
+}
+
+/*
+ * A body that tail calls another function returns AOT_TAIL, with the
+ * callee's body in aot_next, and aot_call() runs that next, so a chain of
+ * tail calls takes no C stack whatever the compiler does with the calls.
+ */
+#define AOT_TAIL 1
+
+static int (*aot_next)(struct t_exec *exec);
+
+static inline int aot_tail(int (*body)(struct t_exec *exec))
+{
+  aot_next = body;
+  return AOT_TAIL;
+}
+
+/*
+ * Call a local function: push its frame and run its translated body, and
+ * the bodies of the functions it tail calls.
+ */
+static inline int aot_call(struct t_exec *exec, struct t_func *func, int argc, int (*body)(struct t_exec *exec), int line)
+{
+  int rc;
+
+  if (exec_push_frame(exec, func, argc, NULL) < 0) {
+    fprintf(stderr, "  on Line %d.\n", line);
+    return -1;
+  }
+  while ((rc = body(exec)) == AOT_TAIL) {
+    body = aot_next;
+  }
+  return rc;
+}
+
+/*
+ * Rebind the current frame for a tail call. The caller then jumps to its
+ * own entry, or returns the callee's body with aot_tail().
+ */
+static inline int aot_tcall(struct t_exec *exec, struct t_func *func, int argc, int discard, int line)
+{
+  if (exec_reuse_frame(exec, func, argc, discard) < 0) {
+    fprintf(stderr, "  on Line %d.\n", line);
+    return -1;
+  }
+  return 0;
+}
+
+static inline int aot_ret(struct t_exec *exec)
+{
+  return exec_return(exec, NULL);
+}
+
+static inline int aot_undefined(const char *name, int line)
+{
+  fprintf(stderr, "Error: Function %s() is not defined, on Line %d.\n", name, line);
+  return -1;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef array_h
+#define array_h
+
+/*
+ * Array values: contiguous storage of ints (long long), floats (double) or
+ * strings (struct t_value *). An ARRAY_MIXED array holds ints, floats and
+ * strings together, each as a struct t_value *, as keys() of a map with
+ * keys of both kinds does. Values hold an array by reference count, so
+ * assigning an array or passing it to a function shares it. A frozen array
+ * is shared between threads: it can't be changed, and isn't counted.
+ */
+
+#define ARRAY_SCALAR 0
+#define ARRAY_SSE2   1
+#define ARRAY_AVX2   2
+
+#define ARRAY_MIXED  -1
+
+struct t_value;
+struct t_fmtbuf;
+
+struct t_array {
+  int refs;
+  int frozen;
+  int type;
+  int len;
+  int cap;
+  void *data;
+};
+
+struct t_array * array_new(int type, int len);
+struct t_array * array_ref(struct t_array *array);
+void array_release(struct t_array *array);
+struct t_array * array_copy(struct t_array *array);
+void array_freeze(struct t_array *array, int frozen);
+int array_get(struct t_array *array, long long i, struct t_value *out);
+int array_set(struct t_array *array, long long i, struct t_value *value);
+int array_push(struct t_array *array, struct t_value *value);
+int array_format_elem(struct t_value *value, struct t_fmtbuf *fb);
+int array_format(struct t_array *array, struct t_fmtbuf *fb);
+
+/*
+ * Bulk operations. These use SSE2 or AVX2 kernels when the CPU has them,
+ * and scalar loops otherwise. PARSE1_SIMD=scalar or =sse2 caps the level.
+ */
+int array_simd(void);
+int array_sum(struct t_array *array, struct t_value *ret);
+int array_minmax(struct t_array *array, int max, struct t_value *ret);
+int array_dot(struct t_array *a, struct t_array *b, struct t_value *ret);
+struct t_array * array_scale(struct t_array *array, struct t_value *k);
+struct t_array * array_add(struct t_array *a, struct t_array *b, struct t_value *k);
+
+#endif
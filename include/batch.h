@@ -0,0 +1,54 @@
+#ifndef batch_h
+#define batch_h
+
+#include "exec.h"
+#include "pool.h"
+
+/*
+ * Batch runs: many scripts, each loaded once, run as jobs on a thread pool.
+ */
+
+/* What a thread wrote to stderr while it loaded a script or ran a job */
+struct t_batch_log {
+  char *text;
+  int len;
+  int cap;
+};
+
+/* A script named by one or more jobs, and the program loaded from it */
+struct t_batch_script {
+  char *path;
+  struct t_program *program;
+  struct t_batch_log err;
+};
+
+/* One run of a script, with what it printed and how it went */
+struct t_batch_job {
+  struct t_batch *batch;
+  char *path;
+  int script;
+  char *out;
+  int outlen;
+  struct t_batch_log err;
+  int status;
+  double secs;
+};
+
+/* A worker's exec, kept for as long as it runs jobs of the same program */
+struct t_batch_worker {
+  struct t_exec exec;
+  struct t_program *program;
+};
+
+struct t_batch {
+  struct t_batch_job *jobs;
+  int njobs;
+  struct t_batch_script *scripts;
+  int nscripts;
+  struct t_batch_worker *workers;
+  struct t_pool pool;
+};
+
+int batch_main(int argc, char **argv);
+
+#endif
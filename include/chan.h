@@ -0,0 +1,125 @@
+#ifndef chan_h
+#define chan_h
+
+#include <pthread.h>
+#include "parser.h"
+
+/*
+ * Channels between execs on different threads, and threads that run a
+ * function in an exec of their own. A channel is a bounded ring that any
+ * number of threads may send to and receive from without locks.
+ */
+
+/* Channels open at once, in the whole process */
+#define CHAN_MAX 4096
+#define CHAN_MAX_CAP (1 << 20)
+
+/* Tries of a full or empty ring before the task waits, if another CPU may change it */
+#define CHAN_SPIN 1000
+
+/*
+ * A value on its way between execs. A string on the heap goes as a
+ * reference to its buffer, which is shared for good. Other strings are
+ * copied, inline if they are short, and arrays are copied.
+ */
+struct t_msg {
+  int type;
+  long long intval;
+  double floatval;
+  int len;
+  struct t_strbuf *sbuf;
+  struct t_array *array;
+  char inl[VALUE_INLINE_LEN];
+};
+
+/* A ring slot. seq is pos while it is free for the sender at pos, and pos + 1 once it holds a message */
+struct t_chan_slot {
+  unsigned long seq;
+  struct t_msg msg;
+};
+
+/*
+ * The wake fds of the event loops waiting on one end of a channel. They
+ * are woken once: the fds are dropped then, and gen counts how often.
+ */
+struct t_chan_waiters {
+  pthread_mutex_t lock;
+  int waiting;
+  int gen;
+  int n;
+  int cap;
+  int *fds;
+};
+
+/*
+ * head is where the next message is received from, and tail where the
+ * next one is sent to. They are on cache lines of their own, so senders
+ * and receivers don't slow each other down. refs counts the execs that
+ * use the channel, under the table's lock.
+ */
+struct t_chan {
+  int id;
+  int refs;
+  int closed;
+  unsigned long mask;
+  struct t_chan_slot *slots;
+  struct t_chan_waiters senders;
+  struct t_chan_waiters receivers;
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+};
+
+/* A thread running a function in an exec of its own, until it is joined */
+struct t_stage {
+  int id;
+  pthread_t thread;
+  struct t_exec *caller;
+  struct t_func *func;
+  int argc;
+  struct t_msg args[MAX_FUNC_ARGS];
+  struct t_msg result;
+  int status;
+  int wakefd;
+  char *out;
+  int outlen;
+  struct t_stage *next;
+};
+
+/*
+ * An exec's channels: those it has used, by slot in the table, and the
+ * slots of those it made, which it closes on reset. stages are the threads
+ * it started, which haven't been joined yet. failed is set by one that
+ * fails, to its id, which the exec's event loop is woken to see.
+ */
+struct t_chans {
+  struct t_chan **used;
+  int nused;
+  int *own;
+  int nown;
+  int capown;
+  struct t_stage *stages;
+  int next_stage;
+  int failed;
+};
+
+struct t_exec;
+
+void chans_init(struct t_chans *chans);
+int chan_new(struct t_exec *exec, long long cap);
+struct t_chan * chan_get(struct t_exec *exec, struct t_value *id, const char *name);
+int chan_send(struct t_exec *exec, struct t_chan *chan, struct t_value *value);
+int chan_recv(struct t_exec *exec, struct t_chan *chan, struct t_value *end, struct t_value *ret);
+int chan_try_send(struct t_chan *chan, struct t_msg *msg);
+int chan_try_recv(struct t_chan *chan, struct t_msg *end, struct t_value *ret);
+int chan_watch(struct t_chan_waiters *waiters, int fd, int *gen);
+int chan_watched(struct t_chan_waiters *waiters, int gen);
+void chan_unwatch(struct t_chan_waiters *waiters, int fd, int gen);
+void chan_close(struct t_chan *chan);
+void msg_free(struct t_msg *msg);
+int stage_start(struct t_exec *exec, struct t_func *func, int argc, struct t_value **argv);
+int stage_join(struct t_exec *exec, long long id, struct t_value *ret);
+int stage_join_all(struct t_exec *exec);
+void chans_reset(struct t_exec *exec);
+void chans_close(struct t_exec *exec);
+
+#endif
@@ -1 +1,53 @@
+#ifndef corelib_h
+#define corelib_h
+
+#include "exec.h"
+
+/* A native function, and the C symbol implementing it */
+struct t_native {
+  char *name;
+  int (*fn)(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+  char *symbol;
+};
+
+extern const struct t_native corelib_natives[];
+
+int fn_println(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_flush(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_read(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_write(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_open(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_readline(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_eof(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_close(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_len(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_range(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_push(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_sum(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_min(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_max(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_dot(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_scale(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_map_add(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_get(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_set(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_has(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_delete(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_keys(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_parallel_for(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_pipe(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_socketpair(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_fd_read(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_fd_write(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_fd_close(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_sleep(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_timer(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_channel(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_send(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_recv(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_chan_close(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_thread(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+int fn_join(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
 int core_apply(struct t_exec *exec);
+
+#endif
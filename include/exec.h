@@ -3,21 +3,57 @@
 
 #include "parser.h"
 #include "util.h"
+#include "jit.h"
+#include "io.h"
+#include "program.h"
+#include "task.h"
+#include "loop.h"
+#include "chan.h"
 
 #define EXEC_SCRATCH 1024
+#define EXEC_MAX_FRAMES 10000
+#define EXEC_MAX_DEOPT 2
+#define EXEC_MAX_FREE_VALUES 256
 
-extern struct item *firstfunc;
-extern struct item *lastfunc;
-
-/* Execution environment */
+/*
+ * Execution environment: the state of one run of a program. Several execs
+ * can run one program, and exec_reset() readies an exec for another run.
+ * globals, if set, are the frozen variables of another exec, which this one
+ * reads instead of its own. feed, if set, is called when the main task
+ * runs off the end of the code, to set current to more of it, or to NULL.
+ */
 struct t_exec {
-  struct t_parser parser;
+  struct t_program *program;
+  int own_program;
   struct list stack;
   struct list functions;
+  struct t_func **calls;
+  int ncalls;
   struct list vars;
+  struct list *globals;
   struct item *current;
+  int (*feed)(struct t_exec *exec);
+  void *feed_arg;
   struct list formats;
   struct list values;
+  int values_mark;
+  struct list free_values;
+  struct list frames;
+  struct t_tasks tasks;
+  struct t_loop loop;
+  struct t_chans chans;
+  struct t_output out;
+  struct t_mapfile *files[IO_MAX_FILES];
+};
+
+/* Call frame of a local function */
+struct t_frame {
+  struct t_func *func;
+  struct item *ret;
+  struct list locals;
+  int stack_base;
+  int values_mark;
+  int discard;
 };
 
 /* ICode Operation */
@@ -26,6 +62,7 @@ struct t_icode_op {
   struct t_value * (*op0)(struct t_exec *exec, struct t_icode *icode);
   struct t_value * (*op1)(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd);
   struct t_value * (*op2)(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+  int generic;
 };
 
 extern const struct t_icode_op operations[];
@@ -33,23 +70,52 @@ extern const int operations_len;
 
 int exec_main(int argc, char* argv[]);
 int exec_init(struct t_exec *exec, FILE *in);
+int exec_init_program(struct t_exec *exec, struct t_program *program);
+int exec_init_worker(struct t_exec *exec, struct t_exec *caller);
+void exec_reset(struct t_exec *exec);
 int exec_close(struct t_exec *exec);
 struct t_expr * exec_push(struct t_exec *exec, struct t_expr *expr);
 struct t_expr * exec_pop(struct t_exec *exec);
 
 struct t_value * exec_stmt(struct t_exec *exec);
 int exec_statements(struct t_exec *exec);
-void exec_get_funcs(struct t_exec *exec);
 int exec_run(struct t_exec *exec);
 struct t_value * exec_icode(struct t_exec *exec, struct t_icode *icode);
+int exec_generic_type(struct t_icode *icode);
 
 struct t_value * exec_i_nop(struct t_exec *exec, struct t_icode *icode);
 struct t_value * exec_i_pop(struct t_exec *exec, struct t_icode *icode);
+void exec_settle(struct t_exec *exec);
+void exec_forget(struct t_exec *exec, int start, int end);
+void exec_reclaim(struct t_exec *exec, int mark);
+struct t_value * exec_value(struct t_exec *exec, int type);
+struct t_value * exec_int(struct t_exec *exec, long long n);
+struct t_value * exec_float(struct t_exec *exec, double f);
 struct t_value * exec_i_push(struct t_exec *exec, struct t_icode *icode);
 struct t_value * exec_i_fcall(struct t_exec *exec, struct t_icode *fcall);
 struct t_value * exec_i_jmp(struct t_exec *exec, struct t_icode *jmp);
 struct t_value * exec_i_jz(struct t_exec *exec, struct t_icode *jmp);
 struct t_value * exec_i_jst(struct t_exec *exec, struct t_icode *jmp);
+struct t_value * exec_i_ret(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_tcall(struct t_exec *exec, struct t_icode *tcall);
+struct t_value * exec_i_cmpjz(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_incr(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_call1(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_array(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_make_array(struct t_exec *exec, int n);
+struct t_value * exec_i_index(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_setindex(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_map(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_make_map(struct t_exec *exec, int n);
+int exec_map_get(struct t_map *map, struct t_value *key, struct t_value *ret);
+int exec_concat_n(struct t_exec *exec, struct t_value **opnds, int n);
+struct t_value * exec_i_concat(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_spawn(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_i_yield(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_parts(struct t_exec *exec, struct t_icode *icode);
+struct t_value * exec_operand(struct t_exec *exec, struct t_value *opnd);
+struct t_value * exec_invoke_native(struct t_exec *exec, struct t_func *func, int argc, struct t_value **argv);
+struct t_value * exec_call(struct t_exec *exec, struct t_func *func, int argc, struct t_value **argv);
 int exec_jump(struct t_exec *exec, int offset);
 
 struct t_value * exec_i_assign(struct t_exec *exec, struct t_icode *icode);
@@ -57,6 +123,9 @@ struct t_value * exec_i_add(struct t_exec *exec, struct t_icode *icode, struct t
 struct t_value * exec_i_sub(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
 struct t_value * exec_i_mul(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
 struct t_value * exec_i_div(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_arith(struct t_exec *exec, char op, struct t_value *opnd1, struct t_value *opnd2);
+int exec_equal(struct t_value *opnd1, struct t_value *opnd2);
+int exec_compare(int type, struct t_value *opnd1, struct t_value *opnd2);
 struct t_value * exec_i_eq(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
 struct t_value * exec_i_ne(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
 struct t_value * exec_i_lt(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
@@ -64,16 +133,49 @@ struct t_value * exec_i_gt(struct t_exec *exec, struct t_icode *icode, struct t_
 struct t_value * exec_i_le(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
 struct t_value * exec_i_ge(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
 
+/*
+ * Quickening
+ */
+int exec_quicken(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_deopt(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_concat(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, const char *str2, int len2);
+struct t_value * exec_i_add_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_add_ss(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_add_si(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_sub_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_mul_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_div_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_eq_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_ne_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_lt_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_gt_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_le_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+struct t_value * exec_i_ge_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2);
+
 /*
  * Variables
  */
 struct t_var * var_new(char *name, struct t_value *clonefrom);
 void var_close(struct t_var *var);
 struct t_var * var_lookup(struct t_exec *exec, char *name);
+struct list * var_scope(struct t_exec *exec);
+
+/*
+ * Call frames
+ */
+struct t_frame * frame_new(struct t_func *func, struct item *ret);
+void frame_free(struct t_frame *frame);
 
 void exec_addfunc(struct t_exec *exec, struct t_func *func);
 struct t_func * exec_addfunc2(struct t_exec *exec, char *name, int (*fn)(struct t_func *func, struct list *args, struct t_value *ret));
+struct t_func * exec_addnative(struct t_exec *exec, char *name, int (*fn)(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret));
 struct t_func * exec_funcbyname(struct t_exec *exec, char *name);
+struct t_func * exec_resolve_func(struct t_exec *exec, struct t_icode *fcall);
+int exec_bind_args(struct t_exec *exec, struct t_func *func, int argc, struct list *locals);
+struct t_value * exec_call_native(struct t_exec *exec, struct t_func *func, int argc);
+int exec_push_frame(struct t_exec *exec, struct t_func *func, int argc, struct item *ret);
+int exec_reuse_frame(struct t_exec *exec, struct t_func *func, int argc, int discard);
+int exec_return(struct t_exec *exec, struct item **resume);
 struct t_expr * exec_invoke(struct t_exec *exec, struct t_expr *expr);
 
 #endif
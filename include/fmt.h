@@ -0,0 +1,33 @@
+#ifndef fmt_h
+#define fmt_h
+
+/*
+ * Number formatting, and growable buffers to format into.
+ */
+
+/* Longest int or float from fmt_int() or fmt_float(), with the NUL */
+#define FMT_NUM_MAX 32
+
+/*
+ * A buffer that starts out in storage the caller provides, usually on its
+ * stack, and moves to the heap if it has to grow. buf is always
+ * NUL-terminated.
+ */
+struct t_fmtbuf {
+  char *buf;
+  int len;
+  int cap;
+  int heap;
+};
+
+int fmt_int(char *dst, long long n);
+int fmt_float(char *dst, double d);
+
+void fmtbuf_init(struct t_fmtbuf *fb, char *buf, int cap);
+char * fmtbuf_reserve(struct t_fmtbuf *fb, int n);
+int fmtbuf_add(struct t_fmtbuf *fb, const char *str, int len);
+int fmtbuf_int(struct t_fmtbuf *fb, long long n);
+int fmtbuf_float(struct t_fmtbuf *fb, double d);
+void fmtbuf_close(struct t_fmtbuf *fb);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef io_h
+#define io_h
+
+#include <stddef.h>
+
+/*
+ * Script I/O: a buffered output stream, and files mapped into memory for
+ * reading.
+ */
+
+#define IO_BUF_SIZE 65536
+#define IO_MAX_FILES 16
+
+/* The fd of an output that is kept in memory */
+#define IO_CAPTURE -1
+
+/*
+ * Output is collected in buf and written out when it is full, or when it
+ * is flushed. Writes that don't fit go out together with the buffer, in
+ * one writev(). On a terminal each line is flushed as it is written.
+ * A captured output is never written out: buf grows to hold all of it,
+ * until output_take() hands it over.
+ */
+struct t_output {
+  int fd;
+  int tty;
+  int len;
+  int cap;
+  char *buf;
+};
+
+/* A file mapped for reading, and the offset of the next line */
+struct t_mapfile {
+  char *data;
+  size_t size;
+  size_t pos;
+};
+
+int output_init(struct t_output *out, int fd);
+int output_write(struct t_output *out, const char *data, int len);
+int output_flush(struct t_output *out);
+int output_capture(struct t_output *out);
+char * output_take(struct t_output *out, int *len);
+int output_close(struct t_output *out);
+struct t_output * output_bind(struct t_output *out);
+
+struct t_mapfile * mapfile_open(const char *path);
+int mapfile_line(struct t_mapfile *file, const char **line);
+void mapfile_close(struct t_mapfile *file);
+int io_write_file(const char *path, const char *data, int len);
+
+#endif
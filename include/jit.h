@@ -0,0 +1,42 @@
+#ifndef jit_h
+#define jit_h
+
+#include <stddef.h>
+#include <pthread.h>
+#include "util.h"
+
+#define JIT_THRESHOLD 100
+#define JIT_ICODE_MAX_SIZE 512
+
+struct t_exec;
+struct t_func;
+struct t_icode;
+
+/*
+ * Template JIT state of a program. Regions are compiled under lock, and
+ * published on their first icode once they are ready to run.
+ */
+struct t_jit {
+  int enabled;
+  int threshold;
+  int perfmap;
+  struct list regions;
+  pthread_mutex_t lock;
+};
+
+/* A compiled run of consecutive icodes */
+struct t_jit_region {
+  struct t_icode *start;
+  unsigned char *code;
+  size_t size;
+  int (*run)(struct t_exec *exec);
+};
+
+int jit_init(struct t_jit *jit);
+void jit_close(struct t_jit *jit);
+int jit_loop(struct t_exec *exec, struct item *jmp);
+int jit_func(struct t_exec *exec, struct t_func *func);
+int jit_run(struct t_exec *exec, struct t_icode *icode);
+void jit_drop(struct t_jit *jit, struct t_icode *icode);
+
+#endif
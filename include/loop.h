@@ -0,0 +1,88 @@
+#ifndef loop_h
+#define loop_h
+
+#include "chan.h"
+
+/*
+ * An exec's event loop, on epoll. A task that would block on an fd, or
+ * that sleeps, waits in the loop while the other tasks run, and is queued
+ * again when its wait is over. Deadlines are kept in a heap, and one
+ * timerfd is set to the earliest. A task waiting on a channel is woken by
+ * a write to the loop's wake fd, from the thread that changed it.
+ */
+
+struct t_exec;
+struct t_task;
+struct t_func;
+struct t_value;
+
+#define LOOP_READ  1
+#define LOOP_WRITE 2
+#define LOOP_SLEEP 3
+#define LOOP_TIMER 4
+#define LOOP_SEND  5
+#define LOOP_RECV  6
+
+#define LOOP_EVENTS 64
+
+/*
+ * A task's wait, which ends by filling in ret, the result of the call
+ * that waits. A timer has no task: it spawns func when it is due. A send
+ * waits with its message in msg, and a recv with the value it gives once
+ * the channel is closed.
+ */
+struct t_wait {
+  int type;
+  int fd;
+  struct t_task *task;
+  struct t_value *ret;
+  int len;
+  char *data;
+  int done;
+  long long deadline;
+  struct t_func *func;
+  struct t_chan *chan;
+  int gen;
+  struct t_msg msg;
+  struct t_wait *prev;
+  struct t_wait *next;
+};
+
+/* The waits on an fd, and the events it is registered for */
+struct t_fdwaits {
+  struct t_wait *reader;
+  struct t_wait *writer;
+  int events;
+};
+
+/*
+ * epfd, timerfd and wakefd are opened by the first wait. waits lists
+ * every wait, and waiting counts them.
+ */
+struct t_loop {
+  int epfd;
+  int timerfd;
+  int wakefd;
+  int waiting;
+  struct t_wait *waits;
+  struct t_fdwaits *fds;
+  int nfds;
+  struct t_wait **heap;
+  int nheap;
+  int capheap;
+};
+
+void loop_init(struct t_loop *loop);
+int loop_read(struct t_exec *exec, int fd, int n, struct t_value *ret);
+int loop_write(struct t_exec *exec, int fd, const char *data, int len, struct t_value *ret);
+int loop_sleep(struct t_exec *exec, long long ms, struct t_value *ret);
+int loop_timer(struct t_exec *exec, long long ms, struct t_func *func);
+int loop_chan(struct t_exec *exec, int type, struct t_chan *chan, struct t_msg *msg, struct t_value *ret);
+int loop_poll(struct t_exec *exec, int block);
+int loop_busy(struct t_loop *loop, int fd);
+int loop_wakefd(struct t_loop *loop);
+int loop_pipe(int fds[2], int sockets);
+void loop_reset(struct t_exec *exec);
+void loop_close(struct t_loop *loop);
+
+#endif
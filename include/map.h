@@ -0,0 +1,57 @@
+#ifndef map_h
+#define map_h
+
+/*
+ * Map values: hash tables from string or int keys to values, with Robin
+ * Hood open addressing. Each slot keeps its key's hash and type, and an int
+ * key itself or a string key's pointer, so probing stays within the slot
+ * array. The values are kept in an array of their own, at the same index
+ * as their slots, so a hit reads the value from the table without making
+ * the slots bigger to probe. Values hold a map by reference count, like
+ * arrays, so a map that holds itself is never freed. Maps freeze like
+ * arrays.
+ */
+
+#define MAP_MIN_CAP 8
+
+struct t_value;
+struct t_array;
+struct t_fmtbuf;
+
+/*
+ * dist is 0 for an empty slot, else 1 + the distance from the home slot.
+ * key holds a string key's value, and is NULL for an int key.
+ */
+struct t_map_slot {
+  unsigned int hash;
+  unsigned short dist;
+  unsigned short type;
+  union {
+    long long i;
+    const char *s;
+  } k;
+  struct t_value *key;
+};
+
+struct t_map {
+  int refs;
+  int frozen;
+  int count;
+  int mask;
+  struct t_map_slot *slots;
+  struct t_value *values;
+};
+
+struct t_map * map_new(int count);
+struct t_map * map_ref(struct t_map *map);
+void map_release(struct t_map *map);
+void map_freeze(struct t_map *map, int frozen);
+int map_hash(struct t_value *key, unsigned int *hash);
+int map_get(struct t_map *map, struct t_value *key, struct t_value **value);
+int map_set(struct t_map *map, struct t_value *key, struct t_value *value);
+int map_delete(struct t_map *map, struct t_value *key);
+struct t_array * map_keys(struct t_map *map);
+int map_format_key(struct t_value *key, char *buf, int size);
+int map_format(struct t_map *map, struct t_fmtbuf *fb);
+
+#endif
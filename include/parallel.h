@@ -0,0 +1,40 @@
+#ifndef parallel_h
+#define parallel_h
+
+#include <pthread.h>
+#include "exec.h"
+
+/*
+ * parallel_for(): calls of a function over a range of ints, in chunks that
+ * run on threads, each chunk in an exec of its own.
+ */
+
+#define PARALLEL_MAX_CHUNKS 64
+
+struct t_parallel;
+
+/* A chunk of the range, with the sum of its results and what it printed */
+struct t_parallel_chunk {
+  struct t_parallel *par;
+  long long lo;
+  long long hi;
+  struct t_value sum;
+  char *out;
+  int outlen;
+  int status;
+};
+
+struct t_parallel {
+  struct t_exec *exec;
+  struct t_func *func;
+  struct t_parallel_chunk chunks[PARALLEL_MAX_CHUNKS];
+  int nchunks;
+  int remaining;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+};
+
+int parallel_for(struct t_exec *exec, long long lo, long long hi, struct t_func *func, struct t_value *ret);
+
+#endif
@@ -2,14 +2,23 @@
 #define parser_h
 
 #include "scanner.h"
+#include "strtab.h"
+#include "strbuf.h"
+#include "array.h"
+#include "map.h"
+#include "fmt.h"
 
 #define PARSER_FORMAT_BUF_SIZE 1024
-#define STATEMENT_FORMAT_BUF_SIZE 1024
 #define PARSER_SCRATCH_BUF 1024
 #define MAX_FUNC_NAME 100
 #define MAX_FUNC_ARGS 20
 #define MAX_PARSE_ERRORS 10
 #define MAX_ERROR_MSG 200
+#define VALUE_INLINE_LEN 16
+#define MAX_CONCAT 16
+
+/* Native functions are called with the exec they run in */
+struct t_exec;
 
 #define PARSER_ERR_NONE 0
 #define PARSER_ERR_MAX_ERRORS 1
@@ -30,6 +39,8 @@
 #define VAL_OBJECT  5
 #define VAL_VAR     6
 #define VAL_FCALL   7
+#define VAL_ARRAY   8
+#define VAL_MAP     9
 
 #define I_NOP       0
 #define I_PUSH      1
@@ -49,6 +60,42 @@
 #define I_GT        15
 #define I_LE        16
 #define I_GE        17
+#define I_RET       18
+#define I_TCALL     19
+
+/* Superinstructions, formed by parser_fuse() */
+#define I_CMPJZ     20
+#define I_INCR      21
+#define I_CALL1     22
+
+/* Type-specialized icodes, rewritten in place by exec_quicken() */
+#define I_ADD_II    23
+#define I_ADD_SS    24
+#define I_ADD_SI    25
+#define I_SUB_II    26
+#define I_MUL_II    27
+#define I_DIV_II    28
+#define I_EQ_II     29
+#define I_NE_II     30
+#define I_LT_II     31
+#define I_GT_II     32
+#define I_LE_II     33
+#define I_GE_II     34
+
+/* Arrays */
+#define I_ARRAY     35
+#define I_INDEX     36
+#define I_SETINDEX  37
+
+/* Maps */
+#define I_MAP       38
+
+/* String + chain, formed by parser_fuse() */
+#define I_CONCAT_N  39
+
+/* Tasks */
+#define I_SPAWN     40
+#define I_YIELD     41
 
 extern char *parser_keywords[];
 extern char *icodes[];
@@ -71,6 +118,9 @@ struct t_parser {
   struct list output;
   struct list functions;
   int max_output;
+  int func_depth;
+  int fuse;
+  struct t_strtab strings;
   char formatbuf[PARSER_FORMAT_BUF_SIZE];
 };
 
@@ -88,10 +138,18 @@ struct t_fcall {
 
 struct t_value {
   int type;
-  int intval;
-  float floatval;
+  long long intval;
+  double floatval;
   char *stringval;
   int len;
+  struct t_strbuf *sbuf;
+  struct t_array *array;
+  struct t_map *map;
+  int temp;
+  unsigned int hash;
+  int interned;
+  int frozen;
+  char inl[VALUE_INLINE_LEN];
   char *name;
   int argc;
   char *formatbuf;
@@ -101,14 +159,24 @@ struct t_value {
 struct t_func {
   char *name;
   
-  /* Native function */
+  /* Native function, called with the arguments in argv */
+  int (*native)(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret);
+
+  /* Native function registered with exec_addfunc2(), with the arguments in a list */
   int (*invoke)(struct t_func *func, struct list *args, struct t_value *ret);
 
   /* Local function */
   int start;
   int end;
+  int argc;
+  char *params[MAX_FUNC_ARGS];
+  struct item *entry;
+  int hits;
 };
 
+#define value_is_num(v) ((v)->type == VAL_INT || (v)->type == VAL_FLOAT)
+#define value_num(v) ((v)->type == VAL_FLOAT ? (v)->floatval : (double) (v)->intval)
+
 struct t_var {
   char *name;
   struct t_value *value;
@@ -120,8 +188,22 @@ struct t_icode {
   char *formatbuf;
   int addr;
   struct t_token *token;
+  struct t_icode **parts;
+  int nparts;
+  int deopt;
+  int hits;
+  void *jit;
+  int inplace;
 };
 
+/*
+ * Quickening rewrites an icode's type while other execs may be running the
+ * same program, so it is read and written atomically. Every type it can
+ * hold has a handler, so any value a thread sees is safe to run.
+ */
+#define icode_type(icode) __atomic_load_n(&(icode)->type, __ATOMIC_RELAXED)
+#define icode_set_type(icode, t) __atomic_store_n(&(icode)->type, (t), __ATOMIC_RELAXED)
+
 /*
  * Parser general
  */
@@ -147,6 +229,12 @@ int parse_stmt(struct t_parser *parser);
 int parse_if(struct t_parser *parser);
 int parse_while(struct t_parser *parser);
 int parse_func(struct t_parser *parser);
+int parse_return(struct t_parser *parser);
+int parse_yield(struct t_parser *parser);
+int parse_spawn(struct t_parser *parser);
+void parser_mark_tail_calls(struct t_parser *parser, struct item *first);
+int parser_fuse(struct t_parser *parser);
+void parser_mark_appends(struct t_parser *parser);
 int parse_assign(struct t_parser *parser);
 int compare_multiple_strings(const char *source, char **list);
 int parse_expr(struct t_parser *parser);
@@ -156,6 +244,9 @@ int parse_factor(struct t_parser *parser);
 int parse_num(struct t_parser *parser);
 int parse_name(struct t_parser *parser);
 int parse_fcall(struct t_parser *parser, char *name);
+int parse_array(struct t_parser *parser);
+int parse_index(struct t_parser *parser);
+int parse_map(struct t_parser *parser);
 
 /*
  * Values
@@ -169,11 +260,26 @@ void icode_free(struct t_icode *icode);
 struct t_icode * create_icode_append(struct t_parser *parser, int type, struct t_value *value);
 char * format_icode(struct t_parser *parser, struct t_icode *icode);
 struct t_value * create_value(int type);
-struct t_value * create_num_from_int(int v);
+struct t_value * create_num_from_int(long long v);
+struct t_value * create_num_from_float(double v);
 struct t_value * create_num_from_str(char * v);
 struct t_value * create_str(char *str);
+struct t_value * create_interned_str(struct t_strtab *strings, const char *str);
+struct t_value * create_interned_var(struct t_strtab *strings, const char *name);
+int value_set_str(struct t_value *value, const char *str, int len);
+int value_append_str(struct t_value *value, const char *str, int len);
+int value_copy_str(struct t_value *value, struct t_value *from);
+int value_move_str(struct t_value *value, struct t_value *from);
+int value_copy(struct t_value *value, struct t_value *from);
+char * value_alloc_str(struct t_value *value, int len);
+int value_str_owned(struct t_value *value);
+unsigned int value_str_hash(struct t_value *value);
+void value_freeze(struct t_value *value, int frozen);
+int value_str_eq(struct t_value *a, struct t_value *b);
 struct t_value * create_var(char *str);
 struct t_value * create_fcall(char *name, int argc);
+int value_format_num(struct t_value *value, char *buf, int size);
+int value_format(struct t_fmtbuf *fb, struct t_value *value);
 char * format_value(struct t_value *value);
 char * value_to_s(struct t_value *value);
 
@@ -0,0 +1,92 @@
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <stdio.h>
+#include <pthread.h>
+#include "exec.h"
+
+/*
+ * Pipelined runs: a script is scanned, parsed and run all at once, each
+ * on a thread of its own, a top-level statement at a time. So a script
+ * starts running while the rest of it is still being read, and only the
+ * statements in between are held in memory, not the whole script.
+ */
+
+/* Tokens in a batch, and batches or statements a ring holds */
+#define PIPE_BATCH 256
+#define PIPE_TOKEN_DEPTH 16
+#define PIPE_STMT_DEPTH 256
+
+/* Tries of a full or empty ring before the thread sleeps, if another CPU may change it */
+#define PIPE_SPIN 1000
+
+/*
+ * A bounded ring of pointers from one thread to one other, without locks.
+ * head is where the next item is taken from, and tail where the next one
+ * is put. The producer sets ended after its last item; the consumer sets
+ * closed if it stops early, and later puts fail. sleeping counts the
+ * sides waiting on cond.
+ */
+struct t_pipe_ring {
+  void **slots;
+  unsigned long mask;
+  int ended;
+  int closed;
+  int sleeping;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+};
+
+/* Tokens from the scanner, for the parser */
+struct t_pipe_batch {
+  int n;
+  struct t_token *tokens[PIPE_BATCH];
+};
+
+/*
+ * A parsed top-level statement: its icodes, the tokens they came from, and
+ * the functions it defines, of which the first installed belong to the
+ * program by now. Its icodes are at addresses base and up. Statements that
+ * define functions are kept, and the others are freed once they have run.
+ */
+struct t_pipe_stmt {
+  struct list code;
+  struct list tokens;
+  struct list funcs;
+  int installed;
+  int base;
+};
+
+/*
+ * The exec runs program, which gets the functions of the statements as
+ * they run. The parser parses into parser, whose scanner takes the tokens
+ * of batch from next on, and base is the address of the next statement.
+ * failed is set if the script doesn't parse. stmt is the statement the
+ * exec runs, and kept are those kept. started counts the threads.
+ */
+struct t_pipeline {
+  struct t_program *program;
+  struct t_scanner scanner;
+  struct t_parser parser;
+  struct t_pipe_ring tokens;
+  struct t_pipe_ring stmts;
+  struct t_pipe_batch *batch;
+  int next;
+  int base;
+  int failed;
+  struct t_pipe_stmt *stmt;
+  struct list kept;
+  pthread_t scan_thread;
+  pthread_t parse_thread;
+  int started;
+};
+
+int pipeline_init(struct t_pipeline *pipe, FILE *in);
+int pipeline_start(struct t_pipeline *pipe);
+int pipeline_run(struct t_pipeline *pipe, struct t_exec *exec);
+void pipeline_close(struct t_pipeline *pipe);
+int pipeline_main(FILE *in);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef pool_h
+#define pool_h
+
+#include <pthread.h>
+
+/*
+ * A work-stealing thread pool. Each worker has a deque of tasks: it takes
+ * the newest task from its own, and when that is empty steals the oldest
+ * from another worker's.
+ */
+
+#define POOL_DEQUE_SIZE 64
+
+struct t_pool_task {
+  void (*fn)(void *arg, int worker);
+  void *arg;
+};
+
+/* A worker's tasks, from top (oldest) up to bottom (newest) */
+struct t_deque {
+  pthread_mutex_t lock;
+  struct t_pool_task *tasks;
+  int cap;
+  long top;
+  long bottom;
+};
+
+struct t_pool_worker {
+  struct t_pool *pool;
+  int id;
+  pthread_t thread;
+  struct t_deque deque;
+  long steals;
+};
+
+struct t_pool {
+  int n;
+  struct t_pool_worker *workers;
+  int next;
+  int queued;
+  int pending;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+};
+
+int pool_cpus(void);
+int pool_init(struct t_pool *pool, int n);
+int pool_submit(struct t_pool *pool, void (*fn)(void *arg, int worker), void *arg);
+void pool_wait(struct t_pool *pool);
+long pool_steals(struct t_pool *pool);
+void pool_close(struct t_pool *pool);
+
+#endif
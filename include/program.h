@@ -0,0 +1,28 @@
+#ifndef program_h
+#define program_h
+
+#include <stdio.h>
+#include "parser.h"
+#include "jit.h"
+
+/*
+ * A parsed program: its icodes, constants and functions, and the machine
+ * code the JIT made from them. After program_load() it is only read, so
+ * any number of execs can run it at once, on any threads. The exceptions
+ * are the quickened icode types and the hit counters, which are written
+ * with atomics, and JIT regions, which are compiled under the JIT's lock.
+ */
+struct t_program {
+  struct t_parser parser;
+  struct t_jit jit;
+};
+
+struct t_program * program_new(FILE *in);
+struct t_program * program_load(FILE *in);
+void program_link(struct t_program *program);
+int program_add_func(struct t_program *program, struct t_func *func);
+void program_drop_funcs(struct t_program *program, int n);
+void program_relocate(struct list *code, struct list *funcs, int base);
+void program_free(struct t_program *program);
+
+#endif
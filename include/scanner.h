@@ -39,6 +39,11 @@ extern char *parse_error_names[];
 #define TT_STRING  12
 #define TT_LT      13
 #define TT_GT      14
+#define TT_BRACKETL 15
+#define TT_BRACKETR 16
+#define TT_BRACEL  17
+#define TT_BRACER  18
+#define TT_COLON   19
 
 extern char *token_types[];
 
@@ -55,7 +60,7 @@ extern char *token_types[];
 
 extern char * scanner_cc_names[];
 
-#define MAX_NUM_LEN 4
+#define MAX_NUM_LEN 18
 #define MAX_NAME_LEN 50
 #define MAX_STRING_LEN 50
 
@@ -78,8 +83,14 @@ struct t_token {
   char *formatbuf;
 };
 
+/*
+ * A scanner reads in, or, if in is NULL, takes ready tokens from feed,
+ * which gives an EOF token once there are no more.
+ */
 struct t_scanner {
   FILE *in;
+  struct t_token * (*feed)(void *arg);
+  void *feed_arg;
   int error;
   int debug;
   struct t_char *current;
@@ -98,6 +109,7 @@ void scanner_close(struct t_scanner *scanner);
 struct t_token * scanner_create_token(struct t_scanner *scanner, int type);
 void scanner_init_token(struct t_scanner *scanner, struct t_token *token, int type);
 void token_copy(struct t_token *dest, const struct t_token *source);
+void token_free(struct t_token *token);
 
 struct t_char * scanner_c(struct t_scanner *scanner);
 int scanner_ch(struct t_scanner *scanner);
@@ -127,7 +139,7 @@ struct t_token * scanner_parse_string(struct t_scanner *scanner);
 int scanner_skip_whitespace(struct t_scanner *scanner);
 
 int scanner_charclass(int c);
-void scanner_build_cc_table();
+void scanner_build_cc_table(void);
 int util_escape_string(char buf[], int buf_size, const char *str);
 int util_escape_char(char *buf, char c);
 
@@ -0,0 +1,61 @@
+#ifndef server_h
+#define server_h
+
+#include <sys/types.h>
+#include "exec.h"
+
+/*
+ * A pre-forked server: libraries are loaded once, and workers forked from
+ * the warm state run scripts sent to a Unix socket against them.
+ */
+
+#define SERVER_MAX_WORKERS 128
+#define SERVER_MAX_REQUEST (16 << 20)
+
+/*
+ * A worker ends its answer with a trailer of SERVER_TRAILER_LEN bytes: a
+ * NUL, then '0' if the script ran, or '1' if it failed. An answer that
+ * ends without one was cut short, by a worker that died.
+ */
+#define SERVER_TRAILER_LEN 2
+
+/*
+ * What workers are forked with: the libraries, parsed into program, and
+ * lib, which ran their top-level code and holds their globals, frozen.
+ * exec runs the requests, with lib's globals. text is the libraries'
+ * source, which program reads.
+ */
+struct t_server_state {
+  char *text;
+  struct t_program *program;
+  struct t_exec lib;
+  struct t_exec exec;
+};
+
+/* A worker process, and the generation of the state it was forked with */
+struct t_server_worker {
+  pid_t pid;
+  int gen;
+};
+
+/*
+ * A server listening on path, with nworkers workers, each of which serves
+ * up to max_requests requests, or any number if it is 0. A reload loads
+ * the libraries again into a new state, of the next generation, and the
+ * workers of the older one finish the request they serve, and exit.
+ */
+struct t_server {
+  const char *path;
+  int fd;
+  int nworkers;
+  int max_requests;
+  char **libs;
+  int nlibs;
+  struct t_server_state *state;
+  int gen;
+  struct t_server_worker workers[2 * SERVER_MAX_WORKERS];
+};
+
+int server_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef shard_h
+#define shard_h
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "exec.h"
+#include "io.h"
+
+/*
+ * Sharded runs: a coordinator splits a line-oriented input into shards,
+ * which worker processes run a script's function on, and merges what they
+ * printed and returned, in input order.
+ */
+
+#define SHARD_MAX_WORKERS 64
+#define SHARD_MAX_MSG (256 << 20)
+
+/* Runs of a shard that end with its worker gone, before the run fails */
+#define SHARD_MAX_TRIES 3
+
+/*
+ * Messages between the coordinator and a worker: a type byte and a
+ * 4-byte length in network order, then that many bytes. The coordinator
+ * sends the program once, as the function's name and a newline, then the
+ * script, which is answered with an empty result once it has run. Each
+ * shard is answered with a result: the sum of what the function returned,
+ * as "i <int>", "f <float>" or "n" if nothing, and a newline, then what
+ * it printed. Either is answered with failed instead, if the script
+ * failed.
+ */
+#define SHARD_MSG_PROGRAM 'P'
+#define SHARD_MSG_SHARD 'S'
+#define SHARD_MSG_RESULT 'R'
+#define SHARD_MSG_FAILED 'F'
+
+/* Lines of the input, and what came of them once done */
+struct t_shard {
+  const char *data;
+  int len;
+  int tries;
+  int done;
+  struct t_value sum;
+  char *out;
+  int outlen;
+};
+
+/*
+ * A connection to a worker, at address, or forked locally as pid, which
+ * a thread of the coordinator sends shards to, one at a time.
+ */
+struct t_shard_conn {
+  struct t_shard_run *run;
+  const char *address;
+  int fd;
+  pid_t pid;
+  pthread_t thread;
+  int started;
+};
+
+/*
+ * A coordinator's run. queue holds the shards not taken yet, or given
+ * back by a worker that went away, and remaining counts those not done.
+ * alive counts the workers left. Under lock, signalled on cond.
+ */
+struct t_shard_run {
+  char *program;
+  int programlen;
+  struct t_mapfile *input;
+  struct t_shard *shards;
+  int nshards;
+  int *queue;
+  int nqueue;
+  int remaining;
+  int alive;
+  int retried;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct t_shard_conn conns[SHARD_MAX_WORKERS];
+  int nconns;
+};
+
+int shard_serve(int fd);
+int shard_main(int argc, char **argv);
+
+#endif
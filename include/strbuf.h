@@ -0,0 +1,34 @@
+#ifndef strbuf_h
+#define strbuf_h
+
+#include <stddef.h>
+
+/*
+ * A reference-counted heap string buffer. Values share a buffer when a
+ * string is assigned or passed as an argument, and copy it before changing
+ * it while it is shared. A frozen buffer is shared between threads: its
+ * count is left alone, and it always counts as shared. A buffer sent over
+ * a channel stays shared for good, with its count kept atomically, as
+ * execs on other threads hold it.
+ */
+struct t_strbuf {
+  int refs;
+  int cap;
+  int frozen;
+  char str[];
+};
+
+/* frozen values */
+#define STRBUF_FROZEN 1
+#define STRBUF_SHARED 2
+
+#define strbuf_of(s) ((struct t_strbuf *) ((s) - offsetof(struct t_strbuf, str)))
+#define strbuf_shared(sb) ((sb)->frozen || (sb)->refs > 1)
+
+struct t_strbuf * strbuf_new(int size);
+struct t_strbuf * strbuf_ref(struct t_strbuf *sb);
+void strbuf_release(struct t_strbuf *sb);
+int strbuf_share(struct t_strbuf *sb);
+struct t_strbuf * strbuf_reserve(struct t_strbuf *sb, int size);
+
+#endif
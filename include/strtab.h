@@ -0,0 +1,38 @@
+#ifndef strtab_h
+#define strtab_h
+
+#include <stddef.h>
+
+#define STRTAB_INITIAL_SIZE 64
+
+/*
+ * An interned string. The hash and length sit in a header right before the
+ * bytes, so they can be found from the string pointer alone.
+ */
+struct t_istr {
+  struct t_istr *next;
+  unsigned int hash;
+  int len;
+  char str[];
+};
+
+/*
+ * Table of interned strings, each stored once. id is a number of its own,
+ * which values interned in it carry, to tell its strings from those of
+ * another table, such as a server request's.
+ */
+struct t_strtab {
+  struct t_istr **buckets;
+  int size;
+  int count;
+  int id;
+};
+
+#define strtab_header(s) ((struct t_istr *) ((s) - offsetof(struct t_istr, str)))
+
+int strtab_init(struct t_strtab *tab);
+void strtab_close(struct t_strtab *tab);
+char * strtab_intern(struct t_strtab *tab, const char *str, int len);
+unsigned int strtab_hash(const char *str, int len);
+
+#endif
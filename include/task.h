@@ -0,0 +1,64 @@
+#ifndef task_h
+#define task_h
+
+#include "util.h"
+
+/*
+ * Green threads: tasks that take turns running in one exec. Each task has
+ * its own operand stack, call frames and temporary values, which are
+ * swapped into the exec while it runs, so a switch copies a few list heads
+ * and allocates nothing.
+ */
+
+struct t_exec;
+struct t_func;
+
+/* Tasks done waiting in the event loop are looked for after this many yields */
+#define TASK_POLL_YIELDS 64
+
+/*
+ * A task's state while it isn't running, and its place in the queue.
+ * failed is set when a wait in the event loop ends in an error.
+ */
+struct t_task {
+  int id;
+  int failed;
+  struct list stack;
+  struct list frames;
+  struct list values;
+  int values_mark;
+  struct item *current;
+  struct t_task *next;
+};
+
+/*
+ * The tasks of an exec. main is the program's own, which spawned the rest;
+ * when it ends while tasks are queued, it waits until they have all ended.
+ * Ended tasks are kept in spare, with their lists' items, for new ones.
+ * A task that waits in the event loop sets blocked, and is in no queue
+ * until its wait ends.
+ */
+struct t_tasks {
+  struct t_task main;
+  struct t_task *running;
+  struct t_task *first;
+  struct t_task *last;
+  struct t_task *spare;
+  int next_id;
+  int blocked;
+  int yields;
+  struct item end;
+};
+
+void task_init(struct t_exec *exec);
+int task_spawn(struct t_exec *exec, struct t_func *func, int argc);
+int task_yield(struct t_exec *exec);
+int task_block(struct t_exec *exec);
+void task_wake(struct t_exec *exec, struct t_task *task);
+int task_end(struct t_exec *exec);
+void task_reset(struct t_exec *exec);
+void task_close(struct t_exec *exec);
+
+#define task_pending(exec) ((exec)->tasks.first || (exec)->tasks.running != &(exec)->tasks.main || (exec)->loop.waiting)
+
+#endif
@@ -3,6 +3,10 @@
 
 #define DBG(level, fmt, ...)   debug(level, "%s()[%d]: " fmt "\n", __FUNCTION__, __LINE__, ## __VA_ARGS__)
 
+/*
+ * Process-wide, so set them before starting any interpreter threads.
+ * debug_stream defaults to stderr.
+ */
 extern int debug_level;
 extern FILE *debug_stream;
 
@@ -12,10 +16,16 @@ struct item {
   struct item *prev;
 };
 
+/*
+ * Popped items are kept on the spare chain and reused by the next push, so a
+ * list that goes up and down, like the stack, stops allocating once it has
+ * been as deep as it gets. list_empty() frees them.
+ */
 struct list {
   struct item *first;
   struct item *last;
   int size;
+  struct item *spare;
 };
 
 //struct item * llist_newitem(void *value);
@@ -34,4 +44,6 @@ void *list_last(struct list *list);
 
 int debug(int level, char* fmt, ...);
 
+void * util_grow(void *buf, int *cap, int size);
+
 #endif
@@ -0,0 +1,788 @@
+/*
+ * Ahead-of-time translation of a script to C.
+ *
+ * Parses a script from stdin and writes a C translation unit to stdout, with
+ * one C function per script function and one for the top-level code. Jumps
+ * become gotos to labels, calls to corelib natives reference the natives
+ * directly, and every other icode calls its exec handler directly.
+ * Superinstructions keep their fast paths for int operands.
+ *
+ *   aot < script.txt > script.c
+ *   cc -Iinclude -pthread -o script script.c lib/exec.o lib/task.o lib/loop.o lib/chan.o \
+ *     lib/program.o lib/corelib.o lib/parallel.o lib/pool.o lib/jit.o lib/io.o lib/parser.o \
+ *     lib/strtab.o lib/strbuf.o lib/fmt.o lib/array.o lib/map.o lib/scanner.o lib/util.o
+ *
+ * Variables are still looked up by name at run time, through the same call
+ * frames as the interpreter, so the program's output is unchanged. Int
+ * compares, increments and "x = a op b" become C expressions on the values
+ * of the variables, which each function keeps in C locals once looked up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exec.h"
+#include "corelib.h"
+#include "util.h"
+
+/*
+ * Names of the exec handlers for icodes that map onto one handler call.
+ */
+const char *handlers[] = {
+  [I_POP] = "exec_i_pop",
+  [I_ASSIGN] = "exec_i_assign",
+  [I_ADD] = "exec_i_add",
+  [I_SUB] = "exec_i_sub",
+  [I_MUL] = "exec_i_mul",
+  [I_DIV] = "exec_i_div",
+  [I_EQ] = "exec_i_eq",
+  [I_NE] = "exec_i_ne",
+  [I_LT] = "exec_i_lt",
+  [I_GT] = "exec_i_gt",
+  [I_LE] = "exec_i_le",
+  [I_GE] = "exec_i_ge",
+  [I_INDEX] = "exec_i_index",
+  [I_SETINDEX] = "exec_i_setindex",
+};
+const int handlers_len = sizeof(handlers) / sizeof(handlers[0]);
+
+const char *c_compare[] = {
+  [I_EQ] = "==",
+  [I_NE] = "!=",
+  [I_LT] = "<",
+  [I_GT] = ">",
+  [I_LE] = "<=",
+  [I_GE] = ">=",
+};
+
+const char *c_arith[] = {
+  [I_ADD] = "add",
+  [I_SUB] = "sub",
+  [I_MUL] = "mul",
+};
+
+/*
+ * Write a string as a C string literal.
+ */
+void emit_string(const char *str)
+{
+  if (!str) {
+    printf("NULL");
+    return;
+  }
+  putchar('"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      printf("\\%c", *str);
+    }
+    else if (*str == '\n') {
+      printf("\\n");
+    }
+    else if (*str == '\t') {
+      printf("\\t");
+    }
+    else if ((unsigned char) *str < 0x20 || (unsigned char) *str >= 0x7f) {
+      printf("\\%03o", (unsigned char) *str);
+    }
+    else {
+      putchar(*str);
+    }
+  }
+  putchar('"');
+}
+
+struct t_func * func_byname(struct t_parser *parser, char *name)
+{
+  struct item *item;
+  struct t_func *func;
+
+  for (item = parser->functions.first; item; item = item->next) {
+    func = item->value;
+    if (strcmp(func->name, name) == 0) {
+      return func;
+    }
+  }
+  return NULL;
+}
+
+const struct t_native * native_byname(char *name)
+{
+  const struct t_native *native;
+
+  for (native = corelib_natives; native->name; native++) {
+    if (strcmp(native->name, name) == 0) {
+      return native;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * The call made by an icode, if any, looking inside superinstructions.
+ */
+struct t_icode * call_of(struct t_icode *icode)
+{
+  if (icode->type == I_CALL1) {
+    icode = icode->parts[1];
+  }
+  if (icode->type == I_FCALL || icode->type == I_TCALL) {
+    return icode;
+  }
+  return NULL;
+}
+
+/*
+ * Whether the script calls a function by this name.
+ */
+int native_called(struct t_parser *parser, char *name)
+{
+  struct item *item;
+  struct t_icode *call;
+
+  for (item = parser->output.first; item; item = item->next) {
+    call = call_of(item->value);
+    if (call && strcmp(call->operand->name, name) == 0) {
+      return !func_byname(parser, name);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Whether a function tail calls itself.
+ */
+int self_tail_call(struct t_parser *parser, struct t_func *func)
+{
+  struct item *item;
+  struct t_icode *icode, *call;
+
+  for (item = parser->output.first; item; item = item->next) {
+    icode = item->value;
+    call = call_of(icode);
+    if (icode->addr > func->start && icode->addr <= func->end + 1
+        && call && call->type == I_TCALL && strcmp(call->operand->name, func->name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Whether any ADD appends in place, see parser_mark_appends().
+ */
+int parser_has_inplace(struct t_parser *parser)
+{
+  struct item *item;
+
+  for (item = parser->output.first; item; item = item->next) {
+    if (((struct t_icode *) item->value)->inplace) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Address an icode jumps to, or -1.
+ */
+int jump_target(struct t_icode *icode)
+{
+  if (icode->type == I_JMP || icode->type == I_JZ) {
+    return icode->addr + (int) icode->operand->intval;
+  }
+  if (icode->type == I_CMPJZ) {
+    return icode->addr + (int) icode->parts[3]->operand->intval;
+  }
+  return -1;
+}
+
+/*
+ * Constants pushed by the script, emitted as static values.
+ */
+struct t_value **consts = NULL;
+int nconsts = 0;
+int consts_cap = 0;
+
+/*
+ * Grow one of the tables above to hold n pointers. Out of memory, there is
+ * nothing useful left to emit.
+ */
+void * grow_table(void *table, int *cap, int n)
+{
+  table = util_grow(table, cap, n * (int) sizeof(void *));
+  if (!table) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+  return table;
+}
+
+void emit_const(struct t_value *value)
+{
+  if (value->type == VAL_NULL) {
+    return;
+  }
+  consts = grow_table(consts, &consts_cap, nconsts + 1);
+  consts[nconsts] = value;
+  printf("static struct t_value c%d = {.type = VAL_%s, .intval = %lldLL, .floatval = %a, .len = %d, .argc = %d, .stringval = ",
+    nconsts, value_types[value->type], value->intval, value->floatval, value->len, value->argc);
+  emit_string(value->stringval);
+  printf(", .name = ");
+  emit_string(value->name);
+  printf("};\n");
+  nconsts++;
+}
+
+void emit_values(struct t_parser *parser)
+{
+  struct item *item;
+  struct t_icode *icode;
+  int i;
+
+  for (item = parser->output.first; item; item = item->next) {
+    icode = item->value;
+    if (icode->type == I_PUSH) {
+      emit_const(icode->operand);
+    }
+    for (i=0; i < icode->nparts; i++) {
+      if (icode->parts[i]->type == I_PUSH) {
+        emit_const(icode->parts[i]->operand);
+      }
+    }
+  }
+  printf("\n");
+}
+
+/*
+ * Variables held in C locals v0, v1, ... by the function being emitted.
+ */
+char **locals = NULL;
+int nlocals = 0;
+int locals_cap = 0;
+
+int local_of(char *name)
+{
+  int i;
+
+  for (i=0; i < nlocals; i++) {
+    if (strcmp(locals[i], name) == 0) {
+      return i;
+    }
+  }
+  locals = grow_table(locals, &locals_cap, nlocals + 1);
+  locals[nlocals] = name;
+  return nlocals++;
+}
+
+int is_int_operand(struct t_value *value)
+{
+  return value->type == VAL_VAR || value->type == VAL_INT;
+}
+
+/*
+ * Whether the icodes at an item are PUSH var:x; PUSH a; PUSH b; ADD|SUB|MUL;
+ * ASSIGN; POP, with a and b variables or ints, and no jump into them.
+ */
+int is_arith(struct item *item, char *targets)
+{
+  struct t_icode *code[6];
+  int i;
+
+  for (i=0; i < 6; i++, item = item->next) {
+    if (!item) {
+      return 0;
+    }
+    code[i] = item->value;
+    if (i > 0 && targets[code[i]->addr]) {
+      return 0;
+    }
+  }
+  return code[0]->type == I_PUSH && code[0]->operand->type == VAL_VAR
+    && code[1]->type == I_PUSH && is_int_operand(code[1]->operand)
+    && code[2]->type == I_PUSH && is_int_operand(code[2]->operand)
+    && (code[3]->type == I_ADD || code[3]->type == I_SUB || code[3]->type == I_MUL)
+    && code[4]->type == I_ASSIGN
+    && code[5]->type == I_POP;
+}
+
+/*
+ * Print the conditions that the variables among operands hold ints, and
+ * load them into their locals.
+ */
+void emit_int_guards(struct t_value **operands, int n)
+{
+  int i, j, guards = 0;
+
+  for (i=0; i < n; i++) {
+    for (j=0; j < i && !(operands[j]->type == VAL_VAR && operands[i]->type == VAL_VAR
+        && strcmp(operands[j]->name, operands[i]->name) == 0); j++);
+    if (operands[i]->type == VAL_VAR && j == i) {
+      printf("%saot_int(exec, &v%d, ", guards++ ? " && " : "", local_of(operands[i]->name));
+      emit_string(operands[i]->name);
+      printf(")");
+    }
+  }
+  if (!guards) {
+    printf("1");
+  }
+}
+
+/* An int operand as a C expression */
+void emit_int(struct t_value *value)
+{
+  if (value->type == VAL_VAR) {
+    printf("v%d->intval", local_of(value->name));
+  }
+  else {
+    printf("%lldLL", value->intval);
+  }
+}
+
+/*
+ * Print a reference to the static copy of a pushed value.
+ */
+void emit_ref(struct t_value *value)
+{
+  int i;
+
+  for (i=0; i < nconsts; i++) {
+    if (consts[i] == value) {
+      printf("&c%d", i);
+      return;
+    }
+  }
+  printf("&nullvalue");
+}
+
+void emit_funcs(struct t_parser *parser)
+{
+  struct item *item;
+  struct t_func *func;
+  int i;
+
+  if (parser_has_inplace(parser)) {
+    printf("static struct t_icode inplace = {.type = I_ADD, .inplace = 1};\n");
+  }
+
+  for (item = parser->functions.first; item; item = item->next) {
+    func = item->value;
+    printf("static struct t_func f_%s = {.name = \"%s\", .argc = %d, .start = %d, .end = %d, .params = {",
+      func->name, func->name, func->argc, func->start, func->end);
+    for (i=0; i < func->argc; i++) {
+      printf("%s\"%s\"", i ? ", " : "", func->params[i]);
+    }
+    printf("}};\n");
+    printf("static int aot_body_%s(struct t_exec *exec);\n", func->name);
+  }
+  for (i=0; corelib_natives[i].name; i++) {
+    if (!native_called(parser, corelib_natives[i].name)) {
+      continue;
+    }
+    printf("static struct t_func n_%s = {.name = \"%s\", .native = &%s};\n",
+      corelib_natives[i].name, corelib_natives[i].name, corelib_natives[i].symbol);
+  }
+  printf("\n");
+}
+
+/*
+ * Whether an icode belongs to a function defined inside the one being
+ * emitted, or to any function when emitting the top-level code.
+ */
+int in_nested(struct t_parser *parser, int addr, struct t_func *self)
+{
+  struct item *item;
+  struct t_func *func;
+
+  for (item = parser->functions.first; item; item = item->next) {
+    func = item->value;
+    if (func != self && (!self || func->start > self->start)
+        && addr >= func->start && addr <= func->end + 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Emit a call. Returns -1 if the icode can't be translated.
+ */
+int emit_call(struct t_parser *parser, struct t_icode *icode, struct t_func *self)
+{
+  struct t_func *func;
+  const struct t_native *native;
+  char *name = icode->operand->name;
+  int argc = icode->operand->argc;
+  int line = icode->token ? icode->token->row+1 : 0;
+
+  /*
+   * They run a function by name, from its icodes, which a translated
+   * program doesn't keep: timer()'s task, and thread()'s exec.
+   */
+  if ((strcmp(name, "timer") == 0 || strcmp(name, "thread") == 0) && !func_byname(parser, name)) {
+    fprintf(stderr, "Error: Can't translate a call to %s() at addr=%d\n", name, icode->addr);
+    return -1;
+  }
+
+  func = func_byname(parser, name);
+  if (func && icode->type == I_TCALL && self) {
+    printf("  if (aot_tcall(exec, &f_%s, %d, %d, %d) < 0) return -1;\n", name, argc, (int) icode->operand->intval, line);
+    if (func == self) {
+      printf("  goto entry;\n");
+    }
+    else {
+      printf("  return aot_tail(&aot_body_%s);\n", name);
+    }
+  }
+  else if (func) {
+    printf("  if (aot_call(exec, &f_%s, %d, &aot_body_%s, %d) < 0) return -1;\n", name, argc, name, line);
+  }
+  else if ((native = native_byname(name))) {
+    printf("  if (aot_native(exec, &n_%s, %d) < 0) return -1;\n", native->name, argc);
+  }
+  else {
+    printf("  return aot_undefined(\"%s\", %d);\n", name, line);
+  }
+
+  return 0;
+}
+
+/*
+ * Emit one icode. Returns -1 if it can't be translated.
+ */
+int emit_icode(struct t_parser *parser, struct t_icode *icode, struct t_func *self)
+{
+  struct t_value *operands[2];
+  int i;
+
+  switch (icode->type) {
+    case I_NOP:
+      break;
+    case I_PUSH:
+      printf("  aot_push(exec, ");
+      emit_ref(icode->operand);
+      printf(");\n");
+      break;
+    case I_POP:
+    case I_ASSIGN:
+    case I_SETINDEX:
+      printf("  if (aot_op0(exec, &%s) < 0) return -1;\n", handlers[icode->type]);
+      break;
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+    case I_DIV:
+    case I_EQ:
+    case I_NE:
+    case I_LT:
+    case I_GT:
+    case I_LE:
+    case I_GE:
+    case I_INDEX:
+      printf("  if (aot_op2(exec, &%s, %s) < 0) return -1;\n", handlers[icode->type], icode->inplace ? "&inplace" : "NULL");
+      break;
+    case I_JMP:
+      printf("  goto L%d;\n", jump_target(icode));
+      break;
+    case I_JZ:
+      printf("  if (aot_jz(exec)) goto L%d;\n", jump_target(icode));
+      break;
+    case I_FCALL:
+    case I_TCALL:
+      return emit_call(parser, icode, self);
+    case I_RET:
+      printf("  return aot_ret(exec);\n");
+      break;
+    case I_ARRAY:
+      printf("  if (!exec_make_array(exec, %d)) return -1;\n", (int) icode->operand->intval);
+      break;
+    case I_MAP:
+      printf("  if (!exec_make_map(exec, %d)) return -1;\n", (int) icode->operand->intval);
+      break;
+    case I_CMPJZ:
+      operands[0] = icode->parts[0]->operand;
+      operands[1] = icode->parts[1]->operand;
+      printf("  if (");
+      emit_int_guards(operands, 2);
+      printf(") {\n    if (!(");
+      emit_int(operands[0]);
+      printf(" %s ", c_compare[icode->parts[2]->type]);
+      emit_int(operands[1]);
+      printf(")) goto L%d;\n  }\n", jump_target(icode));
+      printf("  else switch (aot_cmpjz(exec, ");
+      emit_ref(icode->parts[0]->operand);
+      printf(", ");
+      emit_ref(icode->parts[1]->operand);
+      printf(", I_%s, &%s)) {\n", icodes[icode->parts[2]->type], handlers[icode->parts[2]->type]);
+      printf("    case -1: return -1;\n");
+      printf("    case 1: goto L%d;\n", jump_target(icode));
+      printf("  }\n");
+      break;
+    case I_INCR:
+      operands[0] = icode->parts[0]->operand;
+      printf("  if (");
+      emit_int_guards(operands, 1);
+      printf(" && !v%d->frozen\n      && !__builtin_%s_overflow(", local_of(operands[0]->name), icode->parts[3]->type == I_SUB ? "sub" : "add");
+      emit_int(operands[0]);
+      printf(", ");
+      emit_int(icode->parts[2]->operand);
+      printf(", &n)) {\n    ");
+      emit_int(operands[0]);
+      printf(" = n;\n  }\n");
+      printf("  else if (aot_incr(exec, ");
+      emit_ref(icode->parts[0]->operand);
+      printf(", ");
+      emit_ref(icode->parts[2]->operand);
+      printf(", &%s, %d) < 0) return -1;\n", handlers[icode->parts[3]->type], icode->parts[3]->type == I_SUB ? -1 : 1);
+      break;
+    case I_CONCAT_N:
+      printf("  switch (exec_concat_n(exec, (struct t_value *[]) {");
+      for (i=0; i < icode->nparts; i += i ? 2 : 1) {
+        printf(i ? ", " : "");
+        emit_ref(icode->parts[i]->operand);
+      }
+      printf("}, %d)) {\n", (icode->nparts + 1) / 2);
+      printf("  case -1: return -1;\n");
+      printf("  case 0:\n");
+      for (i=0; i < icode->nparts; i++) {
+        if (emit_icode(parser, icode->parts[i], self) < 0) {
+          return -1;
+        }
+      }
+      printf("  }\n");
+      break;
+    case I_CALL1:
+      for (i=0; i < icode->nparts; i++) {
+        if (emit_icode(parser, icode->parts[i], self) < 0) {
+          return -1;
+        }
+      }
+      break;
+    default:
+      fprintf(stderr, "Error: Can't translate icode %s at addr=%d\n", icodes[icode->type], icode->addr);
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Emit x = a op b from the six icodes at an item, see is_arith().
+ */
+void emit_arith(struct item *item)
+{
+  struct t_icode *code[6];
+  struct t_value *operands[3];
+  int i;
+
+  for (i=0; i < 6; i++, item = item->next) {
+    code[i] = item->value;
+  }
+  for (i=0; i < 3; i++) {
+    operands[i] = code[i]->operand;
+  }
+  printf("  if (");
+  emit_int_guards(operands, 3);
+  printf(" && !v%d->frozen\n      && !__builtin_%s_overflow(", local_of(operands[0]->name), c_arith[code[3]->type]);
+  emit_int(operands[1]);
+  printf(", ");
+  emit_int(operands[2]);
+  printf(", &n)) {\n    ");
+  emit_int(operands[0]);
+  printf(" = n;\n  }\n");
+  printf("  else if (aot_arith(exec, ");
+  for (i=0; i < 3; i++) {
+    emit_ref(operands[i]);
+    printf(", ");
+  }
+  printf("&%s, %s) < 0) return -1;\n", handlers[code[3]->type], code[3]->inplace ? "&inplace" : "NULL");
+}
+
+/*
+ * Whether an icode always leaves the function or jumps, so that what
+ * follows it is unreachable until the next label.
+ */
+int is_exit(struct t_parser *parser, struct t_icode *icode, struct t_func *self)
+{
+  struct t_icode *call = call_of(icode);
+
+  if (icode->type == I_RET || icode->type == I_JMP) {
+    return 1;
+  }
+  if (!call || call->type != I_TCALL) {
+    return 0;
+  }
+  /* A jump to, or return into, a local function; or an undefined one */
+  if (func_byname(parser, call->operand->name)) {
+    return self != NULL;
+  }
+  return !native_byname(call->operand->name);
+}
+
+/*
+ * Emit the icodes at [first, last] as the body of a C function, skipping
+ * any function defined inside the range.
+ */
+int emit_range(struct t_parser *parser, int first, int last, struct t_func *self)
+{
+  struct item *item;
+  struct t_icode *icode;
+  char *targets;
+  int addr, i;
+  int need_n = 0, live = 1;
+  int ret = 0;
+
+  targets = calloc(parser->output.size + 1, 1);
+  for (item = parser->output.first; item; item = item->next) {
+    icode = item->value;
+    if (icode->addr < first || icode->addr > last || in_nested(parser, icode->addr, self)) {
+      continue;
+    }
+    if (icode->type == I_JMP || icode->type == I_JZ || icode->type == I_CMPJZ) {
+      addr = jump_target(icode);
+      if (addr < 0 || addr > parser->output.size) {
+        fprintf(stderr, "Error: Jump out of range at addr=%d\n", icode->addr);
+        free(targets);
+        return -1;
+      }
+      targets[addr] = 1;
+    }
+  }
+
+  /* C locals for the variables of int expressions */
+  nlocals = 0;
+  for (item = parser->output.first; item; item = item->next) {
+    icode = item->value;
+    if (icode->addr < first || icode->addr > last || in_nested(parser, icode->addr, self)) {
+      continue;
+    }
+    if (icode->type == I_CMPJZ || icode->type == I_INCR) {
+      for (i=0; i < 2; i++) {
+        if (icode->parts[i]->operand->type == VAL_VAR) local_of(icode->parts[i]->operand->name);
+      }
+      need_n |= icode->type == I_INCR;
+    }
+    else if (is_arith(item, targets)) {
+      for (i=0; i < 3; i++, item = item->next) {
+        if (((struct t_icode *) item->value)->operand->type == VAL_VAR) local_of(((struct t_icode *) item->value)->operand->name);
+      }
+      need_n = 1;
+      item = item->prev;
+    }
+  }
+  if (nlocals) {
+    printf("  struct t_value ");
+    for (i=0; i < nlocals; i++) {
+      printf("%s*v%d = NULL", i ? ", " : "", i);
+    }
+    printf(";\n");
+  }
+  if (need_n) {
+    printf("  long long n;\n");
+  }
+  if (nlocals || need_n) {
+    printf("\n");
+  }
+
+  if (self && self_tail_call(parser, self)) {
+    printf("entry: ;\n");
+    /* The tail call freed the frame's variables */
+    for (i=0; i < nlocals; i++) {
+      printf("  v%d = NULL;\n", i);
+    }
+  }
+  for (item = parser->output.first; item && ret == 0; item = item->next) {
+    icode = item->value;
+    if (icode->addr < first || icode->addr > last) {
+      continue;
+    }
+    if (targets[icode->addr]) {
+      printf("L%d: ;\n", icode->addr);
+      live = 1;
+    }
+    if (!live || in_nested(parser, icode->addr, self)) {
+      continue;
+    }
+    if (is_arith(item, targets)) {
+      emit_arith(item);
+      for (i=1; i < 6; i++) {
+        item = item->next;
+      }
+      continue;
+    }
+    ret = emit_icode(parser, icode, self);
+    live = !is_exit(parser, icode, self);
+  }
+  if (targets[parser->output.size] && last >= parser->output.size - 1) {
+    printf("L%d: ;\n", parser->output.size);
+  }
+  free(targets);
+
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  struct t_parser parser;
+  struct item *item;
+  struct t_func *func;
+  int ret = 1;
+
+  if (argc > 1) {
+    debug_level = atoi(argv[1]);
+  }
+
+  if (parser_init(&parser, stdin)) {
+    fprintf(stderr, "Failed to initialize parser\n");
+    return 1;
+  }
+
+  do {
+    if (parse(&parser) < 0) {
+      break;
+    }
+
+    printf("/* Generated by aot. */\n");
+    printf("#include \"aot.h\"\n\n");
+    emit_values(&parser);
+    emit_funcs(&parser);
+
+    for (item = parser.functions.first; item; item = item->next) {
+      func = item->value;
+      printf("static int aot_body_%s(struct t_exec *exec)\n{\n", func->name);
+      if (emit_range(&parser, func->start + 1, func->end + 1, func) < 0) {
+        break;
+      }
+      printf("}\n\n");
+    }
+    if (item) {
+      break;
+    }
+
+    printf("static int aot_main(struct t_exec *exec)\n{\n");
+    if (emit_range(&parser, 0, parser.output.size - 1, NULL) < 0) {
+      break;
+    }
+    printf("  return 0;\n}\n\n");
+
+    printf("int main(int argc, char *argv[])\n{\n");
+    printf("  struct t_exec exec;\n");
+    printf("  int rc;\n\n");
+    printf("  /* The scanner reads ahead, so keep it off the program's stdin */\n");
+    printf("  if (exec_init(&exec, fopen(\"/dev/null\", \"r\")) < 0) {\n");
+    printf("    fprintf(stderr, \"Failed to exec\\n\");\n");
+    printf("    return 1;\n");
+    printf("  }\n");
+    printf("  /* Errors come after what was printed before them */\n");
+    printf("  output_bind(&exec.out);\n");
+    printf("  rc = aot_main(&exec) < 0 ? 1 : 0;\n");
+    printf("  output_bind(NULL);\n");
+    printf("  exec_close(&exec);\n\n");
+    printf("  return rc;\n}\n");
+    ret = 0;
+  } while (0);
+
+  parser_close(&parser);
+  free(consts);
+  free(locals);
+
+  return ret;
+}
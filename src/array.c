@@ -0,0 +1,1077 @@
+/*
+ * Array values, and the bulk kernels behind sum(), min(), max(), dot(),
+ * scale() and map_add().
+ *
+ * Each kernel has a scalar loop, and on x86-64 an SSE2 and an AVX2 version.
+ * The level is chosen once, from the CPU and PARSE1_SIMD. Int kernels
+ * check for overflow: the vector versions keep a sticky overflow mask per
+ * lane, and on overflow rerun the scalar loop, which either finds that the
+ * exact result still fits or reports the error. Float sums add in the same
+ * order at every level, see sum8(), so they don't depend on the CPU.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "parser.h"
+#include "array.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ARRAY_X86
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+#define ARRAY_MIN_CAP 8
+
+static int array_level;
+static pthread_once_t array_level_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Allocate an array of len elements. Numbers start at zero, strings and
+ * mixed elements at NULL.
+ */
+struct t_array * array_new(int type, int len)
+{
+  struct t_array *array;
+
+  array = malloc(sizeof(struct t_array));
+  if (!array) {
+    return NULL;
+  }
+  array->refs = 1;
+  array->frozen = 0;
+  array->type = type;
+  array->len = len;
+  array->cap = len < ARRAY_MIN_CAP ? ARRAY_MIN_CAP : len;
+  array->data = calloc(array->cap, 8);
+  if (!array->data) {
+    free(array);
+    return NULL;
+  }
+  return array;
+}
+
+/*
+ * Whether the elements are struct t_value pointers, which the array owns.
+ */
+static int array_boxed(struct t_array *array)
+{
+  return array->type == VAL_STRING || array->type == ARRAY_MIXED;
+}
+
+struct t_array * array_ref(struct t_array *array)
+{
+  if (!array->frozen) {
+    array->refs++;
+  }
+  return array;
+}
+
+void array_release(struct t_array *array)
+{
+  struct t_value **strs = array->data;
+  int i;
+
+  if (array->frozen || --array->refs > 0) {
+    return;
+  }
+  if (array_boxed(array)) {
+    for (i=0; i < array->len; i++) {
+      if (strs[i]) value_free(strs[i]);
+    }
+  }
+  free(array->data);
+  free(array);
+}
+
+/*
+ * A new array with the same elements, sharing nothing with the old one:
+ * strings are copied, into buffers of their own.
+ */
+struct t_array * array_copy(struct t_array *array)
+{
+  struct t_array *copy;
+  struct t_value **from = array->data;
+  struct t_value **strs;
+  int i;
+
+  copy = array_new(array->type, array->len);
+  if (!copy) {
+    return NULL;
+  }
+  if (!array_boxed(array)) {
+    memcpy(copy->data, array->data, (size_t) array->len * 8);
+    return copy;
+  }
+  strs = copy->data;
+  for (i=0; i < array->len; i++) {
+    if (!from[i]) {
+      continue;
+    }
+    strs[i] = create_value(from[i]->type);
+    if (from[i]->type != VAL_STRING) {
+      strs[i]->intval = from[i]->intval;
+      strs[i]->floatval = from[i]->floatval;
+    }
+    else if (value_set_str(strs[i], from[i]->stringval, from[i]->len) < 0) {
+      array_release(copy);
+      return NULL;
+    }
+  }
+  return copy;
+}
+
+/*
+ * Freeze or thaw the array and its strings, as value_freeze() does.
+ */
+void array_freeze(struct t_array *array, int frozen)
+{
+  struct t_value **strs = array->data;
+  int i;
+
+  if (array->frozen == frozen) {
+    return;
+  }
+  array->frozen = frozen;
+  if (array_boxed(array)) {
+    for (i=0; i < array->len; i++) {
+      if (strs[i]) value_freeze(strs[i], frozen);
+    }
+  }
+}
+
+static int array_frozen(struct t_array *array)
+{
+  if (array->frozen) {
+    fprintf(stderr, "Error: Can't change a frozen array, which is shared\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Every element type takes 8 bytes, so an int array becomes a float array
+ * in place.
+ */
+static void array_promote(struct t_array *array)
+{
+  long long n;
+  double f;
+  int i;
+
+  for (i=0; i < array->len; i++) {
+    memcpy(&n, (char *) array->data + 8 * i, 8);
+    f = (double) n;
+    memcpy((char *) array->data + 8 * i, &f, 8);
+  }
+  array->type = VAL_FLOAT;
+}
+
+static int array_check(struct t_array *array, long long i)
+{
+  if (i < 0 || i >= array->len) {
+    fprintf(stderr, "Error: Index %lld out of range for an array of length %d\n", i, array->len);
+    return -1;
+  }
+  return 0;
+}
+
+int array_get(struct t_array *array, long long i, struct t_value *out)
+{
+  struct t_value *elem;
+
+  if (array_check(array, i) < 0) {
+    return -1;
+  }
+  if (array->type == ARRAY_MIXED) {
+    elem = ((struct t_value **) array->data)[i];
+    if (!elem) {
+      out->type = VAL_INT;
+      out->intval = 0;
+      return 0;
+    }
+    out->type = elem->type;
+    if (elem->type == VAL_STRING) {
+      return value_copy_str(out, elem);
+    }
+    out->intval = elem->intval;
+    out->floatval = elem->floatval;
+    return 0;
+  }
+  out->type = array->type;
+  if (array->type == VAL_INT) {
+    out->intval = ((long long *) array->data)[i];
+  }
+  else if (array->type == VAL_FLOAT) {
+    out->floatval = ((double *) array->data)[i];
+  }
+  else {
+    return value_copy_str(out, ((struct t_value **) array->data)[i]);
+  }
+  return 0;
+}
+
+/*
+ * Store into an element that exists. Storing a float into an int array
+ * makes it a float array; strings and numbers don't mix, except in a mixed
+ * array.
+ */
+static int array_store(struct t_array *array, int i, struct t_value *value)
+{
+  struct t_value **strs = array->data;
+
+  if (array->type == ARRAY_MIXED) {
+    if (!value_is_num(value) && value->type != VAL_STRING) {
+      fprintf(stderr, "Error: Can't store a %s value in an array\n", value_types[value->type]);
+      return -1;
+    }
+    if (!strs[i]) {
+      strs[i] = create_value(value->type);
+    }
+    return value_copy(strs[i], value);
+  }
+  if (array->type == VAL_STRING) {
+    if (value->type != VAL_STRING) {
+      fprintf(stderr, "Error: Can't store a %s value in an array of strings\n", value_types[value->type]);
+      return -1;
+    }
+    if (!strs[i]) {
+      strs[i] = create_value(VAL_STRING);
+    }
+    return value_copy_str(strs[i], value);
+  }
+
+  if (!value_is_num(value)) {
+    fprintf(stderr, "Error: Can't store a %s value in an array of numbers\n", value_types[value->type]);
+    return -1;
+  }
+  if (array->type == VAL_INT && value->type == VAL_FLOAT) {
+    array_promote(array);
+  }
+  if (array->type == VAL_INT) {
+    ((long long *) array->data)[i] = value->intval;
+  }
+  else {
+    ((double *) array->data)[i] = value_num(value);
+  }
+  return 0;
+}
+
+int array_set(struct t_array *array, long long i, struct t_value *value)
+{
+  if (array_frozen(array) < 0 || array_check(array, i) < 0) {
+    return -1;
+  }
+  return array_store(array, i, value);
+}
+
+/*
+ * Append an element, growing the storage geometrically. An empty array,
+ * unless mixed, takes the type of its first element.
+ */
+int array_push(struct t_array *array, struct t_value *value)
+{
+  void *data;
+  int cap;
+
+  if (array_frozen(array) < 0) {
+    return -1;
+  }
+  if (array->len == 0 && array->type != ARRAY_MIXED && (value_is_num(value) || value->type == VAL_STRING)) {
+    array->type = value->type;
+  }
+  if (array->len == array->cap) {
+    cap = array->cap * 2;
+    data = realloc(array->data, (size_t) cap * 8);
+    if (!data) {
+      return -1;
+    }
+    memset((char *) data + (size_t) array->len * 8, 0, (size_t) (cap - array->len) * 8);
+    array->data = data;
+    array->cap = cap;
+  }
+  array->len++;
+  if (array_store(array, array->len - 1, value) < 0) {
+    array->len--;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Append an element, or a map's key: a number, or a string in quotes.
+ */
+int array_format_elem(struct t_value *value, struct t_fmtbuf *fb)
+{
+  if (value->type == VAL_STRING) {
+    if (fmtbuf_add(fb, "\"", 1) < 0 || fmtbuf_add(fb, value->stringval, value->len) < 0) {
+      return -1;
+    }
+    return fmtbuf_add(fb, "\"", 1);
+  }
+  if (value->type == VAL_FLOAT) {
+    return fmtbuf_float(fb, value->floatval);
+  }
+  return fmtbuf_int(fb, value->intval);
+}
+
+/*
+ * Append as [1, 2, 3], growing fb as needed. Returns -1 if it can't grow.
+ */
+int array_format(struct t_array *array, struct t_fmtbuf *fb)
+{
+  struct t_value *elem;
+  int rc, i;
+
+  rc = fmtbuf_add(fb, "[", 1);
+  for (i=0; i < array->len && rc == 0; i++) {
+    if (i > 0 && fmtbuf_add(fb, ", ", 2) < 0) {
+      return -1;
+    }
+    if (array_boxed(array)) {
+      elem = ((struct t_value **) array->data)[i];
+      rc = elem ? array_format_elem(elem, fb) : fmtbuf_int(fb, 0);
+    }
+    else if (array->type == VAL_INT) {
+      rc = fmtbuf_int(fb, ((long long *) array->data)[i]);
+    }
+    else {
+      rc = fmtbuf_float(fb, ((double *) array->data)[i]);
+    }
+  }
+  if (rc < 0) {
+    return -1;
+  }
+  return fmtbuf_add(fb, "]", 1);
+}
+
+/*
+ * Pick the SIMD level, once per process.
+ */
+static void array_detect_simd(void)
+{
+  char *env;
+
+  array_level = ARRAY_SCALAR;
+#ifdef ARRAY_X86
+  array_level = __builtin_cpu_supports("avx2") ? ARRAY_AVX2 : ARRAY_SSE2;
+#endif
+  env = getenv("PARSE1_SIMD");
+  if (env && (strcmp(env, "0") == 0 || strcmp(env, "scalar") == 0)) {
+    array_level = ARRAY_SCALAR;
+  }
+  else if (env && strcmp(env, "sse2") == 0 && array_level > ARRAY_SSE2) {
+    array_level = ARRAY_SSE2;
+  }
+}
+
+/*
+ * SIMD level to use.
+ */
+int array_simd(void)
+{
+  pthread_once(&array_level_once, array_detect_simd);
+  return array_level;
+}
+
+/*
+ * The reduction order of float sums: element i of each block of 8 goes to
+ * partial sum i % 8, the partial sums are added pairwise as below, and the
+ * tail then one by one. The AVX2 kernels hold the partial sums in two
+ * vectors, SSE2 in four, and the scalar loops in eight doubles.
+ */
+static double sum8(const double *p)
+{
+  return ((p[0] + p[4]) + (p[1] + p[5])) + ((p[2] + p[6]) + (p[3] + p[7]));
+}
+
+/*
+ * Sum
+ */
+static double sum_f64_scalar(const double *v, int n)
+{
+  double p[8] = {0}, s;
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    p[0] += v[i];
+    p[1] += v[i+1];
+    p[2] += v[i+2];
+    p[3] += v[i+3];
+    p[4] += v[i+4];
+    p[5] += v[i+5];
+    p[6] += v[i+6];
+    p[7] += v[i+7];
+  }
+  s = sum8(p);
+  for (; i < n; i++) {
+    s += v[i];
+  }
+  return s;
+}
+
+static int sum_i64_scalar(const long long *v, int n, long long *out)
+{
+  long long s = 0;
+  int i;
+
+  for (i=0; i < n; i++) {
+    if (__builtin_add_overflow(s, v[i], &s)) {
+      return -1;
+    }
+  }
+  *out = s;
+  return 0;
+}
+
+/* Add the lanes and the tail to a vector sum, with overflow checks */
+static int sum_i64_finish(const long long *lanes, int nlanes, const long long *v, int i, int n, long long *out)
+{
+  long long s = 0;
+  int j;
+
+  for (j=0; j < nlanes; j++) {
+    if (__builtin_add_overflow(s, lanes[j], &s)) return -1;
+  }
+  for (; i < n; i++) {
+    if (__builtin_add_overflow(s, v[i], &s)) return -1;
+  }
+  *out = s;
+  return 0;
+}
+
+#ifdef ARRAY_X86
+static double sum_f64_sse2(const double *v, int n)
+{
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  __m128d a2 = _mm_setzero_pd(), a3 = _mm_setzero_pd();
+  double p[8], s;
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    a0 = _mm_add_pd(a0, _mm_loadu_pd(v + i));
+    a1 = _mm_add_pd(a1, _mm_loadu_pd(v + i + 2));
+    a2 = _mm_add_pd(a2, _mm_loadu_pd(v + i + 4));
+    a3 = _mm_add_pd(a3, _mm_loadu_pd(v + i + 6));
+  }
+  _mm_storeu_pd(p, a0);
+  _mm_storeu_pd(p + 2, a1);
+  _mm_storeu_pd(p + 4, a2);
+  _mm_storeu_pd(p + 6, a3);
+  s = sum8(p);
+  for (; i < n; i++) {
+    s += v[i];
+  }
+  return s;
+}
+
+AVX2 static double sum_f64_avx2(const double *v, int n)
+{
+  __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+  double p[8], s;
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    a0 = _mm256_add_pd(a0, _mm256_loadu_pd(v + i));
+    a1 = _mm256_add_pd(a1, _mm256_loadu_pd(v + i + 4));
+  }
+  _mm256_storeu_pd(p, a0);
+  _mm256_storeu_pd(p + 4, a1);
+  s = sum8(p);
+  for (; i < n; i++) {
+    s += v[i];
+  }
+  return s;
+}
+
+static int sum_i64_sse2(const long long *v, int n, long long *out)
+{
+  __m128i acc = _mm_setzero_si128(), ovf = _mm_setzero_si128(), x, s;
+  long long lanes[2];
+  int i;
+
+  for (i=0; i + 2 <= n; i += 2) {
+    x = _mm_loadu_si128((const __m128i *) (v + i));
+    s = _mm_add_epi64(acc, x);
+    ovf = _mm_or_si128(ovf, _mm_and_si128(_mm_xor_si128(acc, s), _mm_xor_si128(x, s)));
+    acc = s;
+  }
+  if (_mm_movemask_pd(_mm_castsi128_pd(ovf))) {
+    return sum_i64_scalar(v, n, out);
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  return sum_i64_finish(lanes, 2, v, i, n, out);
+}
+
+AVX2 static int sum_i64_avx2(const long long *v, int n, long long *out)
+{
+  __m256i acc = _mm256_setzero_si256(), ovf = _mm256_setzero_si256(), x, s;
+  long long lanes[4];
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((const __m256i *) (v + i));
+    s = _mm256_add_epi64(acc, x);
+    ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(acc, s), _mm256_xor_si256(x, s)));
+    acc = s;
+  }
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf))) {
+    return sum_i64_scalar(v, n, out);
+  }
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  return sum_i64_finish(lanes, 4, v, i, n, out);
+}
+#endif
+
+static double sum_f64(const double *v, int n)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: return sum_f64_avx2(v, n);
+  case ARRAY_SSE2: return sum_f64_sse2(v, n);
+#endif
+  default: return sum_f64_scalar(v, n);
+  }
+}
+
+static int sum_i64(const long long *v, int n, long long *out)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: return sum_i64_avx2(v, n, out);
+  case ARRAY_SSE2: return sum_i64_sse2(v, n, out);
+#endif
+  default: return sum_i64_scalar(v, n, out);
+  }
+}
+
+/*
+ * Minimum and maximum, of at least one element. A NaN anywhere makes the
+ * result the first NaN, at every SIMD level: the vector kernels check for
+ * one, and leave it to the scalar loop.
+ */
+static double minmax_f64_scalar(const double *v, int n, int max)
+{
+  double m = v[0];
+  int i;
+
+  for (i=0; i < n; i++) {
+    if (isnan(v[i])) return v[i];
+    if (max ? v[i] > m : v[i] < m) m = v[i];
+  }
+  return m;
+}
+
+static long long minmax_i64_scalar(const long long *v, int n, int max)
+{
+  long long m = v[0];
+  int i;
+
+  for (i=1; i < n; i++) {
+    if (max ? v[i] > m : v[i] < m) m = v[i];
+  }
+  return m;
+}
+
+#ifdef ARRAY_X86
+static double minmax_f64_sse2(const double *v, int n, int max)
+{
+  __m128d m = _mm_set1_pd(v[0]), nan = _mm_setzero_pd(), x;
+  double lanes[2];
+  int i;
+
+  for (i=0; i + 2 <= n; i += 2) {
+    x = _mm_loadu_pd(v + i);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+    m = max ? _mm_max_pd(m, x) : _mm_min_pd(m, x);
+  }
+  if (_mm_movemask_pd(nan)) {
+    return minmax_f64_scalar(v, n, max);
+  }
+  _mm_storeu_pd(lanes, m);
+  lanes[0] = max ? (lanes[1] > lanes[0] ? lanes[1] : lanes[0]) : (lanes[1] < lanes[0] ? lanes[1] : lanes[0]);
+  for (; i < n; i++) {
+    if (isnan(v[i])) return v[i];
+    if (max ? v[i] > lanes[0] : v[i] < lanes[0]) lanes[0] = v[i];
+  }
+  return lanes[0];
+}
+
+AVX2 static double minmax_f64_avx2(const double *v, int n, int max)
+{
+  __m256d m = _mm256_set1_pd(v[0]), nan = _mm256_setzero_pd(), x;
+  double lanes[4];
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_pd(v + i);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+    m = max ? _mm256_max_pd(m, x) : _mm256_min_pd(m, x);
+  }
+  if (_mm256_movemask_pd(nan)) {
+    return minmax_f64_scalar(v, n, max);
+  }
+  _mm256_storeu_pd(lanes, m);
+  for (; i < n; i++) {
+    if (isnan(v[i])) return v[i];
+    if (max ? v[i] > lanes[0] : v[i] < lanes[0]) lanes[0] = v[i];
+  }
+  return minmax_f64_scalar(lanes, 4, max);
+}
+
+AVX2 static long long minmax_i64_avx2(const long long *v, int n, int max)
+{
+  __m256i m = _mm256_set1_epi64x(v[0]), x, take;
+  long long lanes[4];
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((const __m256i *) (v + i));
+    take = max ? _mm256_cmpgt_epi64(x, m) : _mm256_cmpgt_epi64(m, x);
+    m = _mm256_blendv_epi8(m, x, take);
+  }
+  _mm256_storeu_si256((__m256i *) lanes, m);
+  for (; i < n; i++) {
+    if (max ? v[i] > lanes[0] : v[i] < lanes[0]) lanes[0] = v[i];
+  }
+  return minmax_i64_scalar(lanes, 4, max);
+}
+#endif
+
+static double minmax_f64(const double *v, int n, int max)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: return minmax_f64_avx2(v, n, max);
+  case ARRAY_SSE2: return minmax_f64_sse2(v, n, max);
+#endif
+  default: return minmax_f64_scalar(v, n, max);
+  }
+}
+
+static long long minmax_i64(const long long *v, int n, int max)
+{
+#ifdef ARRAY_X86
+  /* 64-bit compares need AVX2 (SSE4.2 at least) */
+  if (array_simd() == ARRAY_AVX2) return minmax_i64_avx2(v, n, max);
+#endif
+  return minmax_i64_scalar(v, n, max);
+}
+
+/*
+ * Dot product
+ */
+static double dot_f64_scalar(const double *a, const double *b, int n)
+{
+  double p[8] = {0}, s;
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    p[0] += a[i] * b[i];
+    p[1] += a[i+1] * b[i+1];
+    p[2] += a[i+2] * b[i+2];
+    p[3] += a[i+3] * b[i+3];
+    p[4] += a[i+4] * b[i+4];
+    p[5] += a[i+5] * b[i+5];
+    p[6] += a[i+6] * b[i+6];
+    p[7] += a[i+7] * b[i+7];
+  }
+  s = sum8(p);
+  for (; i < n; i++) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+
+static int dot_i64(const long long *a, const long long *b, int n, long long *out)
+{
+  long long s = 0, p;
+  int i;
+
+  /* No 64-bit vector multiply before AVX-512, so ints stay scalar */
+  for (i=0; i < n; i++) {
+    if (__builtin_mul_overflow(a[i], b[i], &p) || __builtin_add_overflow(s, p, &s)) {
+      return -1;
+    }
+  }
+  *out = s;
+  return 0;
+}
+
+#ifdef ARRAY_X86
+static double dot_f64_sse2(const double *a, const double *b, int n)
+{
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  __m128d a2 = _mm_setzero_pd(), a3 = _mm_setzero_pd();
+  double p[8], s;
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    a2 = _mm_add_pd(a2, _mm_mul_pd(_mm_loadu_pd(a + i + 4), _mm_loadu_pd(b + i + 4)));
+    a3 = _mm_add_pd(a3, _mm_mul_pd(_mm_loadu_pd(a + i + 6), _mm_loadu_pd(b + i + 6)));
+  }
+  _mm_storeu_pd(p, a0);
+  _mm_storeu_pd(p + 2, a1);
+  _mm_storeu_pd(p + 4, a2);
+  _mm_storeu_pd(p + 6, a3);
+  s = sum8(p);
+  for (; i < n; i++) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+
+AVX2 static double dot_f64_avx2(const double *a, const double *b, int n)
+{
+  __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+  double p[8], s;
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+  }
+  _mm256_storeu_pd(p, a0);
+  _mm256_storeu_pd(p + 4, a1);
+  s = sum8(p);
+  for (; i < n; i++) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+#endif
+
+static double dot_f64(const double *a, const double *b, int n)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: return dot_f64_avx2(a, b, n);
+  case ARRAY_SSE2: return dot_f64_sse2(a, b, n);
+#endif
+  default: return dot_f64_scalar(a, b, n);
+  }
+}
+
+/*
+ * Element-wise: dst = a * k, and dst = a + b, or a + k when b is NULL
+ */
+static void scale_f64_scalar(double *dst, const double *a, double k, int n)
+{
+  int i;
+
+  for (i=0; i < n; i++) {
+    dst[i] = a[i] * k;
+  }
+}
+
+static void add_f64_scalar(double *dst, const double *a, const double *b, double k, int n)
+{
+  int i;
+
+  for (i=0; i < n; i++) {
+    dst[i] = a[i] + (b ? b[i] : k);
+  }
+}
+
+static int add_i64_scalar(long long *dst, const long long *a, const long long *b, long long k, int n)
+{
+  int i;
+
+  for (i=0; i < n; i++) {
+    if (__builtin_add_overflow(a[i], b ? b[i] : k, &dst[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+#ifdef ARRAY_X86
+static void scale_f64_sse2(double *dst, const double *a, double k, int n)
+{
+  __m128d vk = _mm_set1_pd(k);
+  int i;
+
+  for (i=0; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_loadu_pd(a + i), vk));
+  }
+  scale_f64_scalar(dst + i, a + i, k, n - i);
+}
+
+AVX2 static void scale_f64_avx2(double *dst, const double *a, double k, int n)
+{
+  __m256d vk = _mm256_set1_pd(k);
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vk));
+  }
+  scale_f64_scalar(dst + i, a + i, k, n - i);
+}
+
+static void add_f64_sse2(double *dst, const double *a, const double *b, double k, int n)
+{
+  __m128d vk = _mm_set1_pd(k);
+  int i;
+
+  for (i=0; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(dst + i, _mm_add_pd(_mm_loadu_pd(a + i), b ? _mm_loadu_pd(b + i) : vk));
+  }
+  add_f64_scalar(dst + i, a + i, b ? b + i : NULL, k, n - i);
+}
+
+AVX2 static void add_f64_avx2(double *dst, const double *a, const double *b, double k, int n)
+{
+  __m256d vk = _mm256_set1_pd(k);
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(a + i), b ? _mm256_loadu_pd(b + i) : vk));
+  }
+  add_f64_scalar(dst + i, a + i, b ? b + i : NULL, k, n - i);
+}
+
+static int add_i64_sse2(long long *dst, const long long *a, const long long *b, long long k, int n)
+{
+  __m128i vk = _mm_set1_epi64x(k), ovf = _mm_setzero_si128(), x, y, s;
+  int i;
+
+  for (i=0; i + 2 <= n; i += 2) {
+    x = _mm_loadu_si128((const __m128i *) (a + i));
+    y = b ? _mm_loadu_si128((const __m128i *) (b + i)) : vk;
+    s = _mm_add_epi64(x, y);
+    ovf = _mm_or_si128(ovf, _mm_and_si128(_mm_xor_si128(x, s), _mm_xor_si128(y, s)));
+    _mm_storeu_si128((__m128i *) (dst + i), s);
+  }
+  if (_mm_movemask_pd(_mm_castsi128_pd(ovf))) {
+    return -1;
+  }
+  return add_i64_scalar(dst + i, a + i, b ? b + i : NULL, k, n - i);
+}
+
+AVX2 static int add_i64_avx2(long long *dst, const long long *a, const long long *b, long long k, int n)
+{
+  __m256i vk = _mm256_set1_epi64x(k), ovf = _mm256_setzero_si256(), x, y, s;
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((const __m256i *) (a + i));
+    y = b ? _mm256_loadu_si256((const __m256i *) (b + i)) : vk;
+    s = _mm256_add_epi64(x, y);
+    ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(x, s), _mm256_xor_si256(y, s)));
+    _mm256_storeu_si256((__m256i *) (dst + i), s);
+  }
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf))) {
+    return -1;
+  }
+  return add_i64_scalar(dst + i, a + i, b ? b + i : NULL, k, n - i);
+}
+#endif
+
+static void scale_f64(double *dst, const double *a, double k, int n)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: scale_f64_avx2(dst, a, k, n); break;
+  case ARRAY_SSE2: scale_f64_sse2(dst, a, k, n); break;
+#endif
+  default: scale_f64_scalar(dst, a, k, n);
+  }
+}
+
+static void add_f64(double *dst, const double *a, const double *b, double k, int n)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: add_f64_avx2(dst, a, b, k, n); break;
+  case ARRAY_SSE2: add_f64_sse2(dst, a, b, k, n); break;
+#endif
+  default: add_f64_scalar(dst, a, b, k, n);
+  }
+}
+
+static int add_i64(long long *dst, const long long *a, const long long *b, long long k, int n)
+{
+  switch (array_simd()) {
+#ifdef ARRAY_X86
+  case ARRAY_AVX2: return add_i64_avx2(dst, a, b, k, n);
+  case ARRAY_SSE2: return add_i64_sse2(dst, a, b, k, n);
+#endif
+  default: return add_i64_scalar(dst, a, b, k, n);
+  }
+}
+
+/*
+ * Operations on array values
+ */
+
+static int array_numeric(struct t_array *array)
+{
+  if (array->type == VAL_STRING) {
+    fprintf(stderr, "Error: Expected an array of numbers, got an array of strings\n");
+    return 0;
+  }
+  if (array->type == ARRAY_MIXED) {
+    fprintf(stderr, "Error: Expected an array of numbers, got a mixed array\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int array_overflow(void)
+{
+  fprintf(stderr, "Error: Integer overflow in array operation\n");
+  return -1;
+}
+
+/*
+ * The elements as doubles: the array's own storage, or a converted copy in
+ * *copy, which the caller frees.
+ */
+static double * array_f64(struct t_array *array, double **copy)
+{
+  long long *ints = array->data;
+  int i;
+
+  *copy = NULL;
+  if (array->type == VAL_FLOAT) {
+    return array->data;
+  }
+  *copy = malloc(sizeof(double) * (array->len ? array->len : 1));
+  for (i=0; i < array->len; i++) {
+    (*copy)[i] = (double) ints[i];
+  }
+  return *copy;
+}
+
+int array_sum(struct t_array *array, struct t_value *ret)
+{
+  if (!array_numeric(array)) {
+    return -1;
+  }
+  ret->type = array->type;
+  if (array->type == VAL_INT) {
+    if (sum_i64(array->data, array->len, &ret->intval) < 0) {
+      return array_overflow();
+    }
+  }
+  else {
+    ret->floatval = sum_f64(array->data, array->len);
+  }
+  return 0;
+}
+
+int array_minmax(struct t_array *array, int max, struct t_value *ret)
+{
+  if (!array_numeric(array)) {
+    return -1;
+  }
+  if (array->len == 0) {
+    fprintf(stderr, "Error: %s() of an empty array\n", max ? "max" : "min");
+    return -1;
+  }
+  ret->type = array->type;
+  if (array->type == VAL_INT) {
+    ret->intval = minmax_i64(array->data, array->len, max);
+  }
+  else {
+    ret->floatval = minmax_f64(array->data, array->len, max);
+  }
+  return 0;
+}
+
+static int array_same_len(struct t_array *a, struct t_array *b)
+{
+  if (a->len != b->len) {
+    fprintf(stderr, "Error: Arrays have different lengths, %d and %d\n", a->len, b->len);
+    return 0;
+  }
+  return 1;
+}
+
+int array_dot(struct t_array *a, struct t_array *b, struct t_value *ret)
+{
+  double *fa, *fb, *ca, *cb;
+
+  if (!array_numeric(a) || !array_numeric(b) || !array_same_len(a, b)) {
+    return -1;
+  }
+  if (a->type == VAL_INT && b->type == VAL_INT) {
+    ret->type = VAL_INT;
+    if (dot_i64(a->data, b->data, a->len, &ret->intval) < 0) {
+      return array_overflow();
+    }
+    return 0;
+  }
+  fa = array_f64(a, &ca);
+  fb = array_f64(b, &cb);
+  ret->type = VAL_FLOAT;
+  ret->floatval = dot_f64(fa, fb, a->len);
+  free(ca);
+  free(cb);
+  return 0;
+}
+
+struct t_array * array_scale(struct t_array *array, struct t_value *k)
+{
+  struct t_array *ret;
+  long long *src, *dst;
+  double *fa, *copy;
+  int i;
+
+  if (!array_numeric(array) || !value_is_num(k)) {
+    return NULL;
+  }
+  if (array->type == VAL_INT && k->type == VAL_INT) {
+    ret = array_new(VAL_INT, array->len);
+    src = array->data;
+    dst = ret->data;
+    /* No 64-bit vector multiply before AVX-512, so ints stay scalar */
+    for (i=0; i < array->len; i++) {
+      if (__builtin_mul_overflow(src[i], k->intval, &dst[i])) {
+        array_release(ret);
+        array_overflow();
+        return NULL;
+      }
+    }
+    return ret;
+  }
+  ret = array_new(VAL_FLOAT, array->len);
+  fa = array_f64(array, &copy);
+  scale_f64(ret->data, fa, value_num(k), array->len);
+  free(copy);
+  return ret;
+}
+
+struct t_array * array_add(struct t_array *a, struct t_array *b, struct t_value *k)
+{
+  struct t_array *ret;
+  double *fa, *fb = NULL, *ca, *cb = NULL;
+  int ints;
+
+  if (!array_numeric(a) || (b && (!array_numeric(b) || !array_same_len(a, b))) || (!b && !value_is_num(k))) {
+    return NULL;
+  }
+  ints = a->type == VAL_INT && (b ? b->type == VAL_INT : k->type == VAL_INT);
+  if (ints) {
+    ret = array_new(VAL_INT, a->len);
+    if (add_i64(ret->data, a->data, b ? b->data : NULL, b ? 0 : k->intval, a->len) < 0) {
+      array_release(ret);
+      array_overflow();
+      return NULL;
+    }
+    return ret;
+  }
+  ret = array_new(VAL_FLOAT, a->len);
+  fa = array_f64(a, &ca);
+  if (b) {
+    fb = array_f64(b, &cb);
+  }
+  add_f64(ret->data, fa, fb, b ? 0 : value_num(k), a->len);
+  free(ca);
+  free(cb);
+  return ret;
+}
@@ -0,0 +1,456 @@
+/*
+ * Batch runner.
+ *
+ *   run -b <manifest|directory> [-j threads]
+ *
+ * A manifest lists one script path per line. Blank lines and lines that
+ * start with # are skipped. A directory runs each regular file in it, in
+ * name order. Each script is loaded once, however many jobs name it, and
+ * the scripts are loaded in parallel. The jobs then run on a work-stealing
+ * pool, with one exec per worker that is reset between jobs.
+ *
+ * Each job's output is captured, and printed in job order under a header
+ * with its status: 0 if it ran, 1 if it failed, 2 if it didn't load. What
+ * a job writes to stderr is captured as well, by a stderr that goes to the
+ * writing thread's current job, and printed to stderr after the job's
+ * output, so with 2>&1 errors show under the header of the job that made
+ * them. A job whose script didn't load gets the errors from loading it.
+ * Last comes a report on stderr, with the throughput and the 50th and 99th
+ * percentile job latencies.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "corelib.h"
+
+/* The log this thread's stderr goes to, or NULL for the real stderr */
+static __thread struct t_batch_log *batch_log;
+static FILE *batch_stderr;
+
+static double batch_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t batch_log_write(void *cookie, const char *buf, size_t size)
+{
+  struct t_batch_log *log = batch_log;
+  char *text;
+  int cap;
+
+  if (!log) {
+    return write(STDERR_FILENO, buf, size);
+  }
+  if (log->len + (int) size > log->cap) {
+    cap = log->cap ? log->cap : 256;
+    while (cap < log->len + (int) size) {
+      cap *= 2;
+    }
+    text = realloc(log->text, cap);
+    if (!text) {
+      return size;
+    }
+    log->text = text;
+    log->cap = cap;
+  }
+  memcpy(log->text + log->len, buf, size);
+  log->len += size;
+  return size;
+}
+
+/*
+ * Point stderr at a stream that writes to the calling thread's log, for
+ * the duration of the batch.
+ */
+static int batch_capture_stderr(void)
+{
+  cookie_io_functions_t io = {NULL, batch_log_write, NULL, NULL};
+  FILE *f;
+
+  /* The stderr that flushes script output goes first, to be put back */
+  output_bind(NULL);
+  fflush(stderr);
+  f = fopencookie(NULL, "w", io);
+  if (!f) {
+    fprintf(stderr, "Error: Can't capture stderr\n");
+    return -1;
+  }
+  setvbuf(f, NULL, _IONBF, 0);
+  batch_stderr = stderr;
+  stderr = f;
+  return 0;
+}
+
+static void batch_restore_stderr(void)
+{
+  if (batch_stderr) {
+    fclose(stderr);
+    stderr = batch_stderr;
+    batch_stderr = NULL;
+  }
+}
+
+static int batch_add(struct t_batch *batch, const char *path, int *cap)
+{
+  struct t_batch_job *jobs;
+
+  if (batch->njobs == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    jobs = realloc(batch->jobs, sizeof(struct t_batch_job) * *cap);
+    if (!jobs) {
+      fprintf(stderr, "Error: Out of memory adding %s\n", path);
+      return -1;
+    }
+    batch->jobs = jobs;
+  }
+  memset(&batch->jobs[batch->njobs], 0, sizeof(struct t_batch_job));
+  batch->jobs[batch->njobs].batch = batch;
+  batch->jobs[batch->njobs].path = strdup(path);
+  batch->njobs++;
+  return 0;
+}
+
+static int batch_visible(const struct dirent *entry)
+{
+  return entry->d_name[0] != '.';
+}
+
+/*
+ * A job for each regular file in dir.
+ */
+static int batch_read_dir(struct t_batch *batch, const char *dir)
+{
+  struct dirent **entries;
+  struct stat st;
+  char path[4096];
+  int cap = 0;
+  int i, n, rc = 0;
+
+  n = scandir(dir, &entries, batch_visible, alphasort);
+  if (n < 0) {
+    fprintf(stderr, "Error: Can't read directory %s\n", dir);
+    return -1;
+  }
+  for (i=0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+    if (rc == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      rc = batch_add(batch, path, &cap);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  return rc;
+}
+
+/*
+ * A job for each path listed in a manifest.
+ */
+static int batch_read_manifest(struct t_batch *batch, const char *manifest)
+{
+  FILE *f;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int cap = 0;
+  int rc = 0;
+
+  f = fopen(manifest, "r");
+  if (!f) {
+    fprintf(stderr, "Error: Can't open manifest %s\n", manifest);
+    return -1;
+  }
+  while (rc == 0 && (len = getline(&line, &size, f)) >= 0) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' ' || line[len-1] == '\t')) {
+      line[--len] = '\0';
+    }
+    if (len > 0 && line[0] != '#') {
+      rc = batch_add(batch, line, &cap);
+    }
+  }
+  free(line);
+  fclose(f);
+  return rc;
+}
+
+static int batch_cmp_path(const void *a, const void *b)
+{
+  return strcmp((*(struct t_batch_job **) a)->path, (*(struct t_batch_job **) b)->path);
+}
+
+/*
+ * One script for each distinct path, shared by all the jobs that name it.
+ */
+static int batch_scripts(struct t_batch *batch)
+{
+  struct t_batch_job **order;
+  struct t_batch_script *script;
+  int i;
+
+  order = malloc(sizeof(struct t_batch_job *) * batch->njobs);
+  batch->scripts = calloc(batch->njobs, sizeof(struct t_batch_script));
+  if (!order || !batch->scripts) {
+    fprintf(stderr, "Error: Out of memory\n");
+    free(order);
+    return -1;
+  }
+  for (i=0; i < batch->njobs; i++) {
+    order[i] = &batch->jobs[i];
+  }
+  qsort(order, batch->njobs, sizeof(struct t_batch_job *), batch_cmp_path);
+  for (i=0; i < batch->njobs; i++) {
+    if (i == 0 || strcmp(order[i]->path, order[i-1]->path) != 0) {
+      script = &batch->scripts[batch->nscripts++];
+      script->path = order[i]->path;
+    }
+    order[i]->script = batch->nscripts - 1;
+  }
+  free(order);
+  return 0;
+}
+
+static void batch_load(void *arg, int worker)
+{
+  struct t_batch_script *script = arg;
+  FILE *in;
+
+  batch_log = &script->err;
+  in = fopen(script->path, "r");
+  if (!in) {
+    fprintf(stderr, "Error: Can't open %s\n", script->path);
+  }
+  else {
+    script->program = program_load(in);
+  }
+  batch_log = NULL;
+}
+
+static void batch_job(void *arg, int worker)
+{
+  struct t_batch_job *job = arg;
+  struct t_batch *batch = job->batch;
+  struct t_batch_worker *w = &batch->workers[worker];
+  struct t_program *program = batch->scripts[job->script].program;
+  double start;
+
+  start = batch_now();
+  job->status = 2;
+  if (!program) {
+    return;
+  }
+
+  batch_log = &job->err;
+  if (w->program != program) {
+    if (w->program) {
+      exec_close(&w->exec);
+      w->program = NULL;
+    }
+    if (exec_init_program(&w->exec, program) < 0 || output_capture(&w->exec.out) < 0) {
+      exec_close(&w->exec);
+      batch_log = NULL;
+      return;
+    }
+    core_apply(&w->exec);
+    w->program = program;
+  }
+
+  job->status = exec_statements(&w->exec) < 0 ? 1 : 0;
+  job->out = output_take(&w->exec.out, &job->outlen);
+  exec_reset(&w->exec);
+  batch_log = NULL;
+  job->secs = batch_now() - start;
+}
+
+static void batch_print_log(struct t_batch_log *log)
+{
+  if (log->len) {
+    fflush(stdout);
+    fwrite(log->text, 1, log->len, stderr);
+  }
+}
+
+/*
+ * A job's output to stdout and its errors to stderr, after its header.
+ */
+static void batch_print(struct t_batch *batch, struct t_batch_job *job)
+{
+  printf("==> %s (status %d) <==\n", job->path, job->status);
+  if (job->out) {
+    fwrite(job->out, 1, job->outlen, stdout);
+  }
+  if (job->status == 2) {
+    batch_print_log(&batch->scripts[job->script].err);
+  }
+  batch_print_log(&job->err);
+}
+
+static int batch_cmp_double(const void *a, const void *b)
+{
+  double x = *(double *) a, y = *(double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * The pth percentile of n sorted values, by nearest rank.
+ */
+static double batch_percentile(double *sorted, int n, int p)
+{
+  int rank = (n * p + 99) / 100;
+
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void batch_report(struct t_batch *batch, double load_secs, double run_secs)
+{
+  double *secs;
+  int failed = 0;
+  int i;
+
+  secs = malloc(sizeof(double) * batch->njobs);
+  if (!secs) {
+    return;
+  }
+  for (i=0; i < batch->njobs; i++) {
+    secs[i] = batch->jobs[i].secs;
+    failed += batch->jobs[i].status != 0;
+  }
+  qsort(secs, batch->njobs, sizeof(double), batch_cmp_double);
+
+  fprintf(stderr, "batch: %d jobs of %d scripts on %d threads, %d failed\n",
+    batch->njobs, batch->nscripts, batch->pool.n, failed);
+  fprintf(stderr, "batch: loaded in %.3f s, ran in %.3f s, %.1f jobs/s\n",
+    load_secs, run_secs, run_secs > 0 ? batch->njobs / run_secs : 0.0);
+  fprintf(stderr, "batch: latency p50 %.3f ms, p99 %.3f ms, %ld steals\n",
+    batch_percentile(secs, batch->njobs, 50) * 1000, batch_percentile(secs, batch->njobs, 99) * 1000,
+    pool_steals(&batch->pool));
+  free(secs);
+}
+
+static void batch_close(struct t_batch *batch)
+{
+  int i;
+
+  if (batch->workers) {
+    for (i=0; i < batch->pool.n; i++) {
+      if (batch->workers[i].program) {
+        exec_close(&batch->workers[i].exec);
+      }
+    }
+    free(batch->workers);
+  }
+  if (batch->pool.workers) {
+    pool_close(&batch->pool);
+  }
+  for (i=0; i < batch->nscripts; i++) {
+    if (batch->scripts[i].program) {
+      program_free(batch->scripts[i].program);
+    }
+    free(batch->scripts[i].err.text);
+  }
+  free(batch->scripts);
+  for (i=0; i < batch->njobs; i++) {
+    free(batch->jobs[i].path);
+    free(batch->jobs[i].out);
+    free(batch->jobs[i].err.text);
+  }
+  free(batch->jobs);
+}
+
+/*
+ * Run the jobs listed in source, a manifest or a directory, on threads
+ * threads, or one per CPU if it is 0. Returns 0 if every job ran.
+ */
+static int batch_run(const char *source, int threads)
+{
+  struct t_batch batch;
+  struct stat st;
+  double start, loaded, done;
+  int i, rc;
+
+  memset(&batch, 0, sizeof(struct t_batch));
+  if (stat(source, &st) < 0) {
+    fprintf(stderr, "Error: Can't find %s\n", source);
+    return 2;
+  }
+  rc = S_ISDIR(st.st_mode) ? batch_read_dir(&batch, source) : batch_read_manifest(&batch, source);
+  if (rc == 0 && !batch.njobs) {
+    fprintf(stderr, "Error: No scripts in %s\n", source);
+    rc = -1;
+  }
+  if (rc < 0 || batch_scripts(&batch) < 0 || pool_init(&batch.pool, threads) < 0) {
+    batch_close(&batch);
+    return 2;
+  }
+  batch.workers = calloc(batch.pool.n, sizeof(struct t_batch_worker));
+  if (!batch.workers || batch_capture_stderr() < 0) {
+    if (!batch.workers) {
+      fprintf(stderr, "Error: Out of memory\n");
+    }
+    batch_close(&batch);
+    return 2;
+  }
+
+  start = batch_now();
+  for (i=0; i < batch.nscripts; i++) {
+    pool_submit(&batch.pool, batch_load, &batch.scripts[i]);
+  }
+  pool_wait(&batch.pool);
+  loaded = batch_now();
+
+  for (i=0; i < batch.njobs; i++) {
+    pool_submit(&batch.pool, batch_job, &batch.jobs[i]);
+  }
+  pool_wait(&batch.pool);
+  done = batch_now();
+
+  batch_restore_stderr();
+  rc = 0;
+  for (i=0; i < batch.njobs; i++) {
+    batch_print(&batch, &batch.jobs[i]);
+    if (batch.jobs[i].status) {
+      rc = 1;
+    }
+  }
+  fflush(stdout);
+  batch_report(&batch, loaded - start, done - loaded);
+  batch_close(&batch);
+  return rc;
+}
+
+int batch_main(int argc, char **argv)
+{
+  const char *source = NULL;
+  int threads = 0;
+  int i;
+
+  for (i=1; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      source = argv[++i];
+    }
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    }
+    else {
+      source = NULL;
+      break;
+    }
+  }
+  if (!source || threads < 0) {
+    fprintf(stderr, "Usage: run [-p]\n"
+            "       run -b manifest|directory [-j threads]\n"
+            "       run -s socket [-w workers] [-n requests] [library...]\n"
+            "       run -d script input [-f function] [-k shards] [-w workers] [-a address]...\n"
+            "       run -r address\n");
+    return 2;
+  }
+  return batch_run(source, threads);
+}
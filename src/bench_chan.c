@@ -0,0 +1,208 @@
+/*
+ * Benchmark for channels.
+ *
+ * Times messages going from one thread to another through a channel. The
+ * ring alone first: a sender and a receiver in C, on threads of their own,
+ * that call chan_try_send() and chan_try_recv() and yield the CPU when
+ * the ring is full or empty. Then scripts: a thread() that sends n
+ * messages, and the main exec that receives them, with ints and with
+ * strings on the heap, which go by reference to their buffer.
+ *
+ *   bench_chan [n] [capacity]
+ *
+ * Each runs on a channel of capacity slots, and on one of 2, where each
+ * side mostly waits for the other. Prints messages per second for each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "exec.h"
+#include "corelib.h"
+#include "chan.h"
+
+#define BENCH_DEFAULT_N 1000000
+#define BENCH_DEFAULT_CAP 1024
+
+static const char bench_script[] =
+  "ch = channel(%d)\n"
+  "func producer(ch, n, m)\n"
+  "  i = 0\n"
+  "  while i < n\n"
+  "    send(ch, %s)\n"
+  "    i = i + 1\n"
+  "  end\n"
+  "  chan_close(ch)\n"
+  "  return n\n"
+  "end\n"
+  "t = thread(\"producer\", ch, %d, \"a message on the heap, \" + 1)\n"
+  "stop = %s\n"
+  "n = 0\n"
+  "v = recv(ch, stop)\n"
+  "while v != stop\n"
+  "  n = n + 1\n"
+  "  v = recv(ch, stop)\n"
+  "end\n"
+  "result = n + join(t)\n";
+
+struct t_ring_bench {
+  struct t_chan *chan;
+  int n;
+  long long sum;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * ring_sender(void *arg)
+{
+  struct t_ring_bench *bench = arg;
+  struct t_msg msg;
+  int i;
+
+  memset(&msg, 0, sizeof(struct t_msg));
+  for (i=0; i < bench->n; i++) {
+    msg.type = VAL_INT;
+    msg.intval = i;
+    while (chan_try_send(bench->chan, &msg) == 0) {
+      sched_yield();
+    }
+  }
+  chan_close(bench->chan);
+  return NULL;
+}
+
+/*
+ * n ints through the ring of a new channel of cap slots. Returns the
+ * messages per second, or -1 if they didn't all arrive.
+ */
+static double ring_bench(struct t_exec *exec, int n, int cap)
+{
+  struct t_ring_bench bench;
+  struct t_value id, ret;
+  struct t_msg end;
+  pthread_t sender;
+  double start, secs;
+  int rc;
+
+  memset(&end, 0, sizeof(struct t_msg));
+  value_init(&id, VAL_INT);
+  value_init(&ret, VAL_NULL);
+  id.intval = chan_new(exec, cap);
+  bench.chan = id.intval < 0 ? NULL : chan_get(exec, &id, "bench");
+  if (!bench.chan) {
+    return -1;
+  }
+  bench.n = n;
+  bench.sum = 0;
+
+  start = now();
+  if (pthread_create(&sender, NULL, ring_sender, &bench) != 0) {
+    fprintf(stderr, "Error: Can't start a thread\n");
+    return -1;
+  }
+  for (;;) {
+    end.type = VAL_NULL;
+    rc = chan_try_recv(bench.chan, &end, &ret);
+    if (rc == 0) {
+      sched_yield();
+      continue;
+    }
+    if (ret.type != VAL_INT) {
+      break;
+    }
+    bench.sum += ret.intval;
+  }
+  pthread_join(sender, NULL);
+  secs = now() - start;
+
+  if (bench.sum != (long long) n * (n - 1) / 2) {
+    fprintf(stderr, "Error: The ring lost messages\n");
+    return -1;
+  }
+  return n / secs;
+}
+
+/*
+ * The script, with n messages of the kind in send, on a channel of cap
+ * slots. Returns the messages per second, or -1 if it went wrong.
+ */
+static double script_bench(int n, int cap, const char *send, const char *end)
+{
+  struct t_exec exec;
+  struct t_var *var;
+  char script[sizeof(bench_script) + 64];
+  double start, secs = 0;
+  FILE *in;
+  int ok = 0;
+
+  snprintf(script, sizeof(script), bench_script, cap, send, n, end);
+  in = fmemopen(script, strlen(script), "r");
+  if (!in) {
+    return -1;
+  }
+  if (exec_init(&exec, in) == 0) {
+    core_apply(&exec);
+    start = now();
+    if (exec_statements(&exec) == 0) {
+      secs = now() - start;
+      var = var_lookup(&exec, "result");
+      ok = var && var->value->type == VAL_INT && var->value->intval == 2LL * n;
+    }
+  }
+  exec_close(&exec);
+  if (!ok) {
+    fprintf(stderr, "Error: The script went wrong\n");
+    return -1;
+  }
+  return n / secs;
+}
+
+static int bench(struct t_exec *exec, int n, int cap)
+{
+  double ring, ints, strs;
+
+  ring = ring_bench(exec, n, cap);
+  ints = script_bench(n, cap, "i", "0 - 1");
+  strs = script_bench(n, cap, "m", "\"\"");
+  if (ring < 0 || ints < 0 || strs < 0) {
+    return -1;
+  }
+  printf("cap %-7d ring   int    %12.0f msgs/s\n", cap, ring);
+  printf("cap %-7d script int    %12.0f msgs/s\n", cap, ints);
+  printf("cap %-7d script string %12.0f msgs/s\n", cap, strs);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  static const char empty[] = "\n";
+  struct t_exec exec;
+  int n = BENCH_DEFAULT_N;
+  int cap = BENCH_DEFAULT_CAP;
+  int rc;
+
+  if (argc > 1) {
+    n = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    cap = atoi(argv[2]);
+  }
+  if (n <= 0 || cap < 1 || cap > CHAN_MAX_CAP) {
+    fprintf(stderr, "Usage: bench_chan [n] [capacity]\n");
+    return 1;
+  }
+  if (exec_init(&exec, fmemopen((void *) empty, sizeof(empty) - 1, "r")) < 0) {
+    return 1;
+  }
+  rc = bench(&exec, n, cap) < 0 || bench(&exec, n, 2) < 0;
+  exec_close(&exec);
+  return rc;
+}
@@ -0,0 +1,261 @@
+/*
+ * Benchmark for map values.
+ *
+ * Times inserts, lookups that hit and lookups that miss on a map with n
+ * int keys and one with n interned string keys, against a baseline in plain
+ * C: a chained hash table with one malloc'd node per entry, like the one
+ * the string table uses.
+ *
+ *   bench_map [n]
+ *
+ * Prints nanoseconds per operation for each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parser.h"
+
+#define BENCH_DEFAULT_N 1000000
+
+struct t_node {
+  struct t_node *next;
+  unsigned int hash;
+  int type;
+  long long ikey;
+  const char *skey;
+  long long value;
+};
+
+struct t_chained {
+  struct t_node **buckets;
+  int mask;
+  int count;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int key_eq(struct t_node *node, struct t_value *key)
+{
+  if (node->type != key->type) {
+    return 0;
+  }
+  if (key->type == VAL_INT) {
+    return node->ikey == key->intval;
+  }
+  return node->skey == key->stringval || strcmp(node->skey, key->stringval) == 0;
+}
+
+static void chained_init(struct t_chained *tab)
+{
+  tab->mask = 63;
+  tab->count = 0;
+  tab->buckets = calloc(tab->mask + 1, sizeof(struct t_node *));
+}
+
+static void chained_grow(struct t_chained *tab)
+{
+  struct t_node **buckets, *node, *next;
+  int mask = tab->mask * 2 + 1;
+  int i;
+
+  buckets = calloc(mask + 1, sizeof(struct t_node *));
+  for (i=0; i <= tab->mask; i++) {
+    for (node = tab->buckets[i]; node; node = next) {
+      next = node->next;
+      node->next = buckets[node->hash & mask];
+      buckets[node->hash & mask] = node;
+    }
+  }
+  free(tab->buckets);
+  tab->buckets = buckets;
+  tab->mask = mask;
+}
+
+static struct t_node * chained_find(struct t_chained *tab, struct t_value *key, unsigned int hash)
+{
+  struct t_node *node;
+
+  for (node = tab->buckets[hash & tab->mask]; node; node = node->next) {
+    if (node->hash == hash && key_eq(node, key)) {
+      return node;
+    }
+  }
+  return NULL;
+}
+
+static void chained_set(struct t_chained *tab, struct t_value *key, long long value)
+{
+  struct t_node *node;
+  unsigned int hash;
+
+  map_hash(key, &hash);
+  node = chained_find(tab, key, hash);
+  if (!node) {
+    if (tab->count > tab->mask) {
+      chained_grow(tab);
+    }
+    node = malloc(sizeof(struct t_node));
+    node->hash = hash;
+    node->type = key->type;
+    node->ikey = key->intval;
+    node->skey = key->stringval;
+    node->next = tab->buckets[hash & tab->mask];
+    tab->buckets[hash & tab->mask] = node;
+    tab->count++;
+  }
+  node->value = value;
+}
+
+static long long chained_get(struct t_chained *tab, struct t_value *key)
+{
+  struct t_node *node;
+  unsigned int hash;
+
+  map_hash(key, &hash);
+  node = chained_find(tab, key, hash);
+  return node ? node->value : -1;
+}
+
+static void chained_close(struct t_chained *tab)
+{
+  struct t_node *node, *next;
+  int i;
+
+  for (i=0; i <= tab->mask; i++) {
+    for (node = tab->buckets[i]; node; node = next) {
+      next = node->next;
+      free(node);
+    }
+  }
+  free(tab->buckets);
+}
+
+/*
+ * Run both tables over keys[0..n-1], then look up misses[0..n-1].
+ */
+static void bench(const char *name, struct t_value **keys, struct t_value **misses, int n)
+{
+  struct t_map *map;
+  struct t_chained tab;
+  struct t_value *val;
+  struct t_value num;
+  long long check = 0;
+  double t[7];
+  int i;
+
+  value_init(&num, VAL_INT);
+  map = map_new(0);
+  chained_init(&tab);
+
+  t[0] = now();
+  for (i=0; i < n; i++) {
+    num.intval = i;
+    map_set(map, keys[i], &num);
+  }
+  t[1] = now();
+  for (i=0; i < n; i++) {
+    if (map_get(map, keys[i], &val) > 0) check += val->intval;
+  }
+  t[2] = now();
+  for (i=0; i < n; i++) {
+    check += map_get(map, misses[i], &val);
+  }
+  t[3] = now();
+  for (i=0; i < n; i++) {
+    chained_set(&tab, keys[i], i);
+  }
+  t[4] = now();
+  for (i=0; i < n; i++) {
+    check -= chained_get(&tab, keys[i]);
+  }
+  t[5] = now();
+  for (i=0; i < n; i++) {
+    check -= chained_get(&tab, misses[i]) + 1;
+  }
+  t[6] = now();
+
+  printf("%-7s %-8s insert %6.1f ns  hit %6.1f ns  miss %6.1f ns\n", name, "map",
+         (t[1] - t[0]) * 1e9 / n, (t[2] - t[1]) * 1e9 / n, (t[3] - t[2]) * 1e9 / n);
+  printf("%-7s %-8s insert %6.1f ns  hit %6.1f ns  miss %6.1f ns\n", name, "chained",
+         (t[4] - t[3]) * 1e9 / n, (t[5] - t[4]) * 1e9 / n, (t[6] - t[5]) * 1e9 / n);
+  if (check != 0 || map->count != n) {
+    fprintf(stderr, "Error: The tables disagree\n");
+    exit(1);
+  }
+
+  map_release(map);
+  chained_close(&tab);
+}
+
+/*
+ * Keys in a shuffled order, so neither table sees them sequentially.
+ */
+static void shuffle(struct t_value **keys, int n)
+{
+  struct t_value *tmp;
+  int i, j;
+
+  for (i=n-1; i > 0; i--) {
+    j = rand() % (i + 1);
+    tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct t_value **keys, **misses;
+  struct t_strtab strings;
+  char buf[32];
+  int n = BENCH_DEFAULT_N;
+  int i;
+
+  if (argc > 1) {
+    n = atoi(argv[1]);
+  }
+  if (n <= 0) {
+    fprintf(stderr, "Usage: bench_map [n]\n");
+    return 1;
+  }
+  keys = malloc(sizeof(struct t_value *) * n);
+  misses = malloc(sizeof(struct t_value *) * n);
+  strtab_init(&strings);
+  srand(1);
+
+  for (i=0; i < n; i++) {
+    keys[i] = create_num_from_int((long long) i * 7919);
+    misses[i] = create_num_from_int((long long) i * 7919 + 1);
+  }
+  shuffle(keys, n);
+  bench("int", keys, misses, n);
+  for (i=0; i < n; i++) {
+    value_free(keys[i]);
+    value_free(misses[i]);
+  }
+
+  for (i=0; i < n; i++) {
+    snprintf(buf, sizeof(buf), "key%d", i);
+    keys[i] = create_interned_str(&strings, buf);
+    snprintf(buf, sizeof(buf), "miss%d", i);
+    misses[i] = create_interned_str(&strings, buf);
+  }
+  shuffle(keys, n);
+  bench("string", keys, misses, n);
+  for (i=0; i < n; i++) {
+    value_free(keys[i]);
+    value_free(misses[i]);
+  }
+
+  strtab_close(&strings);
+  free(keys);
+  free(misses);
+  return 0;
+}
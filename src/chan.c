@@ -0,0 +1,808 @@
+/*
+ * Channels and threads.
+ *
+ * channel(cap) makes a channel that holds up to cap messages, and gives
+ * its id. send(ch, v) puts v on it, and recv(ch) takes the oldest message
+ * off; once the channel is closed and empty, it gives null, or end with
+ * recv(ch, end). thread("f", args...) calls f(args...) on a thread of its
+ * own, in a new exec on the caller's program, and join(t) waits for it and
+ * gives what f returned. Values go between threads only as messages:
+ * numbers, strings, and arrays of them.
+ *
+ * A channel is a ring of slots, each with a sequence number, after
+ * Vyukov's bounded MPMC queue. A sender claims the slot at tail with a
+ * compare-and-swap, fills it in, and then bumps its sequence to hand it to
+ * the receivers; a receiver takes it from head the same way. So any number
+ * of senders and receivers, and one of each in particular, go without a
+ * lock. A ring has at least two slots, as one would look free and full
+ * at once.
+ *
+ * When the ring is full, or empty, the task spins a little if another CPU
+ * may change it, and then waits in its exec's event loop. The exec's other
+ * tasks run meanwhile, and its thread sleeps once none are left. The
+ * loop's wake fd is added to the channel's waiters, and whichever thread
+ * next sends or receives writes to it, and drops it, so that the sends and
+ * recvs after that cost no system call. That is backpressure: a sender
+ * that gets ahead waits for the receivers to catch up.
+ *
+ * Channels are in a table that every exec shares, and are freed once no
+ * exec uses them. An exec closes the channels it made when it is reset,
+ * after its threads have been joined at the end of the program, or before
+ * they are after an error, so that none waits forever. For the same reason
+ * a thread that fails closes every channel it used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include "exec.h"
+#include "chan.h"
+#include "array.h"
+#include "pool.h"
+
+static struct t_chan *chan_table[CHAN_MAX];
+static int chan_next_id;
+static pthread_mutex_t chan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int chan_cpus;
+static pthread_once_t chan_cpus_once = PTHREAD_ONCE_INIT;
+
+static void chan_cpus_init(void)
+{
+  chan_cpus = pool_cpus();
+}
+
+void chans_init(struct t_chans *chans)
+{
+  memset(chans, 0, sizeof(struct t_chans));
+}
+
+/*
+ * Make a message of a value. A string with a heap buffer shares it, which
+ * is from then on counted atomically and never changed in place. Returns
+ * -1 if the value can't be sent.
+ */
+static int msg_set(struct t_msg *msg, struct t_value *value, const char *name)
+{
+  struct t_strbuf *sb;
+
+  msg->type = value->type;
+  msg->intval = value->intval;
+  msg->floatval = value->floatval;
+  msg->len = 0;
+  msg->sbuf = NULL;
+  msg->array = NULL;
+  if (value->type == VAL_NULL || value->type == VAL_BOOL || value_is_num(value)) {
+    return 0;
+  }
+  if (value->type == VAL_STRING) {
+    msg->len = value->len;
+    if (value->sbuf && strbuf_share(value->sbuf) == 0) {
+      msg->sbuf = strbuf_ref(value->sbuf);
+      return 0;
+    }
+    if (value->len < VALUE_INLINE_LEN) {
+      memcpy(msg->inl, value->stringval, value->len);
+      return 0;
+    }
+    sb = strbuf_new(value->len + 1);
+    if (!sb) {
+      fprintf(stderr, "Error: Out of memory in %s()\n", name);
+      return -1;
+    }
+    memcpy(sb->str, value->stringval, value->len);
+    sb->str[value->len] = '\0';
+    msg->sbuf = sb;
+    return 0;
+  }
+  if (value->type == VAL_ARRAY) {
+    msg->array = array_copy(value->array);
+    if (!msg->array) {
+      fprintf(stderr, "Error: Out of memory in %s()\n", name);
+      return -1;
+    }
+    return 0;
+  }
+  fprintf(stderr, "Error: %s() can't pass a %s value to another thread.\n", name, value_types[value->type]);
+  return -1;
+}
+
+/*
+ * Move a message into a value, which must hold no string, array or map.
+ */
+static void msg_take(struct t_msg *msg, struct t_value *value)
+{
+  struct t_value str;
+
+  value->type = msg->type;
+  value->intval = msg->intval;
+  value->floatval = msg->floatval;
+  if (msg->type == VAL_STRING) {
+    value_init(&str, VAL_STRING);
+    str.sbuf = msg->sbuf;
+    str.stringval = msg->sbuf ? msg->sbuf->str : msg->inl;
+    str.len = msg->len;
+    /* An inline string is copied inline again, which can't fail */
+    value_move_str(value, &str);
+  }
+  else if (msg->type == VAL_ARRAY) {
+    value->array = msg->array;
+  }
+  msg->type = VAL_NULL;
+  msg->sbuf = NULL;
+  msg->array = NULL;
+}
+
+void msg_free(struct t_msg *msg)
+{
+  if (msg->sbuf) {
+    strbuf_release(msg->sbuf);
+  }
+  if (msg->array) {
+    array_release(msg->array);
+  }
+  msg->type = VAL_NULL;
+  msg->sbuf = NULL;
+  msg->array = NULL;
+}
+
+/*
+ * Wake the loops waiting on one end of a channel, after the other end has
+ * changed it. A loop whose waits can't go on yet adds its fd again.
+ */
+static void chan_notify(struct t_chan_waiters *waiters)
+{
+  uint64_t one = 1;
+  int i;
+
+  /* Pairs with the fence in chan_watch(): either side sees the other */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&waiters->waiting, __ATOMIC_RELAXED)) {
+    return;
+  }
+  pthread_mutex_lock(&waiters->lock);
+  /* Before the writes, so a loop they wake sees its fd was dropped */
+  __atomic_store_n(&waiters->waiting, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&waiters->gen, waiters->gen + 1, __ATOMIC_RELEASE);
+  for (i=0; i < waiters->n; i++) {
+    /* It only fails when the count is full, so the loop is woken anyway */
+    if (write(waiters->fds[i], &one, sizeof(one)) < 0) {
+      continue;
+    }
+  }
+  waiters->n = 0;
+  pthread_mutex_unlock(&waiters->lock);
+}
+
+/*
+ * Add a loop's wake fd to the waiters, once for each wait, and set *gen
+ * for chan_watched(). The caller tries the ring again after this.
+ */
+int chan_watch(struct t_chan_waiters *waiters, int fd, int *gen)
+{
+  int *fds;
+
+  pthread_mutex_lock(&waiters->lock);
+  if (waiters->n == waiters->cap) {
+    fds = realloc(waiters->fds, sizeof(int) * (waiters->cap ? waiters->cap * 2 : 4));
+    if (!fds) {
+      pthread_mutex_unlock(&waiters->lock);
+      fprintf(stderr, "Error: Out of memory waiting on a channel\n");
+      return -1;
+    }
+    waiters->fds = fds;
+    waiters->cap = waiters->cap ? waiters->cap * 2 : 4;
+  }
+  waiters->fds[waiters->n++] = fd;
+  *gen = waiters->gen;
+  __atomic_store_n(&waiters->waiting, waiters->n, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&waiters->lock);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/*
+ * Whether a wait's fd, added at gen, is still there: it hasn't been woken.
+ */
+int chan_watched(struct t_chan_waiters *waiters, int gen)
+{
+  return __atomic_load_n(&waiters->gen, __ATOMIC_ACQUIRE) == gen;
+}
+
+/*
+ * Take a wait's fd off the waiters, unless it was dropped when they were
+ * woken.
+ */
+void chan_unwatch(struct t_chan_waiters *waiters, int fd, int gen)
+{
+  int i;
+
+  pthread_mutex_lock(&waiters->lock);
+  if (waiters->gen == gen) {
+    for (i=0; i < waiters->n && waiters->fds[i] != fd; i++);
+    if (i < waiters->n) {
+      waiters->fds[i] = waiters->fds[--waiters->n];
+    }
+    __atomic_store_n(&waiters->waiting, waiters->n, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&waiters->lock);
+}
+
+/*
+ * Put a message in the ring, which takes it over. Returns 1 if it did, 0
+ * if the ring is full, or -1 if the channel is closed.
+ */
+int chan_try_send(struct t_chan *chan, struct t_msg *msg)
+{
+  struct t_chan_slot *slot;
+  unsigned long pos, seq;
+  long dif;
+
+  if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) {
+    fprintf(stderr, "Error: send(): Channel %d is closed.\n", chan->id);
+    return -1;
+  }
+  pos = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &chan->slots[pos & chan->mask];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    dif = (long) (seq - pos);
+    if (dif == 0) {
+      /* On failure pos is the tail another sender moved it to */
+      if (__atomic_compare_exchange_n(&chan->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if (dif < 0) {
+      return 0;
+    }
+    else {
+      pos = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->msg = *msg;
+  msg->type = VAL_NULL;
+  msg->sbuf = NULL;
+  msg->array = NULL;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  chan_notify(&chan->receivers);
+  return 1;
+}
+
+/*
+ * Take a message out of the ring, into ret. Returns 1 if it did, or if
+ * the channel is closed and empty, with end taken into ret instead; 0 if
+ * the ring is empty.
+ */
+int chan_try_recv(struct t_chan *chan, struct t_msg *end, struct t_value *ret)
+{
+  struct t_chan_slot *slot;
+  struct t_msg msg;
+  unsigned long pos, seq;
+  long dif;
+  int closed;
+
+  /* Read first, so a message sent before the close is taken */
+  closed = __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE);
+  pos = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &chan->slots[pos & chan->mask];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    dif = (long) (seq - (pos + 1));
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&chan->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if (dif < 0) {
+      if (closed) {
+        msg_take(end, ret);
+        return 1;
+      }
+      return 0;
+    }
+    else {
+      pos = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+    }
+  }
+  msg = slot->msg;
+  __atomic_store_n(&slot->seq, pos + chan->mask + 1, __ATOMIC_RELEASE);
+  chan_notify(&chan->senders);
+  msg_take(&msg, ret);
+  return 1;
+}
+
+/*
+ * Whether to spin on a full or empty ring before waiting: only if another
+ * CPU may change it, and no other task of the exec could run instead.
+ */
+static int chan_spins(struct t_exec *exec)
+{
+  pthread_once(&chan_cpus_once, chan_cpus_init);
+  return chan_cpus > 1 && !exec->tasks.first;
+}
+
+static void chan_relax(void)
+{
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * send(ch, v): put v on the channel, waiting while it is full.
+ */
+int chan_send(struct t_exec *exec, struct t_chan *chan, struct t_value *value)
+{
+  struct t_msg msg;
+  int i, rc;
+
+  if (msg_set(&msg, value, "send") < 0) {
+    return -1;
+  }
+  rc = chan_try_send(chan, &msg);
+  if (rc == 0 && chan_spins(exec)) {
+    for (i=0; rc == 0 && i < CHAN_SPIN; i++) {
+      chan_relax();
+      rc = chan_try_send(chan, &msg);
+    }
+  }
+  if (rc == 0) {
+    return loop_chan(exec, LOOP_SEND, chan, &msg, NULL);
+  }
+  if (rc < 0) {
+    msg_free(&msg);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * recv(ch, end): take the oldest message off the channel, waiting while it
+ * is empty. Once it is closed and empty, ret is end, or null if end is
+ * NULL.
+ */
+int chan_recv(struct t_exec *exec, struct t_chan *chan, struct t_value *end, struct t_value *ret)
+{
+  struct t_msg msg;
+  int i, rc;
+
+  msg.type = VAL_NULL;
+  msg.sbuf = NULL;
+  msg.array = NULL;
+  if (end && msg_set(&msg, end, "recv") < 0) {
+    return -1;
+  }
+  rc = chan_try_recv(chan, &msg, ret);
+  if (rc == 0 && chan_spins(exec)) {
+    for (i=0; rc == 0 && i < CHAN_SPIN; i++) {
+      chan_relax();
+      rc = chan_try_recv(chan, &msg, ret);
+    }
+  }
+  if (rc == 0) {
+    return loop_chan(exec, LOOP_RECV, chan, &msg, ret);
+  }
+  msg_free(&msg);
+  return 0;
+}
+
+/*
+ * Close a channel: sends fail from now on, and recvs get null once the
+ * messages in it are taken. The tasks waiting on it are woken.
+ */
+void chan_close(struct t_chan *chan)
+{
+  __atomic_store_n(&chan->closed, 1, __ATOMIC_RELEASE);
+  chan_notify(&chan->senders);
+  chan_notify(&chan->receivers);
+}
+
+/*
+ * The exec's table of the channels it uses, made on first use.
+ */
+static int chans_table(struct t_chans *chans)
+{
+  if (!chans->used) {
+    chans->used = calloc(CHAN_MAX, sizeof(struct t_chan *));
+    if (!chans->used) {
+      fprintf(stderr, "Error: Out of memory for channels\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static struct t_chan * chan_alloc(long long cap)
+{
+  struct t_chan *chan;
+  void *mem;
+  unsigned long i, n = 2;
+
+  while (n < (unsigned long) cap) {
+    n *= 2;
+  }
+  /* For head and tail to be on cache lines of their own */
+  if (posix_memalign(&mem, 64, sizeof(struct t_chan)) != 0) {
+    return NULL;
+  }
+  chan = mem;
+  memset(chan, 0, sizeof(struct t_chan));
+  chan->slots = malloc(sizeof(struct t_chan_slot) * n);
+  if (!chan->slots) {
+    free(chan);
+    return NULL;
+  }
+  for (i=0; i < n; i++) {
+    chan->slots[i].seq = i;
+    chan->slots[i].msg.type = VAL_NULL;
+  }
+  chan->mask = n - 1;
+  pthread_mutex_init(&chan->senders.lock, NULL);
+  pthread_mutex_init(&chan->receivers.lock, NULL);
+  return chan;
+}
+
+/*
+ * Free a channel no exec uses any longer, with the messages left in it.
+ */
+static void chan_free(struct t_chan *chan)
+{
+  unsigned long pos;
+
+  for (pos = chan->head; pos != chan->tail; pos++) {
+    msg_free(&chan->slots[pos & chan->mask].msg);
+  }
+  free(chan->slots);
+  free(chan->senders.fds);
+  free(chan->receivers.fds);
+  pthread_mutex_destroy(&chan->senders.lock);
+  pthread_mutex_destroy(&chan->receivers.lock);
+  free(chan);
+}
+
+static void chan_release(struct t_chan *chan)
+{
+  int last;
+
+  pthread_mutex_lock(&chan_lock);
+  last = --chan->refs == 0;
+  if (last) {
+    chan_table[chan->id % CHAN_MAX] = NULL;
+  }
+  pthread_mutex_unlock(&chan_lock);
+  if (last) {
+    chan_free(chan);
+  }
+}
+
+/*
+ * channel(cap): a new channel of at least cap slots. Returns its id, or
+ * -1 on error. Ids aren't reused for as long as they fit in an int, so a
+ * stale one isn't taken for a new channel.
+ */
+int chan_new(struct t_exec *exec, long long cap)
+{
+  struct t_chans *chans = &exec->chans;
+  struct t_chan *chan;
+  int *own;
+  int i, id = 0;
+
+  if (cap < 1 || cap > CHAN_MAX_CAP) {
+    fprintf(stderr, "Error: channel() needs a capacity from 1 to %d.\n", CHAN_MAX_CAP);
+    return -1;
+  }
+  if (chans_table(chans) < 0) {
+    return -1;
+  }
+  if (chans->nown == chans->capown) {
+    own = realloc(chans->own, sizeof(int) * (chans->capown ? chans->capown * 2 : 16));
+    if (!own) {
+      fprintf(stderr, "Error: Out of memory for channels\n");
+      return -1;
+    }
+    chans->own = own;
+    chans->capown = chans->capown ? chans->capown * 2 : 16;
+  }
+  chan = chan_alloc(cap);
+  if (!chan) {
+    fprintf(stderr, "Error: Out of memory for a channel of %lld\n", cap);
+    return -1;
+  }
+
+  pthread_mutex_lock(&chan_lock);
+  for (i=0; i < CHAN_MAX; i++) {
+    chan_next_id = chan_next_id == INT_MAX ? 1 : chan_next_id + 1;
+    if (!chan_table[chan_next_id % CHAN_MAX]) {
+      id = chan_next_id;
+      break;
+    }
+  }
+  if (id) {
+    chan->id = id;
+    chan->refs = 1;
+    chan_table[id % CHAN_MAX] = chan;
+  }
+  pthread_mutex_unlock(&chan_lock);
+  if (!id) {
+    fprintf(stderr, "Error: Too many channels (%d).\n", CHAN_MAX);
+    chan_free(chan);
+    return -1;
+  }
+
+  chans->used[id % CHAN_MAX] = chan;
+  chans->nused++;
+  chans->own[chans->nown++] = id % CHAN_MAX;
+  return id;
+}
+
+/*
+ * The channel whose id a value holds, for the native name. The exec keeps
+ * a reference to each channel it uses, until it is reset.
+ */
+struct t_chan * chan_get(struct t_exec *exec, struct t_value *id, const char *name)
+{
+  struct t_chans *chans = &exec->chans;
+  struct t_chan *chan;
+  int slot;
+
+  if (id->type != VAL_INT || id->intval < 1 || id->intval > INT_MAX) {
+    fprintf(stderr, "Error: %s() needs a channel, got %s.\n", name, value_types[id->type]);
+    return NULL;
+  }
+  if (chans_table(chans) < 0) {
+    return NULL;
+  }
+  slot = id->intval % CHAN_MAX;
+  chan = chans->used[slot];
+  if (!chan) {
+    pthread_mutex_lock(&chan_lock);
+    chan = chan_table[slot];
+    if (chan && chan->id == id->intval) {
+      chan->refs++;
+    }
+    else {
+      chan = NULL;
+    }
+    pthread_mutex_unlock(&chan_lock);
+    if (chan) {
+      chans->used[slot] = chan;
+      chans->nused++;
+    }
+  }
+  if (!chan || chan->id != id->intval) {
+    fprintf(stderr, "Error: %s(): No channel %lld.\n", name, id->intval);
+    return NULL;
+  }
+  return chan;
+}
+
+/*
+ * A thread failed: close the channels it used, so that its peers see it,
+ * and the threads it started.
+ */
+static void chans_fail(struct t_exec *exec)
+{
+  struct t_chans *chans = &exec->chans;
+  int i;
+
+  for (i=0; i < CHAN_MAX && chans->used; i++) {
+    if (chans->used[i]) {
+      chan_close(chans->used[i]);
+    }
+  }
+  chans_reset(exec);
+}
+
+/*
+ * A thread's body: call the function in an exec of its own, and keep its
+ * result and output for join(). Threads it started are joined first.
+ */
+static void * stage_run(void *arg)
+{
+  struct t_stage *stage = arg;
+  struct t_exec exec;
+  struct t_value args[MAX_FUNC_ARGS];
+  struct t_value *argv[MAX_FUNC_ARGS];
+  struct t_value *result;
+  uint64_t one = 1;
+  int i;
+
+  for (i=0; i < stage->argc; i++) {
+    value_init(&args[i], VAL_NULL);
+    msg_take(&stage->args[i], &args[i]);
+    argv[i] = &args[i];
+  }
+  stage->status = -1;
+  if (exec_init_worker(&exec, stage->caller) == 0) {
+    result = exec_call(&exec, stage->func, stage->argc, argv);
+    if (result && msg_set(&stage->result, result, "thread") == 0) {
+      stage->status = 0;
+    }
+    else {
+      chans_fail(&exec);
+    }
+    if (stage_join_all(&exec) < 0) {
+      stage->status = -1;
+    }
+    stage->out = output_take(&exec.out, &stage->outlen);
+  }
+  exec_close(&exec);
+
+  /* The caller fails too, if it waits in its event loop */
+  if (stage->status < 0) {
+    __atomic_store_n(&stage->caller->chans.failed, stage->id, __ATOMIC_RELEASE);
+    if (write(stage->wakefd, &one, sizeof(one)) < 0) {
+      fprintf(stderr, "Error: Can't wake thread %d's caller: %s\n", stage->id, strerror(errno));
+    }
+  }
+  for (i=0; i < stage->argc; i++) {
+    value_close(&args[i]);
+  }
+  return NULL;
+}
+
+static void stage_free(struct t_stage *stage)
+{
+  int i;
+
+  for (i=0; i < stage->argc; i++) {
+    msg_free(&stage->args[i]);
+  }
+  msg_free(&stage->result);
+  free(stage->out);
+  free(stage);
+}
+
+/*
+ * thread("f", args...): call func with the argc values in argv, which are
+ * sent to it as messages, on a new thread. Returns its id, or -1 on error.
+ */
+int stage_start(struct t_exec *exec, struct t_func *func, int argc, struct t_value **argv)
+{
+  struct t_chans *chans = &exec->chans;
+  struct t_stage *stage, **last;
+  int i, rc;
+
+  if (func->native || func->invoke) {
+    fprintf(stderr, "Error: thread() needs a function of the program, got %s().\n", func->name);
+    return -1;
+  }
+  if (func->argc != argc) {
+    fprintf(stderr, "Error: %s() takes %d arguments, not %d, in thread().\n", func->name, func->argc, argc);
+    return -1;
+  }
+  stage = calloc(1, sizeof(struct t_stage));
+  if (!stage) {
+    fprintf(stderr, "Error: Out of memory in thread()\n");
+    return -1;
+  }
+  for (i=0; i < argc; i++) {
+    if (msg_set(&stage->args[i], argv[i], "thread") < 0) {
+      stage_free(stage);
+      return -1;
+    }
+    stage->argc = i + 1;
+  }
+
+  /* The thread runs functions that may not have been called yet */
+  program_link(exec->program);
+  stage->wakefd = loop_wakefd(&exec->loop);
+  if (stage->wakefd < 0) {
+    stage_free(stage);
+    return -1;
+  }
+
+  stage->caller = exec;
+  stage->func = func;
+  stage->id = ++chans->next_stage;
+  rc = pthread_create(&stage->thread, NULL, stage_run, stage);
+  if (rc != 0) {
+    fprintf(stderr, "Error: Can't start a thread: %s\n", strerror(rc));
+    stage_free(stage);
+    return -1;
+  }
+
+  /* Kept in the order they started, which is the order they are joined in at the end */
+  for (last = &chans->stages; *last; last = &(*last)->next);
+  *last = stage;
+  return stage->id;
+}
+
+/*
+ * Wait for a thread to end, print what it printed, and set ret to its
+ * result, if ret isn't NULL. Returns -1 if the thread failed.
+ */
+static int stage_finish(struct t_exec *exec, struct t_stage *stage, struct t_value *ret)
+{
+  int rc;
+
+  pthread_join(stage->thread, NULL);
+  rc = stage->status;
+  if (stage->out && output_write(&exec->out, stage->out, stage->outlen) < 0) {
+    rc = -1;
+  }
+  if (rc == 0 && ret) {
+    msg_take(&stage->result, ret);
+  }
+  stage_free(stage);
+  return rc;
+}
+
+/*
+ * join(t): wait for the thread with id t, and set ret to what its function
+ * returned.
+ */
+int stage_join(struct t_exec *exec, long long id, struct t_value *ret)
+{
+  struct t_stage **prev, *stage;
+
+  for (prev = &exec->chans.stages; *prev && (*prev)->id != id; prev = &(*prev)->next);
+  stage = *prev;
+  if (!stage) {
+    fprintf(stderr, "Error: join(): No thread %lld.\n", id);
+    return -1;
+  }
+  *prev = stage->next;
+  if (stage_finish(exec, stage, ret) < 0) {
+    fprintf(stderr, "Error: join(): Thread %lld failed.\n", id);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Join every thread that hasn't been joined, in the order they started.
+ * Returns -1 if one failed.
+ */
+int stage_join_all(struct t_exec *exec)
+{
+  struct t_stage *stage;
+  int rc = 0;
+
+  while ((stage = exec->chans.stages)) {
+    exec->chans.stages = stage->next;
+    if (stage_finish(exec, stage, NULL) < 0) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+/*
+ * Close the channels the exec made, join its threads, and let go of the
+ * channels it used, after an error or to run the program again.
+ */
+void chans_reset(struct t_exec *exec)
+{
+  struct t_chans *chans = &exec->chans;
+  int i;
+
+  for (i=0; i < chans->nown; i++) {
+    chan_close(chans->used[chans->own[i]]);
+  }
+  chans->nown = 0;
+  stage_join_all(exec);
+  for (i=0; i < CHAN_MAX && chans->nused; i++) {
+    if (chans->used[i]) {
+      chan_release(chans->used[i]);
+      chans->used[i] = NULL;
+      chans->nused--;
+    }
+  }
+  chans->next_stage = 0;
+  chans->failed = 0;
+}
+
+/*
+ * Free the exec's tables, after chans_reset().
+ */
+void chans_close(struct t_exec *exec)
+{
+  free(exec->chans.used);
+  free(exec->chans.own);
+  chans_init(&exec->chans);
+}
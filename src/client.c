@@ -0,0 +1,95 @@
+/*
+ * Send a script to a server started with run -s, and print what it
+ * printed.
+ *
+ * client socket [script]: the script is read from stdin if it isn't named.
+ * Exits with 1 if the script failed, or the worker running it died.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+static int client_write(int fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  struct sockaddr_un addr;
+  char buf[65536];
+  FILE *in = stdin;
+  size_t len;
+  ssize_t n;
+  int fd, keep = 0;
+
+  if (argc < 2 || argc > 3 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Usage: client socket [script]\n");
+    return 2;
+  }
+  if (argc == 3 && !(in = fopen(argv[2], "r"))) {
+    fprintf(stderr, "Error: Can't open %s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, argv[1]);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) < 0) {
+    fprintf(stderr, "Error: Can't connect to %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  /* The server runs the script once it has all of it */
+  while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (client_write(fd, buf, len) < 0) {
+      fprintf(stderr, "Error: Can't send the script: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+  shutdown(fd, SHUT_WR);
+
+  /* The last bytes read may be the trailer, so they are kept back */
+  while ((n = read(fd, buf + keep, sizeof(buf) - keep)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: Can't read the output: %s\n", strerror(errno));
+      return 1;
+    }
+    n += keep;
+    keep = n < SERVER_TRAILER_LEN ? n : SERVER_TRAILER_LEN;
+    if (client_write(STDOUT_FILENO, buf, n - keep) < 0) {
+      return 1;
+    }
+    memmove(buf, buf + n - keep, keep);
+  }
+  close(fd);
+
+  if (keep == SERVER_TRAILER_LEN && buf[0] == '\0' && (buf[1] == '0' || buf[1] == '1')) {
+    return buf[1] - '0';
+  }
+  client_write(STDOUT_FILENO, buf, keep);
+  fprintf(stderr, "Error: The server didn't finish running the script\n");
+  return 1;
+}
@@ -3,30 +3,773 @@
  *
  * A library of built-in functions
  */
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
 #include "exec.h"
+#include "corelib.h"
+#include "parallel.h"
+#include "loop.h"
+#include "chan.h"
 
 /*
- * C-based function that will be called by interpreted code.
- *
- * Simply returns the value of the first argument.
+ * Check the argument count, and that the arguments marked 'a' in types are
+ * arrays, those marked 'm' are maps and those marked 's' are strings.
+ */
+static int core_args(const char *name, int argc, struct t_value **argv, int expect, const char *types)
+{
+  int i;
+
+  if (argc != expect) {
+    fprintf(stderr, "Error: %s() expects %d arguments, got %d.\n", name, expect, argc);
+    return -1;
+  }
+  for (i=0; i < argc; i++) {
+    if (types[i] == 'a' && argv[i]->type != VAL_ARRAY) {
+      fprintf(stderr, "Error: Argument %d of %s() must be an array, got %s.\n", i+1, name, value_types[argv[i]->type]);
+      return -1;
+    }
+    if (types[i] == 'm' && argv[i]->type != VAL_MAP) {
+      fprintf(stderr, "Error: Argument %d of %s() must be a map, got %s.\n", i+1, name, value_types[argv[i]->type]);
+      return -1;
+    }
+    if (types[i] == 's' && argv[i]->type != VAL_STRING) {
+      fprintf(stderr, "Error: Argument %d of %s() must be a string, got %s.\n", i+1, name, value_types[argv[i]->type]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * println(x): print a value and a newline, to the exec's output buffer.
  */
-int fn_println(struct t_func *func, struct list *args, struct t_value *ret)
+int fn_println(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
 {
-  struct t_value *arg;
+  char buf[PARSER_SCRATCH_BUF + 1];
+  struct t_fmtbuf fb;
+  int rc;
   
-  arg = args->first->value;
-  if (arg->type == VAL_STRING) {
-    printf("%s\n", arg->stringval);
+  if (core_args("println", argc, argv, 1, "-") < 0) {
+    return -1;
+  }
+  if (argv[0]->type == VAL_STRING) {
+    if (output_write(&exec->out, argv[0]->stringval, argv[0]->len) < 0) {
+      return -1;
+    }
+    return output_write(&exec->out, "\n", 1);
+  }
+  fmtbuf_init(&fb, buf, sizeof(buf));
+  rc = value_format(&fb, argv[0]);
+  if (rc == 0) {
+    rc = fmtbuf_add(&fb, "\n", 1);
+  }
+  if (rc == 0) {
+    rc = output_write(&exec->out, fb.buf, fb.len);
+  }
+  fmtbuf_close(&fb);
+
+  return rc;
+}
+
+/*
+ * flush(): write out what has been printed so far.
+ */
+int fn_flush(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("flush", argc, argv, 0, "") < 0) {
+    return -1;
+  }
+  return output_flush(&exec->out);
+}
+
+/*
+ * read(path): the contents of a file, as a string.
+ */
+int fn_read(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_mapfile *file;
+  char *str;
+
+  if (core_args("read", argc, argv, 1, "s") < 0) {
+    return -1;
+  }
+  file = mapfile_open(argv[0]->stringval);
+  if (!file) {
+    return -1;
+  }
+  if (file->size > INT_MAX - 1) {
+    fprintf(stderr, "Error: %s is too big to read().\n", argv[0]->stringval);
+    mapfile_close(file);
+    return -1;
+  }
+  ret->type = VAL_STRING;
+  str = value_alloc_str(ret, file->size);
+  if (str && file->size) {
+    memcpy(str, file->data, file->size);
+  }
+  mapfile_close(file);
+  return str ? 0 : -1;
+}
+
+/*
+ * write(path, s): replace the contents of a file with a string, and return
+ * its length.
+ */
+int fn_write(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("write", argc, argv, 2, "ss") < 0) {
+    return -1;
+  }
+  if (io_write_file(argv[0]->stringval, argv[1]->stringval, argv[1]->len) < 0) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = argv[1]->len;
+  return 0;
+}
+
+/*
+ * The file behind a handle from open(), or NULL.
+ */
+static struct t_mapfile * core_file(struct t_exec *exec, const char *name, struct t_value *handle)
+{
+  if (handle->type != VAL_INT || handle->intval < 1 || handle->intval > IO_MAX_FILES || !exec->files[handle->intval - 1]) {
+    fprintf(stderr, "Error: %s() needs a file from open().\n", name);
+    return NULL;
+  }
+  return exec->files[handle->intval - 1];
+}
+
+/*
+ * open(path): map a file for reading by lines, and return a handle to it.
+ */
+int fn_open(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  int i;
+
+  if (core_args("open", argc, argv, 1, "s") < 0) {
+    return -1;
+  }
+  for (i=0; i < IO_MAX_FILES && exec->files[i]; i++);
+  if (i == IO_MAX_FILES) {
+    fprintf(stderr, "Error: More than %d files open.\n", IO_MAX_FILES);
+    return -1;
+  }
+  exec->files[i] = mapfile_open(argv[0]->stringval);
+  if (!exec->files[i]) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = i + 1;
+  return 0;
+}
+
+/*
+ * readline(f): the next line of a file, without its newline. Only the line
+ * is copied out of the mapping. Returns "" at the end of the file.
+ */
+int fn_readline(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_mapfile *file;
+  const char *line = "";
+  char *str;
+  int len;
+
+  if (core_args("readline", argc, argv, 1, "-") < 0 || !(file = core_file(exec, "readline", argv[0]))) {
+    return -1;
+  }
+  len = mapfile_line(file, &line);
+  if (len < 0) {
+    len = 0;
+  }
+  ret->type = VAL_STRING;
+  str = value_alloc_str(ret, len);
+  if (!str) {
+    return -1;
+  }
+  memcpy(str, line, len);
+  return 0;
+}
+
+/*
+ * eof(f): 1 if all lines of a file have been read, else 0.
+ */
+int fn_eof(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_mapfile *file;
+
+  if (core_args("eof", argc, argv, 1, "-") < 0 || !(file = core_file(exec, "eof", argv[0]))) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = file->pos >= file->size;
+  return 0;
+}
+
+int fn_close(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_mapfile *file;
+
+  if (core_args("close", argc, argv, 1, "-") < 0 || !(file = core_file(exec, "close", argv[0]))) {
+    return -1;
+  }
+  mapfile_close(file);
+  exec->files[argv[0]->intval - 1] = NULL;
+  return 0;
+}
+
+static int core_ret_array(struct t_value *ret, struct t_array *array)
+{
+  if (!array) {
+    return -1;
+  }
+  ret->type = VAL_ARRAY;
+  ret->array = array;
+  return 0;
+}
+
+/*
+ * len(x): length of an array or a string, or the number of keys in a map.
+ */
+int fn_len(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("len", argc, argv, 1, "-") < 0) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  if (argv[0]->type == VAL_ARRAY) {
+    ret->intval = argv[0]->array->len;
+  }
+  else if (argv[0]->type == VAL_STRING) {
+    ret->intval = argv[0]->len;
+  }
+  else if (argv[0]->type == VAL_MAP) {
+    ret->intval = argv[0]->map->count;
   }
   else {
-    printf("%d\n", arg->intval);
+    fprintf(stderr, "Error: len() of a %s value.\n", value_types[argv[0]->type]);
+    return -1;
   }
+  return 0;
+}
 
+/*
+ * range(n): the ints 0 to n-1.
+ */
+int fn_range(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_array *array;
+  long long *ints;
+  int i;
+
+  if (core_args("range", argc, argv, 1, "-") < 0) {
+    return -1;
+  }
+  if (argv[0]->type != VAL_INT || argv[0]->intval < 0 || argv[0]->intval > INT_MAX) {
+    fprintf(stderr, "Error: range() needs an int from 0 to %d.\n", INT_MAX);
+    return -1;
+  }
+  array = array_new(VAL_INT, argv[0]->intval);
+  if (!array) {
+    fprintf(stderr, "Error: Out of memory in range()\n");
+    return -1;
+  }
+  ints = array->data;
+  for (i=0; i < array->len; i++) {
+    ints[i] = i;
+  }
+  return core_ret_array(ret, array);
+}
+
+/*
+ * push(a, v): append v to a, and return a.
+ */
+int fn_push(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("push", argc, argv, 2, "a-") < 0 || array_push(argv[0]->array, argv[1]) < 0) {
+    return -1;
+  }
+  return core_ret_array(ret, array_ref(argv[0]->array));
+}
+
+int fn_sum(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("sum", argc, argv, 1, "a") < 0) {
+    return -1;
+  }
+  return array_sum(argv[0]->array, ret);
+}
+
+int fn_min(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("min", argc, argv, 1, "a") < 0) {
+    return -1;
+  }
+  return array_minmax(argv[0]->array, 0, ret);
+}
+
+int fn_max(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("max", argc, argv, 1, "a") < 0) {
+    return -1;
+  }
+  return array_minmax(argv[0]->array, 1, ret);
+}
+
+int fn_dot(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("dot", argc, argv, 2, "aa") < 0) {
+    return -1;
+  }
+  return array_dot(argv[0]->array, argv[1]->array, ret);
+}
+
+/*
+ * scale(a, k): a new array of each element times k.
+ */
+int fn_scale(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("scale", argc, argv, 2, "a-") < 0) {
+    return -1;
+  }
+  if (!value_is_num(argv[1])) {
+    fprintf(stderr, "Error: scale() needs a number to scale by.\n");
+    return -1;
+  }
+  return core_ret_array(ret, array_scale(argv[0]->array, argv[1]));
+}
+
+/*
+ * map_add(a, b): a new array of a's elements plus b's, or plus b if it is
+ * a number.
+ */
+int fn_map_add(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("map_add", argc, argv, 2, "a-") < 0) {
+    return -1;
+  }
+  if (argv[1]->type == VAL_ARRAY) {
+    return core_ret_array(ret, array_add(argv[0]->array, argv[1]->array, NULL));
+  }
+  if (!value_is_num(argv[1])) {
+    fprintf(stderr, "Error: map_add() needs an array or a number to add.\n");
+    return -1;
+  }
+  return core_ret_array(ret, array_add(argv[0]->array, NULL, argv[1]));
+}
+
+/*
+ * get(m, k): the value at key k, which must be there.
+ * get(m, k, d): the value at key k, or d if it isn't there.
+ */
+int fn_get(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_value *val;
+  int found;
+
+  if (core_args("get", argc, argv, argc == 3 ? 3 : 2, "m--") < 0) {
+    return -1;
+  }
+  if (argc == 2) {
+    return exec_map_get(argv[0]->map, argv[1], ret);
+  }
+  found = map_get(argv[0]->map, argv[1], &val);
+  if (found < 0) {
+    return -1;
+  }
+  return value_copy(ret, found ? val : argv[2]);
+}
+
+/*
+ * set(m, k, v): set key k to v, and return v.
+ */
+int fn_set(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("set", argc, argv, 3, "m--") < 0 || map_set(argv[0]->map, argv[1], argv[2]) < 0) {
+    return -1;
+  }
+  return value_copy(ret, argv[2]);
+}
+
+/*
+ * has(m, k): 1 if key k is in the map, else 0.
+ */
+int fn_has(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_value *val;
+  int found;
+
+  if (core_args("has", argc, argv, 2, "m-") < 0) {
+    return -1;
+  }
+  found = map_get(argv[0]->map, argv[1], &val);
+  if (found < 0) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = found;
+  return 0;
+}
+
+/*
+ * delete(m, k): remove key k. Returns 1 if it was there, else 0.
+ */
+int fn_delete(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  int found;
+
+  if (core_args("delete", argc, argv, 2, "m-") < 0) {
+    return -1;
+  }
+  found = map_delete(argv[0]->map, argv[1]);
+  if (found < 0) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = found;
+  return 0;
+}
+
+/*
+ * keys(m): an array of the keys, in no particular order.
+ */
+int fn_keys(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("keys", argc, argv, 1, "m") < 0) {
+    return -1;
+  }
+  return core_ret_array(ret, map_keys(argv[0]->map));
+}
+
+/*
+ * parallel_for(lo, hi, f): call the function named f with each int from lo
+ * up to hi, on threads, and return the sum of the numbers it returns. f
+ * can read globals but not assign them. See parallel.c.
+ */
+int fn_parallel_for(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_func *func;
+
+  if (core_args("parallel_for", argc, argv, 3, "--s") < 0) {
+    return -1;
+  }
+  if (argv[0]->type != VAL_INT || argv[1]->type != VAL_INT) {
+    fprintf(stderr, "Error: parallel_for() needs an int range, got %s to %s.\n", value_types[argv[0]->type], value_types[argv[1]->type]);
+    return -1;
+  }
+  func = exec_funcbyname(exec, argv[2]->stringval);
+  if (!func) {
+    fprintf(stderr, "Error: Function %s() is not defined, in parallel_for().\n", argv[2]->stringval);
+    return -1;
+  }
+  return parallel_for(exec, argv[0]->intval, argv[1]->intval, func, ret);
+}
+
+/*
+ * Whether a value is an fd, else an error.
+ */
+static int core_fd(const char *name, struct t_value *fd)
+{
+  if (fd->type != VAL_INT || fd->intval < 0 || fd->intval > INT_MAX) {
+    fprintf(stderr, "Error: %s() needs an fd, got %s.\n", name, value_types[fd->type]);
+    return -1;
+  }
   return 0;
 }
 
+/*
+ * Whether a value is a number of milliseconds, else an error.
+ */
+static int core_ms(const char *name, struct t_value *ms)
+{
+  if (ms->type != VAL_INT || ms->intval < 0 || ms->intval > INT_MAX) {
+    fprintf(stderr, "Error: %s() needs an int number of milliseconds.\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+static int core_ret_fds(struct t_value *ret, int fds[2])
+{
+  struct t_array *array;
+
+  array = array_new(VAL_INT, 2);
+  if (!array) {
+    close(fds[0]);
+    close(fds[1]);
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+  ((long long *) array->data)[0] = fds[0];
+  ((long long *) array->data)[1] = fds[1];
+  return core_ret_array(ret, array);
+}
+
+/*
+ * pipe(): [r, w], the read and write ends of a pipe, for fd_read() and
+ * fd_write().
+ */
+int fn_pipe(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  int fds[2];
+
+  if (core_args("pipe", argc, argv, 0, "") < 0 || loop_pipe(fds, 0) < 0) {
+    return -1;
+  }
+  return core_ret_fds(ret, fds);
+}
+
+/*
+ * socketpair(): [a, b], two connected sockets.
+ */
+int fn_socketpair(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  int fds[2];
+
+  if (core_args("socketpair", argc, argv, 0, "") < 0 || loop_pipe(fds, 1) < 0) {
+    return -1;
+  }
+  return core_ret_fds(ret, fds);
+}
+
+/*
+ * fd_read(fd, n): up to n bytes from an fd, or "" at its end. Until there
+ * are some, the task waits and others run.
+ */
+int fn_fd_read(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("fd_read", argc, argv, 2, "--") < 0 || core_fd("fd_read", argv[0]) < 0) {
+    return -1;
+  }
+  if (argv[1]->type != VAL_INT || argv[1]->intval < 1 || argv[1]->intval > INT_MAX - 1) {
+    fprintf(stderr, "Error: fd_read() needs a number of bytes from 1 to %d.\n", INT_MAX - 1);
+    return -1;
+  }
+  return loop_read(exec, argv[0]->intval, argv[1]->intval, ret);
+}
+
+/*
+ * fd_write(fd, s): write all of a string to an fd, and return its length.
+ * While the fd is full, the task waits and others run.
+ */
+int fn_fd_write(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("fd_write", argc, argv, 2, "-s") < 0 || core_fd("fd_write", argv[0]) < 0) {
+    return -1;
+  }
+  return loop_write(exec, argv[0]->intval, argv[1]->stringval, argv[1]->len, ret);
+}
+
+int fn_fd_close(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("fd_close", argc, argv, 1, "-") < 0 || core_fd("fd_close", argv[0]) < 0) {
+    return -1;
+  }
+  if (loop_busy(&exec->loop, argv[0]->intval)) {
+    fprintf(stderr, "Error: fd_close(): A task is waiting on fd %d.\n", (int) argv[0]->intval);
+    return -1;
+  }
+  if (close(argv[0]->intval) < 0) {
+    fprintf(stderr, "Error: fd_close(): Can't close fd %d.\n", (int) argv[0]->intval);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * sleep(ms): the task waits ms milliseconds, while others run.
+ */
+int fn_sleep(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("sleep", argc, argv, 1, "-") < 0 || core_ms("sleep", argv[0]) < 0) {
+    return -1;
+  }
+  return loop_sleep(exec, argv[0]->intval, ret);
+}
+
+/*
+ * timer(ms, fname): spawn a task that calls fname() in ms milliseconds.
+ */
+int fn_timer(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_func *func;
+
+  if (core_args("timer", argc, argv, 2, "-s") < 0 || core_ms("timer", argv[0]) < 0) {
+    return -1;
+  }
+  func = exec_funcbyname(exec, argv[1]->stringval);
+  if (!func) {
+    fprintf(stderr, "Error: Function %s() is not defined, in timer().\n", argv[1]->stringval);
+    return -1;
+  }
+  if (func->native || func->invoke || func->argc != 0) {
+    fprintf(stderr, "Error: timer() needs a function of no arguments, got %s().\n", func->name);
+    return -1;
+  }
+  if (!func->entry) {
+    program_link(exec->program);
+  }
+  return loop_timer(exec, argv[0]->intval, func);
+}
+
+/*
+ * channel(cap): a new channel for up to cap messages, which execs on other
+ * threads can send to and receive from. Returns its id.
+ */
+int fn_channel(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  int id;
+
+  if (core_args("channel", argc, argv, 1, "-") < 0) {
+    return -1;
+  }
+  if (argv[0]->type != VAL_INT) {
+    fprintf(stderr, "Error: channel() needs an int capacity, got %s.\n", value_types[argv[0]->type]);
+    return -1;
+  }
+  id = chan_new(exec, argv[0]->intval);
+  if (id < 0) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = id;
+  return 0;
+}
+
+/*
+ * send(ch, v): put v on a channel. While it is full, the task waits and
+ * others run.
+ */
+int fn_send(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_chan *chan;
+
+  if (core_args("send", argc, argv, 2, "--") < 0 || !(chan = chan_get(exec, argv[0], "send"))) {
+    return -1;
+  }
+  return chan_send(exec, chan, argv[1]);
+}
+
+/*
+ * recv(ch[, end]): take the oldest message off a channel. Once it is
+ * closed and empty, return end, or null. While it is empty, the task waits
+ * and others run.
+ */
+int fn_recv(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_chan *chan;
+
+  if (core_args("recv", argc, argv, argc == 2 ? 2 : 1, "--") < 0 || !(chan = chan_get(exec, argv[0], "recv"))) {
+    return -1;
+  }
+  return chan_recv(exec, chan, argc == 2 ? argv[1] : NULL, ret);
+}
+
+int fn_chan_close(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_chan *chan;
+
+  if (core_args("chan_close", argc, argv, 1, "-") < 0 || !(chan = chan_get(exec, argv[0], "chan_close"))) {
+    return -1;
+  }
+  chan_close(chan);
+  return 0;
+}
+
+/*
+ * thread(fname, args...): call fname(args...) on a new thread, in an exec
+ * of its own. The arguments are copied over as messages. Returns the
+ * thread's id, for join().
+ */
+int fn_thread(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  struct t_func *func;
+  int id;
+
+  if (argc < 1 || argv[0]->type != VAL_STRING) {
+    fprintf(stderr, "Error: thread() needs the name of a function.\n");
+    return -1;
+  }
+  func = exec_funcbyname(exec, argv[0]->stringval);
+  if (!func) {
+    fprintf(stderr, "Error: Function %s() is not defined, in thread().\n", argv[0]->stringval);
+    return -1;
+  }
+  id = stage_start(exec, func, argc - 1, argv + 1);
+  if (id < 0) {
+    return -1;
+  }
+  ret->type = VAL_INT;
+  ret->intval = id;
+  return 0;
+}
+
+/*
+ * join(t): wait for a thread to end, and return what its function
+ * returned. Its output is printed then.
+ */
+int fn_join(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret)
+{
+  if (core_args("join", argc, argv, 1, "-") < 0) {
+    return -1;
+  }
+  if (argv[0]->type != VAL_INT) {
+    fprintf(stderr, "Error: join() needs a thread, got %s.\n", value_types[argv[0]->type]);
+    return -1;
+  }
+  return stage_join(exec, argv[0]->intval, ret);
+}
+
+/*
+ * Natives registered by core_apply(), also referenced directly by AOT output.
+ */
+const struct t_native corelib_natives[] = {
+  {"println", &fn_println, "fn_println"},
+  {"flush", &fn_flush, "fn_flush"},
+  {"read", &fn_read, "fn_read"},
+  {"write", &fn_write, "fn_write"},
+  {"open", &fn_open, "fn_open"},
+  {"readline", &fn_readline, "fn_readline"},
+  {"eof", &fn_eof, "fn_eof"},
+  {"close", &fn_close, "fn_close"},
+  {"len", &fn_len, "fn_len"},
+  {"range", &fn_range, "fn_range"},
+  {"push", &fn_push, "fn_push"},
+  {"sum", &fn_sum, "fn_sum"},
+  {"min", &fn_min, "fn_min"},
+  {"max", &fn_max, "fn_max"},
+  {"dot", &fn_dot, "fn_dot"},
+  {"scale", &fn_scale, "fn_scale"},
+  {"map_add", &fn_map_add, "fn_map_add"},
+  {"get", &fn_get, "fn_get"},
+  {"set", &fn_set, "fn_set"},
+  {"has", &fn_has, "fn_has"},
+  {"delete", &fn_delete, "fn_delete"},
+  {"keys", &fn_keys, "fn_keys"},
+  {"parallel_for", &fn_parallel_for, "fn_parallel_for"},
+  {"pipe", &fn_pipe, "fn_pipe"},
+  {"socketpair", &fn_socketpair, "fn_socketpair"},
+  {"fd_read", &fn_fd_read, "fn_fd_read"},
+  {"fd_write", &fn_fd_write, "fn_fd_write"},
+  {"fd_close", &fn_fd_close, "fn_fd_close"},
+  {"sleep", &fn_sleep, "fn_sleep"},
+  {"timer", &fn_timer, "fn_timer"},
+  {"channel", &fn_channel, "fn_channel"},
+  {"send", &fn_send, "fn_send"},
+  {"recv", &fn_recv, "fn_recv"},
+  {"chan_close", &fn_chan_close, "fn_chan_close"},
+  {"thread", &fn_thread, "fn_thread"},
+  {"join", &fn_join, "fn_join"},
+  {NULL, NULL, NULL}
+};
+
 int core_apply(struct t_exec *exec)
 {
-  exec_addfunc2(exec, "println", &fn_println);
+  const struct t_native *native;
+
+  for (native = corelib_natives; native->name; native++) {
+    exec_addnative(exec, native->name, native->fn);
+  }
   return 0;
 }
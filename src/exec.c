@@ -1,6 +1,8 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 #include "exec.h"
 #include "util.h"
 #include "parser.h"
@@ -23,48 +25,187 @@ const struct t_icode_op operations[] = {
   {2, NULL, NULL, &exec_i_lt},
   {2, NULL, NULL, &exec_i_gt},
   {2, NULL, NULL, &exec_i_le},
-  {2, NULL, NULL, &exec_i_ge}
+  {2, NULL, NULL, &exec_i_ge},
+  {0, &exec_i_ret, NULL, NULL},
+  {0, &exec_i_tcall, NULL, NULL},
+  {0, &exec_i_cmpjz, NULL, NULL},
+  {0, &exec_i_incr, NULL, NULL},
+  {0, &exec_i_call1, NULL, NULL},
+  {2, NULL, NULL, &exec_i_add_ii, I_ADD},
+  {2, NULL, NULL, &exec_i_add_ss, I_ADD},
+  {2, NULL, NULL, &exec_i_add_si, I_ADD},
+  {2, NULL, NULL, &exec_i_sub_ii, I_SUB},
+  {2, NULL, NULL, &exec_i_mul_ii, I_MUL},
+  {2, NULL, NULL, &exec_i_div_ii, I_DIV},
+  {2, NULL, NULL, &exec_i_eq_ii, I_EQ},
+  {2, NULL, NULL, &exec_i_ne_ii, I_NE},
+  {2, NULL, NULL, &exec_i_lt_ii, I_LT},
+  {2, NULL, NULL, &exec_i_gt_ii, I_GT},
+  {2, NULL, NULL, &exec_i_le_ii, I_LE},
+  {2, NULL, NULL, &exec_i_ge_ii, I_GE},
+  {0, &exec_i_array, NULL, NULL},
+  {2, NULL, NULL, &exec_i_index},
+  {0, &exec_i_setindex, NULL, NULL},
+  {0, &exec_i_map, NULL, NULL},
+  {0, &exec_i_concat, NULL, NULL},
+  {0, &exec_i_spawn, NULL, NULL},
+  {0, &exec_i_yield, NULL, NULL}
 };
 const int operations_len = sizeof(operations) / sizeof(struct t_icode_op);
 
 /*
- * Initialize an execution environment.
+ * The generic form of an icode's type, whether or not it is quickened.
+ */
+int exec_generic_type(struct t_icode *icode)
+{
+  int type = icode_type(icode);
+
+  return operations[type].generic ? operations[type].generic : type;
+}
+
+/*
+ * Initialize an execution environment that parses in as it runs.
  */
 int exec_init(struct t_exec *exec, FILE *in) {
-  if (parser_init(&exec->parser, in)) return -1;
+  struct t_program *program;
+  int rc;
+
+  program = program_new(in);
+  if (!program) return -1;
+  rc = exec_init_program(exec, program);
+  exec->own_program = 1;
+  return rc;
+}
+
+/*
+ * Initialize an execution environment that runs a loaded program. The
+ * program is shared, not copied, and must outlive the exec.
+ */
+int exec_init_program(struct t_exec *exec, struct t_program *program) {
+  int i;
+
+  exec->program = program;
+  exec->own_program = 0;
   list_init(&exec->stack);
   list_init(&exec->functions);
+  exec->calls = NULL;
+  exec->ncalls = 0;
   list_init(&exec->vars);
+  exec->globals = NULL;
   list_init(&exec->formats);
+  list_init(&exec->values);
+  exec->values_mark = 0;
+  list_init(&exec->free_values);
+  list_init(&exec->frames);
+  task_init(exec);
+  loop_init(&exec->loop);
+  chans_init(&exec->chans);
   exec->current = NULL;
+  exec->feed = NULL;
+  exec->feed_arg = NULL;
+  for (i=0; i < IO_MAX_FILES; i++) {
+    exec->files[i] = NULL;
+  }
+  if (output_init(&exec->out, STDOUT_FILENO) < 0) return -1;
   return 0;
 }
 
+/*
+ * Initialize an exec that runs on another thread for caller: on the
+ * caller's program, with its natives, and with its output captured.
+ */
+int exec_init_worker(struct t_exec *exec, struct t_exec *caller)
+{
+  struct item *item;
+  struct t_func *func;
+
+  if (exec_init_program(exec, caller->program) < 0) {
+    return -1;
+  }
+  for (item = caller->functions.first; item; item = item->next) {
+    func = item->value;
+    if (func->native) {
+      exec_addnative(exec, func->name, func->native);
+    }
+    else {
+      exec_addfunc2(exec, func->name, func->invoke);
+    }
+  }
+  return output_capture(&exec->out);
+}
+
+/*
+ * Drop what a run left behind, so the program can run again from the
+ * start. Natives, resolved calls, pooled values and list items are kept,
+ * so this costs only as much as the state the run left, and the next run
+ * starts without allocating.
+ */
+void exec_reset(struct t_exec *exec)
+{
+  struct t_var *var;
+  int i;
+
+  for (i=0; i < IO_MAX_FILES; i++) {
+    if (exec->files[i]) {
+      mapfile_close(exec->files[i]);
+      exec->files[i] = NULL;
+    }
+  }
+
+  task_reset(exec);
+  chans_reset(exec);
+
+  /* Left over after an error; the values are owned elsewhere */
+  while (exec->stack.size) {
+    list_pop(&exec->stack);
+  }
+  while (exec->frames.size) {
+    frame_free(list_pop(&exec->frames));
+  }
+
+  exec_reclaim(exec, 0);
+  exec->values_mark = 0;
+
+  while (exec->vars.size) {
+    var = list_pop(&exec->vars);
+    var_close(var);
+    free(var);
+  }
+
+  exec->current = NULL;
+}
+
 int exec_close(struct t_exec *exec) {
   struct item *item;
+  int rc;
   
-  parser_close(&exec->parser);
-  
+  /* Threads print into the output, so they are joined before it is closed */
+  chans_reset(exec);
+  rc = output_close(&exec->out);
+  exec_reset(exec);
+  task_close(exec);
+  loop_close(&exec->loop);
+  chans_close(exec);
+  list_empty(&exec->stack);
+  list_empty(&exec->frames);
+  list_empty(&exec->values);
+  list_empty(&exec->vars);
+
+  /* Natives; the program's functions are freed with it */
   item = exec->functions.first;
   while (item) {
     func_free(item->value);
     item = item->next;
   }
   list_empty(&exec->functions);
+  free(exec->calls);
 
-  item = exec->values.first;
-  while (item) {
-    value_free(item->value);
-    item = item->next;
-  }
-  list_empty(&exec->values);
-  
-  item = exec->vars.first;
+  item = exec->free_values.first;
   while (item) {
-    var_close(item->value);
+    free(item->value);
     item = item->next;
   }
-  list_empty(&exec->vars);
+  list_empty(&exec->free_values);
 
   item = exec->formats.first;
   while (item) {
@@ -72,31 +213,12 @@ int exec_close(struct t_exec *exec) {
     item = item->next;
   }
   list_empty(&exec->formats);
-  
-  return 0;
-}
-
-/*
- * Move functions from parser to exec
- */
-void exec_get_funcs(struct t_exec *exec)
-{
-  struct item *item;
 
-  item = exec->parser.functions.first;
-  if (item) {
-    printf("Copying parser functions to exec functions\n");
-    item->prev = exec->functions.last; // May be NULL
-    if (exec->functions.last) {
-      exec->functions.last->next = item;
-    }
-    exec->functions.last = exec->parser.functions.last;
-    if (!exec->functions.first) {
-      exec->functions.first = item;
-    }
-    exec->parser.functions.first = NULL;
-    exec->parser.functions.last = NULL;
+  if (exec->own_program) {
+    program_free(exec->program);
   }
+  
+  return rc;
 }
 
 /*
@@ -108,6 +230,8 @@ void exec_get_funcs(struct t_exec *exec)
 
 /*
  * Alternate for exec_addfunc()
+ * fn gets its arguments as a list. It still works, through a list built on
+ * the C stack at each call, but new natives should use exec_addnative().
  */
 struct t_func * exec_addfunc2(struct t_exec *exec, char *name, int (*fn)(struct t_func *func, struct list *args, struct t_value *ret))
 {
@@ -120,13 +244,27 @@ struct t_func * exec_addfunc2(struct t_exec *exec, char *name, int (*fn)(struct
 }
 
 /*
- * Find a function by name
+ * Add a native function. fn gets its argc arguments in argv, which it must
+ * not keep, and writes its result into ret.
+ */
+struct t_func * exec_addnative(struct t_exec *exec, char *name, int (*fn)(struct t_exec *exec, int argc, struct t_value **argv, struct t_value *ret))
+{
+  struct t_func *func;
+
+  func = func_new(name);
+  func->native = fn;
+  list_push(&exec->functions, func);
+  return func;
+}
+
+/*
+ * Find a function by name: a native, or else one of the program's
  */
 struct t_func * exec_funcbyname(struct t_exec *exec, char *name) {
   struct item *item;
   struct t_func *func;
   
-  printf("exec_funcbyname() name=%s\n", name);
+  DBG(3, "name=%s", name);
   item = exec->functions.first;
   while (item) {
     func = (struct t_func *) item->value;
@@ -135,21 +273,42 @@ struct t_func * exec_funcbyname(struct t_exec *exec, char *name) {
     }
     item = item->next;
   }
+
+  /* program_add_func() may add one meanwhile */
+  item = __atomic_load_n(&exec->program->parser.functions.first, __ATOMIC_ACQUIRE);
+  while (item) {
+    func = (struct t_func *) item->value;
+    if (strcmp(func->name, name) == 0) {
+      return func;
+    }
+    item = __atomic_load_n(&item->next, __ATOMIC_ACQUIRE);
+  }
   
   return NULL;
 }
 
+/*
+ * Run the whole program, parsing it first unless it was loaded already.
+ */
 int exec_statements(struct t_exec *exec)
 {
-  if (parse(&exec->parser) < 0) {
+  if (exec->own_program && parse(&exec->program->parser) < 0) {
     return -1;
   }
   
   if (exec_run(exec) < 0) {
+    chans_reset(exec);
+    output_flush(&exec->out);
+    return -1;
+  }
+
+  /* Threads that weren't joined end with the program */
+  if (stage_join_all(exec) < 0) {
+    output_flush(&exec->out);
     return -1;
   }
   
-  return 0;
+  return output_flush(&exec->out);
 }
 
 struct t_value * exec_stmt(struct t_exec *exec)
@@ -158,7 +317,7 @@ struct t_value * exec_stmt(struct t_exec *exec)
   struct t_token *token;
   
   debug(1, "%s(): Calling parse_stmt()\n", __FUNCTION__);
-  if (parse_stmt(&exec->parser) < 0) {
+  if (parse_stmt(&exec->program->parser) < 0) {
     res = NULL;
   }
   else {
@@ -170,40 +329,101 @@ struct t_value * exec_stmt(struct t_exec *exec)
       res = list_pop(&exec->stack);
     }
   }
+  output_flush(&exec->out);
   
-  token = parser_token(&exec->parser);
+  token = parser_token(&exec->program->parser);
   
   if (!res) {
     while (token->type != TT_EOL && token->type != TT_EOF) {
-      token = parser_next(&exec->parser);
+      token = parser_next(&exec->program->parser);
     }
   }
   
   while (token->type == TT_EOL) {
-    token = parser_next(&exec->parser);
+    token = parser_next(&exec->program->parser);
   }
   
   return res;
 }
 
+static int exec_loop(struct t_exec *exec);
+
+/*
+ * Run from exec->current until the program, and every task, ends. While it
+ * runs, exec->out is bound to the thread, so errors come after the output
+ * before them.
+ */
 int exec_run(struct t_exec *exec)
+{
+  struct t_output *prev;
+  int rc;
+
+  prev = output_bind(&exec->out);
+  rc = exec_loop(exec);
+  output_bind(prev);
+  return rc;
+}
+
+static int exec_loop(struct t_exec *exec)
 {
   struct t_icode *icode;
   struct t_value *ret;
-
-  exec_get_funcs(exec);
+  struct item *item;
 
   if (!exec->current) {
-    exec->current = exec->parser.output.first;
+    exec->current = exec->program->parser.output.first;
+  }
+  if (!exec->current && exec->feed && exec->feed(exec) < 0) {
+    return -1;
   }
   while (exec->current) {
     icode = (struct t_icode *) exec->current->value;
-    ret = exec_icode(exec, icode);
-    if (!ret) {
-      debug(1, "%s(): returning -1 at line %d\n", __FUNCTION__, __LINE__);
-      return -1;
+    if (__atomic_load_n(&icode->jit, __ATOMIC_ACQUIRE)) {
+      if (jit_run(exec, icode) < 0) {
+        debug(1, "%s(): returning -1 at line %d\n", __FUNCTION__, __LINE__);
+        task_reset(exec);
+        return -1;
+      }
+    }
+    else {
+      item = exec->current;
+      ret = exec_icode(exec, icode);
+      if (!ret) {
+        debug(1, "%s(): returning -1 at line %d\n", __FUNCTION__, __LINE__);
+        task_reset(exec);
+        return -1;
+      }
+
+      /* Count loop back-edges, over every run of the program */
+      if (icode_type(icode) == I_JMP && icode->operand->intval < 0 && exec->program->jit.enabled) {
+        if (__atomic_add_fetch(&icode->hits, 1, __ATOMIC_RELAXED) == exec->program->jit.threshold) {
+          jit_loop(exec, item);
+        }
+      }
     }
     exec->current = exec->current->next;
+
+    while (!exec->current) {
+      /* The main task is at the end of the code so far: there may be more */
+      if (exec->feed && exec->tasks.running == &exec->tasks.main) {
+        if (exec->feed(exec) < 0) {
+          task_reset(exec);
+          return -1;
+        }
+        if (exec->current) {
+          break;
+        }
+      }
+
+      /* The running task ended, so another one runs */
+      if (!task_pending(exec)) {
+        break;
+      }
+      if (task_end(exec) < 0) {
+        task_reset(exec);
+        return -1;
+      }
+    }
   }
   
   return 0;
@@ -215,16 +435,19 @@ struct t_value * exec_icode(struct t_exec *exec, struct t_icode *icode)
   struct t_value *opnd1, *opnd2;
   struct t_value *val1, *val2;
   struct t_icode_op op;
-  struct t_var *var;
+  int type;
 
-  debug(1, "%s(): Executing icode addr=%d: %s\n", __FUNCTION__, icode->addr, format_icode(&exec->parser, icode));
+  if (debug_level >= 1) {
+    debug(1, "%s(): Executing icode addr=%d: %s\n", __FUNCTION__, icode->addr, format_icode(&exec->program->parser, icode));
+  }
 
-  if (icode->type < 0 || icode->type >= operations_len) {
-    fprintf(stderr, "Invalid operation type (value=%d)\n", icode->type);
+  type = icode_type(icode);
+  if (type < 0 || type >= operations_len) {
+    fprintf(stderr, "Invalid operation type (value=%d)\n", type);
     return NULL;
   }
 
-  op = operations[icode->type];
+  op = operations[type];
 
   if (op.opnd_count == 0) {
     ret = op.op0(exec, icode);
@@ -232,13 +455,10 @@ struct t_value * exec_icode(struct t_exec *exec, struct t_icode *icode)
   else if (op.opnd_count == 1) {
     opnd1 = list_pop(&exec->stack);
     assert(opnd1);
-    if (opnd1->type == VAL_VAR) {
-      var = var_lookup(exec, opnd1->name);
-      val1 = var->value;
-      assert(opnd1);
-    }
-    else {
-      val1 = opnd1;
+    val1 = exec_operand(exec, opnd1);
+    if (!val1) {
+      fprintf(stderr, "Error: Undefined variable %s, on Line %d.\n", opnd1->name, icode->token->row+1);
+      return NULL;
     }
 
     ret = op.op1(exec, icode, val1);
@@ -250,39 +470,127 @@ struct t_value * exec_icode(struct t_exec *exec, struct t_icode *icode)
     opnd1 = list_pop(&exec->stack);
     assert(opnd1);
 
-    if (opnd1->type == VAL_VAR) {
-      var = var_lookup(exec, opnd1->name);
-      val1 = var->value;
-      assert(val1);
-    }
-    else {
-      val1 = opnd1;
-    }
-
-    if (opnd2->type == VAL_VAR) {
-      var = var_lookup(exec, opnd2->name);
-      val2 = var->value;
-      assert(val2);
-    }
-    else {
-      val2 = opnd2;
+    val1 = exec_operand(exec, opnd1);
+    val2 = exec_operand(exec, opnd2);
+    if (!val1 || !val2) {
+      fprintf(stderr, "Error: Undefined variable %s, on Line %d.\n", val1 ? opnd2->name : opnd1->name, icode->token->row+1);
+      return NULL;
     }
 
     ret = op.op2(exec, icode, val1, val2);
+    if (ret) {
+      exec_quicken(exec, icode, val1, val2);
+    }
     list_push(&exec->stack, ret);
   }
   else {
-    fprintf(stderr, "Invalid number of operations (%d) for op '%s'\n", op.opnd_count, icodes[icode->type]);
+    fprintf(stderr, "Invalid number of operations (%d) for op '%s'\n", op.opnd_count, icodes[type]);
     return NULL;
   }
   
   return ret;
 }
 
+/*
+ * Pop the result of an expression statement, and free the values made for it.
+ */
 struct t_value * exec_i_pop(struct t_exec *exec, struct t_icode *icode)
 {
   debug(3, "%s(): Before pop, stack size: %d\n", __FUNCTION__, exec->stack.size);
-  return list_pop(&exec->stack);
+  if (!list_pop(&exec->stack)) {
+    return NULL;
+  }
+  exec_settle(exec);
+  return &nullvalue;
+}
+
+/*
+ * Once the stack is back at the frame's base, after a statement or a
+ * condition, nothing refers to the values made since the frame was
+ * entered, so they are freed.
+ */
+void exec_settle(struct t_exec *exec)
+{
+  struct t_frame *frame;
+
+  frame = list_last(&exec->frames);
+  if (exec->stack.size == (frame ? frame->stack_base : 0)) {
+    exec_reclaim(exec, frame ? frame->values_mark : exec->values_mark);
+  }
+}
+
+/*
+ * Free the values made after the first mark values, newest first. Up to
+ * EXEC_MAX_FREE_VALUES of them are kept for exec_value() to reuse.
+ */
+void exec_reclaim(struct t_exec *exec, int mark)
+{
+  struct t_value *value;
+
+  while (exec->values.size > mark) {
+    value = list_pop(&exec->values);
+    if (exec->free_values.size < EXEC_MAX_FREE_VALUES) {
+      value_close(value);
+      list_push(&exec->free_values, value);
+    }
+    else {
+      value_free(value);
+    }
+  }
+}
+
+/*
+ * Drop the calls cached for the icodes at addresses start to end, which
+ * are freed, so the addresses can be used again.
+ */
+void exec_forget(struct t_exec *exec, int start, int end)
+{
+  if (end > exec->ncalls) {
+    end = exec->ncalls;
+  }
+  if (start < end) {
+    memset(exec->calls + start, 0, sizeof(struct t_func *) * (end - start));
+  }
+}
+
+/*
+ * A new temporary value, freed by exec_reclaim().
+ */
+struct t_value * exec_value(struct t_exec *exec, int type)
+{
+  struct t_value *value;
+
+  value = list_pop(&exec->free_values);
+  if (value) {
+    value_init(value, type);
+  }
+  else {
+    value = create_value(type);
+  }
+  list_push(&exec->values, value);
+  return value;
+}
+
+/*
+ * Temporary numbers, for results: in steady state they come from the
+ * values exec_reclaim() kept, so arithmetic doesn't allocate.
+ */
+struct t_value * exec_int(struct t_exec *exec, long long n)
+{
+  struct t_value *value;
+
+  value = exec_value(exec, VAL_INT);
+  value->intval = n;
+  return value;
+}
+
+struct t_value * exec_float(struct t_exec *exec, double f)
+{
+  struct t_value *value;
+
+  value = exec_value(exec, VAL_FLOAT);
+  value->floatval = f;
+  return value;
 }
 
 struct t_value * exec_i_nop(struct t_exec *exec, struct t_icode *icode)
@@ -297,118 +605,609 @@ struct t_value * exec_i_push(struct t_exec *exec, struct t_icode *icode)
   return icode->operand;
 }
 
-struct t_value * exec_i_fcall(struct t_exec *exec, struct t_icode *fcall)
+/*
+ * Look up the function called by an FCALL or TCALL icode.
+ * The result is cached in exec->calls by the icode's address. It can't go
+ * on the icode: natives belong to the exec, and the program may be shared.
+ */
+struct t_func * exec_resolve_func(struct t_exec *exec, struct t_icode *fcall)
 {
-  struct list a, args;
-  int i;
-  struct t_value *ret = &nullvalue;
-  struct t_func * func;
-  struct t_value *opnd;
-  struct item *item;
-  int current_addr;
-  int offset;
-
-  debug(3, "%s(): Stack size at line %d: %d\n", __FUNCTION__, __LINE__, exec->stack.size);
-  debug(3, "%s(): Top of stack at line %d: %s\n", __FUNCTION__, __LINE__, format_value(list_last(&exec->stack)));
-
-  func = exec_funcbyname(exec, fcall->operand->name);
-  if (!func) {
-    fprintf(stderr, "Error: Function %s() is not defined, on Line %d.\n", fcall->operand->name, fcall->token->row+1);
-    return NULL;
-  }
+  struct t_func *func = NULL;
+  struct t_func **calls;
+  int n;
 
-  /* Prepare the arguments */
-  list_init(&a);
-  list_init(&args);
-  for (i=0; i < fcall->operand->argc; i++) {
-    list_push(&a, list_pop(&exec->stack));
+  if (fcall->addr < exec->ncalls) {
+    func = exec->calls[fcall->addr];
   }
-  for (i=0; i < fcall->operand->argc; i++) {
-    list_push(&args, list_pop(&a));
-  }
-
-  if (func->invoke) {
-    DBG(2, "Calling C function");
-    ret = calloc(1, sizeof(struct t_value));
-    list_push(&exec->values, ret);
-    if (func->invoke(func, &args, ret) < 0) {
-      fprintf(stderr, "(TODO) Error in native function: %s()\n", func->name);
+  if (!func) {
+    func = exec_funcbyname(exec, fcall->operand->name);
+    if (!func) {
+      fprintf(stderr, "Error: Function %s() is not defined, on Line %d.\n", fcall->operand->name, fcall->token->row+1);
       return NULL;
     }
-    list_push(&exec->stack, ret);
-  }
-  else {
-    DBG(2, "Calling local function");
-
-    // Calculate the offset
-    offset = 0;
-    item = exec->parser.output.first;
-    printf("func start: %d\n", func->start);
-    current_addr = 0;
-    while (item != exec->current) {
-      item = item->next;
-      current_addr++;
-      if (item == exec->current) {
-        printf("Found current\n");
+    if (fcall->addr >= exec->ncalls) {
+      n = exec->program->parser.output.size;
+      if (n <= fcall->addr) {
+        n = fcall->addr + 1;
+      }
+      calls = realloc(exec->calls, sizeof(struct t_func *) * n);
+      if (!calls) {
+        fprintf(stderr, "Error: Out of memory calling %s()\n", func->name);
+        return NULL;
       }
+      memset(calls + exec->ncalls, 0, sizeof(struct t_func *) * (n - exec->ncalls));
+      exec->calls = calls;
+      exec->ncalls = n;
     }
-    offset = (func->start + 1) - current_addr;
-
-    opnd = create_num_from_int(offset);
-    list_push(&exec->stack, opnd);
-    exec_i_jst(exec, NULL);
+    exec->calls[fcall->addr] = func;
   }
-  
-  return ret;
-}
 
-struct t_value * exec_i_jmp(struct t_exec *exec, struct t_icode *jmp)
-{
-  if (exec_jump(exec, jmp->operand->intval) < 0) {
-    return NULL;
+  /* Only a program still being parsed can have new functions */
+  if (!func->native && !func->invoke && !func->entry) {
+    program_link(exec->program);
+    assert(func->entry);
   }
 
-  return &nullvalue;
+  return func;
 }
 
-int exec_jump(struct t_exec *exec, int offset)
+/*
+ * Pop the arguments of a call to a local function off the stack, and bind
+ * them to the function's parameters as new variables in the locals list.
+ */
+int exec_bind_args(struct t_exec *exec, struct t_func *func, int argc, struct list *locals)
 {
+  struct t_value *argv[MAX_FUNC_ARGS];
+  struct t_value *opnd;
   int i;
-  debug(3, "%s(): Doing jump. offset=%d\n", __FUNCTION__, offset);
-  
-  if (offset > 0) {
-    // Increment offset-1 because the instruction pointer will get incremented anyway.
-    for (i=0; i < offset-1; i++) {
-      exec->current = exec->current->next;
-      assert(exec->current);
-    }
+
+  if (argc != func->argc) {
+    fprintf(stderr, "Error: Function %s() expects %d arguments, got %d.\n", func->name, func->argc, argc);
+    return -1;
   }
-  else if (offset < 0) {
-    for (i=offset-1; i < 0; i++) {
-      exec->current = exec->current->prev;
-      assert(exec->current);
+
+  for (i=func->argc-1; i >= 0; i--) {
+    opnd = list_pop(&exec->stack);
+    assert(opnd);
+    argv[i] = exec_operand(exec, opnd);
+    if (!argv[i]) {
+      fprintf(stderr, "Error: Undefined variable %s in call to %s().\n", opnd->name, func->name);
+      return -1;
     }
   }
-  
+
+  list_init(locals);
+  for (i=0; i < func->argc; i++) {
+    list_push(locals, var_new(func->params[i], argv[i]));
+  }
+
   return 0;
 }
 
-struct t_value * exec_i_jz(struct t_exec *exec, struct t_icode *jmp)
+/*
+ * Call a native function, and push its result.
+ */
+struct t_value * exec_invoke_native(struct t_exec *exec, struct t_func *func, int argc, struct t_value **argv)
 {
-  struct t_value *ret = &nullvalue;
-  
-  ret = list_pop(&exec->stack);
-  if (ret->intval == 0) {
-    exec_i_jmp(exec, jmp);
+  struct item items[MAX_FUNC_ARGS];
+  struct list args;
+  struct t_value *ret;
+  int i, rc;
+
+  ret = exec_value(exec, VAL_NULL);
+  if (func->native) {
+    rc = func->native(exec, argc, argv, ret);
   }
-  
+  else {
+    /* exec_addfunc2() natives take a list, linked here on the C stack */
+    list_init(&args);
+    for (i=0; i < argc; i++) {
+      items[i].value = argv[i];
+      items[i].prev = i ? &items[i-1] : NULL;
+      items[i].next = i < argc - 1 ? &items[i+1] : NULL;
+    }
+    args.first = argc ? &items[0] : NULL;
+    args.last = argc ? &items[argc-1] : NULL;
+    args.size = argc;
+    rc = func->invoke(func, &args, ret);
+  }
+  if (rc < 0) {
+    fprintf(stderr, "(TODO) Error in native function: %s()\n", func->name);
+    return NULL;
+  }
+  list_push(&exec->stack, ret);
+
+  /* It waits in the event loop, so another task runs meanwhile */
+  if (exec->tasks.blocked && task_block(exec) < 0) {
+    return NULL;
+  }
+
   return ret;
 }
 
 /*
- * Jump to location identified by the top of stack.
+ * Call a function from C, and run it until it returns. Returns the result,
+ * which is good until the exec's values are reclaimed, or NULL on error.
  */
-struct t_value * exec_i_jst(struct t_exec *exec, struct t_icode *jmp)
+struct t_value * exec_call(struct t_exec *exec, struct t_func *func, int argc, struct t_value **argv)
+{
+  struct item stop;
+  struct item *resume;
+  int i, rc;
+
+  if (func->native || func->invoke) {
+    if (!exec_invoke_native(exec, func, argc, argv)) {
+      return NULL;
+    }
+    return list_pop(&exec->stack);
+  }
+  if (!func->entry) {
+    program_link(exec->program);
+  }
+
+  for (i=0; i < argc; i++) {
+    list_push(&exec->stack, argv[i]);
+  }
+  /* The frame returns to stop, whose next item ends exec_run() */
+  stop.value = NULL;
+  stop.prev = NULL;
+  stop.next = NULL;
+  if (exec_push_frame(exec, func, argc, &stop) < 0) {
+    return NULL;
+  }
+  resume = exec->current;
+  exec->current = func->entry->next;
+  rc = exec_run(exec);
+  exec->current = resume;
+
+  return rc < 0 ? NULL : list_pop(&exec->stack);
+}
+
+/*
+ * Pop argc arguments off the stack and call a native function with them.
+ * The arguments are read in place, from the top argc items of the stack.
+ */
+struct t_value * exec_call_native(struct t_exec *exec, struct t_func *func, int argc)
+{
+  struct t_value *argv[MAX_FUNC_ARGS];
+  struct t_value *opnd;
+  struct item *item;
+  int i;
+
+  DBG(2, "Calling C function");
+
+  if (argc > MAX_FUNC_ARGS) {
+    fprintf(stderr, "Error: Too many arguments in call to %s().\n", func->name);
+    return NULL;
+  }
+
+  /* Prepare the arguments */
+  item = exec->stack.last;
+  for (i=argc-1; i >= 0; i--) {
+    assert(item);
+    opnd = item->value;
+    argv[i] = exec_operand(exec, opnd);
+    if (!argv[i]) {
+      fprintf(stderr, "Error: Undefined variable %s in call to %s().\n", opnd->name, func->name);
+      return NULL;
+    }
+    item = item->prev;
+  }
+  for (i=0; i < argc; i++) {
+    list_pop(&exec->stack);
+  }
+
+  return exec_invoke_native(exec, func, argc, argv);
+}
+
+/*
+ * Pop argc arguments off the stack and push a new frame for a local function.
+ * ret is the item to resume at when the function returns.
+ */
+int exec_push_frame(struct t_exec *exec, struct t_func *func, int argc, struct item *ret)
+{
+  struct t_frame *frame;
+
+  DBG(2, "Calling local function");
+
+  if (exec->frames.size >= EXEC_MAX_FRAMES) {
+    fprintf(stderr, "Error: Stack overflow (%d frames) calling %s().\n", exec->frames.size, func->name);
+    return -1;
+  }
+
+  frame = frame_new(func, ret);
+  if (exec_bind_args(exec, func, argc, &frame->locals) < 0) {
+    frame_free(frame);
+    return -1;
+  }
+  frame->stack_base = exec->stack.size;
+  frame->values_mark = exec->values.size;
+  list_push(&exec->frames, frame);
+
+  return 0;
+}
+
+/*
+ * Pop argc arguments off the stack, and rebind the current frame to a
+ * local function for a tail call. With discard set, the frame returns null.
+ */
+int exec_reuse_frame(struct t_exec *exec, struct t_func *func, int argc, int discard)
+{
+  struct t_frame *frame;
+  struct list locals;
+  struct item *item;
+
+  DBG(2, "Tail calling local function");
+
+  frame = list_last(&exec->frames);
+  assert(frame);
+
+  /* Bind the new arguments before the old locals go away */
+  if (exec_bind_args(exec, func, argc, &locals) < 0) {
+    return -1;
+  }
+  item = frame->locals.first;
+  while (item) {
+    var_close(item->value);
+    free(item->value);
+    item = item->next;
+  }
+  list_empty(&frame->locals);
+  frame->locals = locals;
+  frame->func = func;
+  frame->discard |= discard;
+
+  /* The old call's temporaries; the new locals hold their own references */
+  if (exec->stack.size == frame->stack_base) {
+    exec_reclaim(exec, frame->values_mark);
+  }
+
+  return 0;
+}
+
+/*
+ * Pop the current frame, and push the return value, which was on top of
+ * the stack. Sets *resume to the item to resume at, if given.
+ */
+int exec_return(struct t_exec *exec, struct item **resume)
+{
+  struct t_value *ret;
+  struct t_frame *frame;
+  struct t_var *var;
+
+  ret = list_pop(&exec->stack);
+  assert(ret);
+
+  frame = list_last(&exec->frames);
+  if (!frame) {
+    fprintf(stderr, "Error: Return outside of a function\n");
+    return -1;
+  }
+  assert(exec->stack.size == frame->stack_base);
+
+  if (frame->discard) {
+    ret = &nullvalue;
+  }
+  else if (ret->type == VAL_VAR) {
+    /* The variable may be a local, so copy its value out of the frame */
+    var = var_lookup(exec, ret->name);
+    if (!var) {
+      fprintf(stderr, "Error: Undefined variable %s\n", ret->name);
+      return -1;
+    }
+    if (var->value->type == VAL_INT) {
+      ret = exec_int(exec, var->value->intval);
+    }
+    else if (var->value->type == VAL_FLOAT) {
+      ret = exec_float(exec, var->value->floatval);
+    }
+    else if (var->value->type == VAL_NULL) {
+      ret = &nullvalue;
+    }
+    else if (var->value->type == VAL_STRING) {
+      ret = exec_value(exec, VAL_STRING);
+      value_copy_str(ret, var->value);
+      ret->temp = !ret->interned;
+    }
+    else if (var->value->type == VAL_ARRAY) {
+      ret = exec_value(exec, VAL_ARRAY);
+      ret->array = array_ref(var->value->array);
+    }
+    else if (var->value->type == VAL_MAP) {
+      ret = exec_value(exec, VAL_MAP);
+      ret->map = map_ref(var->value->map);
+    }
+    else {
+      ret = var->value;
+    }
+  }
+
+  list_pop(&exec->frames);
+  if (resume) {
+    *resume = frame->ret;
+  }
+  frame_free(frame);
+  list_push(&exec->stack, ret);
+
+  return 0;
+}
+
+struct t_value * exec_i_fcall(struct t_exec *exec, struct t_icode *fcall)
+{
+  struct t_func * func;
+
+  debug(3, "%s(): Stack size at line %d: %d\n", __FUNCTION__, __LINE__, exec->stack.size);
+  if (debug_level >= 3) {
+    debug(3, "%s(): Top of stack at line %d: %s\n", __FUNCTION__, __LINE__, format_value(list_last(&exec->stack)));
+  }
+
+  func = exec_resolve_func(exec, fcall);
+  if (!func) {
+    return NULL;
+  }
+
+  if (func->native || func->invoke) {
+    return exec_call_native(exec, func, fcall->operand->argc);
+  }
+
+  if (exec_push_frame(exec, func, fcall->operand->argc, exec->current) < 0) {
+    fprintf(stderr, "  on Line %d.\n", fcall->token->row+1);
+    return NULL;
+  }
+
+  if (exec->program->jit.enabled && __atomic_add_fetch(&func->hits, 1, __ATOMIC_RELAXED) == exec->program->jit.threshold) {
+    jit_func(exec, func);
+  }
+
+  /* The entry is the icode before the body, as current gets incremented */
+  exec->current = func->entry;
+  
+  return &nullvalue;
+}
+
+/*
+ * Call in tail position: reuse the current frame instead of pushing a new one.
+ */
+struct t_value * exec_i_tcall(struct t_exec *exec, struct t_icode *tcall)
+{
+  struct t_func *func;
+
+  func = exec_resolve_func(exec, tcall);
+  if (!func) {
+    return NULL;
+  }
+
+  if (func->native || func->invoke || !exec->frames.size) {
+    return exec_i_fcall(exec, tcall);
+  }
+
+  if (exec_reuse_frame(exec, func, tcall->operand->argc, tcall->operand->intval) < 0) {
+    fprintf(stderr, "  on Line %d.\n", tcall->token->row+1);
+    return NULL;
+  }
+  exec->current = func->entry;
+
+  return &nullvalue;
+}
+
+/*
+ * Return from a local function, with the value on top of the stack.
+ */
+struct t_value * exec_i_ret(struct t_exec *exec, struct t_icode *icode)
+{
+  if (exec_return(exec, &exec->current) < 0) {
+    return NULL;
+  }
+
+  return list_last(&exec->stack);
+}
+
+/*
+ * Value of a pushed operand, looking up variables.
+ */
+struct t_value * exec_operand(struct t_exec *exec, struct t_value *opnd)
+{
+  struct t_var *var;
+
+  if (opnd->type == VAL_VAR) {
+    var = var_lookup(exec, opnd->name);
+    return var ? var->value : NULL;
+  }
+  return opnd;
+}
+
+/*
+ * Execute the parts of a superinstruction one by one.
+ * This is the slow path for operand types the fused handler doesn't cover.
+ */
+struct t_value * exec_parts(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_value *ret = &nullvalue;
+  int i;
+
+  for (i=0; i < icode->nparts; i++) {
+    ret = exec_icode(exec, icode->parts[i]);
+    if (!ret) return NULL;
+  }
+
+  return ret;
+}
+
+/*
+ * PUSH a; PUSH b; <compare>; JZ
+ */
+struct t_value * exec_i_cmpjz(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_value *a, *b;
+  int cond;
+
+  a = exec_operand(exec, icode->parts[0]->operand);
+  b = exec_operand(exec, icode->parts[1]->operand);
+  if (!a || !b || a->type != VAL_INT || b->type != VAL_INT) {
+    /* Floats and strings take the generic path */
+    return exec_parts(exec, icode);
+  }
+
+  switch (exec_generic_type(icode->parts[2])) {
+  case I_EQ: cond = a->intval == b->intval; break;
+  case I_NE: cond = a->intval != b->intval; break;
+  case I_LT: cond = a->intval < b->intval; break;
+  case I_GT: cond = a->intval > b->intval; break;
+  case I_LE: cond = a->intval <= b->intval; break;
+  default:   cond = a->intval >= b->intval; break;
+  }
+  if (!cond) {
+    exec_jump(exec, icode->parts[3]->operand->intval);
+  }
+
+  return &nullvalue;
+}
+
+/*
+ * PUSH var:x; PUSH var:x; PUSH n; ADD|SUB; ASSIGN; POP
+ */
+struct t_value * exec_i_incr(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_var *var;
+  long long n;
+  int overflow;
+
+  var = var_lookup(exec, icode->parts[0]->operand->name);
+  if (!var || var->value->type != VAL_INT || var->value->frozen) {
+    return exec_parts(exec, icode);
+  }
+
+  if (exec_generic_type(icode->parts[3]) == I_SUB) {
+    overflow = __builtin_sub_overflow(var->value->intval, icode->parts[2]->operand->intval, &n);
+  }
+  else {
+    overflow = __builtin_add_overflow(var->value->intval, icode->parts[2]->operand->intval, &n);
+  }
+  if (overflow) {
+    /* The generic path reports it */
+    return exec_parts(exec, icode);
+  }
+  var->value->intval = n;
+
+  return var->value;
+}
+
+/*
+ * spawn f(...): start a task that calls f, and push its id.
+ */
+struct t_value * exec_i_spawn(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_func *func;
+  struct t_value *ret;
+  int id;
+
+  func = exec_resolve_func(exec, icode);
+  if (!func) {
+    return NULL;
+  }
+  if (func->native || func->invoke) {
+    fprintf(stderr, "Error: Can't spawn native function %s(), on Line %d.\n", func->name, icode->token->row+1);
+    return NULL;
+  }
+
+  id = task_spawn(exec, func, icode->operand->argc);
+  if (id < 0) {
+    fprintf(stderr, "  on Line %d.\n", icode->token->row+1);
+    return NULL;
+  }
+  ret = exec_value(exec, VAL_INT);
+  ret->intval = id;
+  list_push(&exec->stack, ret);
+
+  return ret;
+}
+
+/*
+ * yield: let the next queued task run. This one resumes after the YIELD.
+ */
+struct t_value * exec_i_yield(struct t_exec *exec, struct t_icode *icode)
+{
+  if (task_yield(exec) < 0) {
+    return NULL;
+  }
+
+  return &nullvalue;
+}
+
+/*
+ * PUSH x; FCALL f(x)
+ */
+struct t_value * exec_i_call1(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_func *func;
+  struct t_value *arg;
+
+  func = exec_resolve_func(exec, icode->parts[1]);
+  if (!func) {
+    return NULL;
+  }
+  if (!func->native && !func->invoke) {
+    return exec_parts(exec, icode);
+  }
+
+  arg = exec_operand(exec, icode->parts[0]->operand);
+  if (!arg) {
+    fprintf(stderr, "Error: Undefined variable %s, on Line %d.\n", icode->parts[0]->operand->name, icode->token->row+1);
+    return NULL;
+  }
+
+  return exec_invoke_native(exec, func, 1, &arg);
+}
+
+struct t_value * exec_i_jmp(struct t_exec *exec, struct t_icode *jmp)
+{
+  if (exec_jump(exec, jmp->operand->intval) < 0) {
+    return NULL;
+  }
+
+  return &nullvalue;
+}
+
+int exec_jump(struct t_exec *exec, int offset)
+{
+  int i;
+  debug(3, "%s(): Doing jump. offset=%d\n", __FUNCTION__, offset);
+  
+  if (offset > 0) {
+    // Increment offset-1 because the instruction pointer will get incremented anyway.
+    for (i=0; i < offset-1; i++) {
+      exec->current = exec->current->next;
+      assert(exec->current);
+    }
+  }
+  else if (offset < 0) {
+    for (i=offset-1; i < 0; i++) {
+      exec->current = exec->current->prev;
+      assert(exec->current);
+    }
+  }
+  
+  return 0;
+}
+
+struct t_value * exec_i_jz(struct t_exec *exec, struct t_icode *jmp)
+{
+  struct t_value *cond;
+  
+  cond = list_pop(&exec->stack);
+  if (cond->type == VAL_FLOAT ? cond->floatval == 0 : cond->intval == 0) {
+    exec_i_jmp(exec, jmp);
+  }
+  /* A loop's condition would otherwise pile up values until a statement pops */
+  exec_settle(exec);
+  
+  return &nullvalue;
+}
+
+/*
+ * Jump to location identified by the top of stack.
+ */
+struct t_value * exec_i_jst(struct t_exec *exec, struct t_icode *jmp)
 {
   struct t_value *ret = &nullvalue;
 
@@ -442,127 +1241,507 @@ struct t_value * exec_i_assign(struct t_exec *exec, struct t_icode *icode)
   }
 
   if (opnd1->type != VAL_VAR) {
-    fprintf(stderr, "Left side of assignment must be a variable. Got %s=%d instead.\n", value_types[opnd1->type], opnd1->intval);
+    fprintf(stderr, "Left side of assignment must be a variable. Got %s=%lld instead.\n", value_types[opnd1->type], opnd1->intval);
     return NULL;
   }
   debug(3, "%s(): Looking up opnd1 var name=%s\n", __FUNCTION__, opnd1->name);
   var = var_lookup(exec, opnd1->name);
+  if (var && var->value->frozen) {
+    fprintf(stderr, "Error: Can't assign global %s, which is frozen, on Line %d.\n", opnd1->name, icode->token->row+1);
+    return NULL;
+  }
   if (var) {
-    if (var->value->type != opnd2->type) {
+    /* A number may change between int and float */
+    if (var->value->type != opnd2->type && !(value_is_num(var->value) && value_is_num(opnd2))) {
       fprintf(stderr, "Type mismatch when assigning new value: %s = %s\n", opnd1->name, value_types[opnd2->type]);
       return NULL;
     }
   }
   else {
     var = var_new(opnd1->name, opnd2);
-    list_push(&exec->vars, var);
+    list_push(var_scope(exec), var);
   }
   debug(3, "%s(): Copying value to variable\n", __FUNCTION__);
 
-  if (var->value->type == VAL_INT) {
+  if (var->value->type == VAL_INT && opnd2->type == VAL_INT) {
+    var->value->intval = opnd2->intval;
+    ret = exec_int(exec, var->value->intval);
+    debug(3, "%s(): New int val: %lld\n", __FUNCTION__, ret->intval);
+  }
+  else if (var->value->type == VAL_ARRAY) {
+    /* Arrays are shared, not copied */
+    if (var->value->array != opnd2->array) {
+      array_ref(opnd2->array);
+      array_release(var->value->array);
+      var->value->array = opnd2->array;
+    }
+    ret = var->value;
+  }
+  else if (var->value->type == VAL_MAP) {
+    /* So are maps */
+    if (var->value->map != opnd2->map) {
+      map_ref(opnd2->map);
+      map_release(var->value->map);
+      var->value->map = opnd2->map;
+    }
+    ret = var->value;
+  }
+  else if (value_is_num(var->value)) {
+    var->value->type = opnd2->type;
     var->value->intval = opnd2->intval;
-    ret = create_num_from_int(var->value->intval);
-    list_push(&exec->values, ret);
-    debug(3, "%s(): New int val: %d\n", __FUNCTION__, ret->intval);
+    var->value->floatval = opnd2->floatval;
+    ret = exec_value(exec, opnd2->type);
+    ret->intval = opnd2->intval;
+    ret->floatval = opnd2->floatval;
   }
   else if (var->value->type == VAL_STRING) {
-    var->value->stringval = opnd2->stringval;
+    if (opnd2 == var->value) {
+      /* Appended in place */
+    }
+    else if (opnd2->temp) {
+      /* Nothing else refers to a temporary, so take over its buffer */
+      if (value_move_str(var->value, opnd2) < 0) {
+        return NULL;
+      }
+    }
+    else if (value_copy_str(var->value, opnd2) < 0) {
+      return NULL;
+    }
     ret = var->value;
     debug(3, "%s(): Assigned string: %s\n", __FUNCTION__, ret->stringval);
   }
-  else {
-    fprintf(stderr, "Don't know how to assign %s type value\n", value_types[opnd2->type]);
+  else {
+    fprintf(stderr, "Don't know how to assign %s type value\n", value_types[opnd2->type]);
+    return NULL;
+  }
+  
+  list_push(&exec->stack, ret);
+
+  return ret;
+}
+
+/*
+ * Array literal: the elements are the top n values on the stack, the first
+ * one deepest.
+ */
+struct t_value * exec_i_array(struct t_exec *exec, struct t_icode *icode)
+{
+  return exec_make_array(exec, icode->operand->intval);
+}
+
+struct t_value * exec_make_array(struct t_exec *exec, int n)
+{
+  struct t_value *ret, *elem;
+  struct item *item;
+  int i;
+
+  ret = exec_value(exec, VAL_ARRAY);
+  ret->array = array_new(VAL_INT, 0);
+  if (!ret->array) {
+    return NULL;
+  }
+
+  item = exec->stack.last;
+  for (i=1; i < n; i++) {
+    item = item->prev;
+  }
+  for (i=0; i < n; i++, item = item->next) {
+    elem = exec_operand(exec, item->value);
+    if (!elem) {
+      fprintf(stderr, "Error: Undefined variable %s\n", ((struct t_value *) item->value)->name);
+      return NULL;
+    }
+    if (array_push(ret->array, elem) < 0) {
+      return NULL;
+    }
+  }
+  for (i=0; i < n; i++) {
+    list_pop(&exec->stack);
+  }
+  list_push(&exec->stack, ret);
+
+  return ret;
+}
+
+/*
+ * Map literal: the top 2n values on the stack are keys and values, the
+ * first key deepest.
+ */
+struct t_value * exec_i_map(struct t_exec *exec, struct t_icode *icode)
+{
+  return exec_make_map(exec, icode->operand->intval);
+}
+
+struct t_value * exec_make_map(struct t_exec *exec, int n)
+{
+  struct t_value *ret, *key, *val;
+  struct item *item;
+  int i;
+
+  ret = exec_value(exec, VAL_MAP);
+  ret->map = map_new(n);
+  if (!ret->map) {
+    return NULL;
+  }
+
+  item = exec->stack.last;
+  for (i=1; i < 2 * n; i++) {
+    item = item->prev;
+  }
+  for (i=0; i < n; i++, item = item->next->next) {
+    key = exec_operand(exec, item->value);
+    val = exec_operand(exec, item->next->value);
+    if (!key || !val) {
+      fprintf(stderr, "Error: Undefined variable %s\n", ((struct t_value *) (key ? item->next->value : item->value))->name);
+      return NULL;
+    }
+    if (map_set(ret->map, key, val) < 0) {
+      return NULL;
+    }
+  }
+  for (i=0; i < 2 * n; i++) {
+    list_pop(&exec->stack);
+  }
+  list_push(&exec->stack, ret);
+
+  return ret;
+}
+
+/*
+ * Copy the value at key into ret. A missing key is an error.
+ */
+int exec_map_get(struct t_map *map, struct t_value *key, struct t_value *ret)
+{
+  struct t_value *val;
+  char buf[PARSER_SCRATCH_BUF + 1];
+  int found;
+
+  found = map_get(map, key, &val);
+  if (found == 0) {
+    map_format_key(key, buf, sizeof(buf));
+    fprintf(stderr, "Error: Key %s not found in map\n", buf);
+  }
+  if (found <= 0) {
+    return -1;
+  }
+  return value_copy(ret, val);
+}
+
+static int exec_index_of(struct t_value *array, struct t_value *index)
+{
+  if (array->type == VAL_MAP) {
+    /* Keys are checked by map_hash() */
+    return 0;
+  }
+  if (array->type != VAL_ARRAY) {
+    fprintf(stderr, "Error: Can't index a %s value\n", value_types[array->type]);
+    return -1;
+  }
+  if (index->type != VAL_INT) {
+    fprintf(stderr, "Error: Array index must be an int, got %s\n", value_types[index->type]);
+    return -1;
+  }
+  return 0;
+}
+
+struct t_value * exec_i_index(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (exec_index_of(opnd1, opnd2) < 0) {
+    return NULL;
+  }
+  ret = exec_value(exec, VAL_NULL);
+  if (opnd1->type == VAL_MAP) {
+    return exec_map_get(opnd1->map, opnd2, ret) < 0 ? NULL : ret;
+  }
+  if (array_get(opnd1->array, opnd2->intval, ret) < 0) {
+    return NULL;
+  }
+
+  return ret;
+}
+
+/*
+ * x[i] = v: pops v, i and x, and pushes v.
+ */
+struct t_value * exec_i_setindex(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_value *opnd[3];
+  struct t_value *val[3];
+  int i;
+
+  for (i=2; i >= 0; i--) {
+    opnd[i] = list_pop(&exec->stack);
+    assert(opnd[i]);
+    val[i] = exec_operand(exec, opnd[i]);
+    if (!val[i]) {
+      fprintf(stderr, "Error: Undefined variable %s\n", opnd[i]->name);
+      return NULL;
+    }
+  }
+  if (exec_index_of(val[0], val[1]) < 0) {
     return NULL;
   }
-  
-  list_push(&exec->stack, ret);
+  if (val[0]->type == VAL_MAP ? map_set(val[0]->map, val[1], val[2]) < 0 : array_set(val[0]->array, val[1]->intval, val[2]) < 0) {
+    return NULL;
+  }
+  list_push(&exec->stack, val[2]);
 
-  return ret;
+  return val[2];
 }
 
 struct t_value * exec_i_add(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
 {
-  struct t_value *ret = NULL;
-  char buf[PARSER_SCRATCH_BUF+1];
+  char buf[FMT_NUM_MAX];
   
-  if (opnd1->type == VAL_INT) {
-    if (opnd2->type != VAL_INT) {
-      fprintf(stderr, "%s(): Don't know how to add a %s value to an int value.\n", __FUNCTION__, value_types[opnd2->type]);
-    }
-    ret = create_num_from_int(opnd1->intval + opnd2->intval);
-    list_push(&exec->values, ret);
+  if (value_is_num(opnd1)) {
+    return exec_arith(exec, '+', opnd1, opnd2);
   }
   else if (opnd1->type == VAL_STRING) {
-    int opnd2len;
-    char *opnd2str;
-    
     if (opnd2->type == VAL_STRING) {
-      opnd2str = opnd2->stringval;
+      return exec_concat(exec, icode, opnd1, opnd2->stringval, opnd2->len);
     }
-    else if (opnd2->type == VAL_INT) {
-      snprintf(buf, PARSER_SCRATCH_BUF, "%d", opnd2->intval);
-      opnd2str = buf;
+    else if (value_is_num(opnd2)) {
+      return exec_concat(exec, icode, opnd1, buf, value_format_num(opnd2, buf, FMT_NUM_MAX));
     }
-    else {
-      fprintf(stderr, "%s(): Don't know how to concatenate a %s value to a string.", __FUNCTION__, value_types[opnd2->type]);
+    fprintf(stderr, "%s(): Don't know how to concatenate a %s value to a string.", __FUNCTION__, value_types[opnd2->type]);
+    return NULL;
+  }
+  fprintf(stderr, "%s(): Don't know how to concatenate a %s value.\n", __FUNCTION__, value_types[opnd1->type]);
+  return NULL;
+}
+
+/*
+ * Concatenate a string to a string value.
+ *
+ * Appends in place, with amortized constant cost, when the left operand's
+ * buffer is uniquely owned: a temporary result of an earlier concatenation,
+ * or the variable that the result is assigned back to (see
+ * parser_mark_appends()). Otherwise the result is a new temporary.
+ */
+struct t_value * exec_concat(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, const char *str2, int len2)
+{
+  struct t_value *ret;
+
+  if (value_str_owned(opnd1) && (opnd1->temp || (icode && icode->inplace))) {
+    ret = opnd1;
+  }
+  else {
+    ret = exec_value(exec, VAL_STRING);
+    ret->temp = 1;
+    if (value_set_str(ret, opnd1->stringval, opnd1->len) < 0) {
       return NULL;
     }
-    opnd2len = strlen(opnd2str);
-    
-    ret = create_value(VAL_STRING);
-    list_push(&exec->values, ret);
-    ret->stringval = malloc(sizeof(char) * (strlen(opnd1->stringval) + opnd2len + 1));
-    strcpy(ret->stringval, opnd1->stringval);
-    strcat(ret->stringval, opnd2str);
   }
-  else {
-    fprintf(stderr, "%s(): Don't know how to concatenate a %s value.\n", __FUNCTION__, value_types[opnd1->type]);
+  if (value_append_str(ret, str2, len2) < 0) {
+    fprintf(stderr, "%s(): Out of memory\n", __FUNCTION__);
     return NULL;
   }
-  
+
   return ret;
 }
 
-struct t_value * exec_i_sub(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+/*
+ * Concatenate the operands of a CONCAT_N. Numbers are formatted and the
+ * result's length summed first, so it is allocated once.
+ *
+ * Returns 1 after pushing the result, or -1 on error. Returns 0 when the
+ * chain has to run as separate ADDs: when the first operand isn't a
+ * string, so the first + may be arithmetic, or an operand is undefined or
+ * can't be concatenated, so the ADDs report it as usual.
+ */
+int exec_concat_n(struct t_exec *exec, struct t_value **opnds, int n)
 {
+  struct t_value *vals[MAX_CONCAT];
+  char nums[MAX_CONCAT][FMT_NUM_MAX];
+  int lens[MAX_CONCAT];
   struct t_value *ret;
+  char *dst;
+  int total = 0;
+  int i;
 
-  ret = create_num_from_int(opnd1->intval - opnd2->intval);
-  list_push(&exec->values, ret);
-  
-  return ret;
+  assert(n <= MAX_CONCAT);
+  for (i=0; i < n; i++) {
+    vals[i] = exec_operand(exec, opnds[i]);
+    if (!vals[i]) {
+      return 0;
+    }
+    if (vals[i]->type == VAL_STRING) {
+      lens[i] = vals[i]->len;
+    }
+    else if (i > 0 && vals[i]->type == VAL_INT) {
+      lens[i] = fmt_int(nums[i], vals[i]->intval);
+    }
+    else if (i > 0 && vals[i]->type == VAL_FLOAT) {
+      lens[i] = fmt_float(nums[i], vals[i]->floatval);
+    }
+    else {
+      return 0;
+    }
+    if (lens[i] > INT_MAX - 1 - total) {
+      fprintf(stderr, "Error: String too long\n");
+      return -1;
+    }
+    total += lens[i];
+  }
+
+  ret = exec_value(exec, VAL_STRING);
+  ret->temp = 1;
+  dst = value_alloc_str(ret, total);
+  if (!dst) {
+    fprintf(stderr, "%s(): Out of memory\n", __FUNCTION__);
+    return -1;
+  }
+  for (i=0; i < n; i++) {
+    memcpy(dst, vals[i]->type == VAL_STRING ? vals[i]->stringval : nums[i], lens[i]);
+    dst += lens[i];
+  }
+  list_push(&exec->stack, ret);
+
+  return 1;
 }
 
-struct t_value * exec_i_mul(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+/*
+ * CONCAT_N: the parts are PUSH a; PUSH b; ADD; PUSH c; ADD; ...
+ */
+struct t_value * exec_i_concat(struct t_exec *exec, struct t_icode *icode)
 {
-  struct t_value *ret;
+  struct t_value *opnds[MAX_CONCAT];
+  int n = (icode->nparts + 1) / 2;
+  int i;
 
-  ret = create_num_from_int(opnd1->intval * opnd2->intval);
-  list_push(&exec->values, ret);
-  
-  return ret;
+  opnds[0] = icode->parts[0]->operand;
+  for (i=1; i < n; i++) {
+    opnds[i] = icode->parts[2*i-1]->operand;
+  }
+  switch (exec_concat_n(exec, opnds, n)) {
+  case -1:
+    return NULL;
+  case 0:
+    return exec_parts(exec, icode);
+  }
+  return list_last(&exec->stack);
+}
+
+struct t_value * exec_i_sub(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  return exec_arith(exec, '-', opnd1, opnd2);
+}
+
+struct t_value * exec_i_mul(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  return exec_arith(exec, '*', opnd1, opnd2);
 }
 
 struct t_value * exec_i_div(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  return exec_arith(exec, '/', opnd1, opnd2);
+}
+
+/*
+ * Arithmetic on two numbers. Two ints give an int, and overflowing the
+ * 64-bit range is an error. Otherwise both are promoted to double, and
+ * follow IEEE rules, so a float divided by zero is infinite.
+ */
+struct t_value * exec_arith(struct t_exec *exec, char op, struct t_value *opnd1, struct t_value *opnd2)
 {
   struct t_value *ret;
-  
-  if (opnd2->intval == 0) {
-    fprintf(stderr, "Divide by zero: %d / %d", opnd1->intval, opnd2->intval);
+  long long n = 0;
+  double a, b, f;
+  int overflow = 0;
+
+  if (!value_is_num(opnd1) || !value_is_num(opnd2)) {
+    fprintf(stderr, "Error: Can't apply %c to a %s value and a %s value.\n", op, value_types[opnd1->type], value_types[opnd2->type]);
     return NULL;
   }
-  ret = create_num_from_int(opnd1->intval / opnd2->intval);
-  list_push(&exec->values, ret);
-  
+
+  if (opnd1->type == VAL_INT && opnd2->type == VAL_INT) {
+    switch (op) {
+    case '+': overflow = __builtin_add_overflow(opnd1->intval, opnd2->intval, &n); break;
+    case '-': overflow = __builtin_sub_overflow(opnd1->intval, opnd2->intval, &n); break;
+    case '*': overflow = __builtin_mul_overflow(opnd1->intval, opnd2->intval, &n); break;
+    default:
+      if (opnd2->intval == 0) {
+        fprintf(stderr, "Error: Divide by zero: %lld / %lld\n", opnd1->intval, opnd2->intval);
+        return NULL;
+      }
+      overflow = (opnd1->intval == LLONG_MIN && opnd2->intval == -1);
+      if (!overflow) n = opnd1->intval / opnd2->intval;
+    }
+    if (overflow) {
+      fprintf(stderr, "Error: Integer overflow: %lld %c %lld\n", opnd1->intval, op, opnd2->intval);
+      return NULL;
+    }
+    ret = exec_int(exec, n);
+  }
+  else {
+    a = value_num(opnd1);
+    b = value_num(opnd2);
+    switch (op) {
+    case '+': f = a + b; break;
+    case '-': f = a - b; break;
+    case '*': f = a * b; break;
+    default:  f = a / b; break;
+    }
+    ret = exec_float(exec, f);
+  }
+
   return ret;
 }
 
+/*
+ * Equality of two values: strings by content, numbers by value, arrays and
+ * maps by identity, anything else by intval.
+ */
+int exec_equal(struct t_value *opnd1, struct t_value *opnd2)
+{
+  if (opnd1->type == VAL_STRING || opnd2->type == VAL_STRING) {
+    return opnd1->type == opnd2->type && value_str_eq(opnd1, opnd2);
+  }
+  if (opnd1->type == VAL_ARRAY || opnd2->type == VAL_ARRAY) {
+    return opnd1->array == opnd2->array;
+  }
+  if (opnd1->type == VAL_MAP || opnd2->type == VAL_MAP) {
+    return opnd1->map == opnd2->map;
+  }
+  if (opnd1->type == VAL_FLOAT || opnd2->type == VAL_FLOAT) {
+    return value_is_num(opnd1) && value_is_num(opnd2) && value_num(opnd1) == value_num(opnd2);
+  }
+  return opnd1->intval == opnd2->intval;
+}
+
+/*
+ * Ordering comparison, as I_LT, I_GT, I_LE or I_GE. An int and a float are
+ * compared as doubles.
+ */
+int exec_compare(int type, struct t_value *opnd1, struct t_value *opnd2)
+{
+  double a, b;
+
+  if (opnd1->type != VAL_FLOAT && opnd2->type != VAL_FLOAT) {
+    switch (type) {
+    case I_LT: return opnd1->intval < opnd2->intval;
+    case I_GT: return opnd1->intval > opnd2->intval;
+    case I_LE: return opnd1->intval <= opnd2->intval;
+    default:   return opnd1->intval >= opnd2->intval;
+    }
+  }
+  a = value_num(opnd1);
+  b = value_num(opnd2);
+  switch (type) {
+  case I_LT: return a < b;
+  case I_GT: return a > b;
+  case I_LE: return a <= b;
+  default:   return a >= b;
+  }
+}
+
 struct t_value * exec_i_eq(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
 {
   struct t_value *ret;
   
-  ret = create_num_from_int(opnd1->intval == opnd2->intval);
-  list_push(&exec->values, ret);
+  ret = exec_int(exec, exec_equal(opnd1, opnd2));
   
   return ret;
 }
@@ -571,8 +1750,7 @@ struct t_value * exec_i_ne(struct t_exec *exec, struct t_icode *icode, struct t_
 {
   struct t_value *ret;
   
-  ret = create_num_from_int(opnd1->intval != opnd2->intval);
-  list_push(&exec->values, ret);
+  ret = exec_int(exec, !exec_equal(opnd1, opnd2));
   
   return ret;
 }
@@ -581,8 +1759,7 @@ struct t_value * exec_i_lt(struct t_exec *exec, struct t_icode *icode, struct t_
 {
   struct t_value *ret;
   
-  ret = create_num_from_int(opnd1->intval < opnd2->intval);
-  list_push(&exec->values, ret);
+  ret = exec_int(exec, exec_compare(I_LT, opnd1, opnd2));
   
   return ret;
 }
@@ -591,8 +1768,7 @@ struct t_value * exec_i_gt(struct t_exec *exec, struct t_icode *icode, struct t_
 {
   struct t_value *ret;
   
-  ret = create_num_from_int(opnd1->intval > opnd2->intval);
-  list_push(&exec->values, ret);
+  ret = exec_int(exec, exec_compare(I_GT, opnd1, opnd2));
   
   return ret;
 }
@@ -601,8 +1777,7 @@ struct t_value * exec_i_le(struct t_exec *exec, struct t_icode *icode, struct t_
 {
   struct t_value *ret;
   
-  ret = create_num_from_int(opnd1->intval <= opnd2->intval);
-  list_push(&exec->values, ret);
+  ret = exec_int(exec, exec_compare(I_LE, opnd1, opnd2));
   
   return ret;
 }
@@ -611,43 +1786,337 @@ struct t_value * exec_i_ge(struct t_exec *exec, struct t_icode *icode, struct t_
 {
   struct t_value *ret;
   
-  ret = create_num_from_int(opnd1->intval >= opnd2->intval);
-  list_push(&exec->values, ret);
+  ret = exec_int(exec, exec_compare(I_GE, opnd1, opnd2));
   
   return ret;
 }
 
+/*
+ * Quickening
+ *
+ * After an arithmetic or comparison icode has run, it is rewritten in place
+ * to a form specialized for the operand types it saw. The specialized
+ * handler only checks that the types still match, and otherwise rewrites
+ * the icode back to its generic form with exec_deopt(). After
+ * EXEC_MAX_DEOPT failed guards the icode stays generic.
+ */
+int exec_quicken(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  int was = icode_type(icode);
+  int type = was;
+
+  if (__atomic_load_n(&icode->deopt, __ATOMIC_RELAXED) >= EXEC_MAX_DEOPT) {
+    return type;
+  }
+
+  if (opnd1->type == VAL_INT && opnd2->type == VAL_INT) {
+    switch (type) {
+    case I_ADD: type = I_ADD_II; break;
+    case I_SUB: type = I_SUB_II; break;
+    case I_MUL: type = I_MUL_II; break;
+    case I_DIV: type = I_DIV_II; break;
+    case I_EQ:  type = I_EQ_II; break;
+    case I_NE:  type = I_NE_II; break;
+    case I_LT:  type = I_LT_II; break;
+    case I_GT:  type = I_GT_II; break;
+    case I_LE:  type = I_LE_II; break;
+    case I_GE:  type = I_GE_II; break;
+    }
+  }
+  else if (type == I_ADD && opnd1->type == VAL_STRING) {
+    if (opnd2->type == VAL_STRING) {
+      type = I_ADD_SS;
+    }
+    else if (opnd2->type == VAL_INT) {
+      type = I_ADD_SI;
+    }
+  }
+
+  if (type != was) {
+    DBG(3, "Quickening addr=%d: %s -> %s", icode->addr, icodes[was], icodes[type]);
+    icode_set_type(icode, type);
+  }
+
+  return type;
+}
+
+/*
+ * A specialized icode's type guard failed: go back to the generic form.
+ * Another exec running the program may have done so already.
+ */
+struct t_value * exec_deopt(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  int generic = exec_generic_type(icode);
+
+  DBG(3, "Deoptimizing addr=%d: %s -> %s", icode->addr, icodes[icode_type(icode)], icodes[generic]);
+  icode_set_type(icode, generic);
+  __atomic_add_fetch(&icode->deopt, 1, __ATOMIC_RELAXED);
+
+  return operations[generic].op2(exec, icode, opnd1, opnd2);
+}
+
+struct t_value * exec_i_add_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+  long long n;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  if (__builtin_add_overflow(opnd1->intval, opnd2->intval, &n)) {
+    return exec_arith(exec, '+', opnd1, opnd2);
+  }
+  ret = exec_int(exec, n);
+
+  return ret;
+}
+
+struct t_value * exec_i_add_ss(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  if (opnd1->type != VAL_STRING || opnd2->type != VAL_STRING) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  return exec_concat(exec, icode, opnd1, opnd2->stringval, opnd2->len);
+}
+
+struct t_value * exec_i_add_si(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  char buf[FMT_NUM_MAX];
+
+  if (opnd1->type != VAL_STRING || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  return exec_concat(exec, icode, opnd1, buf, fmt_int(buf, opnd2->intval));
+}
+
+struct t_value * exec_i_div_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  if (opnd2->intval == 0 || opnd2->intval == -1) {
+    /* Reports division by zero, and overflow of LLONG_MIN / -1 */
+    return exec_arith(exec, '/', opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval / opnd2->intval);
+
+  return ret;
+}
+
+struct t_value * exec_i_sub_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+  long long n;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  if (__builtin_sub_overflow(opnd1->intval, opnd2->intval, &n)) {
+    return exec_arith(exec, '-', opnd1, opnd2);
+  }
+  ret = exec_int(exec, n);
+
+  return ret;
+}
+
+struct t_value * exec_i_mul_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+  long long n;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  if (__builtin_mul_overflow(opnd1->intval, opnd2->intval, &n)) {
+    return exec_arith(exec, '*', opnd1, opnd2);
+  }
+  ret = exec_int(exec, n);
+
+  return ret;
+}
+
+struct t_value * exec_i_eq_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval == opnd2->intval);
+
+  return ret;
+}
+
+struct t_value * exec_i_ne_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval != opnd2->intval);
+
+  return ret;
+}
+
+struct t_value * exec_i_lt_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval < opnd2->intval);
+
+  return ret;
+}
+
+struct t_value * exec_i_gt_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval > opnd2->intval);
+
+  return ret;
+}
+
+struct t_value * exec_i_le_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval <= opnd2->intval);
+
+  return ret;
+}
+
+struct t_value * exec_i_ge_ii(struct t_exec *exec, struct t_icode *icode, struct t_value *opnd1, struct t_value *opnd2)
+{
+  struct t_value *ret;
+
+  if (opnd1->type != VAL_INT || opnd2->type != VAL_INT) {
+    return exec_deopt(exec, icode, opnd1, opnd2);
+  }
+  ret = exec_int(exec, opnd1->intval >= opnd2->intval);
+
+  return ret;
+}
+
 struct t_var * var_new(char *name, struct t_value *clonefrom)
 {
   struct t_var *var;
   
   var = malloc(sizeof(struct t_var));
-  var->name = malloc(sizeof(char) * (strlen(name) + 1));
-  strcpy(var->name, name);
+  /* Names are interned by the parser, or static, so they are not copied */
+  var->name = name;
   
-  var->value = malloc(sizeof(struct t_value));
-  memcpy(var->value, clonefrom, sizeof(struct t_value));
+  /* Copy the contents only, not the source's buffers or its name */
+  var->value = create_value(clonefrom->type);
+  var->value->intval = clonefrom->intval;
+  var->value->floatval = clonefrom->floatval;
+  var->value->argc = clonefrom->argc;
+  if (clonefrom->type == VAL_STRING) {
+    /* Shares the buffer; it is copied if either side appends to it */
+    value_copy_str(var->value, clonefrom);
+  }
+  else if (clonefrom->type == VAL_ARRAY) {
+    var->value->array = array_ref(clonefrom->array);
+  }
+  else if (clonefrom->type == VAL_MAP) {
+    var->value->map = map_ref(clonefrom->map);
+  }
   
   return var;
 }
 
 void var_close(struct t_var *var)
 {
-  if (var->name) free(var->name);
-  if (var->value) free(var->value);
+  if (var->value) value_free(var->value);
 }
 
+/*
+ * Find a variable. The current frame's locals shadow the globals.
+ */
 struct t_var * var_lookup(struct t_exec *exec, char *name)
 {
   struct item *item;
+  struct t_frame *frame;
   
-  item = exec->vars.first;
-  while (item) {
-    if (strcmp(((struct t_var *) item->value)->name, name) == 0) {
+  frame = list_last(&exec->frames);
+  if (frame) {
+    item = frame->locals.first;
+    while (item) {
+      if (((struct t_var *) item->value)->name == name || strcmp(((struct t_var *) item->value)->name, name) == 0) {
+        return ((struct t_var *) item->value);
+      }
+      item = item->next;
+    }
+  }
+
+  for (item = exec->vars.first; item; item = item->next) {
+    if (((struct t_var *) item->value)->name == name || strcmp(((struct t_var *) item->value)->name, name) == 0) {
       return ((struct t_var *) item->value);
     }
-    item = item->next;
+  }
+
+  /* A parallel_for() chunk or a server request reads those it was given */
+  if (exec->globals) {
+    for (item = exec->globals->first; item; item = item->next) {
+      if (((struct t_var *) item->value)->name == name || strcmp(((struct t_var *) item->value)->name, name) == 0) {
+        return ((struct t_var *) item->value);
+      }
+    }
   }
   
   return NULL;
 }
+
+/*
+ * The list that new variables are created in.
+ */
+struct list * var_scope(struct t_exec *exec)
+{
+  struct t_frame *frame;
+
+  frame = list_last(&exec->frames);
+  if (frame) {
+    return &frame->locals;
+  }
+  return &exec->vars;
+}
+
+struct t_frame * frame_new(struct t_func *func, struct item *ret)
+{
+  struct t_frame *frame;
+
+  frame = malloc(sizeof(struct t_frame));
+  frame->func = func;
+  frame->ret = ret;
+  list_init(&frame->locals);
+  frame->stack_base = 0;
+  frame->values_mark = 0;
+  frame->discard = 0;
+
+  return frame;
+}
+
+void frame_free(struct t_frame *frame)
+{
+  struct item *item;
+
+  item = frame->locals.first;
+  while (item) {
+    var_close(item->value);
+    free(item->value);
+    item = item->next;
+  }
+  list_empty(&frame->locals);
+  free(frame);
+}
@@ -0,0 +1,279 @@
+/*
+ * Number formatting.
+ *
+ * Ints are written two digits at a time from a table, after the length is
+ * found from the bit length without a loop. Floats get the fewest digits
+ * that read back as the same double. For the common case, a float from
+ * 1e-4 up to 1e15 with at most 15 or 16 digits, these are found by scaling
+ * by powers of ten: m / 10^p with m below 2^53 is exact in both operands,
+ * so the division rounds the same way strtod() does, and checking it
+ * against the double tells whether m with p decimals reads back. The rest
+ * go through snprintf() and strtod().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fmt.h"
+
+#define FMT_EXACT_LIMIT 9007199254740992.0
+#define FMT_MAX_DECIMALS 17
+
+static const char fmt_digits[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static const unsigned long long fmt_pow10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/*
+ * Number of decimal digits in u: about log10(2) * bit length, less one if
+ * u is below the power of ten that estimate lands on.
+ */
+static int fmt_uint_len(unsigned long long u)
+{
+  int t;
+
+  u |= 1;
+  t = (64 - __builtin_clzll(u)) * 1233 >> 12;
+  return t + 1 - (u < fmt_pow10[t]);
+}
+
+/*
+ * Write u as len digits, backwards from dst + len, with leading zeros if
+ * it has fewer.
+ */
+static void fmt_uint_write(char *dst, int len, unsigned long long u)
+{
+  char *p = dst + len;
+  int i;
+
+  while (u >= 100) {
+    i = (u % 100) * 2;
+    u /= 100;
+    *--p = fmt_digits[i + 1];
+    *--p = fmt_digits[i];
+  }
+  if (u >= 10) {
+    i = u * 2;
+    *--p = fmt_digits[i + 1];
+    *--p = fmt_digits[i];
+  }
+  else {
+    *--p = '0' + u;
+  }
+  while (p > dst) {
+    *--p = '0';
+  }
+}
+
+/*
+ * Write n and a NUL into dst, which has room for FMT_NUM_MAX bytes.
+ * Returns the length.
+ */
+int fmt_int(char *dst, long long n)
+{
+  unsigned long long u = n < 0 ? -(unsigned long long) n : (unsigned long long) n;
+  int neg = n < 0;
+  int len;
+
+  dst[0] = '-';
+  len = fmt_uint_len(u);
+  fmt_uint_write(dst + neg, len, u);
+  dst[neg + len] = '\0';
+  return neg + len;
+}
+
+/*
+ * The rounding error of p = a * b, so a * b is exactly p plus it. This is
+ * Dekker's product, with each factor split into two 26-bit halves.
+ */
+static double fmt_prod_err(double a, double b, double p)
+{
+  double c, ah, al, bh, bl;
+
+  c = 134217729.0 * a;
+  ah = c - (c - a);
+  al = a - ah;
+  c = 134217729.0 * b;
+  bh = c - (c - b);
+  bl = b - bh;
+  return ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+}
+
+/*
+ * The shortest fixed-point form of d, if it has one that can be checked
+ * exactly, else -1.
+ */
+static int fmt_float_exact(char *dst, double d)
+{
+  int neg = signbit(d) != 0;
+  double a = neg ? -d : d;
+  double scaled, frac;
+  unsigned long long m = 0;
+  int p, len;
+
+  if (!(a == 0 || (a >= 1e-4 && a < 1e15))) {
+    return -1;
+  }
+  for (p=0; p <= FMT_MAX_DECIMALS; p++) {
+    scaled = a * (double) fmt_pow10[p];
+    if (scaled >= FMT_EXACT_LIMIT) {
+      return -1;
+    }
+    /* The int nearest to the exact product, ties to even, like printf */
+    m = (unsigned long long) scaled;
+    frac = (scaled - (double) m) + fmt_prod_err(a, (double) fmt_pow10[p], scaled);
+    if (frac > 0.5 || (frac == 0.5 && (m & 1))) {
+      m++;
+    }
+    if ((double) m / (double) fmt_pow10[p] == a) {
+      break;
+    }
+  }
+  if (p > FMT_MAX_DECIMALS) {
+    return -1;
+  }
+
+  dst[0] = '-';
+  len = neg;
+  len += fmt_int(dst + len, m / fmt_pow10[p]);
+  dst[len++] = '.';
+  if (p == 0) {
+    dst[len++] = '0';
+  }
+  else {
+    fmt_uint_write(dst + len, p, m % fmt_pow10[p]);
+    len += p;
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+/*
+ * Write d and a NUL into dst, which has room for FMT_NUM_MAX bytes, and
+ * return the length. A float keeps a fraction, so 2.0 is not shown as 2.
+ */
+int fmt_float(char *dst, double d)
+{
+  int len;
+  int digits;
+
+  len = fmt_float_exact(dst, d);
+  if (len >= 0) {
+    return len;
+  }
+  for (digits = 15; digits < 17; digits++) {
+    len = snprintf(dst, FMT_NUM_MAX, "%.*g", digits, d);
+    if (strtod(dst, NULL) == d) {
+      break;
+    }
+  }
+  if (digits == 17) {
+    len = snprintf(dst, FMT_NUM_MAX, "%.17g", d);
+  }
+  if (strspn(dst, "-0123456789") == len) {
+    strcpy(dst + len, ".0");
+    len += 2;
+  }
+  return len;
+}
+
+void fmtbuf_init(struct t_fmtbuf *fb, char *buf, int cap)
+{
+  fb->buf = buf;
+  fb->len = 0;
+  fb->cap = cap;
+  fb->heap = 0;
+  buf[0] = '\0';
+}
+
+/*
+ * Room for n more bytes and a NUL. Returns where they go, or NULL if the
+ * buffer can't grow.
+ */
+char * fmtbuf_reserve(struct t_fmtbuf *fb, int n)
+{
+  char *buf;
+  int cap;
+
+  if (fb->len + n < fb->cap) {
+    return fb->buf + fb->len;
+  }
+  cap = fb->cap * 2;
+  while (cap <= fb->len + n) {
+    cap *= 2;
+  }
+  if (fb->heap) {
+    buf = realloc(fb->buf, cap);
+  }
+  else {
+    buf = malloc(cap);
+    if (buf) {
+      memcpy(buf, fb->buf, fb->len + 1);
+    }
+  }
+  if (!buf) {
+    fprintf(stderr, "Error: Out of memory formatting a value\n");
+    return NULL;
+  }
+  fb->buf = buf;
+  fb->cap = cap;
+  fb->heap = 1;
+  return fb->buf + fb->len;
+}
+
+int fmtbuf_add(struct t_fmtbuf *fb, const char *str, int len)
+{
+  char *dst;
+
+  dst = fmtbuf_reserve(fb, len);
+  if (!dst) {
+    return -1;
+  }
+  memcpy(dst, str, len);
+  fb->len += len;
+  fb->buf[fb->len] = '\0';
+  return 0;
+}
+
+int fmtbuf_int(struct t_fmtbuf *fb, long long n)
+{
+  char *dst;
+
+  dst = fmtbuf_reserve(fb, FMT_NUM_MAX);
+  if (!dst) {
+    return -1;
+  }
+  fb->len += fmt_int(dst, n);
+  return 0;
+}
+
+int fmtbuf_float(struct t_fmtbuf *fb, double d)
+{
+  char *dst;
+
+  dst = fmtbuf_reserve(fb, FMT_NUM_MAX);
+  if (!dst) {
+    return -1;
+  }
+  fb->len += fmt_float(dst, d);
+  return 0;
+}
+
+void fmtbuf_close(struct t_fmtbuf *fb)
+{
+  if (fb->heap) {
+    free(fb->buf);
+  }
+  fb->buf = NULL;
+  fb->heap = 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Report the icode sequences that are worth fusing into superinstructions.
+ *
+ * Reads an execution trace, as printed by exec_icode() at debug level 1,
+ * counts every sequence of 2 to MAX_N consecutive icodes, and prints the
+ * most common ones. The score is the number of dispatches that fusing the
+ * sequence would save: count * (n - 1).
+ *
+ * Compiled code is not traced, so turn the JIT off when tracing:
+ *
+ *   PARSE1_JIT=0 test_exec 1 < script.txt 2>&1 | icode_ngrams [MAX_N] [TOP]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_BUF 1024
+#define OP_NAME_LEN 16
+#define MAX_NGRAM 8
+#define HASH_SIZE 4096
+
+struct t_ngram {
+  char key[(OP_NAME_LEN + 1) * MAX_NGRAM];
+  int n;
+  long count;
+  struct t_ngram *next;
+};
+
+struct t_ngram *table[HASH_SIZE];
+int ngram_count = 0;
+
+unsigned int hash_key(const char *key)
+{
+  unsigned int h = 5381;
+  while (*key) {
+    h = h * 33 + (unsigned char) *key++;
+  }
+  return h % HASH_SIZE;
+}
+
+void ngram_add(const char *key, int n)
+{
+  struct t_ngram *ngram;
+  unsigned int h;
+
+  h = hash_key(key);
+  for (ngram = table[h]; ngram; ngram = ngram->next) {
+    if (strcmp(ngram->key, key) == 0) {
+      ngram->count++;
+      return;
+    }
+  }
+  ngram = calloc(1, sizeof(struct t_ngram));
+  strcpy(ngram->key, key);
+  ngram->n = n;
+  ngram->count = 1;
+  ngram->next = table[h];
+  table[h] = ngram;
+  ngram_count++;
+}
+
+/*
+ * Get the op name from a trace line, or return 0 if it isn't one.
+ */
+int parse_line(const char *line, char *op)
+{
+  const char *p;
+  int i;
+
+  p = strstr(line, "Executing icode addr=");
+  if (!p) return 0;
+  p = strstr(p, ": (");
+  if (!p) return 0;
+  p += 3;
+  for (i=0; i < OP_NAME_LEN && p[i] && p[i] != ' ' && p[i] != ')'; i++) {
+    op[i] = p[i];
+  }
+  op[i] = '\0';
+  return i > 0;
+}
+
+int compare_score(const void *a, const void *b)
+{
+  const struct t_ngram *x = *(const struct t_ngram **) a;
+  const struct t_ngram *y = *(const struct t_ngram **) b;
+  long sx = x->count * (x->n - 1);
+  long sy = y->count * (y->n - 1);
+
+  if (sx != sy) return sx < sy ? 1 : -1;
+  return strcmp(x->key, y->key);
+}
+
+int main(int argc, char *argv[])
+{
+  char line[LINE_BUF];
+  char op[OP_NAME_LEN + 1];
+  char window[MAX_NGRAM][OP_NAME_LEN + 1];
+  char key[(OP_NAME_LEN + 1) * MAX_NGRAM];
+  struct t_ngram **all;
+  struct t_ngram *ngram;
+  int max_n = 4;
+  int top = 20;
+  long ops = 0;
+  int i, n, len;
+
+  if (argc > 1) max_n = atoi(argv[1]);
+  if (argc > 2) top = atoi(argv[2]);
+  if (max_n < 2 || max_n > MAX_NGRAM) {
+    fprintf(stderr, "MAX_N must be between 2 and %d\n", MAX_NGRAM);
+    exit(2);
+  }
+
+  while (fgets(line, LINE_BUF, stdin)) {
+    if (!parse_line(line, op)) continue;
+
+    /* window[0] is the newest op */
+    memmove(window[1], window[0], sizeof(window[0]) * (MAX_NGRAM - 1));
+    strcpy(window[0], op);
+    ops++;
+
+    for (n=2; n <= max_n && n <= ops; n++) {
+      len = 0;
+      for (i=n-1; i >= 0; i--) {
+        len += sprintf(&key[len], i ? "%s " : "%s", window[i]);
+      }
+      ngram_add(key, n);
+    }
+  }
+
+  all = malloc(sizeof(struct t_ngram *) * (ngram_count + 1));
+  for (i=0, n=0; i < HASH_SIZE; i++) {
+    for (ngram = table[i]; ngram; ngram = ngram->next) {
+      all[n++] = ngram;
+    }
+  }
+  qsort(all, n, sizeof(struct t_ngram *), compare_score);
+
+  printf("%ld icodes executed, %d distinct sequences\n", ops, ngram_count);
+  printf("%10s %10s  %s\n", "saved", "count", "sequence");
+  for (i=0; i < n && i < top; i++) {
+    printf("%10ld %10ld  %s\n", all[i]->count * (all[i]->n - 1), all[i]->count, all[i]->key);
+  }
+
+  exit(0);
+}
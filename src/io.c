@@ -0,0 +1,334 @@
+/*
+ * Script I/O.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "io.h"
+
+/* The output of the exec that runs on this thread, see output_bind() */
+static __thread struct t_output *io_bound;
+static pthread_once_t io_stderr_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Write to stderr, after what is waiting in the thread's bound output.
+ */
+static ssize_t io_stderr_write(void *cookie, const char *buf, size_t size)
+{
+  ssize_t n;
+  size_t done = 0;
+
+  if (io_bound) {
+    output_flush(io_bound);
+  }
+  while (done < size) {
+    n = write(STDERR_FILENO, buf + done, size - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done ? (ssize_t) done : -1;
+    }
+    done += n;
+  }
+  return size;
+}
+
+static void io_stderr_init(void)
+{
+  cookie_io_functions_t io = {NULL, io_stderr_write, NULL, NULL};
+  FILE *f;
+
+  fflush(stderr);
+  f = fopencookie(NULL, "w", io);
+  if (f) {
+    setvbuf(f, NULL, _IONBF, 0);
+    stderr = f;
+  }
+}
+
+/*
+ * Make out the calling thread's output, or none if it is NULL, and return
+ * the one it replaces. What is written to stderr from then on, errors
+ * above all, first flushes it, so that with 2>&1 an error comes after the
+ * lines printed before it. That stderr is put in place by the first call,
+ * or the first output_init().
+ */
+struct t_output * output_bind(struct t_output *out)
+{
+  struct t_output *prev = io_bound;
+
+  pthread_once(&io_stderr_once, io_stderr_init);
+  io_bound = out;
+  return prev;
+}
+
+int output_init(struct t_output *out, int fd)
+{
+  pthread_once(&io_stderr_once, io_stderr_init);
+  out->fd = fd;
+  out->tty = fd != IO_CAPTURE && isatty(fd);
+  out->len = 0;
+  out->cap = IO_BUF_SIZE;
+  out->buf = malloc(IO_BUF_SIZE);
+  if (!out->buf) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write out all of iov, going on after short writes.
+ */
+static int output_writev(struct t_output *out, struct iovec *iov, int n)
+{
+  ssize_t done;
+
+  /* Anything printed through stdio goes first, to keep the order */
+  if (out->fd == STDOUT_FILENO) {
+    fflush(stdout);
+  }
+  while (n > 0) {
+    done = writev(out->fd, iov, n);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: Can't write output: %s\n", strerror(errno));
+      return -1;
+    }
+    while (n > 0 && (size_t) done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Grow a captured output's buffer to hold len more bytes.
+ */
+static int output_grow(struct t_output *out, int len)
+{
+  char *buf;
+  int cap = out->cap;
+
+  while (cap - out->len < len) {
+    cap *= 2;
+  }
+  buf = realloc(out->buf, cap);
+  if (!buf) {
+    fprintf(stderr, "Error: Out of memory capturing output\n");
+    return -1;
+  }
+  out->buf = buf;
+  out->cap = cap;
+  return 0;
+}
+
+int output_write(struct t_output *out, const char *data, int len)
+{
+  struct iovec iov[2];
+  int rc = 0;
+
+  if (out->fd == IO_CAPTURE && out->len + len > out->cap && output_grow(out, len) < 0) {
+    return -1;
+  }
+  if (out->len + len <= out->cap) {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+  }
+  else {
+    iov[0].iov_base = out->buf;
+    iov[0].iov_len = out->len;
+    iov[1].iov_base = (char *) data;
+    iov[1].iov_len = len;
+    out->len = 0;
+    rc = output_writev(out, iov, 2);
+  }
+  if (out->tty && memchr(data, '\n', len)) {
+    rc |= output_flush(out);
+  }
+  return rc;
+}
+
+int output_flush(struct t_output *out)
+{
+  struct iovec iov;
+
+  if (!out->len || out->fd == IO_CAPTURE) {
+    return 0;
+  }
+  iov.iov_base = out->buf;
+  iov.iov_len = out->len;
+  out->len = 0;
+  return output_writev(out, &iov, 1);
+}
+
+/*
+ * Keep everything written from now on in memory, for output_take().
+ */
+int output_capture(struct t_output *out)
+{
+  int rc;
+
+  rc = output_flush(out);
+  out->fd = IO_CAPTURE;
+  out->tty = 0;
+  return rc;
+}
+
+/*
+ * A copy of what a captured output holds, and empty it. The caller frees
+ * the copy. Returns NULL if out of memory.
+ */
+char * output_take(struct t_output *out, int *len)
+{
+  char *data;
+
+  data = malloc(out->len + 1);
+  if (!data) {
+    fprintf(stderr, "Error: Out of memory capturing output\n");
+    return NULL;
+  }
+  memcpy(data, out->buf, out->len);
+  data[out->len] = '\0';
+  *len = out->len;
+  out->len = 0;
+  return data;
+}
+
+/*
+ * Flush and free the buffer. The fd is left open.
+ */
+int output_close(struct t_output *out)
+{
+  int rc;
+
+  if (!out->buf) {
+    return 0;
+  }
+  rc = output_flush(out);
+  free(out->buf);
+  out->buf = NULL;
+  return rc;
+}
+
+/*
+ * Map a file for reading. An empty file has no mapping.
+ */
+struct t_mapfile * mapfile_open(const char *path)
+{
+  struct t_mapfile *file;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Can't open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "Error: %s is not a regular file\n", path);
+    close(fd);
+    return NULL;
+  }
+  file = malloc(sizeof(struct t_mapfile));
+  if (!file) {
+    close(fd);
+    return NULL;
+  }
+  file->data = NULL;
+  file->size = st.st_size;
+  file->pos = 0;
+  if (file->size) {
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->data == MAP_FAILED) {
+      fprintf(stderr, "Error: Can't map %s: %s\n", path, strerror(errno));
+      close(fd);
+      free(file);
+      return NULL;
+    }
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return file;
+}
+
+/*
+ * Point *line at the next line in the mapping, and return its length
+ * without the newline, or -1 at the end of the file.
+ */
+int mapfile_line(struct t_mapfile *file, const char **line)
+{
+  const char *start, *end;
+
+  if (file->pos >= file->size) {
+    return -1;
+  }
+  start = file->data + file->pos;
+  end = memchr(start, '\n', file->size - file->pos);
+  if (end) {
+    file->pos = end - file->data + 1;
+  }
+  else {
+    end = file->data + file->size;
+    file->pos = file->size;
+  }
+  *line = start;
+  return end - start;
+}
+
+void mapfile_close(struct t_mapfile *file)
+{
+  if (file->data) {
+    munmap(file->data, file->size);
+  }
+  free(file);
+}
+
+/*
+ * Replace the contents of a file with data.
+ */
+int io_write_file(const char *path, const char *data, int len)
+{
+  ssize_t done;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Can't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  while (len > 0) {
+    done = write(fd, data, len);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: Can't write %s: %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    data += done;
+    len -= done;
+  }
+  if (close(fd) < 0) {
+    fprintf(stderr, "Error: Can't write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,824 @@
+/*
+ * Template JIT for x86-64 Linux.
+ *
+ * Hot loops (counted on their backward I_JMP) and hot local functions
+ * (counted on entry) are compiled to machine code by copying a template for
+ * each icode into an mmap'd buffer. Jumps within the region become native
+ * jumps. Every other icode becomes a direct call to its handler, skipping
+ * the dispatch in exec_icode() for op0 icodes. Quickened and fused icodes
+ * keep their fast paths, since their handlers are what gets called.
+ *
+ * Regions belong to the program, not to an exec: the code refers only to
+ * the program's icodes, and gets the exec it runs for as its argument. So
+ * a loop that got hot in one run is already compiled for the next.
+ *
+ * Compiled code keeps exec->current in sync before each call, so handlers
+ * behave exactly as in the interpreter. When a handler moves exec->current
+ * (a taken jump, a call or a return) the code either jumps to the target's
+ * label, or returns to exec_run(), which resumes at exec->current->next.
+ *
+ * CMPJZ, INCR and "x = a + b" (also - and *, on vars and int literals) get
+ * inline code instead: the compare, branch or arithmetic on the intvals,
+ * with no calls and nothing on the VM stack. Variables are looked up once
+ * into slots on the native stack, and forgotten after any handler call,
+ * which may free or shadow them. When an operand is not an int, the target
+ * is frozen, or the result overflows, the template's slow path calls the
+ * handlers as above.
+ *
+ * Environment:
+ *   PARSE1_JIT=0               Disable the JIT
+ *   PARSE1_JIT_THRESHOLD=N     Back-edges or entries before compiling
+ *   PARSE1_JIT_PERFMAP=1       Write /tmp/perf-PID.map for Linux perf
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "exec.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_EXIT  -1
+#define JIT_ERROR -2
+#define JIT_END   -3
+
+/* Icodes covered by an inline PUSH x; PUSH a; PUSH b; op; ASSIGN; POP */
+#define JIT_ARITH_LEN 6
+#define JIT_SLOW_MAX  16
+
+struct t_jit_fixup {
+  int at;
+  int target;
+};
+
+struct t_jit_buf {
+  unsigned char *code;
+  int len;
+  int *labels;
+  struct t_jit_fixup *fixups;
+  int nfixups;
+  char **names;
+  int nslots;
+  int frame;
+  int slow[JIT_SLOW_MAX];
+  int nslow;
+};
+
+static void emit(struct t_jit_buf *buf, const unsigned char *bytes, int len)
+{
+  memcpy(buf->code + buf->len, bytes, len);
+  buf->len += len;
+}
+
+static void emit_u8(struct t_jit_buf *buf, unsigned char b)
+{
+  buf->code[buf->len++] = b;
+}
+
+static void emit_u32(struct t_jit_buf *buf, unsigned int v)
+{
+  memcpy(buf->code + buf->len, &v, 4);
+  buf->len += 4;
+}
+
+static void emit_u64(struct t_jit_buf *buf, unsigned long v)
+{
+  memcpy(buf->code + buf->len, &v, 8);
+  buf->len += 8;
+}
+
+/*
+ * Emit a rel32 operand to be patched to the label of a region index,
+ * or to JIT_EXIT / JIT_ERROR.
+ */
+static void emit_rel32(struct t_jit_buf *buf, int target)
+{
+  buf->fixups[buf->nfixups].at = buf->len;
+  buf->fixups[buf->nfixups].target = target;
+  buf->nfixups++;
+  emit_u32(buf, 0);
+}
+
+/* mov [rbx + current], imm64 (through rax) */
+static void emit_set_current(struct t_jit_buf *buf, struct item *item)
+{
+  emit(buf, (unsigned char []) {0x48, 0xB8}, 2);
+  emit_u64(buf, (unsigned long) item);
+  emit(buf, (unsigned char []) {0x48, 0x89, 0x83}, 3);
+  emit_u32(buf, offsetof(struct t_exec, current));
+}
+
+/* handler(exec, icode); jump to JIT_ERROR on NULL */
+static void emit_call(struct t_jit_buf *buf, void *fn, struct t_icode *icode)
+{
+  emit(buf, (unsigned char []) {0x48, 0x89, 0xDF}, 3);        /* mov rdi, rbx */
+  emit(buf, (unsigned char []) {0x48, 0xBE}, 2);              /* mov rsi, imm64 */
+  emit_u64(buf, (unsigned long) icode);
+  emit(buf, (unsigned char []) {0x48, 0xB8}, 2);              /* mov rax, imm64 */
+  emit_u64(buf, (unsigned long) fn);
+  emit(buf, (unsigned char []) {0xFF, 0xD0}, 2);              /* call rax */
+  emit(buf, (unsigned char []) {0x48, 0x85, 0xC0}, 3);        /* test rax, rax */
+  emit(buf, (unsigned char []) {0x0F, 0x84}, 2);              /* jz error */
+  emit_rel32(buf, JIT_ERROR);
+}
+
+/* Compare exec->current with an item, and jump to target if not equal */
+static void emit_moved(struct t_jit_buf *buf, struct item *item, int equal, int target)
+{
+  emit(buf, (unsigned char []) {0x48, 0x8B, 0x83}, 3);        /* mov rax, [rbx + current] */
+  emit_u32(buf, offsetof(struct t_exec, current));
+  emit(buf, (unsigned char []) {0x48, 0xB9}, 2);              /* mov rcx, imm64 */
+  emit_u64(buf, (unsigned long) item);
+  emit(buf, (unsigned char []) {0x48, 0x39, 0xC8}, 3);        /* cmp rax, rcx */
+  emit(buf, (unsigned char []) {0x0F, equal ? 0x84 : 0x85}, 2);
+  emit_rel32(buf, target);
+}
+
+/*
+ * Emit a rel32 operand to be patched to the slow path of the template
+ * being emitted.
+ */
+static void emit_slow(struct t_jit_buf *buf)
+{
+  assert(buf->nslow < JIT_SLOW_MAX);
+  buf->slow[buf->nslow++] = buf->len;
+  emit_u32(buf, 0);
+}
+
+/* The slow path starts here */
+static void patch_slow(struct t_jit_buf *buf)
+{
+  int i, rel;
+
+  for (i=0; i < buf->nslow; i++) {
+    rel = buf->len - (buf->slow[i] + 4);
+    memcpy(buf->code + buf->slow[i], &rel, 4);
+  }
+  buf->nslow = 0;
+}
+
+/* Index of a variable's slot on the native stack */
+static int var_slot(struct t_jit_buf *buf, char *name)
+{
+  int i;
+
+  for (i=0; i < buf->nslots; i++) {
+    if (strcmp(buf->names[i], name) == 0) return i;
+  }
+  buf->names[buf->nslots] = name;
+  return buf->nslots++;
+}
+
+/* Zero all slots (rep stosq) */
+static void emit_clear(struct t_jit_buf *buf)
+{
+  if (!buf->nslots) return;
+  emit(buf, (unsigned char []) {0x48, 0x89, 0xE7}, 3);        /* mov rdi, rsp */
+  emit(buf, (unsigned char []) {0x31, 0xC0}, 2);              /* xor eax, eax */
+  emit_u8(buf, 0xB9);                                         /* mov ecx, imm32 */
+  emit_u32(buf, buf->nslots);
+  emit(buf, (unsigned char []) {0xF3, 0x48, 0xAB}, 3);        /* rep stosq */
+}
+
+/* add rsp, frame; pop rbx; ret */
+static void emit_return(struct t_jit_buf *buf)
+{
+  if (buf->frame) {
+    emit(buf, (unsigned char []) {0x48, 0x81, 0xC4}, 3);
+    emit_u32(buf, buf->frame);
+  }
+  emit(buf, (unsigned char []) {0x5B, 0xC3}, 2);
+}
+
+/*
+ * Fill a variable's slot with its value, unless it holds one already.
+ * A variable that doesn't exist yet takes the slow path.
+ */
+static void emit_lookup(struct t_jit_buf *buf, char *name)
+{
+  int slot = var_slot(buf, name) * 8;
+  int at;
+
+  emit(buf, (unsigned char []) {0x48, 0x83, 0xBC, 0x24}, 4);  /* cmp qword [rsp + slot], 0 */
+  emit_u32(buf, slot);
+  emit_u8(buf, 0);
+  emit(buf, (unsigned char []) {0x75, 0x00}, 2);              /* jne cached */
+  at = buf->len;
+  emit(buf, (unsigned char []) {0x48, 0x89, 0xDF}, 3);        /* mov rdi, rbx */
+  emit(buf, (unsigned char []) {0x48, 0xBE}, 2);              /* mov rsi, imm64 */
+  emit_u64(buf, (unsigned long) name);
+  emit(buf, (unsigned char []) {0x48, 0xB8}, 2);              /* mov rax, imm64 */
+  emit_u64(buf, (unsigned long) var_lookup);
+  emit(buf, (unsigned char []) {0xFF, 0xD0}, 2);              /* call rax */
+  emit(buf, (unsigned char []) {0x48, 0x85, 0xC0}, 3);        /* test rax, rax */
+  emit(buf, (unsigned char []) {0x0F, 0x84}, 2);              /* jz slow */
+  emit_slow(buf);
+  emit(buf, (unsigned char []) {0x48, 0x8B, 0x80}, 3);        /* mov rax, [rax + value] */
+  emit_u32(buf, offsetof(struct t_var, value));
+  emit(buf, (unsigned char []) {0x48, 0x89, 0x84, 0x24}, 4);  /* mov [rsp + slot], rax */
+  emit_u32(buf, slot);
+  buf->code[at - 1] = buf->len - at;
+}
+
+/*
+ * Load a looked up variable's value into rdx, and take the slow path unless
+ * it is an int, and, to be assigned, not frozen.
+ */
+static void emit_int_var(struct t_jit_buf *buf, char *name, int assign)
+{
+  emit(buf, (unsigned char []) {0x48, 0x8B, 0x94, 0x24}, 4);  /* mov rdx, [rsp + slot] */
+  emit_u32(buf, var_slot(buf, name) * 8);
+  emit(buf, (unsigned char []) {0x83, 0xBA}, 2);              /* cmp dword [rdx + type], VAL_INT */
+  emit_u32(buf, offsetof(struct t_value, type));
+  emit_u8(buf, VAL_INT);
+  emit(buf, (unsigned char []) {0x0F, 0x85}, 2);              /* jne slow */
+  emit_slow(buf);
+  if (assign) {
+    emit(buf, (unsigned char []) {0x83, 0xBA}, 2);            /* cmp dword [rdx + frozen], 0 */
+    emit_u32(buf, offsetof(struct t_value, frozen));
+    emit_u8(buf, 0);
+    emit(buf, (unsigned char []) {0x0F, 0x85}, 2);            /* jne slow */
+    emit_slow(buf);
+  }
+}
+
+/* Load an int operand into rax (reg 0) or rcx (reg 1) */
+static void emit_int(struct t_jit_buf *buf, int reg, struct t_value *operand)
+{
+  if (operand->type == VAL_INT) {
+    emit(buf, (unsigned char []) {0x48, 0xB8 + reg}, 2);      /* mov reg, imm64 */
+    emit_u64(buf, (unsigned long) operand->intval);
+    return;
+  }
+  emit_int_var(buf, operand->name, 0);
+  emit(buf, (unsigned char []) {0x48, 0x8B, 0x82 | reg << 3}, 3); /* mov reg, [rdx + intval] */
+  emit_u32(buf, offsetof(struct t_value, intval));
+}
+
+static void emit_lookup_operand(struct t_jit_buf *buf, struct t_value *operand)
+{
+  if (operand->type == VAL_VAR) {
+    emit_lookup(buf, operand->name);
+  }
+}
+
+/* mov [rdx + intval], rax */
+static void emit_store(struct t_jit_buf *buf)
+{
+  emit(buf, (unsigned char []) {0x48, 0x89, 0x82}, 3);
+  emit_u32(buf, offsetof(struct t_value, intval));
+}
+
+/* PUSH a; PUSH b; <compare>; JZ: jump to target unless the compare holds */
+static void emit_inline_cmpjz(struct t_jit_buf *buf, struct t_icode *icode, int target)
+{
+  unsigned char jcc;
+
+  emit_lookup_operand(buf, icode->parts[0]->operand);
+  emit_lookup_operand(buf, icode->parts[1]->operand);
+  emit_int(buf, 0, icode->parts[0]->operand);
+  emit_int(buf, 1, icode->parts[1]->operand);
+  emit(buf, (unsigned char []) {0x48, 0x39, 0xC8}, 3);        /* cmp rax, rcx */
+  switch (exec_generic_type(icode->parts[2])) {
+  case I_EQ: jcc = 0x85; break;                               /* jne */
+  case I_NE: jcc = 0x84; break;                               /* je */
+  case I_LT: jcc = 0x8D; break;                               /* jge */
+  case I_GT: jcc = 0x8E; break;                               /* jle */
+  case I_LE: jcc = 0x8F; break;                               /* jg */
+  default:   jcc = 0x8C; break;                               /* jl */
+  }
+  emit(buf, (unsigned char []) {0x0F, jcc}, 2);
+  emit_rel32(buf, target);
+}
+
+/* PUSH var:x; PUSH var:x; PUSH n; ADD|SUB; ASSIGN; POP */
+static void emit_inline_incr(struct t_jit_buf *buf, struct t_icode *icode)
+{
+  char *name = icode->parts[0]->operand->name;
+
+  emit_lookup(buf, name);
+  emit_int_var(buf, name, 1);
+  emit(buf, (unsigned char []) {0x48, 0x8B, 0x82}, 3);        /* mov rax, [rdx + intval] */
+  emit_u32(buf, offsetof(struct t_value, intval));
+  emit(buf, (unsigned char []) {0x48, 0xB9}, 2);              /* mov rcx, imm64 */
+  emit_u64(buf, (unsigned long) icode->parts[2]->operand->intval);
+  if (exec_generic_type(icode->parts[3]) == I_SUB) {
+    emit(buf, (unsigned char []) {0x48, 0x29, 0xC8}, 3);      /* sub rax, rcx */
+  }
+  else {
+    emit(buf, (unsigned char []) {0x48, 0x01, 0xC8}, 3);      /* add rax, rcx */
+  }
+  emit(buf, (unsigned char []) {0x0F, 0x80}, 2);              /* jo slow */
+  emit_slow(buf);
+  emit_store(buf);
+}
+
+/* PUSH var:x; PUSH a; PUSH b; ADD|SUB|MUL; ASSIGN; POP */
+static void emit_inline_arith(struct t_jit_buf *buf, struct t_icode **parts)
+{
+  emit_lookup(buf, parts[0]->operand->name);
+  emit_lookup_operand(buf, parts[1]->operand);
+  emit_lookup_operand(buf, parts[2]->operand);
+  emit_int(buf, 0, parts[1]->operand);
+  emit_int(buf, 1, parts[2]->operand);
+  switch (exec_generic_type(parts[3])) {
+  case I_ADD:
+    emit(buf, (unsigned char []) {0x48, 0x01, 0xC8}, 3);      /* add rax, rcx */
+    break;
+  case I_SUB:
+    emit(buf, (unsigned char []) {0x48, 0x29, 0xC8}, 3);      /* sub rax, rcx */
+    break;
+  default:
+    emit(buf, (unsigned char []) {0x48, 0x0F, 0xAF, 0xC1}, 4); /* imul rax, rcx */
+    break;
+  }
+  emit(buf, (unsigned char []) {0x0F, 0x80}, 2);              /* jo slow */
+  emit_slow(buf);
+  emit_int_var(buf, parts[0]->operand->name, 1);
+  emit_store(buf);
+}
+
+static int is_int_push(struct t_icode *icode)
+{
+  return exec_generic_type(icode) == I_PUSH && icode->operand
+    && (icode->operand->type == VAL_VAR || icode->operand->type == VAL_INT);
+}
+
+/*
+ * Static jump target of an icode, relative to the region start.
+ */
+static int jump_target(struct t_icode *icode, int start_addr)
+{
+  int type = icode_type(icode);
+
+  if (type == I_JMP || type == I_JZ) {
+    return icode->addr + icode->operand->intval - start_addr;
+  }
+  if (type == I_CMPJZ) {
+    return icode->addr + icode->parts[3]->operand->intval - start_addr;
+  }
+  return JIT_EXIT;
+}
+
+/*
+ * Number of icodes, starting at region index i, that get an inline
+ * template, or 0. No jump may land inside one, and a CMPJZ must jump
+ * within the region or just past it.
+ */
+static int inline_len(struct item *item, int i, int n, const char *targeted, int start_addr)
+{
+  struct t_icode *parts[JIT_ARITH_LEN];
+  int k, target;
+
+  for (k=0; k < JIT_ARITH_LEN && i + k < n; k++, item = item->next) {
+    parts[k] = (struct t_icode *) item->value;
+  }
+
+  switch (exec_generic_type(parts[0])) {
+  case I_CMPJZ:
+    target = jump_target(parts[0], start_addr);
+    return target >= 0 && target <= n;
+  case I_INCR:
+    return 1;
+  }
+
+  if (k < JIT_ARITH_LEN
+      || !is_int_push(parts[0]) || parts[0]->operand->type != VAL_VAR
+      || !is_int_push(parts[1]) || !is_int_push(parts[2])
+      || exec_generic_type(parts[4]) != I_ASSIGN
+      || exec_generic_type(parts[5]) != I_POP) {
+    return 0;
+  }
+  switch (exec_generic_type(parts[3])) {
+  case I_ADD:
+  case I_SUB:
+  case I_MUL:
+    break;
+  default:
+    return 0;
+  }
+  for (k=1; k < JIT_ARITH_LEN; k++) {
+    if (targeted[i + k]) return 0;
+  }
+  return JIT_ARITH_LEN;
+}
+
+static void perfmap_write(struct t_jit_region *region, int len, const char *name)
+{
+  char path[64];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+  f = fopen(path, "a");
+  if (!f) return;
+  fprintf(f, "%lx %lx %s\n", (unsigned long) region->code, (unsigned long) len, name);
+  fclose(f);
+}
+
+/*
+ * Emit an icode as a call to its handler, or a native jump.
+ */
+static void emit_icode(struct t_jit_buf *buf, struct item *item, struct item *first, int n, int start_addr)
+{
+  struct t_icode *icode = (struct t_icode *) item->value;
+  int type = icode_type(icode);
+  int target;
+
+  target = jump_target(icode, start_addr);
+  if (target < 0 || target >= n) {
+    target = JIT_EXIT;
+  }
+
+  if (type == I_JMP && target != JIT_EXIT) {
+    emit_u8(buf, 0xE9);                                         /* jmp label */
+    emit_rel32(buf, target);
+    return;
+  }
+
+  emit_set_current(buf, item);
+  if (operations[type].opnd_count == 0) {
+    emit_call(buf, operations[type].op0, icode);
+  }
+  else {
+    emit_call(buf, exec_icode, icode);
+  }
+  emit_clear(buf);
+
+  switch (type) {
+  case I_JMP:
+  case I_JZ:
+  case I_CMPJZ:
+    emit_moved(buf, item, 0, target);
+    break;
+  case I_TCALL:
+    /* A tail call back to the region's function stays native */
+    if (first->prev) {
+      emit_moved(buf, first->prev, 1, 0);
+    }
+    emit_moved(buf, item, 0, JIT_EXIT);
+    break;
+  case I_FCALL:
+  case I_CALL1:
+  case I_RET:
+  case I_JST:
+  case I_YIELD:
+    emit_moved(buf, item, 0, JIT_EXIT);
+    break;
+  }
+}
+
+/*
+ * Compile n consecutive icodes, starting at the given item, and publish the
+ * region on the first one. Called with the JIT's lock held.
+ */
+static struct t_jit_region * jit_emit(struct t_jit *jit, struct item *first, int n, const char *name)
+{
+  struct t_jit_buf buf;
+  struct t_jit_region *region = NULL;
+  struct t_icode *icode, *start;
+  struct t_icode *parts[JIT_ARITH_LEN];
+  struct item *item, *cur, *last = NULL;
+  size_t size;
+  unsigned char *code;
+  char *targeted;
+  int *inlined;
+  int i, k, target, end_label, exit_label, error_label, rel;
+
+  start = (struct t_icode *) first->value;
+  size = (n + 1) * JIT_ICODE_MAX_SIZE;
+  code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    perror("jit: mmap");
+    return NULL;
+  }
+
+  memset(&buf, 0, sizeof(buf));
+  buf.code = code;
+  buf.labels = malloc(sizeof(int) * n);
+  buf.fixups = malloc(sizeof(struct t_jit_fixup) * (n * 4 + 1));
+  buf.names = malloc(sizeof(char *) * (n * 3 + 1));
+  targeted = calloc(n + 1, 1);
+  inlined = calloc(n, sizeof(int));
+
+  /* Find the inline templates, and the variables they use */
+  for (i=0, item = first; i < n; i++, item = item->next) {
+    target = jump_target((struct t_icode *) item->value, start->addr);
+    if (target >= 0 && target < n) {
+      targeted[target] = 1;
+    }
+  }
+  for (i=0, item = first; i < n; i++, item = item->next) {
+    inlined[i] = inline_len(item, i, n, targeted, start->addr);
+    for (k=0, cur = item; k < inlined[i]; k++, cur = cur->next) {
+      parts[k] = (struct t_icode *) cur->value;
+    }
+    switch (inlined[i] ? exec_generic_type(parts[0]) : I_NOP) {
+    case I_CMPJZ:
+      if (parts[0]->parts[0]->operand->type == VAL_VAR) var_slot(&buf, parts[0]->parts[0]->operand->name);
+      if (parts[0]->parts[1]->operand->type == VAL_VAR) var_slot(&buf, parts[0]->parts[1]->operand->name);
+      break;
+    case I_INCR:
+      var_slot(&buf, parts[0]->parts[0]->operand->name);
+      break;
+    case I_NOP:
+      break;
+    default:
+      for (k=0; k < 3; k++) {
+        if (parts[k]->operand->type == VAL_VAR) var_slot(&buf, parts[k]->operand->name);
+      }
+      break;
+    }
+    for (k=1; k < inlined[i]; k++) {
+      item = item->next;
+    }
+    i += inlined[i] ? inlined[i] - 1 : 0;
+  }
+  /* Keeps rsp 16-byte aligned for calls, after the push of rbx */
+  buf.frame = (buf.nslots * 8 + 15) & ~15;
+
+  emit_u8(&buf, 0x53);                                          /* push rbx */
+  emit(&buf, (unsigned char []) {0x48, 0x89, 0xFB}, 3);         /* mov rbx, rdi */
+  if (buf.frame) {
+    emit(&buf, (unsigned char []) {0x48, 0x81, 0xEC}, 3);       /* sub rsp, frame */
+    emit_u32(&buf, buf.frame);
+  }
+  emit_clear(&buf);
+
+  for (i=0, item = first; i < n; i++, item = item->next) {
+    assert(item);
+    icode = (struct t_icode *) item->value;
+    buf.labels[i] = buf.len;
+    last = item;
+    if (!inlined[i]) {
+      emit_icode(&buf, item, first, n, start->addr);
+      continue;
+    }
+
+    /* Fast path, then on to the next icode */
+    for (k=0, cur = item; k < inlined[i]; k++, cur = cur->next) {
+      parts[k] = (struct t_icode *) cur->value;
+    }
+    switch (exec_generic_type(icode)) {
+    case I_CMPJZ:
+      target = jump_target(icode, start->addr);
+      emit_inline_cmpjz(&buf, icode, target < n ? target : JIT_END);
+      break;
+    case I_INCR:
+      emit_inline_incr(&buf, icode);
+      break;
+    default:
+      emit_inline_arith(&buf, parts);
+      break;
+    }
+    emit_u8(&buf, 0xE9);                                        /* jmp next */
+    emit_rel32(&buf, i + inlined[i] < n ? i + inlined[i] : JIT_END);
+
+    /* Slow path, through the handlers */
+    patch_slow(&buf);
+    for (k=0; k < inlined[i]; k++) {
+      if (k) {
+        item = item->next;
+        buf.labels[i + k] = buf.len;
+      }
+      emit_icode(&buf, item, first, n, start->addr);
+    }
+    last = item;
+    i += inlined[i] - 1;
+  }
+
+  /* An inline jump past the end: exec->current is the last icode */
+  end_label = buf.len;
+  emit_set_current(&buf, last);
+  /* Falling off the end: the same */
+  exit_label = buf.len;
+  emit(&buf, (unsigned char []) {0x31, 0xC0}, 2);               /* xor eax, eax */
+  emit_return(&buf);
+  error_label = buf.len;
+  emit_u8(&buf, 0xB8);                                          /* mov eax, -1 */
+  emit_u32(&buf, (unsigned int) -1);
+  emit_return(&buf);
+  assert((size_t) buf.len <= size);
+
+  for (i=0; i < buf.nfixups; i++) {
+    target = buf.fixups[i].target;
+    if (target == JIT_EXIT) {
+      target = exit_label;
+    }
+    else if (target == JIT_END) {
+      target = end_label;
+    }
+    else if (target == JIT_ERROR) {
+      target = error_label;
+    }
+    else {
+      target = buf.labels[target];
+    }
+    rel = target - (buf.fixups[i].at + 4);
+    memcpy(code + buf.fixups[i].at, &rel, 4);
+  }
+  free(buf.labels);
+  free(buf.fixups);
+  free(buf.names);
+  free(targeted);
+  free(inlined);
+
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) < 0) {
+    perror("jit: mprotect");
+    munmap(code, size);
+    return NULL;
+  }
+
+  region = malloc(sizeof(struct t_jit_region));
+  region->start = start;
+  region->code = code;
+  region->size = size;
+  region->run = (int (*)(struct t_exec *)) code;
+  list_push(&jit->regions, region);
+  /* Other threads pick it up without the lock, in exec_run() */
+  __atomic_store_n(&start->jit, region, __ATOMIC_RELEASE);
+
+  if (jit->perfmap) {
+    perfmap_write(region, buf.len, name);
+  }
+  DBG(2, "Compiled %s: %d icodes, %d bytes of code", name, n, buf.len);
+
+  return region;
+}
+
+/*
+ * Compile a region, unless an exec running the same program on another
+ * thread already has.
+ */
+static struct t_jit_region * jit_compile(struct t_exec *exec, struct item *first, int n, const char *name)
+{
+  struct t_jit *jit = &exec->program->jit;
+  struct t_jit_region *region = NULL;
+
+  pthread_mutex_lock(&jit->lock);
+  if (!((struct t_icode *) first->value)->jit) {
+    region = jit_emit(jit, first, n, name);
+  }
+  pthread_mutex_unlock(&jit->lock);
+  return region;
+}
+
+int jit_init(struct t_jit *jit)
+{
+  char *env;
+
+  jit->enabled = 1;
+  jit->threshold = JIT_THRESHOLD;
+  jit->perfmap = 0;
+  list_init(&jit->regions);
+  pthread_mutex_init(&jit->lock, NULL);
+
+  if ((env = getenv("PARSE1_JIT")) && strcmp(env, "0") == 0) {
+    jit->enabled = 0;
+  }
+  if ((env = getenv("PARSE1_JIT_THRESHOLD")) && atoi(env) > 0) {
+    jit->threshold = atoi(env);
+  }
+  if ((env = getenv("PARSE1_JIT_PERFMAP")) && strcmp(env, "1") == 0) {
+    jit->perfmap = 1;
+  }
+
+  return 0;
+}
+
+void jit_close(struct t_jit *jit)
+{
+  struct item *item;
+  struct t_jit_region *region;
+
+  item = jit->regions.first;
+  while (item) {
+    region = (struct t_jit_region *) item->value;
+    region->start->jit = NULL;
+    munmap(region->code, region->size);
+    free(region);
+    item = item->next;
+  }
+  list_empty(&jit->regions);
+  list_init(&jit->regions);
+  pthread_mutex_destroy(&jit->lock);
+}
+
+/*
+ * Compile the loop closed by a backward jump.
+ */
+int jit_loop(struct t_exec *exec, struct item *jmp)
+{
+  struct t_icode *icode;
+  struct item *first;
+  char name[64];
+  int n, i;
+
+  icode = (struct t_icode *) jmp->value;
+  n = 1 - icode->operand->intval;
+  first = jmp;
+  for (i=1; i < n; i++) {
+    first = first->prev;
+    assert(first);
+  }
+
+  snprintf(name, sizeof(name), "parse1_loop_addr%d", ((struct t_icode *) first->value)->addr);
+  return jit_compile(exec, first, n, name) ? 0 : -1;
+}
+
+/*
+ * Compile a local function's body, up to and including its final I_RET.
+ */
+int jit_func(struct t_exec *exec, struct t_func *func)
+{
+  char name[MAX_FUNC_NAME + 16];
+
+  assert(func->entry && func->entry->next);
+  snprintf(name, sizeof(name), "parse1_func_%s", func->name);
+  return jit_compile(exec, func->entry->next, func->end + 1 - func->start, name) ? 0 : -1;
+}
+
+/*
+ * Run the region starting at an icode.
+ */
+int jit_run(struct t_exec *exec, struct t_icode *icode)
+{
+  struct t_jit_region *region = __atomic_load_n((struct t_jit_region **) &icode->jit, __ATOMIC_ACQUIRE);
+
+  return region->run(exec);
+}
+
+/*
+ * Free the region starting at an icode, which is about to be freed itself.
+ * No exec may be running it, or still go to it.
+ */
+void jit_drop(struct t_jit *jit, struct t_icode *icode)
+{
+  struct t_jit_region *region;
+  struct item *item;
+
+  pthread_mutex_lock(&jit->lock);
+  for (item = jit->regions.first; item && item->value != icode->jit; item = item->next);
+  if (item) {
+    if (item->prev) {
+      item->prev->next = item->next;
+    }
+    else {
+      jit->regions.first = item->next;
+    }
+    if (item->next) {
+      item->next->prev = item->prev;
+    }
+    else {
+      jit->regions.last = item->prev;
+    }
+    jit->regions.size--;
+    free(item);
+    region = icode->jit;
+    munmap(region->code, region->size);
+    free(region);
+    icode->jit = NULL;
+  }
+  pthread_mutex_unlock(&jit->lock);
+}
+
+#else
+
+int jit_init(struct t_jit *jit)
+{
+  jit->enabled = 0;
+  jit->threshold = JIT_THRESHOLD;
+  jit->perfmap = 0;
+  list_init(&jit->regions);
+  pthread_mutex_init(&jit->lock, NULL);
+  return 0;
+}
+
+void jit_close(struct t_jit *jit)
+{
+  pthread_mutex_destroy(&jit->lock);
+}
+
+int jit_loop(struct t_exec *exec, struct item *jmp)
+{
+  return -1;
+}
+
+int jit_func(struct t_exec *exec, struct t_func *func)
+{
+  return -1;
+}
+
+int jit_run(struct t_exec *exec, struct t_icode *icode)
+{
+  return -1;
+}
+
+void jit_drop(struct t_jit *jit, struct t_icode *icode)
+{
+}
+
+#endif
@@ -0,0 +1,729 @@
+/*
+ * Event loop.
+ *
+ * fd_read() and fd_write() try the fd first, and only wait if it isn't
+ * ready. A wait belongs to the running task, which is then blocked: the
+ * native returns as usual, and exec_invoke_native() switches to another
+ * task once the result is pushed. The loop fills in that result when the
+ * wait ends, and queues the task to run again.
+ *
+ * epoll is level-triggered, with one registration for each fd that a task
+ * waits on, to read, to write or both. The loop is polled when no task is
+ * queued to run, and every so often as tasks yield.
+ *
+ * A send or recv that waits on a channel adds the loop's wake fd to the
+ * channel's waiters. Whichever thread next changes the channel writes to
+ * it, and the loop then tries every channel wait again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "exec.h"
+#include "loop.h"
+#include "chan.h"
+
+void loop_init(struct t_loop *loop)
+{
+  memset(loop, 0, sizeof(struct t_loop));
+  loop->epfd = -1;
+  loop->timerfd = -1;
+  loop->wakefd = -1;
+}
+
+static long long loop_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int loop_add(int epfd, int fd)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Open the epoll, timer and wake fds, for the first wait.
+ */
+static int loop_open(struct t_loop *loop)
+{
+  if (loop->epfd >= 0) {
+    return 0;
+  }
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd >= 0) {
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+  if (loop->timerfd >= 0 && loop->wakefd >= 0
+      && loop_add(loop->epfd, loop->timerfd) == 0 && loop_add(loop->epfd, loop->wakefd) == 0) {
+    return 0;
+  }
+  fprintf(stderr, "Error: Can't start the event loop: %s\n", strerror(errno));
+  if (loop->wakefd >= 0) {
+    close(loop->wakefd);
+  }
+  if (loop->timerfd >= 0) {
+    close(loop->timerfd);
+  }
+  if (loop->epfd >= 0) {
+    close(loop->epfd);
+  }
+  loop_init(loop);
+  return -1;
+}
+
+static struct t_wait * loop_wait(struct t_loop *loop, int type)
+{
+  struct t_wait *wait;
+
+  if (loop_open(loop) < 0) {
+    return NULL;
+  }
+  wait = calloc(1, sizeof(struct t_wait));
+  if (!wait) {
+    fprintf(stderr, "Error: Out of memory in the event loop\n");
+    return NULL;
+  }
+  wait->type = type;
+  wait->fd = -1;
+  wait->next = loop->waits;
+  if (loop->waits) {
+    loop->waits->prev = wait;
+  }
+  loop->waits = wait;
+  loop->waiting++;
+  return wait;
+}
+
+/*
+ * The end of a channel that a send or a recv waits on.
+ */
+static struct t_chan_waiters * loop_waiters(int type, struct t_chan *chan)
+{
+  return type == LOOP_SEND ? &chan->senders : &chan->receivers;
+}
+
+static void loop_unlink(struct t_loop *loop, struct t_wait *wait)
+{
+  if (wait->prev) {
+    wait->prev->next = wait->next;
+  }
+  else {
+    loop->waits = wait->next;
+  }
+  if (wait->next) {
+    wait->next->prev = wait->prev;
+  }
+  loop->waiting--;
+  if (wait->chan) {
+    chan_unwatch(loop_waiters(wait->type, wait->chan), loop->wakefd, wait->gen);
+  }
+  msg_free(&wait->msg);
+  free(wait->data);
+  free(wait);
+}
+
+/*
+ * Block the running task on a wait, with ret for its result.
+ */
+static void loop_block(struct t_exec *exec, struct t_wait *wait, struct t_value *ret)
+{
+  wait->task = exec->tasks.running;
+  wait->ret = ret;
+  exec->tasks.blocked = 1;
+}
+
+/*
+ * End a wait, and queue its task. A task whose wait failed fails when it
+ * is switched to.
+ */
+static void loop_finish(struct t_exec *exec, struct t_wait *wait, int failed)
+{
+  if (wait->task) {
+    wait->task->failed = failed;
+    task_wake(exec, wait->task);
+  }
+  loop_unlink(&exec->loop, wait);
+}
+
+/*
+ * The waits on fd, growing the table to hold it.
+ */
+static struct t_fdwaits * loop_slot(struct t_loop *loop, int fd)
+{
+  struct t_fdwaits *fds;
+  int n;
+
+  if (fd >= loop->nfds) {
+    n = loop->nfds ? loop->nfds : 64;
+    while (n <= fd) {
+      n *= 2;
+    }
+    fds = realloc(loop->fds, sizeof(struct t_fdwaits) * n);
+    if (!fds) {
+      fprintf(stderr, "Error: Out of memory in the event loop\n");
+      return NULL;
+    }
+    memset(fds + loop->nfds, 0, sizeof(struct t_fdwaits) * (n - loop->nfds));
+    loop->fds = fds;
+    loop->nfds = n;
+  }
+  return &loop->fds[fd];
+}
+
+/*
+ * Register fd with epoll for the waits it has now.
+ */
+static int loop_watch(struct t_loop *loop, int fd)
+{
+  struct t_fdwaits *slot = &loop->fds[fd];
+  struct epoll_event ev;
+  int events, op;
+
+  events = (slot->reader ? EPOLLIN : 0) | (slot->writer ? EPOLLOUT : 0);
+  if (events == slot->events) {
+    return 0;
+  }
+  op = !slot->events ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  ev.events = events;
+  ev.data.fd = fd;
+  slot->events = events;
+  if (epoll_ctl(loop->epfd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+    fprintf(stderr, "Error: Can't wait on fd %d: %s\n", fd, strerror(errno));
+    slot->events = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Read up to n bytes into ret. Returns 1 if it did, 0 if there is nothing
+ * to read yet, or -1 on error. ret is "" at the end of the file.
+ */
+static int loop_try_read(int fd, int n, struct t_value *ret)
+{
+  ssize_t got;
+  char *str;
+
+  ret->type = VAL_STRING;
+  str = value_alloc_str(ret, n);
+  if (!str) {
+    fprintf(stderr, "Error: Out of memory in fd_read()\n");
+    return -1;
+  }
+  do {
+    got = read(fd, str, n);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    value_alloc_str(ret, 0);
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    fprintf(stderr, "Error: fd_read(%d): %s\n", fd, strerror(errno));
+    return -1;
+  }
+  ret->len = got;
+  str[got] = '\0';
+  return 1;
+}
+
+/*
+ * Write from data + *done to data + len, adding to *done. Returns 1 once
+ * all of it is written, 0 if fd can't take more yet, or -1 on error.
+ * Sockets are written with send(), so a closed peer is an error rather
+ * than a SIGPIPE.
+ */
+static int loop_try_write(int fd, const char *data, int len, int *done)
+{
+  ssize_t put;
+
+  while (*done < len) {
+    put = send(fd, data + *done, len - *done, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (put < 0 && errno == ENOTSOCK) {
+      put = write(fd, data + *done, len - *done);
+    }
+    if (put < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      fprintf(stderr, "Error: fd_write(%d): %s\n", fd, strerror(errno));
+      return -1;
+    }
+    *done += put;
+  }
+  return 1;
+}
+
+/*
+ * Set the timer for the earliest deadline, or clear it if there are none.
+ */
+static int loop_arm(struct t_loop *loop)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (loop->nheap) {
+    its.it_value.tv_sec = loop->heap[0]->deadline / 1000000000LL;
+    its.it_value.tv_nsec = loop->heap[0]->deadline % 1000000000LL;
+  }
+  if (timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    fprintf(stderr, "Error: Can't set the timer: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Take the wait with the earliest deadline off the heap.
+ */
+static struct t_wait * loop_unschedule(struct t_loop *loop)
+{
+  struct t_wait *top = loop->heap[0];
+  struct t_wait *last = loop->heap[--loop->nheap];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < loop->nheap) {
+    if (child + 1 < loop->nheap && loop->heap[child + 1]->deadline < loop->heap[child]->deadline) {
+      child++;
+    }
+    if (last->deadline <= loop->heap[child]->deadline) {
+      break;
+    }
+    loop->heap[i] = loop->heap[child];
+    i = child;
+  }
+  loop->heap[i] = last;
+  return top;
+}
+
+/*
+ * Add a wait to the heap of deadlines.
+ */
+static int loop_schedule(struct t_loop *loop, struct t_wait *wait)
+{
+  struct t_wait **heap;
+  int i, parent;
+
+  if (loop->nheap == loop->capheap) {
+    heap = realloc(loop->heap, sizeof(struct t_wait *) * (loop->capheap ? loop->capheap * 2 : 64));
+    if (!heap) {
+      fprintf(stderr, "Error: Out of memory in the event loop\n");
+      return -1;
+    }
+    loop->heap = heap;
+    loop->capheap = loop->capheap ? loop->capheap * 2 : 64;
+  }
+  for (i = loop->nheap++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (loop->heap[parent]->deadline <= wait->deadline) {
+      break;
+    }
+    loop->heap[i] = loop->heap[parent];
+  }
+  loop->heap[i] = wait;
+  if (i == 0 && loop_arm(loop) < 0) {
+    loop_unschedule(loop);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * fd_read(fd, n): read up to n bytes, waiting for them if there are none
+ * yet.
+ */
+int loop_read(struct t_exec *exec, int fd, int n, struct t_value *ret)
+{
+  struct t_loop *loop = &exec->loop;
+  struct t_fdwaits *slot;
+  struct t_wait *wait;
+  int rc;
+
+  rc = loop_try_read(fd, n, ret);
+  if (rc != 0) {
+    return rc < 0 ? -1 : 0;
+  }
+  slot = loop_slot(loop, fd);
+  if (!slot) {
+    return -1;
+  }
+  if (slot->reader) {
+    fprintf(stderr, "Error: Another task is reading fd %d.\n", fd);
+    return -1;
+  }
+  wait = loop_wait(loop, LOOP_READ);
+  if (!wait) {
+    return -1;
+  }
+  wait->fd = fd;
+  wait->len = n;
+  slot->reader = wait;
+  if (loop_watch(loop, fd) < 0) {
+    slot->reader = NULL;
+    loop_unlink(loop, wait);
+    return -1;
+  }
+  loop_block(exec, wait, ret);
+  return 0;
+}
+
+/*
+ * fd_write(fd, s): write all of s, waiting as needed for fd to take it.
+ * What is left to write after the first try is copied, as the string may
+ * change while the task waits.
+ */
+int loop_write(struct t_exec *exec, int fd, const char *data, int len, struct t_value *ret)
+{
+  struct t_loop *loop = &exec->loop;
+  struct t_fdwaits *slot;
+  struct t_wait *wait;
+  int done = 0;
+  int rc;
+
+  ret->type = VAL_INT;
+  ret->intval = len;
+  rc = loop_try_write(fd, data, len, &done);
+  if (rc != 0) {
+    return rc < 0 ? -1 : 0;
+  }
+  slot = loop_slot(loop, fd);
+  if (!slot) {
+    return -1;
+  }
+  if (slot->writer) {
+    fprintf(stderr, "Error: Another task is writing fd %d.\n", fd);
+    return -1;
+  }
+  wait = loop_wait(loop, LOOP_WRITE);
+  if (!wait) {
+    return -1;
+  }
+  wait->fd = fd;
+  wait->len = len - done;
+  wait->data = malloc(wait->len);
+  if (!wait->data) {
+    fprintf(stderr, "Error: Out of memory in fd_write()\n");
+    loop_unlink(loop, wait);
+    return -1;
+  }
+  memcpy(wait->data, data + done, wait->len);
+  slot->writer = wait;
+  if (loop_watch(loop, fd) < 0) {
+    slot->writer = NULL;
+    loop_unlink(loop, wait);
+    return -1;
+  }
+  loop_block(exec, wait, ret);
+  return 0;
+}
+
+/*
+ * sleep(ms): block the running task for ms milliseconds.
+ */
+int loop_sleep(struct t_exec *exec, long long ms, struct t_value *ret)
+{
+  struct t_wait *wait;
+
+  wait = loop_wait(&exec->loop, LOOP_SLEEP);
+  if (!wait) {
+    return -1;
+  }
+  wait->deadline = loop_now() + ms * 1000000;
+  if (loop_schedule(&exec->loop, wait) < 0) {
+    loop_unlink(&exec->loop, wait);
+    return -1;
+  }
+  loop_block(exec, wait, ret);
+  return 0;
+}
+
+/*
+ * timer(ms, f): spawn a task that calls f() in ms milliseconds.
+ */
+int loop_timer(struct t_exec *exec, long long ms, struct t_func *func)
+{
+  struct t_wait *wait;
+
+  wait = loop_wait(&exec->loop, LOOP_TIMER);
+  if (!wait) {
+    return -1;
+  }
+  wait->deadline = loop_now() + ms * 1000000;
+  wait->func = func;
+  if (loop_schedule(&exec->loop, wait) < 0) {
+    loop_unlink(&exec->loop, wait);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Try a channel wait's send or recv again. Returns 1 once it is done, 0
+ * if it still has to wait, or -1 on error.
+ */
+static int loop_try_chan(struct t_wait *wait)
+{
+  if (wait->type == LOOP_SEND) {
+    return chan_try_send(wait->chan, &wait->msg);
+  }
+  return chan_try_recv(wait->chan, &wait->msg, wait->ret);
+}
+
+/*
+ * send() or recv() on a channel that is full or empty: the task waits for
+ * it to change. msg, the message to send or the value to receive once the
+ * channel is closed, is taken over. The channel is
+ * tried once more after the wake fd is added to its waiters, as it may
+ * have changed before, with no one to tell.
+ */
+int loop_chan(struct t_exec *exec, int type, struct t_chan *chan, struct t_msg *msg, struct t_value *ret)
+{
+  struct t_loop *loop = &exec->loop;
+  struct t_wait *wait;
+  int rc;
+
+  wait = loop_wait(loop, type);
+  if (!wait) {
+    msg_free(msg);
+    return -1;
+  }
+  wait->msg = *msg;
+  msg->type = VAL_NULL;
+  msg->sbuf = NULL;
+  msg->array = NULL;
+  wait->ret = ret;
+  if (chan_watch(loop_waiters(type, chan), loop->wakefd, &wait->gen) < 0) {
+    loop_unlink(loop, wait);
+    return -1;
+  }
+  wait->chan = chan;
+  rc = loop_try_chan(wait);
+  if (rc != 0) {
+    loop_unlink(loop, wait);
+    return rc < 0 ? -1 : 0;
+  }
+  loop_block(exec, wait, ret);
+  return 0;
+}
+
+/*
+ * A channel changed: go on with the sends and recvs that wait. Those that
+ * still can't, and whose fd was dropped, add it again, and try once more.
+ */
+static int loop_wake(struct t_exec *exec)
+{
+  struct t_loop *loop = &exec->loop;
+  struct t_wait *wait, *next;
+  uint64_t count;
+  int rc;
+
+  if (read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    fprintf(stderr, "Error: Can't read the wake fd: %s\n", strerror(errno));
+    return -1;
+  }
+  if (__atomic_load_n(&exec->chans.failed, __ATOMIC_ACQUIRE)) {
+    fprintf(stderr, "Error: Thread %d failed.\n", exec->chans.failed);
+    return -1;
+  }
+  for (wait = loop->waits; wait; wait = next) {
+    next = wait->next;
+    if (wait->chan) {
+      rc = loop_try_chan(wait);
+      if (rc == 0 && !chan_watched(loop_waiters(wait->type, wait->chan), wait->gen)) {
+        rc = chan_watch(loop_waiters(wait->type, wait->chan), loop->wakefd, &wait->gen);
+        if (rc == 0) {
+          rc = loop_try_chan(wait);
+        }
+      }
+      if (rc != 0) {
+        loop_finish(exec, wait, rc < 0);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * An fd is ready: go on with the reads and writes that wait on it.
+ */
+static int loop_ready(struct t_exec *exec, int fd, int events)
+{
+  struct t_fdwaits *slot = &exec->loop.fds[fd];
+  struct t_wait *wait;
+  int rc;
+
+  wait = slot->reader;
+  if (wait && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+    rc = loop_try_read(fd, wait->len, wait->ret);
+    if (rc != 0) {
+      slot->reader = NULL;
+      loop_finish(exec, wait, rc < 0);
+    }
+  }
+  wait = slot->writer;
+  if (wait && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+    rc = loop_try_write(fd, wait->data, wait->len, &wait->done);
+    if (rc != 0) {
+      slot->writer = NULL;
+      loop_finish(exec, wait, rc < 0);
+    }
+  }
+  return loop_watch(&exec->loop, fd);
+}
+
+/*
+ * The timer went off: end the waits that are due.
+ */
+static int loop_expire(struct t_exec *exec)
+{
+  struct t_loop *loop = &exec->loop;
+  struct t_wait *wait;
+  uint64_t count;
+  long long now;
+
+  if (read(loop->timerfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    fprintf(stderr, "Error: Can't read the timer: %s\n", strerror(errno));
+    return -1;
+  }
+  now = loop_now();
+  while (loop->nheap && loop->heap[0]->deadline <= now) {
+    wait = loop_unschedule(loop);
+    if (wait->func && task_spawn(exec, wait->func, 0) < 0) {
+      loop_unlink(loop, wait);
+      return -1;
+    }
+    loop_finish(exec, wait, 0);
+  }
+  return loop_arm(loop);
+}
+
+/*
+ * Queue the tasks whose waits have ended, first waiting for one to end if
+ * block is set.
+ */
+int loop_poll(struct t_exec *exec, int block)
+{
+  struct t_loop *loop = &exec->loop;
+  struct epoll_event events[LOOP_EVENTS];
+  int i, n, rc = 0;
+
+  n = epoll_wait(loop->epfd, events, LOOP_EVENTS, block ? -1 : 0);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    fprintf(stderr, "Error: Can't poll the event loop: %s\n", strerror(errno));
+    return -1;
+  }
+  for (i=0; i < n && rc == 0; i++) {
+    if (events[i].data.fd == loop->timerfd) {
+      rc = loop_expire(exec);
+    }
+    else if (events[i].data.fd == loop->wakefd) {
+      rc = loop_wake(exec);
+    }
+    else {
+      rc = loop_ready(exec, events[i].data.fd, events[i].events);
+    }
+  }
+  return rc;
+}
+
+/*
+ * Whether a task waits on fd, which can't be closed until it is done.
+ */
+int loop_busy(struct t_loop *loop, int fd)
+{
+  return fd < loop->nfds && (loop->fds[fd].reader || loop->fds[fd].writer);
+}
+
+/*
+ * The loop's wake fd, for another thread to wake it with.
+ */
+int loop_wakefd(struct t_loop *loop)
+{
+  return loop_open(loop) < 0 ? -1 : loop->wakefd;
+}
+
+/*
+ * A pipe, or a pair of connected sockets, whose ends don't block.
+ */
+int loop_pipe(int fds[2], int sockets)
+{
+  int i;
+
+  if (sockets) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+      fprintf(stderr, "Error: socketpair(): %s\n", strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+  if (pipe(fds) < 0) {
+    fprintf(stderr, "Error: pipe(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (i=0; i < 2; i++) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  return 0;
+}
+
+/*
+ * Drop every wait, after an error or to run the program again. Blocked
+ * tasks other than the main and the running one are queued, for
+ * task_reset() to drop.
+ */
+void loop_reset(struct t_exec *exec)
+{
+  struct t_loop *loop = &exec->loop;
+  struct t_wait *wait;
+
+  if (!loop->waiting) {
+    return;
+  }
+  while ((wait = loop->waits)) {
+    if (wait->task && wait->task != &exec->tasks.main && wait->task != exec->tasks.running) {
+      task_wake(exec, wait->task);
+    }
+    if (wait->fd >= 0) {
+      loop->fds[wait->fd].reader = NULL;
+      loop->fds[wait->fd].writer = NULL;
+      loop_watch(loop, wait->fd);
+    }
+    loop_unlink(loop, wait);
+  }
+  loop->nheap = 0;
+  loop_arm(loop);
+}
+
+void loop_close(struct t_loop *loop)
+{
+  if (loop->epfd >= 0) {
+    close(loop->wakefd);
+    close(loop->timerfd);
+    close(loop->epfd);
+  }
+  free(loop->fds);
+  free(loop->heap);
+  loop_init(loop);
+}
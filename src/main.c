@@ -3,12 +3,35 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "exec.h"
 #include "util.h"
 #include "corelib.h"
+#include "batch.h"
+#include "pipeline.h"
+#include "server.h"
+#include "shard.h"
 
+/*
+ * With no options, run the script on stdin. The exit status is 1 if it
+ * fails, as with -p.
+ */
 int main(int argc, char* argv[]) {
   struct t_exec exec;
+  int rc = 1;
+
+  if (argc == 2 && strcmp(argv[1], "-p") == 0) {
+    return pipeline_main(stdin);
+  }
+  if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+    return server_main(argc, argv);
+  }
+  if (argc > 1 && (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "-r") == 0)) {
+    return shard_main(argc, argv);
+  }
+  if (argc > 1) {
+    return batch_main(argc, argv);
+  }
   
   do {
     if (exec_init(&exec, stdin) < 0) {
@@ -17,15 +40,16 @@ int main(int argc, char* argv[]) {
     }
     core_apply(&exec);
     
-    exec.parser.max_output = 100;
+    exec.program->parser.max_output = 100;
   
     if (exec_statements(&exec) < 0) {
       break;
     }
+    rc = 0;
     
   } while (0);
   
   exec_close(&exec);
 
-  return 0;
+  return rc;
 }
@@ -0,0 +1,435 @@
+/*
+ * Map values.
+ *
+ * Robin Hood hashing: an entry being inserted takes the slot of any entry
+ * that is closer to its home slot, and moves on with that one instead. This
+ * keeps probe lengths short and even, so the table can be filled to 7/8
+ * before it grows, and a lookup can stop as soon as it reaches a slot that
+ * is closer to home than the key would be. Deleting shifts the following
+ * entries back, so there are no tombstones.
+ *
+ * String keys hash with the string table's hash, which interned strings
+ * carry precomputed and other strings cache in the value. Int keys go
+ * through a 64-bit mixer, so consecutive ints spread over the table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parser.h"
+#include "map.h"
+
+#define MAP_MAX_DEPTH 4
+
+/*
+ * A map with room for count entries before it grows.
+ */
+struct t_map * map_new(int count)
+{
+  struct t_map *map;
+  int cap = MAP_MIN_CAP;
+
+  while (cap / 8 * 7 < count) {
+    cap *= 2;
+  }
+  map = malloc(sizeof(struct t_map));
+  if (!map) {
+    return NULL;
+  }
+  map->refs = 1;
+  map->frozen = 0;
+  map->count = 0;
+  map->mask = cap - 1;
+  map->slots = calloc(cap, sizeof(struct t_map_slot));
+  map->values = calloc(cap, sizeof(struct t_value));
+  if (!map->slots || !map->values) {
+    free(map->slots);
+    free(map->values);
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+struct t_map * map_ref(struct t_map *map)
+{
+  if (!map->frozen) {
+    map->refs++;
+  }
+  return map;
+}
+
+static void map_free_slot(struct t_map_slot *slot, struct t_value *value)
+{
+  if (slot->key) {
+    value_free(slot->key);
+  }
+  value_close(value);
+}
+
+/*
+ * Move a value to another place in the table. A short string is kept
+ * inline in the value, which has to point at its new copy.
+ */
+static void map_move_value(struct t_value *to, struct t_value *from)
+{
+  *to = *from;
+  if (from->stringval == from->inl) {
+    to->stringval = to->inl;
+  }
+}
+
+/*
+ * The key of a slot. Int keys are only kept in the slot, so they are made
+ * into a value in num.
+ */
+static struct t_value * map_slot_key(struct t_map_slot *slot, struct t_value *num)
+{
+  if (slot->key) {
+    return slot->key;
+  }
+  value_init(num, VAL_INT);
+  num->intval = slot->k.i;
+  return num;
+}
+
+void map_release(struct t_map *map)
+{
+  int i;
+
+  if (map->frozen || --map->refs > 0) {
+    return;
+  }
+  for (i=0; i <= map->mask; i++) {
+    if (map->slots[i].dist) {
+      map_free_slot(&map->slots[i], &map->values[i]);
+    }
+  }
+  free(map->slots);
+  free(map->values);
+  free(map);
+}
+
+/*
+ * Freeze or thaw the map, its keys and its values, as value_freeze() does.
+ * A map that holds itself is visited once.
+ */
+void map_freeze(struct t_map *map, int frozen)
+{
+  int i;
+
+  if (map->frozen == frozen) {
+    return;
+  }
+  map->frozen = frozen;
+  for (i=0; i <= map->mask; i++) {
+    if (map->slots[i].dist) {
+      if (map->slots[i].key) {
+        value_freeze(map->slots[i].key, frozen);
+      }
+      value_freeze(&map->values[i], frozen);
+    }
+  }
+}
+
+static int map_frozen(struct t_map *map)
+{
+  if (map->frozen) {
+    fprintf(stderr, "Error: Can't change a frozen map, which is shared\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * The finalizer of MurmurHash3's 64-bit hash.
+ */
+static unsigned int map_int_hash(long long n)
+{
+  unsigned long long x = (unsigned long long) n;
+
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (unsigned int) x;
+}
+
+/*
+ * Hash of a key. Only strings and ints can be keys.
+ */
+int map_hash(struct t_value *key, unsigned int *hash)
+{
+  if (key->type == VAL_STRING) {
+    *hash = value_str_hash(key);
+  }
+  else if (key->type == VAL_INT) {
+    *hash = map_int_hash(key->intval);
+  }
+  else {
+    fprintf(stderr, "Error: Map keys must be strings or ints, got %s\n", value_types[key->type]);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Index of the key's slot, or -1.
+ */
+static int map_find(struct t_map *map, struct t_value *key, unsigned int hash)
+{
+  struct t_map_slot *slot;
+  int i = hash & map->mask;
+  int dist = 1;
+
+  while (1) {
+    slot = &map->slots[i];
+    if (slot->dist < dist) {
+      return -1;
+    }
+    if (slot->hash == hash && slot->type == key->type) {
+      if (key->type == VAL_INT ? slot->k.i == key->intval : slot->k.s == key->stringval || value_str_eq(slot->key, key)) {
+        return i;
+      }
+    }
+    i = (i + 1) & map->mask;
+    dist++;
+  }
+}
+
+/*
+ * Place an entry whose key is not in the map yet, moving its value into
+ * the table. It goes in the first slot that is closer to its home than the
+ * entry would be, and the entries from there up to the next empty slot
+ * move along by one, which is what swapping it down the run would do, with
+ * each entry moved once.
+ */
+static void map_place(struct t_map *map, struct t_map_slot *entry, struct t_value *value)
+{
+  int i = entry->hash & map->mask;
+  int j, prev;
+
+  entry->dist = 1;
+  while (map->slots[i].dist >= entry->dist) {
+    i = (i + 1) & map->mask;
+    entry->dist++;
+  }
+  for (j = i; map->slots[j].dist; j = (j + 1) & map->mask);
+  while (j != i) {
+    prev = (j - 1) & map->mask;
+    map->slots[j] = map->slots[prev];
+    map->slots[j].dist++;
+    map_move_value(&map->values[j], &map->values[prev]);
+    j = prev;
+  }
+  map->slots[i] = *entry;
+  map_move_value(&map->values[i], value);
+}
+
+static int map_grow(struct t_map *map)
+{
+  struct t_map_slot *old = map->slots;
+  struct t_value *values = map->values;
+  int cap = map->mask + 1;
+  int i;
+
+  map->slots = calloc(cap * 2, sizeof(struct t_map_slot));
+  map->values = calloc(cap * 2, sizeof(struct t_value));
+  if (!map->slots || !map->values) {
+    free(map->slots);
+    free(map->values);
+    map->slots = old;
+    map->values = values;
+    return -1;
+  }
+  map->mask = cap * 2 - 1;
+  for (i=0; i < cap; i++) {
+    if (old[i].dist) {
+      map_place(map, &old[i], &values[i]);
+    }
+  }
+  free(old);
+  free(values);
+  return 0;
+}
+
+/*
+ * Look up a key. Returns 1 and sets *value if it is there, 0 if not, and
+ * -1 if it can't be a key. *value points into the table, so it is only
+ * good until the map changes.
+ */
+int map_get(struct t_map *map, struct t_value *key, struct t_value **value)
+{
+  unsigned int hash;
+  int i;
+
+  if (map_hash(key, &hash) < 0) {
+    return -1;
+  }
+  i = map_find(map, key, hash);
+  if (i < 0) {
+    return 0;
+  }
+  *value = &map->values[i];
+  return 1;
+}
+
+/*
+ * Set a key to a copy of value. Strings are shared, and arrays and maps
+ * held by reference, as in assignment.
+ */
+int map_set(struct t_map *map, struct t_value *key, struct t_value *value)
+{
+  struct t_map_slot entry;
+  struct t_value copy;
+  unsigned int hash;
+  int i;
+
+  if (map_frozen(map) < 0 || map_hash(key, &hash) < 0) {
+    return -1;
+  }
+  i = map_find(map, key, hash);
+  if (i >= 0) {
+    return value_copy(&map->values[i], value);
+  }
+
+  if ((map->count + 1) * 8 > (map->mask + 1) * 7 && map_grow(map) < 0) {
+    return -1;
+  }
+  entry.hash = hash;
+  entry.type = key->type;
+  entry.key = NULL;
+  entry.k.i = key->intval;
+  value_init(&copy, VAL_NULL);
+  if (value_copy(&copy, value) < 0) {
+    value_close(&copy);
+    return -1;
+  }
+  if (key->type == VAL_STRING) {
+    entry.key = create_value(VAL_STRING);
+    if (value_copy_str(entry.key, key) < 0) {
+      map_free_slot(&entry, &copy);
+      return -1;
+    }
+    entry.k.s = entry.key->stringval;
+  }
+  map_place(map, &entry, &copy);
+  map->count++;
+  return 0;
+}
+
+/*
+ * Remove a key. Returns 1 if it was there, 0 if not, and -1 if it can't be
+ * a key. The entries after it that are away from home move back one slot.
+ */
+int map_delete(struct t_map *map, struct t_value *key)
+{
+  unsigned int hash;
+  int i, next;
+
+  if (map_frozen(map) < 0 || map_hash(key, &hash) < 0) {
+    return -1;
+  }
+  i = map_find(map, key, hash);
+  if (i < 0) {
+    return 0;
+  }
+  map_free_slot(&map->slots[i], &map->values[i]);
+  next = (i + 1) & map->mask;
+  while (map->slots[next].dist > 1) {
+    map->slots[i] = map->slots[next];
+    map->slots[i].dist--;
+    map_move_value(&map->values[i], &map->values[next]);
+    i = next;
+    next = (i + 1) & map->mask;
+  }
+  memset(&map->slots[i], 0, sizeof(struct t_map_slot));
+  memset(&map->values[i], 0, sizeof(struct t_value));
+  map->count--;
+  return 1;
+}
+
+/*
+ * The keys, in table order, as an array: of ints or of strings, or a mixed
+ * array if the map has keys of both kinds.
+ */
+struct t_array * map_keys(struct t_map *map)
+{
+  struct t_array *array;
+  struct t_value num;
+  int strs = 0;
+  int i;
+
+  for (i=0; i <= map->mask; i++) {
+    if (map->slots[i].dist && map->slots[i].key) {
+      strs++;
+    }
+  }
+  array = array_new(strs == 0 ? VAL_INT : strs == map->count ? VAL_STRING : ARRAY_MIXED, 0);
+  if (!array) {
+    return NULL;
+  }
+  for (i=0; i <= map->mask; i++) {
+    if (map->slots[i].dist && array_push(array, map_slot_key(&map->slots[i], &num)) < 0) {
+      array_release(array);
+      return NULL;
+    }
+  }
+  return array;
+}
+
+int map_format_key(struct t_value *key, char *buf, int size)
+{
+  if (key->type == VAL_STRING) {
+    return snprintf(buf, size, "\"%s\"", key->stringval);
+  }
+  return value_format_num(key, buf, size);
+}
+
+/*
+ * Append as {"a": 1, 2: "b"}, growing fb as needed. Maps nested deeper
+ * than MAP_MAX_DEPTH, which includes a map that holds itself, are shown
+ * as {...}. Returns -1 if fb can't grow.
+ */
+static int map_format_depth(struct t_map *map, struct t_fmtbuf *fb, int depth)
+{
+  struct t_value num, *value;
+  int first = 1;
+  int rc, i;
+
+  if (depth > MAP_MAX_DEPTH) {
+    return fmtbuf_add(fb, "{...}", 5);
+  }
+  rc = fmtbuf_add(fb, "{", 1);
+  for (i=0; i <= map->mask && rc == 0; i++) {
+    if (!map->slots[i].dist) {
+      continue;
+    }
+    if (!first && fmtbuf_add(fb, ", ", 2) < 0) {
+      return -1;
+    }
+    first = 0;
+    if (array_format_elem(map_slot_key(&map->slots[i], &num), fb) < 0 || fmtbuf_add(fb, ": ", 2) < 0) {
+      return -1;
+    }
+    value = &map->values[i];
+    if (value->type == VAL_ARRAY) {
+      rc = array_format(value->array, fb);
+    }
+    else if (value->type == VAL_MAP) {
+      rc = map_format_depth(value->map, fb, depth + 1);
+    }
+    else {
+      rc = array_format_elem(value, fb);
+    }
+  }
+  if (rc < 0) {
+    return -1;
+  }
+  return fmtbuf_add(fb, "}", 1);
+}
+
+int map_format(struct t_map *map, struct t_fmtbuf *fb)
+{
+  return map_format_depth(map, fb, 0);
+}
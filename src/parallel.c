@@ -0,0 +1,199 @@
+/*
+ * parallel_for(lo, hi, "f") calls f(i) for each i from lo up to hi, on
+ * threads, and returns the sum of the numbers that the calls return.
+ *
+ * The range is split into up to PARALLEL_MAX_CHUNKS chunks, which run on a
+ * work-stealing pool that every exec shares, with one worker per CPU or
+ * PARSE1_THREADS of them. Each chunk runs in an exec of its own on the
+ * caller's program, and adds its calls' results into an accumulator of its
+ * own. The chunks' sums are added and their output printed in range order,
+ * so neither depends on how the chunks were scheduled.
+ *
+ * The chunks can read the caller's globals, which are frozen while they
+ * run, along with the strings, arrays and maps in them. Assigning a global
+ * or changing an array or map that one holds is an error, not a race.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "parallel.h"
+#include "pool.h"
+
+static struct t_pool parallel_pool;
+static int parallel_pool_rc;
+static pthread_once_t parallel_pool_once = PTHREAD_ONCE_INIT;
+
+static void parallel_pool_init(void)
+{
+  char *env = getenv("PARSE1_THREADS");
+
+  parallel_pool_rc = pool_init(&parallel_pool, env ? atoi(env) : 0);
+}
+
+/*
+ * Add a call's result to a sum. A call that returns null adds nothing.
+ */
+static int parallel_add(struct t_value *sum, struct t_value *value, const char *name)
+{
+  if (value->type == VAL_NULL) {
+    return 0;
+  }
+  if (!value_is_num(value)) {
+    fprintf(stderr, "Error: parallel_for() needs %s() to return a number, got %s.\n", name, value_types[value->type]);
+    return -1;
+  }
+  if (sum->type == VAL_INT && value->type == VAL_INT) {
+    if (__builtin_add_overflow(sum->intval, value->intval, &sum->intval)) {
+      fprintf(stderr, "Error: Integer overflow in parallel_for()\n");
+      return -1;
+    }
+    return 0;
+  }
+  sum->floatval = value_num(sum) + value_num(value);
+  sum->type = VAL_FLOAT;
+  return 0;
+}
+
+static void parallel_chunk(void *arg, int worker)
+{
+  struct t_parallel_chunk *chunk = arg;
+  struct t_parallel *par = chunk->par;
+  struct t_exec exec;
+  struct t_value index;
+  struct t_value *argv[1];
+  struct t_value *result;
+  long long i;
+  int mark;
+
+  /* Once a chunk fails, those not started yet are skipped */
+  chunk->status = -1;
+  if (!__atomic_load_n(&par->failed, __ATOMIC_RELAXED)) {
+    /* The chunk reads the caller's globals */
+    if (exec_init_worker(&exec, par->exec) == 0) {
+      exec.globals = &par->exec->vars;
+      value_init(&index, VAL_INT);
+      argv[0] = &index;
+      chunk->status = 0;
+      for (i = chunk->lo; i < chunk->hi && chunk->status == 0; i++) {
+        index.intval = i;
+        mark = exec.values.size;
+        result = exec_call(&exec, par->func, 1, argv);
+        if (!result || parallel_add(&chunk->sum, result, par->func->name) < 0) {
+          chunk->status = -1;
+        }
+        exec_reclaim(&exec, mark);
+      }
+      chunk->out = output_take(&exec.out, &chunk->outlen);
+    }
+    exec_close(&exec);
+  }
+  if (chunk->status < 0) {
+    __atomic_store_n(&par->failed, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&par->lock);
+  if (--par->remaining == 0) {
+    pthread_cond_signal(&par->done);
+  }
+  pthread_mutex_unlock(&par->lock);
+}
+
+static void parallel_freeze(struct t_exec *exec, int frozen)
+{
+  struct item *item;
+
+  for (item = exec->vars.first; item; item = item->next) {
+    value_freeze(((struct t_var *) item->value)->value, frozen);
+  }
+}
+
+/*
+ * Call func(i) for lo <= i < hi on the pool, and set ret to the sum of the
+ * results. Returns -1 if a call failed.
+ */
+int parallel_for(struct t_exec *exec, long long lo, long long hi, struct t_func *func, struct t_value *ret)
+{
+  struct t_parallel par;
+  struct t_parallel_chunk *chunk;
+  long long n, size, extra;
+  int i, rc = 0;
+
+  value_init(ret, VAL_INT);
+  if (exec->globals) {
+    fprintf(stderr, "Error: parallel_for() can't run inside parallel_for()\n");
+    return -1;
+  }
+  if (!func->native && !func->invoke && func->argc != 1) {
+    fprintf(stderr, "Error: parallel_for() needs %s() to take 1 argument, not %d.\n", func->name, func->argc);
+    return -1;
+  }
+  if (hi <= lo) {
+    return 0;
+  }
+  if (__builtin_sub_overflow(hi, lo, &n)) {
+    fprintf(stderr, "Error: parallel_for() range is too large\n");
+    return -1;
+  }
+  pthread_once(&parallel_pool_once, parallel_pool_init);
+  if (parallel_pool_rc < 0) {
+    return -1;
+  }
+
+  /* The chunks run functions that may not have been called yet */
+  program_link(exec->program);
+
+  par.exec = exec;
+  par.func = func;
+  par.nchunks = n < PARALLEL_MAX_CHUNKS ? n : PARALLEL_MAX_CHUNKS;
+  par.remaining = par.nchunks;
+  par.failed = 0;
+  pthread_mutex_init(&par.lock, NULL);
+  pthread_cond_init(&par.done, NULL);
+  size = n / par.nchunks;
+  extra = n % par.nchunks;
+  for (i=0; i < par.nchunks; i++) {
+    chunk = &par.chunks[i];
+    chunk->par = &par;
+    chunk->lo = lo;
+    lo += size + (i < extra);
+    chunk->hi = lo;
+    value_init(&chunk->sum, VAL_INT);
+    chunk->out = NULL;
+    chunk->outlen = 0;
+    chunk->status = 0;
+  }
+
+  parallel_freeze(exec, 1);
+  for (i=0; i < par.nchunks; i++) {
+    if (pool_submit(&parallel_pool, parallel_chunk, &par.chunks[i]) < 0) {
+      /* The chunks not queued count as failed and done */
+      pthread_mutex_lock(&par.lock);
+      par.remaining -= par.nchunks - i;
+      par.failed = 1;
+      pthread_mutex_unlock(&par.lock);
+      break;
+    }
+  }
+  pthread_mutex_lock(&par.lock);
+  while (par.remaining) {
+    pthread_cond_wait(&par.done, &par.lock);
+  }
+  pthread_mutex_unlock(&par.lock);
+  parallel_freeze(exec, 0);
+
+  for (i=0; i < par.nchunks; i++) {
+    chunk = &par.chunks[i];
+    if (chunk->out) {
+      if (rc == 0 && output_write(&exec->out, chunk->out, chunk->outlen) < 0) {
+        rc = -1;
+      }
+      free(chunk->out);
+    }
+    if (rc == 0 && !par.failed && parallel_add(ret, &chunk->sum, func->name) < 0) {
+      rc = -1;
+    }
+  }
+  pthread_cond_destroy(&par.done);
+  pthread_mutex_destroy(&par.lock);
+
+  return par.failed ? -1 : rc;
+}
@@ -33,7 +33,31 @@ char *icodes[] = {
   "LT",
   "GT",
   "LE",
-  "GE"
+  "GE",
+  "RET",
+  "TCALL",
+  "CMPJZ",
+  "INCR",
+  "CALL1",
+  "ADD_INT_INT",
+  "ADD_STR_STR",
+  "ADD_STR_INT",
+  "SUB_INT_INT",
+  "MUL_INT_INT",
+  "DIV_INT_INT",
+  "EQ_INT_INT",
+  "NE_INT_INT",
+  "LT_INT_INT",
+  "GT_INT_INT",
+  "LE_INT_INT",
+  "GE_INT_INT",
+  "ARRAY",
+  "INDEX",
+  "SETINDEX",
+  "MAP",
+  "CONCAT_N",
+  "SPAWN",
+  "YIELD"
 };
 
 const char *value_types[] = {
@@ -44,30 +68,28 @@ const char *value_types[] = {
   "STRING",
   "OBJECT",
   "VAR",
-  "FCALL"
+  "FCALL",
+  "ARRAY",
+  "MAP"
 };
 int value_types_len = sizeof(value_types) / sizeof(char *);
 
-char statement_buf[STATEMENT_FORMAT_BUF_SIZE];
-struct t_value nullvalue;
-struct t_value truevalue;
-struct t_value falsevalue;
+/* Shared by every parser and exec, and never written */
+struct t_value nullvalue = {.type = VAL_NULL};
+struct t_value truevalue = {.type = VAL_BOOL, .intval = 1};
+struct t_value falsevalue = {.type = VAL_BOOL, .intval = 0};
 
 int parser_init(struct t_parser *parser, FILE *in) {
   memset(parser, 0, sizeof(struct t_parser));
   parser->errors[0] = (struct t_parse_error *) 0;
   parser->error = PARSER_ERR_NONE;
   parser->max_output = -1;
+  parser->fuse = 1;
   if (scanner_init(&(parser->scanner), in)) return 1;
+  if (strtab_init(&parser->strings)) return 1;
   list_init(&parser->output);
   list_init(&parser->functions);
   
-  value_init(&nullvalue, VAL_NULL);
-  value_init(&falsevalue, VAL_BOOL);
-  falsevalue.intval = 0;
-  value_init(&truevalue, VAL_BOOL);
-  truevalue.intval = 1;
-  
   return 0;
 }
 
@@ -106,6 +128,9 @@ int parser_close(struct t_parser *parser) {
   }
   list_empty(&parser->functions);
 
+  /* Values freed above may point into the string table */
+  strtab_close(&parser->strings);
+
   DBG(3, "End.");
 
   return 0;
@@ -212,6 +237,12 @@ int parse(struct t_parser *parser)
     fprintf(stderr, "%s(): Unexpected token: %s\n", __FUNCTION__, token_format(token));
     return -1;
   }
+
+  parser_mark_appends(parser);
+
+  if (parser->fuse && parser_fuse(parser) < 0) {
+    return -1;
+  }
   
   return 0;
 }
@@ -232,27 +263,18 @@ int parse_stmt(struct t_parser *parser)
   else {
     if (token->type == TT_NAME && strcmp("if", token->buf) == 0) {
       ret = parse_if(parser);
-      if (ret < 0) return -1;
-      token = parser_token(parser);
-      while (token->type == TT_EOL || token->type == TT_SEMI) {
-        token = parser_next(parser);
-      }
     }
-    if (token->type == TT_NAME && strcmp("while", token->buf) == 0) {
+    else if (token->type == TT_NAME && strcmp("while", token->buf) == 0) {
       ret = parse_while(parser);
-      if (ret < 0) return -1;
-      token = parser_token(parser);
-      while (token->type == TT_EOL || token->type == TT_SEMI) {
-        token = parser_next(parser);
-      }
     }
-    if (token->type == TT_NAME && strcmp("func", token->buf) == 0) {
+    else if (token->type == TT_NAME && strcmp("func", token->buf) == 0) {
       ret = parse_func(parser);
-      if (ret < 0) return -1;
-      token = parser_token(parser);
-      while (token->type == TT_EOL || token->type == TT_SEMI) {
-        token = parser_next(parser);
-      }
+    }
+    else if (token->type == TT_NAME && strcmp("return", token->buf) == 0) {
+      ret = parse_return(parser);
+    }
+    else if (token->type == TT_NAME && strcmp("yield", token->buf) == 0) {
+      ret = parse_yield(parser);
     }
     else {
       if (parse_expr(parser) < 0) return -1;
@@ -269,6 +291,11 @@ int parse_stmt(struct t_parser *parser)
       if (!create_icode_append(parser, I_POP, NULL)) return -1;
       ret = 0;
     }
+    if (ret < 0) return -1;
+    token = parser_token(parser);
+    while (token->type == TT_EOL || token->type == TT_SEMI) {
+      token = parser_next(parser);
+    }
   }
   
   debug(2, "%s(): End\n", __FUNCTION__);
@@ -350,7 +377,7 @@ int parse_if(struct t_parser *parser)
        * Set the JMP offset for the previous conditional.
        */
       prev_jmp->operand->intval = parser->output.size - prev_jmp->addr;
-      debug(3, "%s():  prev cond offset=%d\n", __FUNCTION__, prev_jmp->operand->intval);
+      debug(3, "%s():  prev cond offset=%lld\n", __FUNCTION__, prev_jmp->operand->intval);
     
       token = parser_next(parser);
       if (token->type == TT_NAME && strcmp("if", token->buf) == 0) {
@@ -387,7 +414,7 @@ int parse_if(struct t_parser *parser)
       /* Set the JMP offset for the last conditional, if there was no 'else' block. */
       if (prev_jmp) {
         prev_jmp->operand->intval = after_addr - prev_jmp->addr;
-        debug(3, "%s(): Set JMP offset for prev conditional (%d) to %d\n", __FUNCTION__, prev_jmp->addr, prev_jmp->operand->intval);
+        debug(3, "%s(): Set JMP offset for prev conditional (%d) to %lld\n", __FUNCTION__, prev_jmp->addr, prev_jmp->operand->intval);
       }
     
       /*
@@ -398,7 +425,7 @@ int parse_if(struct t_parser *parser)
       while (item) {
         jmp = (struct t_icode *) item->value;
         jmp->operand->intval = after_addr - jmp->addr;
-        debug(3, "%s(): Set JMP offset for cond block end to %d\n", __FUNCTION__, jmp->operand->intval);
+        debug(3, "%s(): Set JMP offset for cond block end to %lld\n", __FUNCTION__, jmp->operand->intval);
         item = item->next;
       }
     
@@ -471,7 +498,7 @@ int parse_while(struct t_parser *parser)
       debug(3, "%s(). JMP: %s\n", __FUNCTION__, format_icode(parser, jmp));
       
       jz->operand->intval = parser->output.size - jz->addr;
-      debug(3, "%s(). Set jz offset to %d\n", __FUNCTION__, jz->operand->intval);
+      debug(3, "%s(). Set jz offset to %lld\n", __FUNCTION__, jz->operand->intval);
 
       token = parser_next(parser);
       debug(3, "%s(). next token: %s\n", __FUNCTION__, token_format(token));
@@ -491,24 +518,26 @@ int parse_func(struct t_parser *parser)
 {
   int addr_start, addr_end;
   struct t_token *token;
-  struct t_icode *jmp;
+  struct t_icode *jmp, *skip;
+  struct item *item;
   int ret = -1;
-  struct t_func *func;
+  struct t_func *func = NULL;
   char *name;
   int argc = 0;
-  int offset;
+  char *params[MAX_FUNC_ARGS];
 
   addr_start = parser->output.size;
   DBG(2, "Begin. addr_start=%d", addr_start);
 
   /*
-   * Create JMP instruction.
+   * Create JMP instruction that skips over the function body.
+   * The offset is set once the body is parsed.
    */
-  jmp = create_icode_append(parser, I_JMP, create_num_from_int(0));
-  if (!jmp) {
+  skip = create_icode_append(parser, I_JMP, create_num_from_int(0));
+  if (!skip) {
     goto parse_func_end;
   }
-  DBG(3, "FUNC jmp: %s", format_icode(parser, jmp));
+  DBG(3, "FUNC jmp: %s", format_icode(parser, skip));
 
   token = parser_next(parser);
 
@@ -535,19 +564,17 @@ int parse_func(struct t_parser *parser)
     token = parser_next(parser);
   }
   else {
-    DBG(1, "token->type: %s, buf: %s", token_types[token->type], token->buf);
-    assert(0); // Not implemented
     do {
-      if (parse_expr(parser) < -1) goto parse_func_end;
-      argc++;
-      token = parser_token(parser);
-      while (token && (token->type == TT_EOL || token->type == TT_SEMI || token->type == TT_ERROR)) {
-        token = parser_next(parser);
+      if (token->type != TT_NAME) {
+        fprintf(stderr, "Expected argument name in definition of %s(). Got: %s\n", name, token_types[token->type]);
+        goto parse_func_end;
       }
-
-      if (!token) {
+      if (argc >= MAX_FUNC_ARGS) {
+        fprintf(stderr, "Too many arguments in definition of %s() (max %d)\n", name, MAX_FUNC_ARGS);
         goto parse_func_end;
       }
+      params[argc++] = token->buf;
+      token = parser_next(parser);
 
       if (token->type == TT_PARENR) {
         token = parser_next(parser);
@@ -565,45 +592,66 @@ int parse_func(struct t_parser *parser)
 
   DBG(3, "Arguments are parsed. argc=%d, addr=%d. Next token: %s\n", argc, parser->output.size, token_format(token));
 
+  parser->func_depth++;
   do {
-    if (parse_stmt(parser) < 0) {
-      token_format(token);
-      fprintf(stderr, "Syntax Error: Line %d, Column %d: Unrecognized token in FUNC definition block: '%s'\n", (token->row+1), (token->col+1), token->buf);
-      goto parse_func_end;
-    }
-    debug(3, "%s(). After parse_stmt(). addr=%d, token=%s\n", __FUNCTION__, parser->output.size, token_format(token));
     token = parser_token(parser);
-    if (token->type == TT_EOF) {
-      fprintf(stderr, "%s(): Unexpected end=of-file within FUNC definition.\n", __FUNCTION__);
-      goto parse_func_end;
+    while (token->type == TT_EOL || token->type == TT_SEMI) {
+      token = parser_next(parser);
     }
-    else if (token->type == TT_NAME && strcmp("end", token->buf) == 0) {
+    if (token->type == TT_NAME && strcmp("end", token->buf) == 0) {
       addr_end = parser->output.size;
       debug(3, "%s(): FUNC:END. next addr: %d\n", __FUNCTION__, parser->output.size);
 
-      offset = parser->output.size - jmp->addr - 1;
-      debug(3, "%s(). Set jmp offset to %d\n", __FUNCTION__, offset);
-
       /*
-       * Jump back to caller
+       * Return null to the caller when the body falls off the end.
        */
-      DBG(3, "Creating jmp to location indicated by stack");
-      jmp = create_icode_append(parser, I_JMP, create_num_from_int(offset));
-      if (!jmp) {
-        goto parse_func_end;
-      }
-      debug(3, "%s(). FUNC I_JMP: %s\n", __FUNCTION__, format_icode(parser, jmp));
+      if (!create_icode_append(parser, I_PUSH, create_value(VAL_NULL))) break;
+      jmp = create_icode_append(parser, I_RET, NULL);
+      if (!jmp) break;
+      debug(3, "%s(). FUNC I_RET: %s\n", __FUNCTION__, format_icode(parser, jmp));
+
+      skip->operand->intval = parser->output.size - skip->addr;
+      debug(3, "%s(). Set skip jmp offset to %lld\n", __FUNCTION__, skip->operand->intval);
 
       token = parser_next(parser);
       debug(3, "%s(). next token: %s\n", __FUNCTION__, token_format(token));
       ret = 0;
       break;
     }
+    if (parse_stmt(parser) < 0) {
+      token_format(token);
+      fprintf(stderr, "Syntax Error: Line %d, Column %d: Unrecognized token in FUNC definition block: '%s'\n", (token->row+1), (token->col+1), token->buf);
+      break;
+    }
+    debug(3, "%s(). After parse_stmt(). addr=%d, token=%s\n", __FUNCTION__, parser->output.size, token_format(token));
+    token = parser_token(parser);
+    if (token->type == TT_EOF) {
+      fprintf(stderr, "%s(): Unexpected end=of-file within FUNC definition.\n", __FUNCTION__);
+      break;
+    }
   } while (1);
+  parser->func_depth--;
+
+  if (ret < 0) {
+    goto parse_func_end;
+  }
+
+  /*
+   * Find the function's first icode, then rewrite calls in tail position.
+   */
+  item = parser->output.last;
+  while (((struct t_icode *) item->value)->addr != addr_start) {
+    item = item->prev;
+  }
+  parser_mark_tail_calls(parser, item);
 
   func = func_new(name);
   func->start = addr_start;
   func->end = addr_end;
+  func->argc = argc;
+  while (argc-- > 0) {
+    func->params[argc] = strtab_intern(&parser->strings, params[argc], strlen(params[argc]));
+  }
   list_push(&parser->functions, func);
 
   parse_func_end:
@@ -613,19 +661,379 @@ int parse_func(struct t_parser *parser)
   return ret;
 }
 
+int parse_return(struct t_parser *parser)
+{
+  struct t_token *token;
+
+  DBG(2, "Begin.");
+
+  if (parser->func_depth <= 0) {
+    token = parser_token(parser);
+    fprintf(stderr, "Syntax Error: Line %d, Column %d: 'return' outside of a function\n", (token->row+1), (token->col+1));
+    return -1;
+  }
+
+  token = parser_next(parser);
+  if (token->type == TT_EOL || token->type == TT_SEMI || token->type == TT_EOF) {
+    if (!create_icode_append(parser, I_PUSH, create_value(VAL_NULL))) return -1;
+  }
+  else {
+    if (parse_expr(parser) < 0) return -1;
+  }
+  if (!create_icode_append(parser, I_RET, NULL)) return -1;
+
+  return 0;
+}
+
+/*
+ * yield: let other tasks run.
+ */
+int parse_yield(struct t_parser *parser)
+{
+  DBG(2, "Begin.");
+
+  if (!create_icode_append(parser, I_YIELD, NULL)) return -1;
+  parser_next(parser);
+
+  return 0;
+}
+
+/*
+ * Follow unconditional forward jumps, starting at the given item.
+ */
+static struct item * follow_jumps(struct item *item)
+{
+  struct t_icode *icode;
+  int i;
+
+  while (item) {
+    icode = (struct t_icode *) item->value;
+    if (icode->type != I_JMP || icode->operand->intval <= 0) break;
+    for (i=0; item && i < icode->operand->intval; i++) {
+      item = item->next;
+    }
+  }
+
+  return item;
+}
+
+/*
+ * Turn each FCALL in tail position into a TCALL, starting at the given item.
+ *
+ * A call is in tail position when its value is returned directly
+ * (FCALL; RET), or when it is the last statement executed before the
+ * function returns null (FCALL; POP; PUSH null; RET). Unconditional forward
+ * jumps, like those at the end of an if-block, are followed. For the second
+ * form the operand's intval is set, so that the reused frame still returns
+ * null to the original caller.
+ */
+void parser_mark_tail_calls(struct t_parser *parser, struct item *first)
+{
+  struct item *item, *next;
+  struct t_icode *icode, *nexticode;
+
+  for (item = first; item; item = item->next) {
+    icode = (struct t_icode *) item->value;
+    if (icode->type != I_FCALL) continue;
+
+    next = follow_jumps(item->next);
+    if (!next) continue;
+    nexticode = (struct t_icode *) next->value;
+    if (nexticode->type == I_RET) {
+      icode->type = I_TCALL;
+      icode->operand->intval = 0;
+    }
+    else if (nexticode->type == I_POP) {
+      next = follow_jumps(next->next);
+      if (!next || !next->next) continue;
+      nexticode = (struct t_icode *) next->value;
+      if (nexticode->type != I_PUSH || nexticode->operand->type != VAL_NULL) continue;
+      if (((struct t_icode *) next->next->value)->type != I_RET) continue;
+      icode->type = I_TCALL;
+      icode->operand->intval = 1;
+    }
+    else {
+      continue;
+    }
+    DBG(3, "Tail call at addr=%d: %s", icode->addr, format_icode(parser, icode));
+  }
+}
+
+static int is_push_of(struct t_icode *icode, int valtype)
+{
+  return icode->type == I_PUSH && icode->operand && icode->operand->type == valtype;
+}
+
+static int is_compare(int type)
+{
+  return type == I_EQ || type == I_NE || type == I_LT || type == I_GT || type == I_LE || type == I_GE;
+}
+
+/*
+ * Mark the ADDs of "x = x + a + b ..." that may append to x's string in place.
+ *
+ * Starting at the second PUSH of x, the value is tracked through the stack:
+ * it must only ever be the left operand of ADDs, and the last ADD's result
+ * must go straight to the ASSIGN to x. Nothing in between may read x or call
+ * a function, which could read x, so appending early is never observed.
+ */
+void parser_mark_appends(struct t_parser *parser)
+{
+  struct item *item, *cur;
+  struct t_icode *target, *icode;
+  struct t_icode *adds[PARSER_SCRATCH_BUF];
+  int nadds, above, i;
+
+  for (item = parser->output.first; item && item->next; item = item->next) {
+    target = (struct t_icode *) item->value;
+    icode = (struct t_icode *) item->next->value;
+    if (!is_push_of(target, VAL_VAR) || !is_push_of(icode, VAL_VAR)
+        || strcmp(target->operand->name, icode->operand->name) != 0) {
+      continue;
+    }
+
+    /* Number of values on the stack above x's value */
+    above = 0;
+    nadds = 0;
+    for (cur = item->next->next; cur; cur = cur->next) {
+      icode = (struct t_icode *) cur->value;
+      if (icode->type == I_PUSH) {
+        if (is_push_of(icode, VAL_VAR) && strcmp(icode->operand->name, target->operand->name) == 0) break;
+        above++;
+      }
+      else if (icode->type >= I_ADD && icode->type <= I_DIV && above >= 2) {
+        above--;
+      }
+      else if (is_compare(icode->type) && above >= 2) {
+        above--;
+      }
+      else if (icode->type == I_ADD && above == 1 && nadds < PARSER_SCRATCH_BUF) {
+        adds[nadds++] = icode;
+        above = 0;
+      }
+      else {
+        break;
+      }
+    }
+    if (!cur || icode->type != I_ASSIGN || above != 0 || nadds == 0) {
+      continue;
+    }
+
+    for (i=0; i < nadds; i++) {
+      adds[i]->inplace = 1;
+      DBG(3, "In-place append to %s at addr=%d", target->operand->name, adds[i]->addr);
+    }
+  }
+}
+
+/*
+ * Number of icodes, starting at code[0], that form a superinstruction, or 0.
+ * Sets *type to the superinstruction's icode type.
+ */
+static int fuse_match(struct t_icode **code, int avail, int *type)
+{
+  int n, strs;
+
+  /* PUSH a; PUSH b; <compare>; JZ -> CMPJZ */
+  if (avail >= 4
+      && (is_push_of(code[0], VAL_VAR) || is_push_of(code[0], VAL_INT))
+      && (is_push_of(code[1], VAL_VAR) || is_push_of(code[1], VAL_INT))
+      && is_compare(code[2]->type)
+      && code[3]->type == I_JZ) {
+    *type = I_CMPJZ;
+    return 4;
+  }
+
+  /* PUSH var:x; PUSH var:x; PUSH n; ADD|SUB; ASSIGN; POP -> INCR */
+  if (avail >= 6
+      && is_push_of(code[0], VAL_VAR)
+      && is_push_of(code[1], VAL_VAR)
+      && strcmp(code[0]->operand->name, code[1]->operand->name) == 0
+      && is_push_of(code[2], VAL_INT)
+      && (code[3]->type == I_ADD || code[3]->type == I_SUB)
+      && code[4]->type == I_ASSIGN
+      && code[5]->type == I_POP) {
+    *type = I_INCR;
+    return 6;
+  }
+
+  /*
+   * PUSH a; PUSH b; ADD; PUSH c; ADD; ... -> CONCAT_N, for chains of at
+   * least three operands with a string literal among them. Chains that
+   * append in place are left alone.
+   */
+  if (avail >= 5 && code[0]->type == I_PUSH) {
+    strs = is_push_of(code[0], VAL_STRING);
+    for (n=1; n < MAX_CONCAT && 2 * n < avail; n++) {
+      if (code[2*n-1]->type != I_PUSH || code[2*n]->type != I_ADD || code[2*n]->inplace) {
+        break;
+      }
+      strs |= is_push_of(code[2*n-1], VAL_STRING);
+    }
+    if (n >= 3 && strs) {
+      *type = I_CONCAT_N;
+      return 2 * n - 1;
+    }
+  }
+
+  /* PUSH x; FCALL f(x) -> CALL1 */
+  if (avail >= 2
+      && code[0]->type == I_PUSH
+      && code[1]->type == I_FCALL
+      && code[1]->operand->argc == 1) {
+    *type = I_CALL1;
+    return 2;
+  }
+
+  return 0;
+}
+
+/*
+ * Peephole pass that replaces common icode sequences with superinstructions.
+ *
+ * The fused icode keeps the original icodes in its parts, so a handler can
+ * fall back to executing them one by one. Sequences are only fused when no
+ * jump lands inside them. Addresses, jump offsets and function addresses
+ * are then recomputed for the shorter output.
+ */
+int parser_fuse(struct t_parser *parser)
+{
+  struct t_icode **code, **out, *icode, *jz;
+  struct item *item;
+  struct t_func *func;
+  int *target, *newaddr;
+  int n, i, j, len, type, nout;
+  int ret = -1;
+
+  n = parser->output.size;
+  code = malloc(sizeof(struct t_icode *) * (n + 1));
+  out = malloc(sizeof(struct t_icode *) * (n + 1));
+  target = calloc(n + 1, sizeof(int));
+  newaddr = malloc(sizeof(int) * (n + 1));
+  if (!code || !out || !target || !newaddr) {
+    fprintf(stderr, "%s(): Out of memory\n", __FUNCTION__);
+    goto parser_fuse_end;
+  }
+
+  /*
+   * Find every address that control can arrive at other than by falling
+   * through: jump targets, function entries and returns from calls.
+   */
+  for (i=0, item = parser->output.first; item; item = item->next, i++) {
+    code[i] = (struct t_icode *) item->value;
+    assert(code[i]->addr == i);
+  }
+  for (i=0; i < n; i++) {
+    icode = code[i];
+    if (icode->type == I_JMP || icode->type == I_JZ) {
+      j = i + icode->operand->intval;
+      if (j >= 0 && j <= n) target[j] = 1;
+    }
+    else if (icode->type == I_FCALL || icode->type == I_TCALL || icode->type == I_YIELD) {
+      target[i+1] = 1;
+    }
+  }
+  for (item = parser->functions.first; item; item = item->next) {
+    func = (struct t_func *) item->value;
+    target[func->start] = 1;
+    target[func->start+1] = 1;
+  }
+
+  /*
+   * Fuse
+   */
+  nout = 0;
+  for (i=0; i < n; i += len) {
+    len = fuse_match(&code[i], n - i, &type);
+    for (j=1; j < len; j++) {
+      if (target[i+j]) len = 0;
+    }
+    newaddr[i] = nout;
+    if (len == 0) {
+      len = 1;
+      out[nout++] = code[i];
+      continue;
+    }
+    icode = icode_new(type, NULL);
+    icode->token = code[i]->token;
+    icode->addr = i;
+    icode->nparts = len;
+    icode->parts = malloc(sizeof(struct t_icode *) * len);
+    for (j=0; j < len; j++) {
+      icode->parts[j] = code[i+j];
+      newaddr[i+j] = nout;
+    }
+    out[nout++] = icode;
+    DBG(3, "Fused addr=%d: %s", i, format_icode(parser, icode));
+  }
+  newaddr[n] = nout;
+
+  /*
+   * Relocate jumps. icode->addr still holds the old address.
+   */
+  for (i=0; i < nout; i++) {
+    icode = out[i];
+    if (icode->type == I_JMP || icode->type == I_JZ) {
+      icode->operand->intval = newaddr[icode->addr + icode->operand->intval] - i;
+    }
+    else if (icode->type == I_CMPJZ) {
+      jz = icode->parts[3];
+      jz->operand->intval = newaddr[jz->addr + jz->operand->intval] - i;
+    }
+  }
+  for (i=0; i < nout; i++) {
+    out[i]->addr = i;
+    for (j=0; j < out[i]->nparts; j++) {
+      out[i]->parts[j]->addr = i;
+    }
+  }
+  for (item = parser->functions.first; item; item = item->next) {
+    func = (struct t_func *) item->value;
+    func->start = newaddr[func->start];
+    func->end = newaddr[func->end];
+  }
+
+  list_empty(&parser->output);
+  list_init(&parser->output);
+  for (i=0; i < nout; i++) {
+    list_push(&parser->output, out[i]);
+  }
+  DBG(2, "Fused %d icodes into %d", n, nout);
+  ret = 0;
+
+  parser_fuse_end:
+
+  free(code);
+  free(out);
+  free(target);
+  free(newaddr);
+
+  return ret;
+}
+
 int parse_assign(struct t_parser *parser)
 {
   struct t_token *token;
+  struct t_icode *last;
+  int type = I_ASSIGN;
 
   token = parser_token(parser);
   if (token->type != TT_EQUAL) {
     return -1;
   }
   
+  /* x[i] = v: the INDEX is dropped, and stored to after v is pushed */
+  last = list_last(&parser->output);
+  if (last && last->type == I_INDEX) {
+    icode_free(list_pop(&parser->output));
+    type = I_SETINDEX;
+  }
+  
   while (token->type == TT_EQUAL) {
     token = parser_next(parser);
     if (parse_expr(parser) < 0) return -1;
-    if (!create_icode_append(parser, I_ASSIGN, NULL)) return -1;
+    if (!create_icode_append(parser, type, NULL)) return -1;
+    type = I_ASSIGN;
     token = parser_token(parser);
   }
   
@@ -775,15 +1183,25 @@ int parse_factor(struct t_parser *parser)
     if (parse_name(parser) < 0) return -1;
   }
   else if (token->type == TT_STRING) {
-    if (!create_icode_append(parser, I_PUSH, create_str(token->buf))) return -1;
+    if (!create_icode_append(parser, I_PUSH, create_interned_str(&parser->strings, token->buf))) return -1;
     parser_next(parser);
   }
+  else if (token->type == TT_BRACKETL) {
+    if (parse_array(parser) < 0) return -1;
+  }
+  else if (token->type == TT_BRACEL) {
+    if (parse_map(parser) < 0) return -1;
+  }
   else {
     // Higher-level caller needs to display the error message
     return -1;
   }
 
   token = parser_token(parser);
+  while (token->type == TT_BRACKETL) {
+    if (parse_index(parser) < 0) return -1;
+    token = parser_token(parser);
+  }
   debug(2, "%s(): End. token: %s\n", __FUNCTION__, token_format(token));
   
   return 0;
@@ -812,8 +1230,11 @@ int parse_name(struct t_parser *parser)
   if (token->type == TT_PARENL) {
     ret = parse_fcall(parser, name);
   }
+  else if (token->type == TT_NAME && strcmp("spawn", name) == 0) {
+    ret = parse_spawn(parser);
+  }
   else {
-    if (!create_icode_append(parser, I_PUSH, create_var(name))) {
+    if (!create_icode_append(parser, I_PUSH, create_interned_var(&parser->strings, name))) {
       ret = -1;
     }
   }
@@ -874,6 +1295,108 @@ int parse_fcall(struct t_parser *parser, char *name)
   return ret;
 }
 
+/*
+ * spawn f(a, b, ...): a call whose FCALL becomes a SPAWN, which starts a
+ * task to make the call and pushes its id.
+ */
+int parse_spawn(struct t_parser *parser)
+{
+  struct t_token *token;
+  char *name;
+
+  token = parser_token(parser);
+  name = token->buf;
+  token = parser_next(parser);
+  if (token->type != TT_PARENL) {
+    fprintf(stderr, "Syntax Error: Line %d, Column %d: Expected a call after 'spawn'\n", (token->row+1), (token->col+1));
+    return -1;
+  }
+  if (parse_fcall(parser, name) < 0) return -1;
+  ((struct t_icode *) list_last(&parser->output))->type = I_SPAWN;
+
+  return 0;
+}
+
+/*
+ * Array literal: [a, b, ...] pushes its elements, then ARRAY with the count.
+ */
+int parse_array(struct t_parser *parser)
+{
+  struct t_token *token;
+  int n = 0;
+
+  token = parser_next(parser);
+  while (token->type != TT_BRACKETR) {
+    if (parse_expr(parser) < 0) return -1;
+    n++;
+    token = parser_token(parser);
+    if (token->type == TT_COMMA) {
+      token = parser_next(parser);
+    }
+    else if (token->type != TT_BRACKETR) {
+      fprintf(stderr, "Missing closing ']' in array. token: %s\n", token_format(token));
+      return -1;
+    }
+  }
+  parser_next(parser);
+
+  return create_icode_append(parser, I_ARRAY, create_num_from_int(n)) ? 0 : -1;
+}
+
+/*
+ * Index: x[i] pushes x and i, then INDEX. parse_assign() turns the INDEX
+ * into a SETINDEX when the index is assigned to.
+ */
+int parse_index(struct t_parser *parser)
+{
+  struct t_token *token;
+
+  parser_next(parser);
+  if (parse_expr(parser) < 0) return -1;
+  token = parser_token(parser);
+  if (token->type != TT_BRACKETR) {
+    fprintf(stderr, "Missing closing ']' in index. token: %s\n", token_format(token));
+    return -1;
+  }
+  parser_next(parser);
+
+  return create_icode_append(parser, I_INDEX, NULL) ? 0 : -1;
+}
+
+/*
+ * Map literal: {k: v, ...} pushes each key and value, then MAP with the
+ * number of pairs.
+ */
+int parse_map(struct t_parser *parser)
+{
+  struct t_token *token;
+  int n = 0;
+
+  token = parser_next(parser);
+  while (token->type != TT_BRACER) {
+    if (parse_expr(parser) < 0) return -1;
+    token = parser_token(parser);
+    if (token->type != TT_COLON) {
+      fprintf(stderr, "Missing ':' after a key in map. token: %s\n", token_format(token));
+      return -1;
+    }
+    parser_next(parser);
+    if (parse_expr(parser) < 0) return -1;
+    n++;
+    token = parser_token(parser);
+    if (token->type == TT_COMMA) {
+      token = parser_next(parser);
+    }
+    else if (token->type != TT_BRACER) {
+      fprintf(stderr, "Missing closing '}' in map. token: %s\n", token_format(token));
+      return -1;
+    }
+  }
+  parser_next(parser);
+
+  return create_icode_append(parser, I_MAP, create_num_from_int(n)) ? 0 : -1;
+}
+
 struct t_icode * icode_new(int type, struct t_value *operand)
 {
   struct t_icode *icode;
@@ -883,12 +1406,28 @@ struct t_icode * icode_new(int type, struct t_value *operand)
   icode->operand = operand;
   icode->formatbuf = NULL;
   icode->addr = -1;
+  icode->token = NULL;
+  icode->parts = NULL;
+  icode->nparts = 0;
+  icode->deopt = 0;
+  icode->hits = 0;
+  icode->jit = NULL;
+  icode->inplace = 0;
   
   return icode;
 }
 
 void icode_close(struct t_icode *icode)
 {
+  int i;
+
+  if (icode->parts) {
+    for (i=0; i < icode->nparts; i++) {
+      icode_free(icode->parts[i]);
+    }
+    free(icode->parts);
+    icode->parts = NULL;
+  }
   if (icode->formatbuf) {
     free(icode->formatbuf);
     icode->formatbuf = NULL;
@@ -930,11 +1469,21 @@ char * format_icode(struct t_parser *parser, struct t_icode *icode)
 {
   char buf[PARSER_SCRATCH_BUF + 1];
   int len;
+  int i;
   //struct t_icode *opnd1, *opnd2;
   //struct item *item;
   char *toobig = "<#icode {TOO_BIG}>";
   
-  if (icode->operand) {
+  if (icode->parts) {
+    len = snprintf(buf, PARSER_SCRATCH_BUF, "(%s", icodes[icode->type]);
+    for (i=0; i < icode->nparts && len < PARSER_SCRATCH_BUF; i++) {
+      len += snprintf(&buf[len], PARSER_SCRATCH_BUF - len, " %s", format_icode(parser, icode->parts[i]));
+    }
+    if (len < PARSER_SCRATCH_BUF) {
+      len += snprintf(&buf[len], PARSER_SCRATCH_BUF - len, ")");
+    }
+  }
+  else if (icode->operand) {
     len = snprintf(buf, PARSER_SCRATCH_BUF, "(%s %s)",
       icodes[icode->type],
       format_value(icode->operand));
@@ -965,7 +1514,8 @@ char * format_icode(struct t_parser *parser, struct t_icode *icode)
   //  }
   //}
   
-  if (len > PARSER_SCRATCH_BUF) {
+  if (icode->formatbuf) free(icode->formatbuf);
+  if (len >= PARSER_SCRATCH_BUF) {
     icode->formatbuf = malloc(sizeof(char) * (strlen(toobig) + 1));
     strcpy(icode->formatbuf, toobig);
   }
@@ -977,113 +1527,163 @@ char * format_icode(struct t_parser *parser, struct t_icode *icode)
   return icode->formatbuf;
 }
 
-char * format_value(struct t_value *value)
+/*
+ * Append a value as println() shows it: strings as they are, and numbers,
+ * arrays and maps in their literal form.
+ */
+int value_format(struct t_fmtbuf *fb, struct t_value *value)
 {
-  char buf[PARSER_SCRATCH_BUF + 1];
+  if (value->type == VAL_STRING) {
+    return fmtbuf_add(fb, value->stringval, value->len);
+  }
+  if (value->type == VAL_FLOAT) {
+    return fmtbuf_float(fb, value->floatval);
+  }
+  if (value->type == VAL_ARRAY) {
+    return array_format(value->array, fb);
+  }
+  if (value->type == VAL_MAP) {
+    return map_format(value->map, fb);
+  }
+  return fmtbuf_int(fb, value->intval);
+}
+
+/*
+ * Append a value as it would be written in source code, or a description
+ * of it.
+ */
+static int value_format_literal(struct t_fmtbuf *fb, struct t_value *value)
+{
+  char *dst;
   int len;
-  char *toobigval = "TOO_BIG";
-  char *toobig = "<#value {TOO_BIG}>";
-  char valuebuf[PARSER_SCRATCH_BUF + 2 + 1];
-  int show_literal = 0;
 
-  if (!value) return "NULL";
-  
-  /*
-   * Format the value as would be displayed in source code.
-   */
-  if (value->type == VAL_INT) {
-    len = snprintf(valuebuf, PARSER_SCRATCH_BUF, "%d", value->intval);
-    if (len > PARSER_SCRATCH_BUF) {
-      strcpy(valuebuf, toobigval);
+  if (value->type == VAL_STRING) {
+    /* Escaping at most doubles the length */
+    dst = fmtbuf_reserve(fb, value->len * 2 + 2);
+    if (!dst) {
+      return -1;
     }
-    show_literal = 1;
+    dst[0] = '"';
+    len = util_escape_string(dst + 1, value->len * 2 + 1, value->stringval);
+    dst[len + 1] = '"';
+    dst[len + 2] = '\0';
+    fb->len += len + 2;
+    return 0;
   }
-  else if (value->type == VAL_STRING) {
-    valuebuf[0] = '"';
-    len = util_escape_string(&valuebuf[1], PARSER_SCRATCH_BUF - 2, value->stringval);
-    if (len > PARSER_SCRATCH_BUF - 2) {
-      strcpy(valuebuf, toobigval);
-    }
-    else {
-      valuebuf[len+1] = '"';
-      valuebuf[len+2] = '\0';
-    }
-    show_literal = 1;
+  if (value_is_num(value) || value->type == VAL_ARRAY || value->type == VAL_MAP) {
+    return value_format(fb, value);
   }
-  else if (value->type == VAL_VAR) {
-    len = snprintf(valuebuf, PARSER_SCRATCH_BUF, "var:%s", value->name);
-    if (len > PARSER_SCRATCH_BUF) {
-      strcpy(valuebuf, toobigval);
+  if (value->type == VAL_VAR) {
+    if (fmtbuf_add(fb, "var:", 4) < 0) {
+      return -1;
     }
-    show_literal = 1;
+    return fmtbuf_add(fb, value->name, strlen(value->name));
   }
-  else if (value->type == VAL_FCALL) {
-    len = snprintf(valuebuf, PARSER_SCRATCH_BUF, "fcall:%s(argc=%d)", value->name, value->argc);
-    if (len > PARSER_SCRATCH_BUF) {
-      strcpy(valuebuf, toobigval);
+  if (value->type == VAL_FCALL) {
+    if (fmtbuf_add(fb, "fcall:", 6) < 0 || fmtbuf_add(fb, value->name, strlen(value->name)) < 0 ||
+        fmtbuf_add(fb, "(argc=", 6) < 0 || fmtbuf_int(fb, value->argc) < 0) {
+      return -1;
     }
-    show_literal = 1;
+    return fmtbuf_add(fb, ")", 1);
   }
-  else {
-    snprintf(valuebuf, PARSER_SCRATCH_BUF, "(%s)", value_types[value->type]);
-  }
-  
-  if (show_literal) {
-    value->formatbuf = malloc(sizeof(char) * (len + 1));
-    strcpy(value->formatbuf, valuebuf);
+  if (fmtbuf_add(fb, "<#value: {type: ", 16) < 0 || fmtbuf_add(fb, value_types[value->type], strlen(value_types[value->type])) < 0 ||
+      fmtbuf_add(fb, ", value: (", 10) < 0 || fmtbuf_add(fb, value_types[value->type], strlen(value_types[value->type])) < 0) {
+    return -1;
   }
-  else {
-    len = snprintf(buf, PARSER_SCRATCH_BUF, "<#value: {type: %s, value: %s}>", value_types[value->type], valuebuf);
-    if (len > PARSER_SCRATCH_BUF) {
-      value->formatbuf = malloc(sizeof(char) * (strlen(toobig) + 1));
-      strcpy(value->formatbuf, toobig);
+  return fmtbuf_add(fb, ")}>", 3);
+}
+
+/*
+ * Copy a formatted string into *keep, a buffer the value owns. It is a
+ * strbuf, so it knows its size, and is reused when it is big enough.
+ */
+static char * value_keep(char **keep, struct t_fmtbuf *fb)
+{
+  struct t_strbuf *sb = *keep ? strbuf_of(*keep) : NULL;
+
+  if (!sb || sb->cap <= fb->len) {
+    if (sb) {
+      strbuf_release(sb);
     }
-    else {
-      value->formatbuf = malloc(sizeof(char) * (len + 1));
-      strcpy(value->formatbuf, buf);
+    *keep = NULL;
+    sb = strbuf_new(fb->len + 1);
+    if (!sb) {
+      fmtbuf_close(fb);
+      return "NULL";
     }
   }
-  
-  return value->formatbuf;
+  memcpy(sb->str, fb->buf, fb->len + 1);
+  fmtbuf_close(fb);
+  *keep = sb->str;
+  return *keep;
 }
 
-char * value_to_s(struct t_value *value)
+/*
+ * The value as it would be written in source code, or a description of it.
+ * The string belongs to the value, and is good until the next call.
+ */
+char * format_value(struct t_value *value)
 {
-  char buf[PARSER_SCRATCH_BUF + 2 + 1];
-  char *b;
-  int len;
-  int i = 0;
-  
-  if (value->type == VAL_STRING) {
-    buf[i++] = '"';
-    len = util_escape_string(&buf[1], PARSER_SCRATCH_BUF, value->stringval);
-    if (len > PARSER_SCRATCH_BUF) {
-      i += PARSER_SCRATCH_BUF;
-    }
-    else {
-      i += len;
-    }
-    buf[i++] = '"';
-    buf[i++] = '\0';
-    len = i;
-    b = &buf[0];
+  char buf[PARSER_SCRATCH_BUF + 1];
+  struct t_fmtbuf fb;
+
+  if (!value) return "NULL";
+
+  fmtbuf_init(&fb, buf, sizeof(buf));
+  if (value_format_literal(&fb, value) < 0) {
+    fmtbuf_close(&fb);
+    return "NULL";
   }
-  else if (value->type == VAL_INT) {
-    len = snprintf(buf, PARSER_SCRATCH_BUF, "%d", value->intval);
-    if (len > PARSER_SCRATCH_BUF) {
-      len = PARSER_SCRATCH_BUF;
-    }
-    b = &buf[0];
+  return value_keep(&value->formatbuf, &fb);
+}
+
+/*
+ * Format an int or float into buf, returning the length it needs, like
+ * snprintf().
+ */
+int value_format_num(struct t_value *value, char *buf, int size)
+{
+  char num[FMT_NUM_MAX];
+  int len;
+
+  if (value->type == VAL_INT) {
+    len = fmt_int(num, value->intval);
   }
   else {
-    b = format_value(value);
-    len = strlen(b);
+    len = fmt_float(num, value->floatval);
+  }
+  if (size > 0) {
+    memcpy(buf, num, len < size ? len + 1 : size - 1);
+    buf[len < size ? len : size - 1] = '\0';
+  }
+  return len;
+}
+
+/*
+ * Like format_value(), in a buffer of its own.
+ */
+char * value_to_s(struct t_value *value)
+{
+  char buf[PARSER_SCRATCH_BUF + 1];
+  struct t_fmtbuf fb;
+
+  fmtbuf_init(&fb, buf, sizeof(buf));
+  if (value_format_literal(&fb, value) < 0) {
+    fmtbuf_close(&fb);
+    return "NULL";
+  }
+  return value_keep(&value->to_s, &fb);
+}
+
+/*
+ * Drop the value's reference to its heap buffer, if it has one.
+ */
+static void value_release_str(struct t_value *value)
+{
+  if (value->sbuf) {
+    strbuf_release(value->sbuf);
+    value->sbuf = NULL;
   }
-  
-  value->to_s = malloc(sizeof(char) * (len + 1));
-  strcpy(value->to_s, b);
-  
-  return value->to_s;
 }
 
 void value_init(struct t_value *value, int type)
@@ -1093,6 +1693,13 @@ void value_init(struct t_value *value, int type)
   value->floatval = 0.0;
   value->stringval = NULL;
   value->len = 0;
+  value->sbuf = NULL;
+  value->array = NULL;
+  value->map = NULL;
+  value->temp = 0;
+  value->hash = 0;
+  value->interned = 0;
+  value->frozen = 0;
   value->formatbuf = NULL;
   value->to_s = NULL;
   value->name = NULL;
@@ -1111,22 +1718,28 @@ struct t_value * create_value(int type)
 
 void value_close(struct t_value *value)
 {
-  if (value->stringval) {
-    free(value->stringval);
-    value->stringval = NULL;
+  value_release_str(value);
+  value->stringval = NULL;
+  if (value->array) {
+    array_release(value->array);
+    value->array = NULL;
+  }
+  if (value->map) {
+    map_release(value->map);
+    value->map = NULL;
   }
   if (value->formatbuf) {
-    free(value->formatbuf);
+    strbuf_release(strbuf_of(value->formatbuf));
     value->formatbuf = NULL;
   }
   if (value->to_s) {
-    free(value->to_s);
+    strbuf_release(strbuf_of(value->to_s));
     value->to_s = NULL;
   }
-  if (value->name) {
+  if (value->name && !value->interned) {
     free(value->name);
-    value->name = NULL;
   }
+  value->name = NULL;
 }
 
 void value_free(struct t_value *value)
@@ -1135,7 +1748,7 @@ void value_free(struct t_value *value)
   free(value);
 }
 
-struct t_value * create_num_from_int(int v)
+struct t_value * create_num_from_int(long long v)
 {
   struct t_value *value;
   
@@ -1145,9 +1758,25 @@ struct t_value * create_num_from_int(int v)
   return value;
 }
 
+struct t_value * create_num_from_float(double v)
+{
+  struct t_value *value;
+  
+  value = create_value(VAL_FLOAT);
+  value->floatval = v;
+  
+  return value;
+}
+
+/*
+ * Number literal. The scanner limits its length, so an int always fits.
+ */
 struct t_value * create_num_from_str(char * v)
 {
-  return create_num_from_int(atoi(v));
+  if (strchr(v, '.')) {
+    return create_num_from_float(strtod(v, NULL));
+  }
+  return create_num_from_int(strtoll(v, NULL, 10));
 }
 
 struct t_value * create_str(char *str)
@@ -1155,13 +1784,316 @@ struct t_value * create_str(char *str)
   struct t_value *value;
   
   value = create_value(VAL_STRING);
-  value->len = strlen(str);
-  value->stringval = malloc(sizeof(char) * (value->len + 1));
-  strcpy(value->stringval, str);
+  value_set_str(value, str, strlen(str));
   
   return value;
 }
 
+/*
+ * Create a string value for a literal, pointing into the string table.
+ */
+struct t_value * create_interned_str(struct t_strtab *strings, const char *str)
+{
+  struct t_value *value;
+
+  value = create_value(VAL_STRING);
+  value->len = strlen(str);
+  value->stringval = strtab_intern(strings, str, value->len);
+  if (!value->stringval) {
+    free(value);
+    return NULL;
+  }
+  value->hash = strtab_header(value->stringval)->hash;
+  value->interned = strings->id;
+
+  return value;
+}
+
+/*
+ * Create a variable reference whose name points into the string table.
+ */
+struct t_value * create_interned_var(struct t_strtab *strings, const char *name)
+{
+  struct t_value *iden;
+
+  iden = create_value(VAL_VAR);
+  iden->name = strtab_intern(strings, name, strlen(name));
+  if (!iden->name) {
+    free(iden);
+    return NULL;
+  }
+  iden->interned = strings->id;
+
+  return iden;
+}
+
+/*
+ * Whether the value's string is on the heap or inline, so that it may be
+ * changed in place. A heap buffer that is shared is copied first.
+ */
+int value_str_owned(struct t_value *value)
+{
+  return !value->frozen && (value->sbuf || value->stringval == value->inl);
+}
+
+/*
+ * Copy a string into the value's own buffer. Short strings are stored inline
+ * in the value, unless it already has an unshared heap buffer to reuse. str
+ * may point into the value's current string.
+ */
+int value_set_str(struct t_value *value, const char *str, int len)
+{
+  struct t_strbuf *sb;
+
+  value->interned = 0;
+  value->hash = 0;
+
+  if (value->sbuf && !strbuf_shared(value->sbuf)) {
+    sb = strbuf_reserve(value->sbuf, len + 1);
+    if (!sb) {
+      return -1;
+    }
+    if (str == value->stringval) {
+      str = sb->str;
+    }
+    memmove(sb->str, str, len);
+  }
+  else if (!value->sbuf && len < VALUE_INLINE_LEN) {
+    memmove(value->inl, str, len);
+    value->inl[len] = '\0';
+    value->stringval = value->inl;
+    value->len = len;
+    return 0;
+  }
+  else {
+    sb = strbuf_new(len + 1);
+    if (!sb) {
+      return -1;
+    }
+    memcpy(sb->str, str, len);
+    value_release_str(value);
+  }
+  sb->str[len] = '\0';
+  value->sbuf = sb;
+  value->stringval = sb->str;
+  value->len = len;
+
+  return 0;
+}
+
+/*
+ * Append to the value's own buffer, growing it geometrically. An inline
+ * string moves to the heap when it no longer fits, and a shared heap buffer
+ * is copied before it is changed.
+ */
+int value_append_str(struct t_value *value, const char *str, int len)
+{
+  struct t_strbuf *sb;
+  int self;
+
+  assert(value_str_owned(value));
+  value->hash = 0;
+  self = (str == value->stringval);
+
+  if (!value->sbuf && value->len + len < VALUE_INLINE_LEN) {
+    memcpy(value->inl + value->len, str, len);
+    value->len += len;
+    value->inl[value->len] = '\0';
+    return 0;
+  }
+
+  if (!value->sbuf || strbuf_shared(value->sbuf)) {
+    sb = strbuf_new(2 * (value->len + len) + 1);
+    if (!sb) {
+      return -1;
+    }
+    memcpy(sb->str, value->stringval, value->len);
+    value_release_str(value);
+  }
+  else {
+    sb = strbuf_reserve(value->sbuf, value->len + len + 1);
+    if (!sb) {
+      return -1;
+    }
+  }
+  if (self) {
+    str = sb->str;
+  }
+  memcpy(sb->str + value->len, str, len);
+  value->len += len;
+  sb->str[value->len] = '\0';
+  value->sbuf = sb;
+  value->stringval = sb->str;
+
+  return 0;
+}
+
+/*
+ * Make the value refer to another value's string. Interned strings and heap
+ * buffers are shared, not copied; only inline strings are copied.
+ */
+int value_copy_str(struct t_value *value, struct t_value *from)
+{
+  if (!from->interned && !from->sbuf) {
+    return value_set_str(value, from->stringval, from->len);
+  }
+  if (from->sbuf) {
+    strbuf_ref(from->sbuf);
+  }
+  value_release_str(value);
+  value->sbuf = from->sbuf;
+  value->stringval = from->stringval;
+  value->len = from->len;
+  value->hash = from->hash;
+  value->interned = from->interned;
+
+  return 0;
+}
+
+/*
+ * Take over another value's heap buffer, which is left empty. Strings that
+ * are inline or interned are copied instead.
+ */
+int value_move_str(struct t_value *value, struct t_value *from)
+{
+  if (!from->sbuf) {
+    return value_copy_str(value, from);
+  }
+  value_release_str(value);
+  value->sbuf = from->sbuf;
+  value->stringval = from->stringval;
+  value->len = from->len;
+  value->hash = from->hash;
+  value->interned = 0;
+  from->sbuf = NULL;
+  from->stringval = NULL;
+
+  return 0;
+}
+
+/*
+ * Make the value a copy of another: numbers by value, strings shared as by
+ * value_copy_str(), and arrays and maps by reference.
+ */
+int value_copy(struct t_value *value, struct t_value *from)
+{
+  struct t_array *array = value->array;
+  struct t_map *map = value->map;
+
+  if (value == from) {
+    return 0;
+  }
+  value->array = from->type == VAL_ARRAY ? array_ref(from->array) : NULL;
+  value->map = from->type == VAL_MAP ? map_ref(from->map) : NULL;
+  if (array) {
+    array_release(array);
+  }
+  if (map) {
+    map_release(map);
+  }
+  if (from->type == VAL_STRING) {
+    if (value_copy_str(value, from) < 0) {
+      return -1;
+    }
+  }
+  else {
+    value_release_str(value);
+    value->stringval = NULL;
+    value->len = 0;
+    value->hash = 0;
+    value->interned = 0;
+  }
+  value->type = from->type;
+  value->intval = from->intval;
+  value->floatval = from->floatval;
+
+  return 0;
+}
+
+/*
+ * Make the value an owned string of len bytes, for the caller to fill in.
+ * Returns the bytes, which are already terminated.
+ */
+char * value_alloc_str(struct t_value *value, int len)
+{
+  struct t_strbuf *sb;
+
+  value_release_str(value);
+  value->interned = 0;
+  value->hash = 0;
+  if (len < VALUE_INLINE_LEN) {
+    value->stringval = value->inl;
+  }
+  else {
+    sb = strbuf_new(len + 1);
+    if (!sb) {
+      return NULL;
+    }
+    value->sbuf = sb;
+    value->stringval = sb->str;
+  }
+  value->stringval[len] = '\0';
+  value->len = len;
+
+  return value->stringval;
+}
+
+/*
+ * Hash of a string value, computed on first use and cached.
+ */
+unsigned int value_str_hash(struct t_value *value)
+{
+  if (!value->hash) {
+    value->hash = value->interned ? strtab_header(value->stringval)->hash : strtab_hash(value->stringval, value->len);
+  }
+  return value->hash;
+}
+
+/*
+ * Freeze the value, and what it holds, so that threads can share it: it
+ * can't be changed, and its buffers, arrays and maps aren't reference
+ * counted, until it is thawed with frozen 0. String hashes are computed
+ * first, as they are cached on first use.
+ */
+void value_freeze(struct t_value *value, int frozen)
+{
+  value->frozen = frozen;
+  if (value->type == VAL_STRING) {
+    if (frozen) {
+      value_str_hash(value);
+    }
+    /* One sent over a channel stays shared */
+    if (value->sbuf && value->sbuf->frozen != STRBUF_SHARED) {
+      value->sbuf->frozen = frozen;
+    }
+  }
+  else if (value->type == VAL_ARRAY) {
+    array_freeze(value->array, frozen);
+  }
+  else if (value->type == VAL_MAP) {
+    map_freeze(value->map, frozen);
+  }
+}
+
+/*
+ * Compare two string values. Strings interned in the same table are equal
+ * only if they are the same pointer. Otherwise the lengths and hashes are
+ * compared before the bytes.
+ */
+int value_str_eq(struct t_value *a, struct t_value *b)
+{
+  if (a->stringval == b->stringval) {
+    return 1;
+  }
+  if ((a->interned && a->interned == b->interned) || a->len != b->len) {
+    return 0;
+  }
+  if (value_str_hash(a) != value_str_hash(b)) {
+    return 0;
+  }
+  return memcmp(a->stringval, b->stringval, a->len) == 0;
+}
+
 struct t_value * create_var(char *name)
 {
   struct t_value *iden;
@@ -1194,15 +2126,20 @@ struct t_func * func_new(char *name)
   func->name = malloc(sizeof(char) * (strlen(name) + 1));
   strcpy(func->name, name);
   
+  func->native = NULL;
   func->invoke = NULL;
   func->start = -1;
   func->end = -1;
+  func->argc = 0;
+  func->entry = NULL;
+  func->hits = 0;
 
   return func;
 }
 
 void func_close(struct t_func *func)
 {
+  /* Parameter names are interned by the parser */
   free(func->name);
 }
 
@@ -0,0 +1,567 @@
+/*
+ * Pipelined runs.
+ *
+ * run -p reads a script from stdin, and scans, parses and runs it at once:
+ * the scanner on a thread of its own, which hands tokens to the parser in
+ * batches, the parser on another, which hands on each top-level statement
+ * once it is parsed, and the exec on the calling thread, which runs them
+ * in turn. Each hand-over is a ring from one thread to the other, which
+ * takes no lock while it is neither full nor empty. A thread that finds
+ * it full or empty spins a little if another CPU may change it, and then
+ * sleeps until it does. So a script starts running as soon as its first
+ * statement is parsed, and reading it can't get more than the rings hold
+ * ahead of running it.
+ *
+ * The exec gets the next statement when its main task runs off the end of
+ * the one before, which is freed then, with the JIT regions and the calls
+ * cached for it. Only statements that define functions are kept. The
+ * others reuse the same addresses, so memory is bounded by the depth of
+ * the rings, plus the functions and one copy of each name and string
+ * constant, however long the script.
+ *
+ * Unlike a script parsed whole, a function has to be defined before the
+ * statement that first calls it runs, and a syntax error stops the run
+ * where it is, after the statements before it have run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+#include "corelib.h"
+#include "pool.h"
+
+static int pipe_cpus;
+static pthread_once_t pipe_cpus_once = PTHREAD_ONCE_INIT;
+
+static void pipe_cpus_init(void)
+{
+  pipe_cpus = pool_cpus();
+}
+
+static int pipe_ring_init(struct t_pipe_ring *ring, int cap)
+{
+  memset(ring, 0, sizeof(struct t_pipe_ring));
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+  ring->slots = calloc(cap, sizeof(void *));
+  if (!ring->slots) {
+    fprintf(stderr, "Error: Out of memory for the pipeline\n");
+    return -1;
+  }
+  ring->mask = cap - 1;
+  return 0;
+}
+
+static void pipe_ring_close(struct t_pipe_ring *ring)
+{
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->cond);
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+static int pipe_can_put(struct t_pipe_ring *ring)
+{
+  return ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <= ring->mask
+    || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
+
+static int pipe_can_get(struct t_pipe_ring *ring)
+{
+  return ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+    || __atomic_load_n(&ring->ended, __ATOMIC_ACQUIRE)
+    || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
+
+/* Whether the consumer has taken everything: it may be waiting */
+static int pipe_drained(struct t_pipe_ring *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+static void pipe_relax(void)
+{
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * Wait until ready(ring): spin first, if another CPU may make it so, and
+ * then sleep until the other side wakes us.
+ */
+static void pipe_wait(struct t_pipe_ring *ring, int (*ready)(struct t_pipe_ring *ring))
+{
+  int i;
+
+  if (pipe_cpus > 1) {
+    for (i=0; i < PIPE_SPIN; i++) {
+      if (ready(ring)) {
+        return;
+      }
+      pipe_relax();
+    }
+  }
+  pthread_mutex_lock(&ring->lock);
+  /* Both sides may be in here at once, one on its way out */
+  __atomic_add_fetch(&ring->sleeping, 1, __ATOMIC_RELAXED);
+  /* Pairs with the fence in pipe_wake(): either side sees the other */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (!ready(ring)) {
+    pthread_cond_wait(&ring->cond, &ring->lock);
+  }
+  __atomic_sub_fetch(&ring->sleeping, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Wake the other side, if it sleeps, after changing the ring.
+ */
+static void pipe_wake(struct t_pipe_ring *ring)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+/*
+ * Put an item on the ring, waiting while it is full. Returns -1 if the
+ * ring was closed, and the item is still the caller's.
+ */
+static int pipe_put(struct t_pipe_ring *ring, void *item)
+{
+  if (!pipe_can_put(ring)) {
+    pipe_wait(ring, pipe_can_put);
+  }
+  if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  ring->slots[ring->tail & ring->mask] = item;
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+  pipe_wake(ring);
+  return 0;
+}
+
+/*
+ * Take the oldest item off the ring, waiting while it is empty. Returns
+ * NULL once it has ended and is empty, or if it was closed.
+ */
+static void * pipe_get(struct t_pipe_ring *ring)
+{
+  void *item;
+
+  if (!pipe_can_get(ring)) {
+    pipe_wait(ring, pipe_can_get);
+  }
+  if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) || ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  item = ring->slots[ring->head & ring->mask];
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+  pipe_wake(ring);
+  return item;
+}
+
+/* The producer is done: the consumer gets NULL after the last item */
+static void pipe_end(struct t_pipe_ring *ring)
+{
+  __atomic_store_n(&ring->ended, 1, __ATOMIC_RELEASE);
+  pipe_wake(ring);
+}
+
+/* The pipeline stops: both sides give up */
+static void pipe_stop(struct t_pipe_ring *ring)
+{
+  __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+  pipe_wake(ring);
+}
+
+/*
+ * The items left on a ring, once neither side runs any more.
+ */
+static void * pipe_drain(struct t_pipe_ring *ring)
+{
+  if (ring->head == ring->tail) {
+    return NULL;
+  }
+  return ring->slots[ring->head++ & ring->mask];
+}
+
+/*
+ * An EOF token, for the parser once there are no more tokens.
+ */
+static struct t_token * pipeline_eof(void)
+{
+  struct t_token *token;
+
+  token = calloc(1, sizeof(struct t_token));
+  if (!token || !(token->buf = calloc(1, 1))) {
+    fprintf(stderr, "Error: Out of memory for the pipeline\n");
+    free(token);
+    return NULL;
+  }
+  token->type = TT_EOF;
+  return token;
+}
+
+static void pipeline_free_batch(struct t_pipe_batch *batch, int from)
+{
+  int i;
+
+  for (i=from; i < batch->n; i++) {
+    token_free(batch->tokens[i]);
+  }
+  free(batch);
+}
+
+/*
+ * The scanner thread: scan the input into batches of tokens, which go to
+ * the parser when they are full, or at the end of a line if the parser
+ * has taken all the others, so it doesn't wait on a slow input.
+ */
+static void * pipeline_scan(void *arg)
+{
+  struct t_pipeline *pipe = arg;
+  struct t_scanner *scanner = &pipe->scanner;
+  struct t_pipe_batch *batch = NULL;
+  struct t_token *token;
+
+  do {
+    token = scanner_next(scanner);
+    if (token) {
+      /* The parser frees it */
+      list_pop(&scanner->t_list);
+      scanner->token = NULL;
+    }
+    else if (!(token = pipeline_eof())) {
+      break;
+    }
+    if (!batch) {
+      batch = malloc(sizeof(struct t_pipe_batch));
+      if (!batch) {
+        fprintf(stderr, "Error: Out of memory for the pipeline\n");
+        token_free(token);
+        break;
+      }
+      batch->n = 0;
+    }
+    batch->tokens[batch->n++] = token;
+    if (batch->n == PIPE_BATCH || token->type == TT_EOF
+        || (token->type == TT_EOL && pipe_drained(&pipe->tokens))) {
+      if (pipe_put(&pipe->tokens, batch) < 0) {
+        pipeline_free_batch(batch, 0);
+        break;
+      }
+      batch = NULL;
+    }
+  } while (token->type != TT_EOF);
+  pipe_end(&pipe->tokens);
+  return NULL;
+}
+
+/*
+ * The parser's scanner takes its tokens from here.
+ */
+static struct t_token * pipeline_next_token(void *arg)
+{
+  struct t_pipeline *pipe = arg;
+
+  if (!pipe->batch || pipe->next == pipe->batch->n) {
+    free(pipe->batch);
+    pipe->batch = pipe_get(&pipe->tokens);
+    pipe->next = 0;
+    if (!pipe->batch) {
+      return pipeline_eof();
+    }
+  }
+  return pipe->batch->tokens[pipe->next++];
+}
+
+static void pipeline_free_stmt(struct t_pipe_stmt *stmt)
+{
+  struct item *item;
+  int i;
+
+  for (item = stmt->code.first; item; item = item->next) {
+    icode_free(item->value);
+  }
+  list_empty(&stmt->code);
+  for (item = stmt->tokens.first; item; item = item->next) {
+    token_free(item->value);
+  }
+  list_empty(&stmt->tokens);
+  for (i=0, item = stmt->funcs.first; item; i++, item = item->next) {
+    if (i >= stmt->installed) {
+      func_free(item->value);
+    }
+  }
+  list_empty(&stmt->funcs);
+  free(stmt);
+}
+
+/*
+ * Parse the next top-level statement, and take it off the parser, with
+ * the tokens it came from. Its icodes are moved to addresses after those
+ * of the statements that are kept, and its functions are linked to their
+ * first icode.
+ */
+static struct t_pipe_stmt * pipeline_parse_stmt(struct t_pipeline *pipe)
+{
+  struct t_parser *parser = &pipe->parser;
+  struct t_pipe_stmt *stmt;
+  struct t_token *token;
+
+  /* A loop jumps back to the icode before it, so one that starts the code needs one */
+  token = parser_token(parser);
+  if (token->type == TT_NAME && strcmp(token->buf, "while") == 0 && !create_icode_append(parser, I_NOP, NULL)) {
+    return NULL;
+  }
+  if (parse_stmt(parser) < 0) {
+    return NULL;
+  }
+  parser_mark_appends(parser);
+  if (parser->fuse && parser_fuse(parser) < 0) {
+    return NULL;
+  }
+  stmt = malloc(sizeof(struct t_pipe_stmt));
+  if (!stmt) {
+    fprintf(stderr, "Error: Out of memory for the pipeline\n");
+    return NULL;
+  }
+
+  stmt->code = parser->output;
+  list_init(&parser->output);
+  stmt->funcs = parser->functions;
+  list_init(&parser->functions);
+  stmt->installed = 0;
+  stmt->base = pipe->base;
+  program_relocate(&stmt->code, &stmt->funcs, stmt->base);
+  if (stmt->funcs.size) {
+    pipe->base += stmt->code.size;
+  }
+
+  /* Every token so far, but the next statement's first */
+  token = list_pop(&parser->scanner.t_list);
+  stmt->tokens = parser->scanner.t_list;
+  list_init(&parser->scanner.t_list);
+  list_push(&parser->scanner.t_list, token);
+  return stmt;
+}
+
+/*
+ * The parser thread: parse the tokens from the scanner a statement at a
+ * time, for the exec.
+ */
+static void * pipeline_parse(void *arg)
+{
+  struct t_pipeline *pipe = arg;
+  struct t_parser *parser = &pipe->parser;
+  struct t_pipe_stmt *stmt;
+  struct t_token *token;
+
+  token = parser_token(parser);
+  for (;;) {
+    while (token->type == TT_EOL || token->type == TT_SEMI || token->type == TT_ERROR) {
+      token = parser_next(parser);
+    }
+    if (token->type == TT_EOF) {
+      break;
+    }
+    stmt = pipeline_parse_stmt(pipe);
+    if (!stmt) {
+      __atomic_store_n(&pipe->failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    if (pipe_put(&pipe->stmts, stmt) < 0) {
+      pipeline_free_stmt(stmt);
+      break;
+    }
+    token = parser_token(parser);
+  }
+  pipe_end(&pipe->stmts);
+
+  /* Stop the scanner, if it isn't done */
+  pipe_stop(&pipe->tokens);
+  return NULL;
+}
+
+/*
+ * Free a statement that has run, unless it defines functions, along with
+ * what the exec and the JIT keep of it.
+ */
+static void pipeline_retire(struct t_pipeline *pipe, struct t_exec *exec, struct t_pipe_stmt *stmt)
+{
+  struct item *item;
+  struct t_icode *icode;
+
+  if (stmt->funcs.size) {
+    list_push(&pipe->kept, stmt);
+    return;
+  }
+  exec_forget(exec, stmt->base, stmt->base + stmt->code.size);
+  for (item = stmt->code.first; item; item = item->next) {
+    icode = item->value;
+    if (icode->jit) {
+      jit_drop(&pipe->program->jit, icode);
+    }
+  }
+  pipeline_free_stmt(stmt);
+}
+
+/*
+ * The exec's feed: retire the statement that ran, and go on with the
+ * next one, once it is parsed.
+ */
+static int pipeline_feed(struct t_exec *exec)
+{
+  struct t_pipeline *pipe = exec->feed_arg;
+  struct t_pipe_stmt *stmt;
+  struct item *item;
+
+  do {
+    if (pipe->stmt) {
+      pipeline_retire(pipe, exec, pipe->stmt);
+      pipe->stmt = NULL;
+    }
+    stmt = pipe_get(&pipe->stmts);
+    if (!stmt) {
+      exec->current = NULL;
+      return __atomic_load_n(&pipe->failed, __ATOMIC_RELAXED) ? -1 : 0;
+    }
+    pipe->stmt = stmt;
+    for (item = stmt->funcs.first; item; item = item->next) {
+      if (program_add_func(pipe->program, item->value) < 0) {
+        return -1;
+      }
+      stmt->installed++;
+    }
+  } while (!stmt->code.first);
+  exec->current = stmt->code.first;
+  return 0;
+}
+
+/*
+ * A pipeline reading in, to be started, and run by an exec on its program.
+ */
+int pipeline_init(struct t_pipeline *pipe, FILE *in)
+{
+  memset(pipe, 0, sizeof(struct t_pipeline));
+  pthread_once(&pipe_cpus_once, pipe_cpus_init);
+  list_init(&pipe->kept);
+  if (pipe_ring_init(&pipe->tokens, PIPE_TOKEN_DEPTH) < 0 || pipe_ring_init(&pipe->stmts, PIPE_STMT_DEPTH) < 0) {
+    pipe_ring_close(&pipe->tokens);
+    pipe_ring_close(&pipe->stmts);
+    return -1;
+  }
+  pipe->program = program_new(NULL);
+  if (!pipe->program || parser_init(&pipe->parser, NULL)) {
+    if (pipe->program) {
+      program_free(pipe->program);
+    }
+    pipe_ring_close(&pipe->tokens);
+    pipe_ring_close(&pipe->stmts);
+    return -1;
+  }
+  pipe->parser.scanner.feed = pipeline_next_token;
+  pipe->parser.scanner.feed_arg = pipe;
+  scanner_init(&pipe->scanner, in);
+  return 0;
+}
+
+/*
+ * Start the scanner and parser threads.
+ */
+int pipeline_start(struct t_pipeline *pipe)
+{
+  if (pthread_create(&pipe->scan_thread, NULL, pipeline_scan, pipe) != 0) {
+    fprintf(stderr, "Error: Can't start the scanner thread\n");
+    return -1;
+  }
+  pipe->started++;
+  if (pthread_create(&pipe->parse_thread, NULL, pipeline_parse, pipe) != 0) {
+    fprintf(stderr, "Error: Can't start the parser thread\n");
+    return -1;
+  }
+  pipe->started++;
+  return 0;
+}
+
+/*
+ * Run the script in exec, on the pipeline's program, statement by
+ * statement as they are parsed.
+ */
+int pipeline_run(struct t_pipeline *pipe, struct t_exec *exec)
+{
+  exec->feed = pipeline_feed;
+  exec->feed_arg = pipe;
+  return exec_statements(exec);
+}
+
+/*
+ * Stop the threads, and free what is left. The exec that ran the program
+ * must be closed first.
+ */
+void pipeline_close(struct t_pipeline *pipe)
+{
+  struct t_pipe_stmt *stmt;
+  struct t_pipe_batch *batch;
+
+  /* The scanner may still wait on its input, until it ends */
+  pipe_stop(&pipe->stmts);
+  pipe_stop(&pipe->tokens);
+  if (pipe->started > 0) {
+    pthread_join(pipe->scan_thread, NULL);
+  }
+  if (pipe->started > 1) {
+    pthread_join(pipe->parse_thread, NULL);
+  }
+
+  /* Before the statements, as its JIT regions start in their icodes */
+  program_free(pipe->program);
+  if (pipe->stmt) {
+    pipeline_free_stmt(pipe->stmt);
+  }
+  while ((stmt = list_pop(&pipe->kept))) {
+    pipeline_free_stmt(stmt);
+  }
+  list_empty(&pipe->kept);
+  while ((stmt = pipe_drain(&pipe->stmts))) {
+    pipeline_free_stmt(stmt);
+  }
+  if (pipe->batch) {
+    pipeline_free_batch(pipe->batch, pipe->next);
+  }
+  while ((batch = pipe_drain(&pipe->tokens))) {
+    pipeline_free_batch(batch, 0);
+  }
+  parser_close(&pipe->parser);
+  scanner_close(&pipe->scanner);
+  pipe_ring_close(&pipe->tokens);
+  pipe_ring_close(&pipe->stmts);
+}
+
+/*
+ * run -p: run the script read from in, pipelined.
+ */
+int pipeline_main(FILE *in)
+{
+  struct t_pipeline pipe;
+  struct t_exec exec;
+  int rc = -1;
+
+  if (pipeline_init(&pipe, in) < 0) {
+    return 1;
+  }
+  if (exec_init_program(&exec, pipe.program) == 0) {
+    core_apply(&exec);
+    if (pipeline_start(&pipe) == 0) {
+      rc = pipeline_run(&pipe, &exec);
+    }
+  }
+  exec_close(&exec);
+  pipeline_close(&pipe);
+  return rc < 0 ? 1 : 0;
+}
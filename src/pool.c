@@ -0,0 +1,285 @@
+/*
+ * Work-stealing thread pool.
+ *
+ * Tasks submitted from outside are dealt out to the workers in turn. A
+ * worker runs its own tasks newest first, which keeps what they touch in
+ * its cache, and steals the oldest task of the next busy worker when it
+ * runs out. Each deque has its own lock, so workers only contend when one
+ * steals from another. Idle workers sleep until tasks are queued.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+
+static int deque_init(struct t_deque *deque)
+{
+  deque->tasks = malloc(sizeof(struct t_pool_task) * POOL_DEQUE_SIZE);
+  if (!deque->tasks) {
+    return -1;
+  }
+  deque->cap = POOL_DEQUE_SIZE;
+  deque->top = 0;
+  deque->bottom = 0;
+  pthread_mutex_init(&deque->lock, NULL);
+  return 0;
+}
+
+static void deque_close(struct t_deque *deque)
+{
+  pthread_mutex_destroy(&deque->lock);
+  free(deque->tasks);
+}
+
+static int deque_push(struct t_deque *deque, struct t_pool_task *task)
+{
+  struct t_pool_task *tasks;
+  long i;
+  int rc = 0;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom - deque->top == deque->cap) {
+    tasks = malloc(sizeof(struct t_pool_task) * deque->cap * 2);
+    if (tasks) {
+      for (i = deque->top; i < deque->bottom; i++) {
+        tasks[i % (deque->cap * 2)] = deque->tasks[i % deque->cap];
+      }
+      free(deque->tasks);
+      deque->tasks = tasks;
+      deque->cap *= 2;
+    }
+    else {
+      rc = -1;
+    }
+  }
+  if (rc == 0) {
+    deque->tasks[deque->bottom % deque->cap] = *task;
+    deque->bottom++;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return rc;
+}
+
+/*
+ * Take the newest task, as the deque's owner does.
+ */
+static int deque_pop(struct t_deque *deque, struct t_pool_task *task)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top) {
+    deque->bottom--;
+    *task = deque->tasks[deque->bottom % deque->cap];
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+/*
+ * Take the oldest task, as a thief does.
+ */
+static int deque_steal(struct t_deque *deque, struct t_pool_task *task)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top) {
+    *task = deque->tasks[deque->top % deque->cap];
+    deque->top++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+/*
+ * The next task for a worker: its own newest, or another worker's oldest.
+ */
+static int pool_take(struct t_pool *pool, int id, struct t_pool_task *task)
+{
+  int i;
+
+  if (deque_pop(&pool->workers[id].deque, task)) {
+    return 1;
+  }
+  for (i=1; i < pool->n; i++) {
+    if (deque_steal(&pool->workers[(id + i) % pool->n].deque, task)) {
+      pool->workers[id].steals++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void * pool_worker(void *arg)
+{
+  struct t_pool_worker *worker = arg;
+  struct t_pool *pool = worker->pool;
+  struct t_pool_task task;
+  int stop;
+
+  for (;;) {
+    if (pool_take(pool, worker->id, &task)) {
+      __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+      task.fn(task.arg, worker->id);
+      if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+
+    /* Submitters signal under the lock, so a task queued now wakes us */
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop && !__atomic_load_n(&pool->queued, __ATOMIC_RELAXED)) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    stop = pool->stop && !__atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+    if (stop) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Number of CPUs online.
+ */
+int pool_cpus(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? (int) n : 1;
+}
+
+/*
+ * Stop the first n workers, and free the pool.
+ */
+static void pool_stop(struct t_pool *pool, int n)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i=0; i < n; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  for (i=0; i < pool->n; i++) {
+    deque_close(&pool->workers[i].deque);
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->n = 0;
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Start n workers, or one per CPU if n is 0.
+ */
+int pool_init(struct t_pool *pool, int n)
+{
+  int i;
+
+  if (n <= 0) {
+    n = pool_cpus();
+  }
+  memset(pool, 0, sizeof(struct t_pool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->workers = calloc(n, sizeof(struct t_pool_worker));
+  if (!pool->workers) {
+    fprintf(stderr, "Error: Out of memory starting %d workers\n", n);
+    pool_stop(pool, 0);
+    return -1;
+  }
+
+  /* Every deque is ready before any worker looks for tasks to steal */
+  for (i=0; i < n; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    if (deque_init(&pool->workers[i].deque) < 0) {
+      fprintf(stderr, "Error: Out of memory starting %d workers\n", n);
+      pool_stop(pool, 0);
+      return -1;
+    }
+    pool->n = i + 1;
+  }
+  for (i=0; i < n; i++) {
+    if (pthread_create(&pool->workers[i].thread, NULL, pool_worker, &pool->workers[i]) != 0) {
+      fprintf(stderr, "Error: Can't start worker %d\n", i);
+      pool_stop(pool, i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Queue fn(arg, worker) to run on one of the workers.
+ */
+int pool_submit(struct t_pool *pool, void (*fn)(void *arg, int worker), void *arg)
+{
+  struct t_pool_task task;
+  int id;
+
+  task.fn = fn;
+  task.arg = arg;
+  id = (unsigned int) __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->n;
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+  if (deque_push(&pool->workers[id].deque, &task) < 0) {
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "Error: Out of memory queueing a task\n");
+    return -1;
+  }
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+/*
+ * Wait until every submitted task has run.
+ */
+void pool_wait(struct t_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Tasks taken from another worker's deque, so far.
+ */
+long pool_steals(struct t_pool *pool)
+{
+  long steals = 0;
+  int i;
+
+  for (i=0; i < pool->n; i++) {
+    steals += pool->workers[i].steals;
+  }
+  return steals;
+}
+
+/*
+ * Run what is still queued, then stop the workers.
+ */
+void pool_close(struct t_pool *pool)
+{
+  pool_stop(pool, pool->n);
+}
@@ -0,0 +1,158 @@
+/*
+ * Programs: parse once, then run in as many execs as needed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "program.h"
+#include "util.h"
+
+/*
+ * A program reading from in, not parsed yet. exec_init() parses into it
+ * as it goes. With in NULL, it reads nothing, and gets its code elsewhere.
+ */
+struct t_program * program_new(FILE *in)
+{
+  struct t_program *program;
+
+  program = malloc(sizeof(struct t_program));
+  if (!program) {
+    fprintf(stderr, "Error: Out of memory creating a program\n");
+    return NULL;
+  }
+  if (parser_init(&program->parser, in)) {
+    free(program);
+    return NULL;
+  }
+  jit_init(&program->jit);
+  return program;
+}
+
+/*
+ * Parse all of in into a program that execs can share. Returns NULL if it
+ * doesn't parse. The program reads in until it is freed, which closes it.
+ */
+struct t_program * program_load(FILE *in)
+{
+  struct t_program *program;
+
+  program = program_new(in);
+  if (!program) {
+    return NULL;
+  }
+  if (parse(&program->parser) < 0) {
+    program_free(program);
+    return NULL;
+  }
+  program_link(program);
+  return program;
+}
+
+/*
+ * Find the entry item of each local function that doesn't have one yet.
+ */
+void program_link(struct t_program *program)
+{
+  struct item *fitem, *item;
+  struct t_func *func;
+
+  for (fitem = program->parser.functions.first; fitem; fitem = fitem->next) {
+    func = (struct t_func *) fitem->value;
+    if (func->entry) {
+      continue;
+    }
+    item = program->parser.output.first;
+    while (item && ((struct t_icode *) item->value)->addr != func->start) {
+      item = item->next;
+    }
+    func->entry = item;
+  }
+}
+
+/*
+ * Add a function to a program that execs may be running. It is put in
+ * place whole before it is linked in, so exec_funcbyname() can look
+ * through the functions meanwhile, without a lock. Only one thread may
+ * add functions.
+ */
+int program_add_func(struct t_program *program, struct t_func *func)
+{
+  struct list *funcs = &program->parser.functions;
+  struct item *item;
+
+  item = calloc(1, sizeof(struct item));
+  if (!item) {
+    fprintf(stderr, "Error: Out of memory adding %s()\n", func->name);
+    return -1;
+  }
+  item->value = func;
+  item->prev = funcs->last;
+  if (funcs->last) {
+    __atomic_store_n(&funcs->last->next, item, __ATOMIC_RELEASE);
+  }
+  else {
+    __atomic_store_n(&funcs->first, item, __ATOMIC_RELEASE);
+  }
+  funcs->last = item;
+  funcs->size++;
+  return 0;
+}
+
+/*
+ * Remove the last n functions added with program_add_func(). No exec may
+ * be running the program. The caller still owns the functions.
+ */
+void program_drop_funcs(struct t_program *program, int n)
+{
+  struct list *funcs = &program->parser.functions;
+  struct item *item;
+
+  while (n-- > 0 && funcs->last) {
+    item = funcs->last;
+    funcs->last = item->prev;
+    if (funcs->last) {
+      funcs->last->next = NULL;
+    }
+    else {
+      funcs->first = NULL;
+    }
+    funcs->size--;
+    free(item);
+  }
+}
+
+/*
+ * Move code parsed on its own, with the functions it defines, to the
+ * addresses from base on, so it can run with a program's code without
+ * sharing addresses with it. The functions are linked to their entries.
+ */
+void program_relocate(struct list *code, struct list *funcs, int base)
+{
+  struct item *item;
+  struct t_icode *icode;
+  struct t_func *func;
+  int i;
+
+  for (item = code->first; item; item = item->next) {
+    icode = item->value;
+    icode->addr += base;
+    for (i=0; i < icode->nparts; i++) {
+      icode->parts[i]->addr += base;
+    }
+  }
+  for (item = funcs->first; item; item = item->next) {
+    func = item->value;
+    func->start += base;
+    func->end += base;
+    func->entry = code->first;
+    while (func->entry && ((struct t_icode *) func->entry->value)->addr != func->start) {
+      func->entry = func->entry->next;
+    }
+  }
+}
+
+void program_free(struct t_program *program)
+{
+  jit_close(&program->jit);
+  parser_close(&program->parser);
+  free(program);
+}
@@ -3,12 +3,15 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
 #include "scanner.h"
 #include "util.h"
 
 #define CC_TABLE_SIZE 256
-int scanner_cc_table[CC_TABLE_SIZE];
-int scanner_cc_table_initialized = 0;
+
+/* Built once per process, by the first scanner_init() */
+static int scanner_cc_table[CC_TABLE_SIZE];
+static pthread_once_t scanner_cc_table_once = PTHREAD_ONCE_INIT;
 
 char *error_names[] = {
   "ERR_NONE",
@@ -41,7 +44,12 @@ char *token_types[] = {
   "TT_SEMI",
   "TT_STRING",
   "TT_LT",
-  "TT_GT"
+  "TT_GT",
+  "TT_BRACKETL",
+  "TT_BRACKETR",
+  "TT_BRACEL",
+  "TT_BRACER",
+  "TT_COLON"
 };
 
 char * scanner_cc_names[] = {
@@ -56,9 +64,9 @@ char * scanner_cc_names[] = {
   "CC_QUOTE"
 };
 
-char *scanner_operators = "~!@%^&*-+=|?/<>";
-char *scanner_delimiters = "()[]{}.:,;";
-char *scanner_quotes = "\"'`";
+const char *scanner_operators = "~!@%^&*-+=|?/<>";
+const char *scanner_delimiters = "()[]{}.:,;";
+const char *scanner_quotes = "\"'`";
 
 /*
  * Initialize a scanner.
@@ -68,12 +76,11 @@ int scanner_init(struct t_scanner *scanner, FILE *in)
   memset(scanner, 0, sizeof(struct t_scanner));
   scanner->in = in;
   
-  if (!scanner_cc_table_initialized) {
-    scanner_build_cc_table();
-    scanner_cc_table_initialized = 1;
-  }
+  pthread_once(&scanner_cc_table_once, scanner_build_cc_table);
 
-  scanner_init_token(scanner, &scanner->unknown, TT_UNKNOWN);
+  if (in) {
+    scanner_init_token(scanner, &scanner->unknown, TT_UNKNOWN);
+  }
 
   list_init(&scanner->t_list);
   list_init(&scanner->t_pushback);
@@ -93,7 +100,9 @@ void scanner_close(struct t_scanner *scanner) {
 
   DBG(2, "Begin.");
 
-  fclose(scanner->in);
+  if (scanner->in) {
+    fclose(scanner->in);
+  }
 
   item = scanner->c_list.first;
   while (item) {
@@ -106,8 +115,7 @@ void scanner_close(struct t_scanner *scanner) {
   item = scanner->t_list.first;
   while (item) {
     t = (struct t_token *) item->value;
-    if (t->buf) free(t->buf);
-    if (t->formatbuf) free(t->formatbuf);
+    token_free(t);
     item = item->next;
   }
 
@@ -177,6 +185,13 @@ void token_copy(struct t_token *dest, const struct t_token *source)
   }
 }
 
+void token_free(struct t_token *token)
+{
+  free(token->buf);
+  free(token->formatbuf);
+  free(token);
+}
+
 int scanner_nextch(struct t_scanner *scanner) {
   return scanner_nextc(scanner)->c;
 }
@@ -351,6 +366,14 @@ struct t_token * scanner_next(struct t_scanner *scanner) {
     token = (struct t_token *) list_pop(&scanner->t_pushback);
     return token;
   }
+
+  /* A fed token is the scanner's from now on, as if it had made it */
+  if (!scanner->in) {
+    token = scanner->feed(scanner->feed_arg);
+    list_push(&scanner->t_list, token);
+    scanner->token = token;
+    return token;
+  }
   
   c = scanner_c(scanner);
   if (scanner_skip_whitespace(scanner)) return NULL;
@@ -464,6 +487,7 @@ struct t_token * scanner_parse_eol(struct t_scanner *scanner) {
 
 struct t_token * scanner_parse_num(struct t_scanner *scanner) {
   int i;
+  int dot = 0;
   struct t_token *token;
   char buf[SCRATCH_BUF_SIZE + 1];
   int buf_i = 0;
@@ -483,7 +507,11 @@ struct t_token * scanner_parse_num(struct t_scanner *scanner) {
       fprintf(stderr, "Failed on call to scanner_nextc()\n");
       return NULL;
     }
-    if (c->c_class != CC_DIGIT) {
+    if (c->c == '.' && !dot) {
+      /* A fraction makes it a float */
+      dot = 1;
+    }
+    else if (c->c_class != CC_DIGIT) {
       break;
     }
   }
@@ -575,6 +603,21 @@ struct t_token * scanner_parse_delim(struct t_scanner *scanner)
   case ')':
     type = TT_PARENR;
     break;
+  case '[':
+    type = TT_BRACKETL;
+    break;
+  case ']':
+    type = TT_BRACKETR;
+    break;
+  case '{':
+    type = TT_BRACEL;
+    break;
+  case '}':
+    type = TT_BRACER;
+    break;
+  case ':':
+    type = TT_COLON;
+    break;
   case ',':
     type = TT_COMMA;
     break;
@@ -691,7 +734,7 @@ int scanner_charclass(int c)
   }
 }
 
-void scanner_build_cc_table()
+void scanner_build_cc_table(void)
 {
   int i;
   for (i=0; i < CC_TABLE_SIZE; ++i) {
@@ -0,0 +1,597 @@
+/*
+ * run -s socket [-w workers] [-n requests] [library...]: a pre-forked
+ * server for short scripts.
+ *
+ * The master parses the libraries once into a program, runs their
+ * top-level code, JIT-compiles their functions, and registers the natives
+ * in the exec that will run requests. It then forks the workers, which get
+ * all of that copy-on-write, and waits on them. Each worker accepts
+ * connections on the socket: a client sends a script and shuts down its
+ * side, and gets back what the script printed, errors included, and a
+ * trailer with whether it failed.
+ *
+ * A request is parsed on its own, and its code is put after the
+ * libraries', at addresses of its own, and its functions are added to the
+ * program's. So it calls library functions as if they were its own, and
+ * reads the libraries' globals, which are frozen. After it has run, its
+ * code, functions and variables are dropped, so the next request finds
+ * the worker as it was, but for the JIT regions of library code, which are
+ * kept.
+ *
+ * A worker exits after max_requests requests, and the master forks another
+ * one. On SIGHUP the master loads the libraries again, and forks workers
+ * with the new state, while those of the old one finish the request they
+ * serve, and exit. If the libraries don't load, the old ones are kept. On
+ * SIGTERM or SIGINT the workers finish their requests, and the master
+ * removes the socket.
+ *
+ * The libraries' top-level code runs in the master, so it shouldn't start
+ * threads: the workers wouldn't have them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "corelib.h"
+#include "pool.h"
+
+static volatile sig_atomic_t server_stopping;
+static volatile sig_atomic_t server_reloading;
+
+static void server_signal(int sig)
+{
+  if (sig == SIGHUP) {
+    server_reloading = 1;
+  }
+  else if (sig == SIGTERM || sig == SIGINT) {
+    server_stopping = 1;
+  }
+}
+
+/*
+ * The libraries' source, one after the other. Returns NULL if one can't
+ * be read.
+ */
+static char * server_read_libs(struct t_server *server, int *len)
+{
+  char *text = NULL, *grown;
+  int cap = 0, n, i;
+  FILE *in;
+
+  *len = 0;
+  for (i=0; i < server->nlibs; i++) {
+    in = fopen(server->libs[i], "r");
+    if (!in) {
+      fprintf(stderr, "Error: Can't open %s: %s\n", server->libs[i], strerror(errno));
+      free(text);
+      return NULL;
+    }
+    do {
+      grown = util_grow(text, &cap, *len + 4096);
+      if (!grown) {
+        fprintf(stderr, "Error: Out of memory reading %s\n", server->libs[i]);
+        fclose(in);
+        free(text);
+        return NULL;
+      }
+      text = grown;
+      n = fread(text + *len, 1, cap - *len - 1, in);
+      *len += n;
+    } while (n > 0);
+    fclose(in);
+    text[(*len)++] = '\n';
+  }
+  grown = util_grow(text, &cap, *len + 1);
+  if (!grown) {
+    fprintf(stderr, "Error: Out of memory reading the libraries\n");
+    free(text);
+    return NULL;
+  }
+  text = grown;
+  text[(*len)++] = '\n';
+  return text;
+}
+
+static void server_freeze(struct t_exec *exec, int frozen)
+{
+  struct item *item;
+
+  for (item = exec->vars.first; item; item = item->next) {
+    value_freeze(((struct t_var *) item->value)->value, frozen);
+  }
+}
+
+static void server_unload(struct t_server_state *state)
+{
+  server_freeze(&state->lib, 0);
+  exec_close(&state->exec);
+  exec_close(&state->lib);
+  program_free(state->program);
+  free(state->text);
+  free(state);
+}
+
+/*
+ * Load the libraries, run them, and make the exec that runs requests.
+ * Returns NULL if they don't load or fail.
+ */
+static struct t_server_state * server_load(struct t_server *server)
+{
+  struct t_server_state *state;
+  struct t_program *program;
+  struct t_icode *nop;
+  struct t_func *func;
+  struct item *item;
+  FILE *in;
+  int len;
+
+  state = calloc(1, sizeof(struct t_server_state));
+  if (!state) {
+    fprintf(stderr, "Error: Out of memory loading the libraries\n");
+    return NULL;
+  }
+  state->text = server_read_libs(server, &len);
+  if (!state->text) {
+    free(state);
+    return NULL;
+  }
+  in = fmemopen(state->text, len, "r");
+  if (!in) {
+    fprintf(stderr, "Error: Can't read the libraries: %s\n", strerror(errno));
+    free(state->text);
+    free(state);
+    return NULL;
+  }
+  program = program_load(in);
+  if (!program) {
+    free(state->text);
+    free(state);
+    return NULL;
+  }
+  state->program = program;
+
+  /* A request that starts with a loop jumps back to the icode before it */
+  nop = icode_new(I_NOP, NULL);
+  nop->addr = program->parser.output.size;
+  list_push(&program->parser.output, nop);
+
+  exec_init_program(&state->lib, program);
+  core_apply(&state->lib);
+  exec_init_program(&state->exec, program);
+  core_apply(&state->exec);
+  state->exec.globals = &state->lib.vars;
+  if (exec_statements(&state->lib) < 0) {
+    server_unload(state);
+    return NULL;
+  }
+  server_freeze(&state->lib, 1);
+
+  /* Compiled now, once, and not again in the workers */
+  for (item = program->parser.functions.first; item && program->jit.enabled; item = item->next) {
+    func = item->value;
+    jit_func(&state->lib, func);
+    func->hits = program->jit.threshold;
+  }
+  return state;
+}
+
+/*
+ * Run a request's script after the libraries' code, and drop it again.
+ */
+static int server_run(struct t_server_state *state, char *text, int len)
+{
+  struct t_program *program = state->program;
+  struct t_exec *exec = &state->exec;
+  struct list *code = &program->parser.output;
+  struct item *last = code->last;
+  struct t_parser parser;
+  struct t_icode *icode;
+  struct item *item;
+  FILE *in;
+  int base = code->size;
+  int nfuncs = 0;
+  int rc = -1;
+
+  in = fmemopen(text, len, "r");
+  if (!in) {
+    fprintf(stderr, "Error: Can't read the request: %s\n", strerror(errno));
+    return -1;
+  }
+  if (parser_init(&parser, in)) {
+    return -1;
+  }
+  if (parse(&parser) == 0) {
+    rc = 0;
+  }
+  if (rc == 0 && parser.output.first) {
+    program_relocate(&parser.output, &parser.functions, base);
+    last->next = parser.output.first;
+    parser.output.first->prev = last;
+    code->last = parser.output.last;
+    code->size += parser.output.size;
+    for (item = parser.functions.first; item; item = item->next) {
+      if (program_add_func(program, item->value) < 0) {
+        break;
+      }
+      nfuncs++;
+    }
+    if (!item) {
+      exec->current = parser.output.first;
+      rc = exec_statements(exec);
+    }
+    else {
+      rc = -1;
+    }
+
+    last->next = NULL;
+    parser.output.first->prev = NULL;
+    code->last = last;
+    code->size = base;
+    program_drop_funcs(program, nfuncs);
+  }
+  exec_reset(exec);
+
+  /* Library code may have resolved calls to the request's functions too */
+  exec_forget(exec, nfuncs ? 0 : base, base + parser.output.size);
+  for (item = parser.output.first; item; item = item->next) {
+    icode = item->value;
+    if (icode->jit) {
+      jit_drop(&program->jit, icode);
+    }
+  }
+  parser_close(&parser);
+  return rc;
+}
+
+/*
+ * Read a request from a connection, up to the end of the client's side.
+ */
+static char * server_read(int fd, int *len)
+{
+  char *text = NULL, *grown;
+  int cap = 0;
+  ssize_t n;
+
+  *len = 0;
+  do {
+    if (*len + 4096 > SERVER_MAX_REQUEST) {
+      fprintf(stderr, "Error: A request can be up to %d bytes\n", SERVER_MAX_REQUEST);
+      free(text);
+      return NULL;
+    }
+    grown = util_grow(text, &cap, *len + 4096);
+    if (!grown) {
+      fprintf(stderr, "Error: Out of memory reading a request\n");
+      free(text);
+      return NULL;
+    }
+    text = grown;
+    n = read(fd, text + *len, cap - *len);
+    if (n < 0 && errno != EINTR) {
+      fprintf(stderr, "Error: Can't read a request: %s\n", strerror(errno));
+      free(text);
+      return NULL;
+    }
+    if (n > 0) {
+      *len += n;
+    }
+  } while (n != 0);
+  return text;
+}
+
+/*
+ * Serve a connection: its output and errors go to the client, and then
+ * the trailer, with whether the script ran.
+ */
+static void server_serve(struct t_server_state *state, int fd)
+{
+  char trailer[SERVER_TRAILER_LEN] = {'\0', '1'};
+  char *text;
+  int len, out, err;
+
+  fflush(stdout);
+  fflush(stderr);
+  out = dup(STDOUT_FILENO);
+  err = dup(STDERR_FILENO);
+  if (out < 0 || err < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
+    fprintf(stderr, "Error: Can't answer a request: %s\n", strerror(errno));
+  }
+  else {
+    text = server_read(fd, &len);
+    if (text) {
+      if (server_run(state, text, len) == 0) {
+        trailer[1] = '0';
+      }
+      free(text);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if (write(fd, trailer, SERVER_TRAILER_LEN) < 0) {
+      /* The client is gone */
+    }
+  }
+  if (out >= 0) {
+    dup2(out, STDOUT_FILENO);
+    close(out);
+  }
+  if (err >= 0) {
+    dup2(err, STDERR_FILENO);
+    close(err);
+  }
+}
+
+/*
+ * A worker: serve connections until it has served max_requests, or it is
+ * stopped. It only takes the signal to stop while it waits for one, so a
+ * request is never cut short.
+ */
+static void server_worker(struct t_server *server)
+{
+  struct sigaction sa;
+  fd_set ready;
+  sigset_t blocked, waiting, pending;
+  int served = 0;
+  int fd;
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGPIPE, &sa, NULL);
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGCHLD, &sa, NULL);
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGINT);
+  sigprocmask(SIG_SETMASK, &blocked, NULL);
+  sigemptyset(&waiting);
+
+  while (!server_stopping && (!server->max_requests || served < server->max_requests)) {
+    FD_ZERO(&ready);
+    FD_SET(server->fd, &ready);
+    if (pselect(server->fd + 1, &ready, NULL, NULL, NULL, &waiting) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: Can't wait for requests: %s\n", strerror(errno));
+      exit(1);
+    }
+    /*
+     * Stopped meanwhile: the request is left for another worker. If the
+     * socket was ready too, the signal is still pending.
+     */
+    sigpending(&pending);
+    if (server_stopping || sigismember(&pending, SIGTERM) || sigismember(&pending, SIGINT)) {
+      break;
+    }
+    fd = accept(server->fd, NULL, NULL);
+    if (fd < 0) {
+      /* Another worker took it */
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Error: Can't accept a request: %s\n", strerror(errno));
+      exit(1);
+    }
+    server_serve(server->state, fd);
+    close(fd);
+    served++;
+  }
+  exit(0);
+}
+
+/*
+ * Fork the workers missing from the current generation, into free slots.
+ */
+static void server_fork(struct t_server *server)
+{
+  pid_t pid;
+  int i, n = 0;
+
+  for (i=0; i < 2 * server->nworkers; i++) {
+    if (server->workers[i].pid && server->workers[i].gen == server->gen) {
+      n++;
+    }
+  }
+  for (i=0; i < 2 * server->nworkers && n < server->nworkers; i++) {
+    if (server->workers[i].pid) {
+      continue;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Error: Can't fork a worker: %s\n", strerror(errno));
+      return;
+    }
+    if (pid == 0) {
+      server_worker(server);
+    }
+    server->workers[i].pid = pid;
+    server->workers[i].gen = server->gen;
+    n++;
+  }
+}
+
+/*
+ * Reap the workers that exited. Those of the current generation are
+ * replaced, unless the server stops.
+ */
+static void server_reap(struct t_server *server)
+{
+  pid_t pid;
+  int status, i;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (i=0; i < 2 * server->nworkers && server->workers[i].pid != pid; i++);
+    if (i == 2 * server->nworkers) {
+      continue;
+    }
+    server->workers[i].pid = 0;
+    if (server->workers[i].gen != server->gen || server_stopping) {
+      continue;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      fprintf(stderr, "server: recycled a worker\n");
+    }
+    else {
+      fprintf(stderr, "server: a worker failed\n");
+      /* Not as fast as it can fail again */
+      usleep(100000);
+    }
+  }
+}
+
+static void server_kill(struct t_server *server, int below)
+{
+  int i;
+
+  for (i=0; i < 2 * server->nworkers; i++) {
+    if (server->workers[i].pid && server->workers[i].gen < below) {
+      kill(server->workers[i].pid, SIGTERM);
+    }
+  }
+}
+
+/*
+ * Load the libraries again, and move over to workers forked from them.
+ */
+static void server_reload(struct t_server *server)
+{
+  struct t_server_state *state;
+
+  state = server_load(server);
+  if (!state) {
+    fprintf(stderr, "server: reload failed, keeping the libraries loaded before\n");
+    return;
+  }
+  server_unload(server->state);
+  server->state = state;
+  server->gen++;
+  server_kill(server, server->gen);
+  fprintf(stderr, "server: reloaded\n");
+}
+
+static int server_listen(struct t_server *server)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen(server->path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: The socket path %s is too long\n", server->path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, server->path);
+
+  /* Left by a server that didn't stop */
+  if (stat(server->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(server->path);
+  }
+  server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server->fd < 0 || bind(server->fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) < 0
+      || listen(server->fd, SOMAXCONN) < 0 || fcntl(server->fd, F_SETFL, O_NONBLOCK) < 0) {
+    fprintf(stderr, "Error: Can't listen on %s: %s\n", server->path, strerror(errno));
+    if (server->fd >= 0) {
+      close(server->fd);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+int server_main(int argc, char **argv)
+{
+  struct t_server server;
+  struct sigaction sa;
+  sigset_t blocked, waiting;
+  int i;
+
+  memset(&server, 0, sizeof(struct t_server));
+  server.fd = -1;
+  for (i=1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      server.path = argv[++i];
+    }
+    else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      server.nworkers = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      server.max_requests = atoi(argv[++i]);
+    }
+    else {
+      server.path = NULL;
+      break;
+    }
+  }
+  if (!server.nworkers) {
+    server.nworkers = pool_cpus();
+  }
+  if (!server.path || server.nworkers < 1 || server.nworkers > SERVER_MAX_WORKERS || server.max_requests < 0) {
+    fprintf(stderr, "Usage: run -s socket [-w workers] [-n requests] [library...]\n");
+    return 2;
+  }
+  server.libs = argv + i;
+  server.nlibs = argc - i;
+
+  /* Signals are only taken while the master waits */
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGCHLD);
+  sigaddset(&blocked, SIGHUP);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGINT);
+  sigprocmask(SIG_BLOCK, &blocked, &waiting);
+  sigdelset(&waiting, SIGCHLD);
+  sigdelset(&waiting, SIGHUP);
+  sigdelset(&waiting, SIGTERM);
+  sigdelset(&waiting, SIGINT);
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = server_signal;
+  sigaction(SIGCHLD, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  server.state = server_load(&server);
+  if (!server.state) {
+    return 2;
+  }
+  if (server_listen(&server) < 0) {
+    server_unload(server.state);
+    return 2;
+  }
+  fprintf(stderr, "server: listening on %s with %d workers\n", server.path, server.nworkers);
+
+  while (!server_stopping) {
+    server_reap(&server);
+    if (server_reloading) {
+      server_reloading = 0;
+      server_reload(&server);
+    }
+    if (!server_stopping) {
+      server_fork(&server);
+      sigsuspend(&waiting);
+    }
+  }
+
+  server_kill(&server, server.gen + 1);
+  for (i=0; i < 2 * server.nworkers; i++) {
+    if (server.workers[i].pid) {
+      waitpid(server.workers[i].pid, NULL, 0);
+    }
+  }
+  close(server.fd);
+  unlink(server.path);
+  server_unload(server.state);
+  fprintf(stderr, "server: stopped\n");
+  return 0;
+}
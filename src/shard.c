@@ -0,0 +1,807 @@
+/*
+ * run -d script input [-f function] [-k shards] [-w workers] [-a address]...
+ * runs a script's function on each line of an input, in worker processes,
+ * and run -r address is such a worker, for coordinators on other hosts.
+ *
+ * The coordinator maps the input and splits it into shards of about the
+ * same size, at line ends. It forks workers on socket pairs, or connects
+ * to those started with run -r, on a Unix socket path or a TCP host:port,
+ * and sends each the script. A worker runs the script's top-level code
+ * once, and then calls the function, which takes 1 argument, on each line
+ * of the shards it is sent, without its newline. It answers a shard with
+ * what the calls printed, and the sum of the numbers they returned.
+ *
+ * A thread of the coordinator feeds each worker the shards that are left,
+ * so a fast worker takes more of them. If a worker goes away before it
+ * answers, its shard is given to another one, up to SHARD_MAX_TRIES
+ * times, and the run goes on with the workers left. A script that fails
+ * fails the run: it would fail again on any worker. Once all shards are
+ * done, what they printed is printed in input order, and then the sum, if
+ * a call returned a number. So the output is the same for any number of
+ * workers and shards, and whichever of them ran what.
+ *
+ * The script is sent as source, and each worker parses it again, once per
+ * connection. Its top-level code runs in every worker, and what it prints
+ * there is dropped; its globals are frozen while the function is called.
+ *
+ * A worker runs whatever script a coordinator sends it, with no check of
+ * who that is, so anyone who can connect to it can run code as its user.
+ * run -r :port listens on 127.0.0.1 only; a host, such as 0.0.0.0:port,
+ * exposes the worker to that network, which must be trusted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "shard.h"
+#include "program.h"
+#include "corelib.h"
+#include "pool.h"
+
+static int shard_write(int fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Read len bytes. Returns -1 if the other side closed first.
+ */
+static int shard_read(int fd, char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Send a message of head and then body, either of which can be empty.
+ */
+static int shard_send(int fd, int type, const char *head, int headlen, const char *body, int bodylen)
+{
+  unsigned char hdr[5];
+  uint32_t len = htonl(headlen + bodylen);
+
+  hdr[0] = type;
+  memcpy(hdr + 1, &len, 4);
+  if (shard_write(fd, (char *) hdr, 5) < 0 || shard_write(fd, head, headlen) < 0 || shard_write(fd, body, bodylen) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Receive a message, as its type, and its bytes, which the caller frees.
+ * Returns NULL if the connection is gone, or the message is too large.
+ */
+static char * shard_recv(int fd, int *type, int *len)
+{
+  unsigned char hdr[5];
+  uint32_t n;
+  char *data;
+
+  if (shard_read(fd, (char *) hdr, 5) < 0) {
+    return NULL;
+  }
+  memcpy(&n, hdr + 1, 4);
+  n = ntohl(n);
+  if (n > SHARD_MAX_MSG) {
+    fprintf(stderr, "Error: A shard message can be up to %d bytes\n", SHARD_MAX_MSG);
+    return NULL;
+  }
+  data = malloc(n + 1);
+  if (!data) {
+    fprintf(stderr, "Error: Out of memory receiving a shard message\n");
+    return NULL;
+  }
+  if (shard_read(fd, data, n) < 0) {
+    free(data);
+    return NULL;
+  }
+  data[n] = '\0';
+  *type = hdr[0];
+  *len = n;
+  return data;
+}
+
+/*
+ * Add a call's result to a sum, which is null until a number is added.
+ */
+static int shard_add(struct t_value *sum, struct t_value *value, const char *name)
+{
+  if (value->type == VAL_NULL) {
+    return 0;
+  }
+  if (!value_is_num(value)) {
+    fprintf(stderr, "Error: run -d needs %s() to return a number, got %s.\n", name, value_types[value->type]);
+    return -1;
+  }
+  if (sum->type == VAL_NULL) {
+    value_init(sum, VAL_INT);
+  }
+  if (sum->type == VAL_INT && value->type == VAL_INT) {
+    if (__builtin_add_overflow(sum->intval, value->intval, &sum->intval)) {
+      fprintf(stderr, "Error: Integer overflow adding the results of %s()\n", name);
+      return -1;
+    }
+    return 0;
+  }
+  sum->floatval = value_num(sum) + value_num(value);
+  sum->type = VAL_FLOAT;
+  return 0;
+}
+
+static void shard_freeze(struct t_exec *exec, int frozen)
+{
+  struct item *item;
+
+  for (item = exec->vars.first; item; item = item->next) {
+    value_freeze(((struct t_var *) item->value)->value, frozen);
+  }
+}
+
+/*
+ * Call func on each line of a shard, and answer with what the calls
+ * printed and their sum.
+ */
+static int shard_run(struct t_exec *exec, struct t_func *func, int fd, char *data, int len)
+{
+  struct t_mapfile lines;
+  struct t_value arg, sum;
+  struct t_value *argv[1];
+  struct t_value *result;
+  const char *line;
+  char head[64], *out;
+  int n, outlen, mark;
+  int rc = 0;
+
+  lines.data = data;
+  lines.size = len;
+  lines.pos = 0;
+  value_init(&arg, VAL_STRING);
+  value_init(&sum, VAL_NULL);
+  argv[0] = &arg;
+  while (rc == 0 && (n = mapfile_line(&lines, &line)) >= 0) {
+    if (value_set_str(&arg, line, n) < 0) {
+      rc = -1;
+      break;
+    }
+    mark = exec->values.size;
+    result = exec_call(exec, func, 1, argv);
+    if (!result || shard_add(&sum, result, func->name) < 0) {
+      rc = -1;
+    }
+    exec_reclaim(exec, mark);
+  }
+  value_close(&arg);
+
+  out = output_take(&exec->out, &outlen);
+  if (rc < 0 || !out) {
+    free(out);
+    return shard_send(fd, SHARD_MSG_FAILED, NULL, 0, NULL, 0) < 0 ? -1 : 1;
+  }
+  if (sum.type == VAL_INT) {
+    n = snprintf(head, sizeof(head), "i %lld\n", sum.intval);
+  }
+  else if (sum.type == VAL_FLOAT) {
+    n = snprintf(head, sizeof(head), "f %.17g\n", sum.floatval);
+  }
+  else {
+    n = snprintf(head, sizeof(head), "n\n");
+  }
+  rc = shard_send(fd, SHARD_MSG_RESULT, head, n, out, outlen);
+  free(out);
+  return rc;
+}
+
+/*
+ * Serve a coordinator's connection: run the program it sends, and then
+ * the shards, until it closes its side. Returns -1 if the script failed.
+ */
+int shard_serve(int fd)
+{
+  struct t_program *program;
+  struct t_exec lib, exec;
+  struct t_func *func = NULL;
+  char *text, *data, *name, *script;
+  int type, len, n;
+  int rc = -1;
+  FILE *in;
+
+  text = shard_recv(fd, &type, &len);
+  if (!text) {
+    return -1;
+  }
+  script = memchr(text, '\n', len);
+  if (type != SHARD_MSG_PROGRAM || !script) {
+    fprintf(stderr, "Error: Expected a program from the coordinator\n");
+    free(text);
+    return -1;
+  }
+  name = text;
+  *script++ = '\0';
+  in = fmemopen(script, len - (script - text), "r");
+  if (!in) {
+    fprintf(stderr, "Error: Can't read the script: %s\n", strerror(errno));
+    shard_send(fd, SHARD_MSG_FAILED, NULL, 0, NULL, 0);
+    free(text);
+    return -1;
+  }
+  program = program_load(in);
+  if (!program) {
+    shard_send(fd, SHARD_MSG_FAILED, NULL, 0, NULL, 0);
+    free(text);
+    return -1;
+  }
+
+  /* The top-level code runs once, and its globals are read by the calls */
+  exec_init_program(&lib, program);
+  core_apply(&lib);
+  output_capture(&lib.out);
+  exec_init_program(&exec, program);
+  core_apply(&exec);
+  output_capture(&exec.out);
+  exec.globals = &lib.vars;
+  if (exec_statements(&lib) == 0) {
+    free(output_take(&lib.out, &n));
+    shard_freeze(&lib, 1);
+    program_link(program);
+    func = exec_funcbyname(&exec, name);
+    if (!func || func->native || func->invoke) {
+      fprintf(stderr, "Error: Function %s() is not defined in the script\n", name);
+      func = NULL;
+    }
+    else if (func->argc != 1) {
+      fprintf(stderr, "Error: run -d needs %s() to take 1 argument, not %d.\n", name, func->argc);
+      func = NULL;
+    }
+  }
+
+  if (!func) {
+    shard_send(fd, SHARD_MSG_FAILED, NULL, 0, NULL, 0);
+  }
+  else if (shard_send(fd, SHARD_MSG_RESULT, NULL, 0, NULL, 0) == 0) {
+    /* Until the coordinator has no more shards, or a call fails */
+    while ((data = shard_recv(fd, &type, &len))) {
+      if (type != SHARD_MSG_SHARD) {
+        fprintf(stderr, "Error: Expected a shard from the coordinator\n");
+        free(data);
+        break;
+      }
+      n = shard_run(&exec, func, fd, data, len);
+      free(data);
+      if (n != 0) {
+        break;
+      }
+    }
+    rc = data ? -1 : 0;
+  }
+
+  shard_freeze(&lib, 0);
+  exec_close(&exec);
+  exec_close(&lib);
+  program_free(program);
+  free(text);
+  return rc;
+}
+
+/*
+ * A socket on address, a Unix socket path, or host:port for TCP, which
+ * listens on it or is connected to it. The host is 127.0.0.1 if it is
+ * left out. Returns -1 if it can't be.
+ */
+static int shard_socket(const char *address, int listening)
+{
+  struct sockaddr_un addr;
+  struct addrinfo hints, *res, *ai;
+  struct stat st;
+  char host[256];
+  const char *port;
+  int fd = -1, on = 1, rc;
+
+  port = strrchr(address, ':');
+  if (!port) {
+    if (strlen(address) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Error: The socket path %s is too long\n", address);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address);
+    /* Left by a worker that didn't stop */
+    if (listening && stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(address);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && (listening ? bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) < 0 || listen(fd, SOMAXCONN) < 0
+                    : connect(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) < 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  else {
+    if (port - address >= (int) sizeof(host)) {
+      fprintf(stderr, "Error: The host in %s is too long\n", address);
+      return -1;
+    }
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    if (!host[0]) {
+      strcpy(host, "127.0.0.1");
+    }
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(host, port + 1, &hints, &res);
+    if (rc != 0) {
+      fprintf(stderr, "Error: Can't resolve %s: %s\n", address, gai_strerror(rc));
+      return -1;
+    }
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0
+          : connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(res);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Error: Can't %s %s: %s\n", listening ? "listen on" : "connect to", address, strerror(errno));
+  }
+  return fd;
+}
+
+/*
+ * run -r address: serve coordinators, one connection at a time.
+ */
+static int shard_listen(const char *address)
+{
+  int fd, conn;
+
+  fd = shard_socket(address, 1);
+  if (fd < 0) {
+    return 2;
+  }
+  fprintf(stderr, "shard: listening on %s\n", address);
+  for (;;) {
+    conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Error: Can't accept a coordinator: %s\n", strerror(errno));
+      close(fd);
+      return 1;
+    }
+    shard_serve(conn);
+    close(conn);
+  }
+}
+
+/*
+ * A shard that was given to a worker which went away, back on the queue,
+ * unless it went away with it too often. Under the run's lock.
+ */
+static void shard_lost(struct t_shard_run *run, int i)
+{
+  if (run->failed) {
+    return;
+  }
+  if (run->shards[i].tries >= SHARD_MAX_TRIES) {
+    fprintf(stderr, "Error: Shard %d was lost with %d workers\n", i + 1, SHARD_MAX_TRIES);
+    run->failed = 1;
+    return;
+  }
+  run->queue[run->nqueue++] = i;
+  run->retried++;
+}
+
+/*
+ * A result's sum and output, which data holds.
+ */
+static int shard_result(struct t_shard *shard, char *data, int len)
+{
+  char *end = memchr(data, '\n', len);
+
+  if (!end) {
+    return -1;
+  }
+  if (data[0] == 'i') {
+    value_init(&shard->sum, VAL_INT);
+    shard->sum.intval = strtoll(data + 2, NULL, 10);
+  }
+  else if (data[0] == 'f') {
+    value_init(&shard->sum, VAL_FLOAT);
+    shard->sum.floatval = strtod(data + 2, NULL);
+  }
+  shard->outlen = len - (end + 1 - data);
+  memmove(data, end + 1, shard->outlen);
+  shard->out = data;
+  return 0;
+}
+
+/*
+ * A coordinator's thread for a worker: send it the program, and then
+ * shards, while there are any.
+ */
+static void * shard_feed(void *arg)
+{
+  struct t_shard_conn *conn = arg;
+  struct t_shard_run *run = conn->run;
+  struct t_shard *shard;
+  char *data;
+  int type, len, i = -1;
+
+  data = NULL;
+  if (shard_send(conn->fd, SHARD_MSG_PROGRAM, run->program, run->programlen, NULL, 0) == 0) {
+    data = shard_recv(conn->fd, &type, &len);
+  }
+  if (data && type == SHARD_MSG_RESULT) {
+    free(data);
+    data = NULL;
+    for (;;) {
+      pthread_mutex_lock(&run->lock);
+      while (!run->nqueue && run->remaining && !run->failed) {
+        pthread_cond_wait(&run->cond, &run->lock);
+      }
+      if (!run->remaining || run->failed) {
+        pthread_mutex_unlock(&run->lock);
+        i = -1;
+        break;
+      }
+      i = run->queue[--run->nqueue];
+      shard = &run->shards[i];
+      shard->tries++;
+      pthread_mutex_unlock(&run->lock);
+
+      data = NULL;
+      if (shard_send(conn->fd, SHARD_MSG_SHARD, shard->data, shard->len, NULL, 0) == 0) {
+        data = shard_recv(conn->fd, &type, &len);
+      }
+      if (!data || type != SHARD_MSG_RESULT) {
+        break;
+      }
+      pthread_mutex_lock(&run->lock);
+      if (shard_result(shard, data, len) < 0) {
+        fprintf(stderr, "Error: A worker sent a result that can't be read\n");
+        run->failed = 1;
+        free(data);
+      }
+      else {
+        shard->done = 1;
+        run->remaining--;
+      }
+      pthread_cond_broadcast(&run->cond);
+      pthread_mutex_unlock(&run->lock);
+      data = NULL;
+      i = -1;
+    }
+  }
+
+  /* A failed script fails the run; a worker that went away is left out */
+  pthread_mutex_lock(&run->lock);
+  if (data) {
+    if (!run->failed) {
+      if (i >= 0) {
+        fprintf(stderr, "Error: Shard %d failed\n", i + 1);
+      }
+      else {
+        fprintf(stderr, "Error: The script failed to start on a worker\n");
+      }
+    }
+    run->failed = 1;
+    free(data);
+  }
+  else if (i >= 0) {
+    shard_lost(run, i);
+  }
+  run->alive--;
+  pthread_cond_broadcast(&run->cond);
+  pthread_mutex_unlock(&run->lock);
+  return NULL;
+}
+
+/*
+ * Split the input into shards of about size / n bytes, each ending after
+ * a newline, or at the end. Returns -1 if out of memory.
+ */
+static int shard_split(struct t_shard_run *run, int n)
+{
+  struct t_mapfile *input = run->input;
+  const char *nl;
+  size_t start = 0, end;
+  int i;
+
+  run->shards = calloc(n, sizeof(struct t_shard));
+  run->queue = malloc(sizeof(int) * n);
+  if (!run->shards || !run->queue) {
+    fprintf(stderr, "Error: Out of memory splitting the input\n");
+    return -1;
+  }
+  for (i=0; i < n && start < input->size; i++) {
+    end = input->size / n * (i + 1) + input->size % n * (i + 1) / n;
+    if (end <= start) {
+      end = start + 1;
+    }
+    if (end < input->size) {
+      nl = memchr(input->data + end - 1, '\n', input->size - end + 1);
+      end = nl ? nl - input->data + 1 : input->size;
+    }
+    run->shards[run->nshards].data = input->data + start;
+    run->shards[run->nshards].len = end - start;
+    value_init(&run->shards[run->nshards].sum, VAL_NULL);
+    run->nshards++;
+    start = end;
+  }
+
+  /* Taken from the end, so the first shards go first */
+  for (i=0; i < run->nshards; i++) {
+    run->queue[i] = run->nshards - 1 - i;
+  }
+  run->nqueue = run->nshards;
+  run->remaining = run->nshards;
+  return 0;
+}
+
+/*
+ * The script, after the function's name and a newline.
+ */
+static int shard_program(struct t_shard_run *run, const char *path, const char *name)
+{
+  struct t_mapfile *script;
+  int len = strlen(name);
+
+  script = mapfile_open(path);
+  if (!script) {
+    return -1;
+  }
+  if (script->size > SHARD_MAX_MSG - len - 1) {
+    fprintf(stderr, "Error: A script can be up to %d bytes\n", SHARD_MAX_MSG - len - 1);
+    mapfile_close(script);
+    return -1;
+  }
+  run->program = malloc(len + 1 + script->size);
+  if (!run->program) {
+    fprintf(stderr, "Error: Out of memory reading %s\n", path);
+    mapfile_close(script);
+    return -1;
+  }
+  memcpy(run->program, name, len);
+  run->program[len] = '\n';
+  if (script->size) {
+    memcpy(run->program + len + 1, script->data, script->size);
+  }
+  run->programlen = len + 1 + script->size;
+  mapfile_close(script);
+  return 0;
+}
+
+/*
+ * Fork a local worker on a socket pair. Returns -1 if it can't be.
+ */
+static int shard_fork(struct t_shard_run *run, struct t_shard_conn *conn)
+{
+  int sv[2], i;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    fprintf(stderr, "Error: Can't make a socket pair: %s\n", strerror(errno));
+    return -1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  conn->pid = fork();
+  if (conn->pid < 0) {
+    fprintf(stderr, "Error: Can't fork a worker: %s\n", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (conn->pid == 0) {
+    /* The other workers see their coordinator close its side, not this one */
+    for (i=0; i < run->nconns; i++) {
+      close(run->conns[i].fd);
+    }
+    close(sv[0]);
+    exit(shard_serve(sv[1]) < 0 ? 1 : 0);
+  }
+  close(sv[1]);
+  conn->fd = sv[0];
+  return 0;
+}
+
+static void shard_usage(void)
+{
+  fprintf(stderr, "Usage: run -d script input [-f function] [-k shards] [-w workers] [-a address]...\n"
+          "       run -r address\n"
+          "A worker runs any script sent to it. run -r :port listens on 127.0.0.1;\n"
+          "only give it another host on a trusted network.\n");
+}
+
+int shard_main(int argc, char **argv)
+{
+  struct t_shard_run run;
+  struct t_shard_conn *conn;
+  struct t_shard *shard;
+  struct t_value total;
+  struct sigaction sa;
+  const char *name = "map";
+  const char *addresses[SHARD_MAX_WORKERS];
+  char buf[64];
+  int nworkers = 0, naddresses = 0, nshards = 0;
+  int i, rc = 0;
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+  if (strcmp(argv[1], "-r") == 0) {
+    if (argc != 3) {
+      shard_usage();
+      return 2;
+    }
+    return shard_listen(argv[2]);
+  }
+
+  for (i=4; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      name = argv[++i];
+    }
+    else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      nshards = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      nworkers = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc && naddresses < SHARD_MAX_WORKERS) {
+      addresses[naddresses++] = argv[++i];
+    }
+    else {
+      break;
+    }
+  }
+  if (!nworkers && !naddresses) {
+    nworkers = pool_cpus();
+  }
+  if (argc < 4 || i < argc || strchr(name, '\n') || nworkers < 0 || nworkers + naddresses > SHARD_MAX_WORKERS || nshards < 0) {
+    shard_usage();
+    return 2;
+  }
+  if (!nshards) {
+    nshards = 4 * (nworkers + naddresses);
+  }
+
+  memset(&run, 0, sizeof(struct t_shard_run));
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.cond, NULL);
+  if (shard_program(&run, argv[2], name) < 0 || !(run.input = mapfile_open(argv[3])) || shard_split(&run, nshards) < 0) {
+    rc = 2;
+  }
+
+  /* Local workers are forked before any thread is started */
+  for (i=0; rc == 0 && i < nworkers + naddresses; i++) {
+    conn = &run.conns[run.nconns];
+    conn->run = &run;
+    conn->fd = -1;
+    if (i < nworkers) {
+      if (shard_fork(&run, conn) < 0) {
+        continue;
+      }
+    }
+    else {
+      conn->address = addresses[i - nworkers];
+      conn->fd = shard_socket(conn->address, 0);
+      if (conn->fd < 0) {
+        continue;
+      }
+    }
+    run.nconns++;
+  }
+  run.alive = run.nconns;
+  if (rc == 0 && !run.nconns) {
+    fprintf(stderr, "Error: No workers to run the shards on\n");
+    rc = 1;
+  }
+  for (i=0; rc == 0 && i < run.nconns; i++) {
+    conn = &run.conns[i];
+    if (pthread_create(&conn->thread, NULL, shard_feed, conn) != 0) {
+      fprintf(stderr, "Error: Can't start a thread for a worker\n");
+      pthread_mutex_lock(&run.lock);
+      run.alive--;
+      pthread_mutex_unlock(&run.lock);
+      continue;
+    }
+    conn->started = 1;
+  }
+
+  pthread_mutex_lock(&run.lock);
+  while (rc == 0 && run.remaining && !run.failed && run.alive) {
+    pthread_cond_wait(&run.cond, &run.lock);
+  }
+  if (rc == 0 && run.remaining && !run.failed) {
+    fprintf(stderr, "Error: All workers went away, with %d shards left\n", run.remaining);
+    run.failed = 1;
+  }
+  pthread_cond_broadcast(&run.cond);
+  pthread_mutex_unlock(&run.lock);
+
+  /* Workers still running a shard of a failed run are cut short */
+  for (i=0; i < run.nconns; i++) {
+    conn = &run.conns[i];
+    if (run.failed) {
+      shutdown(conn->fd, SHUT_RDWR);
+    }
+    if (conn->started) {
+      pthread_join(conn->thread, NULL);
+    }
+    close(conn->fd);
+    if (conn->pid > 0) {
+      waitpid(conn->pid, NULL, 0);
+    }
+  }
+
+  value_init(&total, VAL_NULL);
+  for (i=0; i < run.nshards; i++) {
+    shard = &run.shards[i];
+    if (rc == 0 && !run.failed && shard->done) {
+      fwrite(shard->out, 1, shard->outlen, stdout);
+      if (shard_add(&total, &shard->sum, name) < 0) {
+        run.failed = 1;
+      }
+    }
+    free(shard->out);
+  }
+  if (rc == 0 && !run.failed) {
+    if (total.type != VAL_NULL && value_format_num(&total, buf, sizeof(buf)) >= 0) {
+      printf("%s\n", buf);
+    }
+    fflush(stdout);
+    fprintf(stderr, "shard: %d shards on %d workers, %d retried\n", run.nshards, run.nconns, run.retried);
+  }
+  fflush(stdout);
+
+  free(run.shards);
+  free(run.queue);
+  free(run.program);
+  if (run.input) {
+    mapfile_close(run.input);
+  }
+  pthread_cond_destroy(&run.cond);
+  pthread_mutex_destroy(&run.lock);
+  return rc ? rc : run.failed;
+}
@@ -0,0 +1,90 @@
+/*
+ * Reference-counted string buffers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "strbuf.h"
+#include "util.h"
+
+/*
+ * New buffer with room for at least size bytes, and one reference.
+ */
+struct t_strbuf * strbuf_new(int size)
+{
+  struct t_strbuf *sb;
+
+  sb = malloc(sizeof(struct t_strbuf) + size);
+  if (!sb) {
+    return NULL;
+  }
+  sb->refs = 1;
+  sb->cap = size;
+  sb->frozen = 0;
+
+  return sb;
+}
+
+struct t_strbuf * strbuf_ref(struct t_strbuf *sb)
+{
+  if (sb->frozen == STRBUF_SHARED) {
+    __atomic_add_fetch(&sb->refs, 1, __ATOMIC_RELAXED);
+  }
+  else if (!sb->frozen) {
+    sb->refs++;
+  }
+  return sb;
+}
+
+void strbuf_release(struct t_strbuf *sb)
+{
+  if (sb->frozen == STRBUF_SHARED) {
+    if (__atomic_sub_fetch(&sb->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      free(sb);
+    }
+  }
+  else if (!sb->frozen) {
+    assert(sb->refs > 0);
+    if (--sb->refs == 0) {
+      free(sb);
+    }
+  }
+}
+
+/*
+ * Share the buffer with other threads, for good. Frozen buffers can't be,
+ * as their count is off while they are. A buffer that is shared already
+ * is left alone, as other threads may be reading frozen.
+ */
+int strbuf_share(struct t_strbuf *sb)
+{
+  int frozen = __atomic_load_n(&sb->frozen, __ATOMIC_RELAXED);
+
+  if (frozen == STRBUF_FROZEN) {
+    return -1;
+  }
+  if (frozen != STRBUF_SHARED) {
+    sb->frozen = STRBUF_SHARED;
+  }
+  return 0;
+}
+
+/*
+ * Grow an unshared buffer to hold at least size bytes. The capacity at
+ * least doubles, so repeated appends take amortized constant time.
+ */
+struct t_strbuf * strbuf_reserve(struct t_strbuf *sb, int size)
+{
+  int blockcap;
+
+  assert(!strbuf_shared(sb));
+  if (size <= sb->cap) {
+    return sb;
+  }
+  blockcap = sizeof(struct t_strbuf) + sb->cap;
+  sb = util_grow(sb, &blockcap, sizeof(struct t_strbuf) + size);
+  if (sb) {
+    sb->cap = blockcap - sizeof(struct t_strbuf);
+  }
+  return sb;
+}
@@ -0,0 +1,222 @@
+/*
+ * Stress test for running interpreters in parallel.
+ *
+ * Each thread runs the same script over and over, and checks that every
+ * run computes the same result as a first run on the main thread. The
+ * script exercises functions, the JIT, strings, maps, arrays and natives.
+ * Built with -fsanitize=thread, this shows any state that runs still
+ * share.
+ *
+ *   stress [threads] [runs]
+ *
+ * Runs the script runs times on one thread, then on each of threads
+ * threads, and prints the throughput of both and the speedup. This is done
+ * twice: parsing the script into a fresh exec for each run, and then with
+ * one program loaded up front and shared by all threads, each of which
+ * resets and reuses a single exec.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "exec.h"
+#include "corelib.h"
+
+#define STRESS_DEFAULT_THREADS 4
+#define STRESS_DEFAULT_RUNS 50
+
+static const char stress_script[] =
+  "func fib(n)\n"
+  "  if n < 2\n"
+  "    return n\n"
+  "  end\n"
+  "  return fib(n - 1) + fib(n - 2)\n"
+  "end\n"
+  "m = {\"a\": 1}\n"
+  "s = \"\"\n"
+  "total = 0\n"
+  "i = 0\n"
+  "while i < 300\n"
+  "  total = total + i * 2\n"
+  "  s = s + i + \",\"\n"
+  "  set(m, i, total / 3.0)\n"
+  "  i = i + 1\n"
+  "end\n"
+  "result = total + fib(15) + len(s) + len(m) + sum(range(100))\n";
+
+struct t_stress {
+  pthread_t thread;
+  struct t_program *program;
+  int runs;
+  long long expect;
+  int failed;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static FILE * stress_open(void)
+{
+  return fmemopen((void *) stress_script, sizeof(stress_script) - 1, "r");
+}
+
+/*
+ * Run the exec's program, and set *result. Returns -1 on error.
+ */
+static int stress_result(struct t_exec *exec, long long *result)
+{
+  struct t_var *var;
+
+  if (exec_statements(exec) < 0) {
+    return -1;
+  }
+  var = var_lookup(exec, "result");
+  if (!var || var->value->type != VAL_INT) {
+    return -1;
+  }
+  *result = var->value->intval;
+  return 0;
+}
+
+/*
+ * Parse and run the script in a new exec. Closing the exec closes in.
+ */
+static int stress_run(long long *result)
+{
+  struct t_exec exec;
+  FILE *in;
+  int rc = -1;
+
+  in = stress_open();
+  if (!in) {
+    return -1;
+  }
+  if (exec_init(&exec, in) == 0) {
+    core_apply(&exec);
+    rc = stress_result(&exec, result);
+  }
+  exec_close(&exec);
+  return rc;
+}
+
+static void * stress_thread(void *arg)
+{
+  struct t_stress *stress = arg;
+  struct t_exec exec;
+  long long result;
+  int i;
+
+  if (!stress->program) {
+    for (i=0; i < stress->runs; i++) {
+      if (stress_run(&result) < 0 || result != stress->expect) {
+        stress->failed++;
+      }
+    }
+    return NULL;
+  }
+
+  if (exec_init_program(&exec, stress->program) < 0) {
+    stress->failed = stress->runs;
+    return NULL;
+  }
+  core_apply(&exec);
+  for (i=0; i < stress->runs; i++) {
+    if (stress_result(&exec, &result) < 0 || result != stress->expect) {
+      stress->failed++;
+    }
+    exec_reset(&exec);
+  }
+  exec_close(&exec);
+  return NULL;
+}
+
+/*
+ * Run runs scripts on each of n threads, in a fresh exec each time, or on
+ * program if it's not NULL. Returns the runs per second, or -1 if any run
+ * went wrong.
+ */
+static double stress(int n, int runs, long long expect, struct t_program *program)
+{
+  struct t_stress *threads;
+  double start, secs;
+  int failed = 0;
+  int i;
+
+  threads = calloc(n, sizeof(struct t_stress));
+  start = now();
+  for (i=0; i < n; i++) {
+    threads[i].program = program;
+    threads[i].runs = runs;
+    threads[i].expect = expect;
+    if (pthread_create(&threads[i].thread, NULL, stress_thread, &threads[i]) != 0) {
+      fprintf(stderr, "Error: Can't start thread %d\n", i);
+      exit(1);
+    }
+  }
+  for (i=0; i < n; i++) {
+    pthread_join(threads[i].thread, NULL);
+    failed += threads[i].failed;
+  }
+  secs = now() - start;
+  free(threads);
+
+  if (failed) {
+    fprintf(stderr, "Error: %d of %d runs on %d threads went wrong\n", failed, n * runs, n);
+    return -1;
+  }
+  return n * runs / secs;
+}
+
+int main(int argc, char **argv)
+{
+  int threads = STRESS_DEFAULT_THREADS;
+  int runs = STRESS_DEFAULT_RUNS;
+  struct t_program *program;
+  long long expect;
+  double one, many;
+
+  if (argc > 1) {
+    threads = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    runs = atoi(argv[2]);
+  }
+  if (threads <= 0 || runs <= 0) {
+    fprintf(stderr, "Usage: stress [threads] [runs]\n");
+    return 1;
+  }
+  if (stress_run(&expect) < 0) {
+    fprintf(stderr, "Error: The script failed\n");
+    return 1;
+  }
+  printf("result: %lld\n", expect);
+
+  one = stress(1, runs, expect, NULL);
+  many = stress(threads, runs, expect, NULL);
+  if (one < 0 || many < 0) {
+    return 1;
+  }
+  printf("fresh exec, 1 thread:       %8.1f runs/s\n", one);
+  printf("fresh exec, %d threads:      %8.1f runs/s, %.2fx\n", threads, many, many / one);
+
+  program = program_load(stress_open());
+  if (!program) {
+    fprintf(stderr, "Error: The script failed to load\n");
+    return 1;
+  }
+  one = stress(1, runs, expect, program);
+  many = stress(threads, runs, expect, program);
+  program_free(program);
+  if (one < 0 || many < 0) {
+    return 1;
+  }
+  printf("shared program, 1 thread:   %8.1f runs/s\n", one);
+  printf("shared program, %d threads:  %8.1f runs/s, %.2fx\n", threads, many, many / one);
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * String table.
+ *
+ * Literals and identifiers are interned when they are parsed, so two equal
+ * interned strings are always the same pointer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "strtab.h"
+
+static unsigned int strtab_next_id;
+
+int strtab_init(struct t_strtab *tab)
+{
+  /* Never 0, which values use for "not interned" */
+  tab->id = __atomic_add_fetch(&strtab_next_id, 1, __ATOMIC_RELAXED) & INT_MAX;
+  if (!tab->id) {
+    tab->id = 1;
+  }
+  tab->size = STRTAB_INITIAL_SIZE;
+  tab->count = 0;
+  tab->buckets = calloc(tab->size, sizeof(struct t_istr *));
+  return tab->buckets ? 0 : -1;
+}
+
+void strtab_close(struct t_strtab *tab)
+{
+  struct t_istr *istr, *next;
+  int i;
+
+  for (i=0; i < tab->size; i++) {
+    for (istr = tab->buckets[i]; istr; istr = next) {
+      next = istr->next;
+      free(istr);
+    }
+  }
+  free(tab->buckets);
+  tab->buckets = NULL;
+  tab->size = 0;
+  tab->count = 0;
+}
+
+/*
+ * FNV-1a. Never returns 0, which values use for "not hashed yet".
+ */
+unsigned int strtab_hash(const char *str, int len)
+{
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i=0; i < len; i++) {
+    h ^= (unsigned char) str[i];
+    h *= 16777619u;
+  }
+  return h ? h : 1;
+}
+
+static int strtab_grow(struct t_strtab *tab)
+{
+  struct t_istr **buckets, *istr, *next;
+  int size, i;
+
+  size = tab->size * 2;
+  buckets = calloc(size, sizeof(struct t_istr *));
+  if (!buckets) {
+    return -1;
+  }
+  for (i=0; i < tab->size; i++) {
+    for (istr = tab->buckets[i]; istr; istr = next) {
+      next = istr->next;
+      istr->next = buckets[istr->hash & (size - 1)];
+      buckets[istr->hash & (size - 1)] = istr;
+    }
+  }
+  free(tab->buckets);
+  tab->buckets = buckets;
+  tab->size = size;
+
+  return 0;
+}
+
+/*
+ * Return the interned copy of a string, adding it if needed.
+ */
+char * strtab_intern(struct t_strtab *tab, const char *str, int len)
+{
+  struct t_istr *istr;
+  unsigned int hash;
+
+  hash = strtab_hash(str, len);
+  for (istr = tab->buckets[hash & (tab->size - 1)]; istr; istr = istr->next) {
+    if (istr->hash == hash && istr->len == len && memcmp(istr->str, str, len) == 0) {
+      return istr->str;
+    }
+  }
+
+  if (tab->count >= tab->size && strtab_grow(tab) < 0) {
+    return NULL;
+  }
+  istr = malloc(sizeof(struct t_istr) + len + 1);
+  if (!istr) {
+    return NULL;
+  }
+  istr->hash = hash;
+  istr->len = len;
+  memcpy(istr->str, str, len);
+  istr->str[len] = '\0';
+  istr->next = tab->buckets[hash & (tab->size - 1)];
+  tab->buckets[hash & (tab->size - 1)] = istr;
+  tab->count++;
+
+  return istr->str;
+}
@@ -0,0 +1,297 @@
+/*
+ * Green threads.
+ *
+ * spawn f(x) starts a task that calls f(x), and gives its id. The task is
+ * queued, and first runs when the running one yields or ends. yield sends
+ * the running task to the back of the queue. A task ends when f returns,
+ * and the program when its main task and every task it spawned have ended.
+ *
+ * A task's base frame returns to the end item, whose next is NULL, so
+ * exec_run() sees the task end as it would the end of the program.
+ *
+ * A task blocked in the event loop is in no queue until its wait ends.
+ * When every task is blocked, or has ended, the loop is waited on until
+ * one is queued again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "exec.h"
+#include "task.h"
+#include "loop.h"
+
+void task_init(struct t_exec *exec)
+{
+  struct t_tasks *tasks = &exec->tasks;
+
+  tasks->running = &tasks->main;
+  tasks->first = NULL;
+  tasks->last = NULL;
+  tasks->spare = NULL;
+  tasks->next_id = 0;
+  tasks->blocked = 0;
+  tasks->yields = 0;
+  tasks->main.failed = 0;
+  tasks->end.value = NULL;
+  tasks->end.prev = NULL;
+  tasks->end.next = NULL;
+}
+
+static void task_save(struct t_exec *exec, struct t_task *task)
+{
+  task->stack = exec->stack;
+  task->frames = exec->frames;
+  task->values = exec->values;
+  task->values_mark = exec->values_mark;
+  task->current = exec->current;
+}
+
+static void task_load(struct t_exec *exec, struct t_task *task)
+{
+  exec->stack = task->stack;
+  exec->frames = task->frames;
+  exec->values = task->values;
+  exec->values_mark = task->values_mark;
+  exec->current = task->current;
+  exec->tasks.running = task;
+}
+
+static void task_enqueue(struct t_tasks *tasks, struct t_task *task)
+{
+  task->next = NULL;
+  if (tasks->last) {
+    tasks->last->next = task;
+  }
+  else {
+    tasks->first = task;
+  }
+  tasks->last = task;
+}
+
+static struct t_task * task_dequeue(struct t_tasks *tasks)
+{
+  struct t_task *task = tasks->first;
+
+  if (task) {
+    tasks->first = task->next;
+    if (!tasks->first) {
+      tasks->last = NULL;
+    }
+  }
+  return task;
+}
+
+/*
+ * Take the next task off the queue. While it is empty and tasks wait in
+ * the event loop, wait for them. *next is NULL once no task is left.
+ */
+static int task_next(struct t_exec *exec, struct t_task **next)
+{
+  while (!exec->tasks.first && exec->loop.waiting) {
+    if (loop_poll(exec, 1) < 0) {
+      return -1;
+    }
+  }
+  *next = task_dequeue(&exec->tasks);
+  return 0;
+}
+
+/*
+ * Switch to a task, which fails if its wait did.
+ */
+static int task_resume(struct t_exec *exec, struct t_task *task)
+{
+  task_load(exec, task);
+  if (task->failed) {
+    task->failed = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Drop the running task's state, and keep its record as a spare.
+ */
+static void task_retire(struct t_exec *exec)
+{
+  struct t_task *task = exec->tasks.running;
+
+  while (exec->stack.size) {
+    list_pop(&exec->stack);
+  }
+  while (exec->frames.size) {
+    frame_free(list_pop(&exec->frames));
+  }
+  exec_reclaim(exec, 0);
+  task_save(exec, task);
+  task->next = exec->tasks.spare;
+  exec->tasks.spare = task;
+}
+
+/*
+ * Queue a task that calls func with the argc arguments on top of the
+ * stack, which are popped. Returns its id, or -1 on error.
+ */
+int task_spawn(struct t_exec *exec, struct t_func *func, int argc)
+{
+  struct t_tasks *tasks = &exec->tasks;
+  struct t_task *task;
+  struct t_frame *frame;
+
+  frame = frame_new(func, &tasks->end);
+  if (exec_bind_args(exec, func, argc, &frame->locals) < 0) {
+    frame_free(frame);
+    return -1;
+  }
+
+  task = tasks->spare;
+  if (task) {
+    tasks->spare = task->next;
+  }
+  else {
+    task = malloc(sizeof(struct t_task));
+    if (!task) {
+      fprintf(stderr, "Error: Out of memory spawning %s()\n", func->name);
+      frame_free(frame);
+      return -1;
+    }
+    list_init(&task->stack);
+    list_init(&task->frames);
+    list_init(&task->values);
+  }
+  list_push(&task->frames, frame);
+  task->failed = 0;
+  task->values_mark = 0;
+  /* The entry is the icode before the body, as current gets incremented */
+  task->current = func->entry;
+  task->id = ++tasks->next_id;
+  task_enqueue(tasks, task);
+
+  return task->id;
+}
+
+/*
+ * Switch to the next queued task, if there is one, and queue the running
+ * one behind the rest. It resumes after the current icode.
+ */
+int task_yield(struct t_exec *exec)
+{
+  struct t_tasks *tasks = &exec->tasks;
+  struct t_task *next;
+
+  /* Tasks done waiting get a turn, even while others keep yielding */
+  if (exec->loop.waiting && (!tasks->first || ++tasks->yields % TASK_POLL_YIELDS == 0)) {
+    if (loop_poll(exec, 0) < 0) {
+      return -1;
+    }
+  }
+  next = task_dequeue(tasks);
+  if (!next) {
+    return 0;
+  }
+  task_save(exec, tasks->running);
+  task_enqueue(tasks, tasks->running);
+  return task_resume(exec, next);
+}
+
+/*
+ * The running task is blocked in the event loop: switch to the next one.
+ * It resumes after the current icode, once its wait ends.
+ */
+int task_block(struct t_exec *exec)
+{
+  struct t_task *next;
+
+  exec->tasks.blocked = 0;
+  task_save(exec, exec->tasks.running);
+  if (task_next(exec, &next) < 0) {
+    return -1;
+  }
+  return task_resume(exec, next);
+}
+
+/*
+ * Queue a task whose wait has ended.
+ */
+void task_wake(struct t_exec *exec, struct t_task *task)
+{
+  task_enqueue(&exec->tasks, task);
+}
+
+/*
+ * The running task has ended: switch to the next, and set the item to
+ * resume at. When the main task ends first, it is set aside until no
+ * other task is left, and then switched back to, with nothing to resume.
+ */
+int task_end(struct t_exec *exec)
+{
+  struct t_tasks *tasks = &exec->tasks;
+  struct t_task *next;
+  int rc = 0;
+
+  if (tasks->running == &tasks->main) {
+    task_save(exec, &tasks->main);
+  }
+  else {
+    task_retire(exec);
+  }
+  if (task_next(exec, &next) < 0) {
+    return -1;
+  }
+  if (next) {
+    rc = task_resume(exec, next);
+  }
+  else {
+    task_load(exec, &tasks->main);
+  }
+  exec->current = exec->current ? exec->current->next : NULL;
+
+  return rc;
+}
+
+/*
+ * Drop every task but the main one, and switch back to it, after an error
+ * or to run the program again. Waits in the event loop are dropped first,
+ * which queues their tasks.
+ */
+void task_reset(struct t_exec *exec)
+{
+  struct t_tasks *tasks = &exec->tasks;
+  struct t_task *task;
+
+  loop_reset(exec);
+  tasks->blocked = 0;
+  if (tasks->running != &tasks->main) {
+    task_retire(exec);
+    task_load(exec, &tasks->main);
+  }
+  if (!tasks->first) {
+    tasks->next_id = 0;
+    return;
+  }
+  task_save(exec, &tasks->main);
+  while ((task = task_dequeue(tasks))) {
+    if (task == &tasks->main) {
+      continue;
+    }
+    task_load(exec, task);
+    task_retire(exec);
+  }
+  task_load(exec, &tasks->main);
+  tasks->next_id = 0;
+}
+
+/*
+ * Free the spare task records, after task_reset().
+ */
+void task_close(struct t_exec *exec)
+{
+  struct t_task *task;
+
+  while ((task = exec->tasks.spare)) {
+    exec->tasks.spare = task->next;
+    list_empty(&task->stack);
+    list_empty(&task->frames);
+    list_empty(&task->values);
+    free(task);
+  }
+}
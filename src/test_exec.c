@@ -44,7 +44,7 @@ int main(int argc, char* argv[]) {
     
     core_apply(&exec);
 
-    exec.parser.max_output = 100;
+    exec.program->parser.max_output = 100;
 
     exec_addfunc2(&exec, "funcA", &myfunc);
 
@@ -24,7 +24,7 @@ int main(int argc, char** argv) {
     }
     printf("result: %s\n", format_value(res));
     i++;
-  } while (parser_token(&exec.parser)->type != TT_EOF && i < 8);
+  } while (parser_token(&exec.program->parser)->type != TT_EOF && i < 8);
   
   exec_close(&exec);
 
@@ -50,11 +50,16 @@ void list_init(struct list *list) {
   list->first = NULL;
   list->last = NULL;
   list->size = 0;
+  list->spare = NULL;
 }
 
 void list_empty(struct list *list) {
   if (list->first) llist_free(list->first);
+  llist_free(list->spare);
+  list->first = NULL;
+  list->last = NULL;
   list->size = 0;
+  list->spare = NULL;
 }
 
 int list_size(struct list *list) {
@@ -64,12 +69,21 @@ int list_size(struct list *list) {
 int list_push(struct list *list, void *item) {
   struct item *listitem;
 
+  if (list->spare) {
+    listitem = list->spare;
+    list->spare = listitem->next;
+    listitem->value = item;
+    listitem->next = NULL;
+    listitem->prev = NULL;
+  }
+  else {
+    listitem = llist_newitem(item);
+  }
   if (!list->first) {
-    list->first = llist_newitem(item);
+    list->first = listitem;
     list->last = list->first;
   }
   else {
-    listitem = llist_newitem(item);
     llist_append(list->last, listitem);
     list->last = listitem;
   }
@@ -88,7 +102,8 @@ void *list_pop(struct list *list) {
   list->last = last->prev;
   if (!list->last) list->first = NULL;
   llist_remove(last);
-  free(last);
+  last->next = list->spare;
+  list->spare = last;
   list->size--;
   
   return value;
@@ -100,6 +115,28 @@ void *list_last(struct list *list)
   return list->last->value;
 }
 
+/*
+ * Grow a heap buffer to hold at least size bytes. The capacity at least
+ * doubles, so repeated appends take amortized constant time.
+ */
+void * util_grow(void *buf, int *cap, int size)
+{
+  int newcap;
+
+  if (size <= *cap) {
+    return buf;
+  }
+  newcap = *cap < 16 ? 16 : *cap;
+  while (newcap < size) {
+    newcap *= 2;
+  }
+  buf = realloc(buf, newcap);
+  if (buf) {
+    *cap = newcap;
+  }
+  return buf;
+}
+
 int debug(int level, char* fmt, ...)
 {
 
@@ -107,9 +144,8 @@ int debug(int level, char* fmt, ...)
   va_list ap;
 
   if (level <= debug_level) {
-    if (!debug_stream) debug_stream = stderr;
     va_start(ap, fmt); /* Initialize the va_list */
-    retval = vfprintf(debug_stream, fmt, ap); /* Call vprintf */
+    retval = vfprintf(debug_stream ? debug_stream : stderr, fmt, ap); /* Call vprintf */
     va_end(ap); /* Cleanup the va_list */
   }
 
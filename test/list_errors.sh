@@ -3,7 +3,7 @@
 `dirname $0`/../bin/list_errors<<EOF
 foo bar
 88 11111111 22222222 333
-12345678
+1234567890123456789012
 6
 EOF
 
@@ -0,0 +1,217 @@
+#!/bin/sh
+#
+# Translate scripts to C with bin/aot, build them, and check that the native
+# binary prints the same as the interpreter.
+
+LIBS="lib/exec.o lib/task.o lib/loop.o lib/chan.o lib/program.o lib/corelib.o lib/parallel.o lib/pool.o lib/jit.o lib/io.o lib/parser.o lib/strtab.o lib/strbuf.o lib/fmt.o lib/array.o lib/map.o lib/scanner.o lib/util.o"
+tmp=/tmp/test_aot.$$
+opt=-O2
+status=0
+
+# check name [run option]
+check() {
+  cat > $tmp.txt
+  ./bin/run $2 < $tmp.txt > $tmp.run 2>&1
+  if ! ./bin/aot < $tmp.txt > $tmp.c || ! cc -Iinclude $opt -pthread -o $tmp $tmp.c $LIBS; then
+    echo "FAILED to build: $1"
+    status=1
+    return
+  fi
+  $tmp < /dev/null > $tmp.aot 2>&1
+  if cmp -s $tmp.run $tmp.aot; then
+    echo "same: $1"
+  else
+    echo "DIFFERENT: $1"
+    diff $tmp.run $tmp.aot
+    status=1
+  fi
+}
+
+check loops <<EOF
+i = 0
+s = "x"
+while i < 5
+  if i == 2
+    println("two")
+  end
+  s = s + i
+  i = i + 1
+end
+println(s)
+println("Say \"hi\"")
+EOF
+
+check functions <<EOF
+func greet(name)
+  println("Hello, " + name)
+end
+greet("world")
+func fact(n)
+  if n < 2
+    return 1
+  end
+  return n * fact(n - 1)
+end
+println(fact(10))
+EOF
+
+check tail_calls <<EOF
+func countdown(n)
+  if n == 0
+    return "done"
+  end
+  return countdown(n - 1)
+end
+println(countdown(9999 + 9999))
+func is_even(n)
+  if n == 0
+    return 1
+  end
+  return is_odd(n - 1)
+end
+func is_odd(n)
+  if n == 0
+    return 0
+  end
+  return is_even(n - 1)
+end
+println(is_even(9999 + 9999))
+i = 0
+func loop(n)
+  if i < n
+    i = i + 1
+    loop(n)
+  end
+end
+loop(9999 + 9999)
+println(i)
+EOF
+
+# Tail calls between functions don't depend on the C compiler optimizing
+# them
+opt=-O0
+check tail_calls_O0 <<EOF
+func is_even(n)
+  if n == 0
+    return 1
+  end
+  return is_odd(n - 1)
+end
+func is_odd(n)
+  if n == 0
+    return 0
+  end
+  return is_even(n - 1)
+end
+println(is_even(3000000))
+EOF
+opt=-O2
+
+check numbers <<EOF
+x = 0
+i = 0
+while i < 4
+  x = x + i * 0.5
+  i = i + 1
+end
+println(x)
+println(9223372036854775 * 1000)
+println(7 / 2 + 1 / 4.0)
+EOF
+
+check arrays <<EOF
+a = [3, 1, 2]
+a[1] = 10
+push(a, 4)
+println(a)
+println(a[1] + len(a))
+f = scale(range(1000), 0.5)
+println(sum(f))
+println(max(map_add(a, 1)))
+EOF
+
+check maps <<EOF
+m = {"a": 1, 2: "b"}
+m["c"] = [1, 2]
+println(m["a"] + len(m))
+println(get(m, "z", "none"))
+delete(m, 2)
+println(m)
+EOF
+
+check concat <<EOF
+age = 42
+println("She is " + age + " years old, pi is " + 3.25 + ".")
+x = 1
+println(x + 2 + 3 + "")
+EOF
+
+check fds <<EOF
+s = socketpair()
+fd_write(s[0], "ping")
+sleep(5)
+println(fd_read(s[1], 10))
+fd_close(s[0])
+println(fd_read(s[1], 10) == "")
+EOF
+
+check channels <<EOF
+ch = channel(2)
+send(ch, "a longer string, sent by reference")
+send(ch, [1, 2])
+chan_close(ch)
+println(recv(ch))
+println(recv(ch))
+println(recv(ch, "closed"))
+EOF
+
+check int_math <<EOF
+func sum_to(n, acc)
+  if n == 0
+    return acc
+  end
+  k = acc + n
+  return sum_to(n - 1, k)
+end
+println(sum_to(1000, 0))
+f = 0.5
+x = 3
+i = 0
+while i < 62
+  f = f + i
+  x = x * 2
+  i = i + 1
+end
+println(f)
+EOF
+
+# A long script, with more icodes and constants than fit any fixed table,
+# and more than bin/run allows without -p
+{
+  echo "x = 0"
+  i=0
+  while [ $i -lt 1500 ]; do
+    echo "x = x + $i"
+    echo "s = \"line $i\""
+    i=$((i + 1))
+  done
+  echo 'println(s + ", " + x)'
+} | check long -p
+
+check errors <<EOF
+println("before")
+func f(n)
+  return 1 + f(n)
+end
+f(1)
+println("after")
+EOF
+
+# A runtime error fails the native binary
+if $tmp < /dev/null > /dev/null 2>&1; then
+  echo "DIFFERENT: errors: exit status 0"
+  status=1
+fi
+
+rm -f $tmp $tmp.txt $tmp.c $tmp.run $tmp.aot
+exit $status
@@ -0,0 +1,58 @@
+#!/bin/sh
+
+# Appending in place must not change other variables holding the string
+./bin/run <<EOF
+s = "ab"
+t = s
+s = s + "c"
+println(t)
+println(s)
+s = s + s
+println(s)
+s = s + "-" + 1 + "-" + t
+println(s)
+u = s + "!"
+println(u)
+println(s)
+func f(p)
+  p = p + "?"
+  return p
+end
+println(f(t))
+println(t)
+s = "x" + s
+println(s)
+EOF
+echo "Expected: ab; abc; abcabc; abcabc-1-ab; abcabc-1-ab!; abcabc-1-ab; ab?; ab; xabcabc-1-ab"
+
+# Long strings share one buffer until one of the holders changes it
+./bin/run <<EOF
+s = "a long string, on the heap"
+t = s
+s = s + "!"
+println(t)
+println(s)
+func f(p)
+  p = p + "?"
+  return p
+end
+u = f(t)
+println(u)
+println(t)
+t = t + "."
+println(t)
+println(u)
+EOF
+echo "Expected: a long string, on the heap; a long string, on the heap!; a long string, on the heap?; a long string, on the heap; a long string, on the heap.; a long string, on the heap?"
+
+# Building a long string takes linear time
+./bin/run <<EOF
+i = 0
+s = ""
+while i < 9999 * 10
+  s = s + "line " + i
+  i = i + 1
+end
+println("done")
+EOF
+echo "Expected: done (quickly)"
@@ -0,0 +1,96 @@
+#!/bin/sh
+
+# Literals, indexing, and sharing by assignment
+./bin/run <<EOF
+a = [1, 2, 3]
+a[1] = 20
+println(a)
+b = a
+b[0] = 7
+println(a)
+push(a, 2.5)
+println(a)
+println(len(a))
+s = ["x", "y"]
+s[0] = s[0] + "z"
+println(s)
+EOF
+echo "Expected: [1, 20, 3]; [7, 20, 3]; [7.0, 20.0, 3.0, 2.5]; 4; [\"xz\", \"y\"]"
+
+# Arrays passed to and returned from functions, in a hot loop
+./bin/run <<EOF
+func fill(a, n)
+  i = 0
+  while i < n
+    push(a, i * i)
+    i = i + 1
+  end
+  return a
+end
+x = fill([], 500)
+t = 0
+i = 0
+while i < len(x)
+  t = t + x[i]
+  i = i + 1
+end
+println(t)
+println(t == sum(x))
+EOF
+echo "Expected: 41541750; 1"
+
+# Bulk builtins, with each SIMD level
+for level in avx2 sse2 scalar; do
+PARSE1_SIMD=$level ./bin/run <<EOF
+a = range(100003)
+f = scale(a, 0.5)
+println(sum(a))
+println(sum(f))
+println(min(map_add(f, 0 - 7)))
+println(max(a))
+println(dot(a, a))
+EOF
+done
+echo "Expected 3 times: 5000250003; 2500125001.5; -7.0; 100002; 333358333950005"
+
+# Float sums round the same at each SIMD level
+for level in avx2 sse2 scalar; do
+PARSE1_SIMD=$level ./bin/run <<EOF
+f = scale(range(500003), 1.0)
+println(dot(f, f))
+println(sum(scale(f, 0.1)))
+EOF
+done
+echo "Expected 3 times: 4.166729166975e+16; 12500125000.300001"
+
+# A NaN makes min() and max() NaN at each SIMD level, wherever it is
+for level in avx2 sse2 scalar; do
+PARSE1_SIMD=$level ./bin/run <<EOF
+n = 0.0 / 0.0
+a = [n, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0]
+b = [1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0]
+push(b, n)
+println([min(a), max(a), min(b), max(b)])
+EOF
+done
+echo "Expected 3 times: [-nan, -nan, -nan, -nan]"
+
+# Arrays print in full, however long they are
+echo 'println(range(1000))' | ./bin/run | tail -c 25
+./bin/run <<EOF | wc -c
+s = "abcdefgh"
+while len(s) < 2000
+  s = s + s
+end
+println([s, s])
+EOF
+echo "Expected: 995, 996, 997, 998, 999]; 4105"
+
+# Errors
+echo 'a = [1, 2]
+println(a[2])' | ./bin/run
+echo 'a = [1, "b"]' | ./bin/run
+echo 'println(dot([1, 2], [1, 2, 3]))' | ./bin/run
+echo 'm = 9223372036854775 * 1000 + 807
+println(sum([m, 1]))' | ./bin/run
+echo "Expected: index out of range; can't store a string; different lengths; integer overflow"
@@ -0,0 +1,114 @@
+#!/bin/sh
+
+# A task reading a pipe waits for data, while the writer sleeps between writes
+./bin/run <<EOF
+p = pipe()
+func reader(fd)
+  s = fd_read(fd, 100)
+  while s != ""
+    println("got " + s)
+    s = fd_read(fd, 100)
+  end
+  println("eof")
+end
+func writer(fd)
+  fd_write(fd, "one")
+  sleep(20)
+  fd_write(fd, "two")
+  sleep(20)
+  fd_close(fd)
+end
+spawn reader(p[0])
+spawn writer(p[1])
+println("main done")
+EOF
+echo "Expected: main done; got one; got two; eof"
+
+# Sleeping tasks and timers wake in deadline order
+./bin/run <<EOF
+func nap(name, ms)
+  sleep(ms)
+  println(name + " woke")
+end
+func ring()
+  println("ring")
+end
+spawn nap("c", 30)
+spawn nap("a", 10)
+spawn nap("b", 20)
+timer(15, "ring")
+sleep(25)
+println("main woke")
+EOF
+echo "Expected: a woke; ring; b woke; main woke; c woke"
+
+# A write bigger than the socket buffer waits for the reader to drain it
+./bin/run <<EOF
+s = socketpair()
+big = "x"
+i = 0
+while i < 20
+  big = big + big
+  i = i + 1
+end
+func server(fd)
+  total = 0
+  part = fd_read(fd, 65536)
+  while part != ""
+    total = total + len(part)
+    part = fd_read(fd, 65536)
+  end
+  println("server read " + total)
+end
+func client(fd)
+  println("client wrote " + fd_write(fd, big))
+  fd_close(fd)
+end
+spawn server(s[0])
+spawn client(s[1])
+EOF
+echo "Expected: client wrote 1048576; server read 1048576"
+
+# Errors
+echo 'fd_read(99, 10)' | ./bin/run 2>&1
+echo 'x = 0 - 1
+sleep(x)' | ./bin/run 2>&1
+echo 'func f(a)
+end
+timer(1, "f")' | ./bin/run 2>&1
+echo 'p = pipe()
+func r()
+  fd_read(p[0], 1)
+end
+spawn r()
+spawn r()
+yield' | ./bin/run 2>&1
+echo 'p = pipe()
+func r()
+  fd_read(p[0], 1)
+end
+spawn r()
+yield
+fd_close(p[0])' | ./bin/run 2>&1
+echo "Expected: bad fd 99; sleep() needs ms; timer() needs no arguments; another task is reading; can't close while waited on"
+
+# A wait that fails fails its task: the peer closes during a big write
+./bin/run 2>&1 <<EOF
+s = socketpair()
+big = "x"
+i = 0
+while i < 22
+  big = big + big
+  i = i + 1
+end
+func w()
+  fd_write(s[1], big)
+  println("not reached")
+end
+spawn w()
+yield
+fd_close(s[0])
+sleep(10)
+println("not reached either")
+EOF
+echo "Expected: fd_write(): Broken pipe"
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+run=$(pwd)/bin/run
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+cd $dir
+
+cat > a.txt <<END
+println("a")
+END
+cat > b.txt <<END
+i = 0
+t = 0
+while i < 1000
+  t = t + i
+  i = i + 1
+end
+println("b " + t)
+END
+echo 'println(1 / 0)' > c.txt
+
+# Every file in a directory, on 2 threads. The jobs file isn't there yet
+$run -b . -j 2 2>&1 | grep -v "loaded in\|latency"
+echo "Expected: a, b 499500 and the divide by zero error, with statuses 0, 0, 1; 3 jobs of 3 scripts, 1 failed"
+
+# A manifest may name a script more than once; it is loaded once
+echo 'm = {"a" 1}' > bad.txt
+cat > jobs <<END
+# comment
+b.txt
+a.txt
+
+b.txt
+missing.txt
+bad.txt
+c.txt
+END
+$run -b jobs -j 3 2>&1 | grep -v "loaded in\|latency"
+echo "Expected: b, a, b; missing.txt and bad.txt with status 2 and why; c.txt's error; 6 jobs of 5 scripts, 3 failed"
+
+# Errors go to stderr, not stdout
+$run -b jobs -j 3 2>/dev/null | grep -c Error
+echo "Expected: 0"
+
+$run -b nothing
+$run -x
+echo "Expected: can't find, then usage"
@@ -0,0 +1,97 @@
+#!/bin/sh
+
+# A producer thread sends lines to the main one, which reads until the channel is closed
+./bin/run <<EOF
+ch = channel(4)
+func producer(ch, n)
+  i = 0
+  while i < n
+    send(ch, "line " + i)
+    i = i + 1
+  end
+  chan_close(ch)
+  return n
+end
+t = thread("producer", ch, 6)
+s = recv(ch, "")
+while s != ""
+  println(s)
+  s = recv(ch, "")
+end
+println("producer sent " + join(t))
+EOF
+echo "Expected: line 0 to line 5; producer sent 6"
+
+# A full channel holds up the sender, while the receiver runs
+./bin/run <<EOF
+ch = channel(2)
+func producer()
+  i = 0
+  while i < 5
+    send(ch, i)
+    println("sent " + i)
+    i = i + 1
+  end
+end
+spawn producer()
+yield
+i = 0
+while i < 5
+  println("got " + recv(ch))
+  i = i + 1
+end
+EOF
+echo "Expected: sent 0, sent 1, then never more than 2 sent ahead of got; got 0 to 4"
+
+# Messages are copies: the sender's string and array change, the message doesn't
+./bin/run <<EOF
+ch = channel(4)
+s = "a string on the heap, sent without a copy"
+a = [1, 2, 3]
+send(ch, s)
+send(ch, a)
+s = s + "!"
+push(a, 4)
+println(recv(ch))
+println(recv(ch))
+println(s)
+println(a)
+EOF
+echo "Expected: the string; [1, 2, 3]; the string and !; [1, 2, 3, 4]"
+
+# Threads print into their own output, which is printed when they are joined
+./bin/run <<EOF
+func work(name, n)
+  println(name + " working")
+  return n * n
+end
+a = thread("work", "a", 3)
+b = thread("work", "b", 4)
+println("started")
+println(join(b) + join(a))
+EOF
+echo "Expected: started; b working; a working; 25"
+
+# Errors
+echo 'ch = channel(1)
+chan_close(ch)
+send(ch, 1)' | ./bin/run 2>&1 | grep -v TODO
+echo 'recv(7)' | ./bin/run 2>&1 | grep -v TODO
+echo 'send(channel(1), {"k": 1})' | ./bin/run 2>&1 | grep -v TODO
+echo 'func f(a)
+end
+thread("f")' | ./bin/run 2>&1 | grep -v TODO
+echo 'join(3)' | ./bin/run 2>&1 | grep -v TODO
+echo "Expected: Channel 1 is closed; No channel 7; can't pass a MAP value; f() takes 1 arguments, not 0; No thread 3"
+
+# A thread that fails fails the caller waiting on it, instead of leaving it waiting
+./bin/run 2>&1 <<EOF | grep -v TODO
+ch = channel(1)
+func f(ch)
+  x = recv(ch) / 0
+end
+t = thread("f", ch)
+send(ch, 1)
+println(recv(channel(1)))
+EOF
+echo "Expected: Divide by zero; Thread 1 failed"
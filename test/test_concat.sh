@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# String + chains run as one CONCAT_N
+./bin/run <<EOF
+age = 42
+name = "Ann"
+println("She is " + age + " years old.")
+println(name + " is " + age + ", pi is " + 3.25 + "!")
+n = 0 - 9223372036854775 * 1000 - 808
+println("min " + n + " " + 0 + " " + (0 - 7))
+println("a" + "b" + "c" + "d" + "e" + "f" + "g" + "h" + "i" + "j" + "k" + "l" + "m" + "n" + "o" + "p" + "q" + "r")
+EOF
+echo "Expected: She is 42 years old.; Ann is 42, pi is 3.25!; min -9223372036854775808 0 -7; abcdefghijklmnopqr"
+
+# Chains that don't start with a string, and appends in place, run as ADDs
+./bin/run <<EOF
+s = ""
+i = 0
+while i < 3
+  s = s + i + ","
+  i = i + 1
+end
+println(s)
+println("x" + undefined + "y")
+EOF
+echo 'x = 1
+println(x + 2 + "a")' | ./bin/run
+echo "Expected: 0,1,2,; Undefined variable undefined; can't apply + to INT and STRING"
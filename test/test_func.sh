@@ -0,0 +1,68 @@
+#!/bin/sh
+
+./bin/run <<EOF
+func greet(name)
+  println("Hello, " + name)
+end
+greet("world")
+func fact(n)
+  if n < 2
+    return 1
+  end
+  return n * fact(n - 1)
+end
+println(fact(10))
+EOF
+echo "Expected: Hello, world; 3628800"
+
+# Tail calls reuse the frame, so they may go deeper than the frame limit
+./bin/run <<EOF
+func countdown(n)
+  if n == 0
+    return "done"
+  end
+  return countdown(n - 1)
+end
+println(countdown(9999 + 9999))
+func is_even(n)
+  if n == 0
+    return 1
+  end
+  return is_odd(n - 1)
+end
+func is_odd(n)
+  if n == 0
+    return 0
+  end
+  return is_even(n - 1)
+end
+println(is_even(9999 + 9999))
+i = 0
+func loop(n)
+  if i < n
+    i = i + 1
+    loop(n)
+  end
+end
+loop(9999 + 9999)
+println(i)
+EOF
+echo "Expected: done; 1; 19998"
+
+./bin/run <<EOF
+func f(n)
+  return 1 + f(n)
+end
+f(1)
+EOF
+echo "Expected: Stack overflow error"
+
+# A returned local is read before its frame goes away
+./bin/run <<EOF
+func f(n)
+  p = n + 1
+  return p
+end
+println(f(41))
+EOF
+echo "Expected: 42"
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+prog='i = 0
+while i < 5
+  println("i=" + i)
+  i = i + 1
+end
+s = "x"
+s = s + 1
+println(s)
+'
+
+echo "$prog" | ./bin/test_icode 0 | grep '^\['
+echo "$prog" | ./bin/run
+echo "Expected: i=0 .. i=4, x1"
+
+echo "$prog" | PARSE1_JIT=0 ./bin/test_exec 1 2>&1 | ./bin/icode_ngrams 3 5
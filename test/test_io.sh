@@ -0,0 +1,47 @@
+#!/bin/sh
+
+tmp=$(mktemp)
+trap 'rm -f $tmp' EXIT
+
+# Write a file, read it back whole, then line by line
+./bin/run <<EOF
+println(write("$tmp", "one\ntwo\n\nfour"))
+s = read("$tmp")
+println(len(s))
+f = open("$tmp")
+n = 0
+while eof(f) == 0
+  n = n + 1
+  println("line " + n + ": " + readline(f))
+end
+println("[" + readline(f) + "]")
+close(f)
+EOF
+echo "Expected: 13; 13; line 1: one; line 2: two; line 3: ; line 4: four; []"
+
+# Output is buffered, and flushed at the end or by flush()
+./bin/run <<EOF | cat
+println("before")
+flush()
+i = 0
+while i < 3
+  println(i)
+  i = i + 1
+end
+EOF
+echo "Expected: before; 0; 1; 2"
+
+# Output printed before an error is written before it
+./bin/run <<EOF 2>&1 | cat
+println("printed")
+println(1 / 0)
+EOF
+echo "Expected: printed, then the error"
+
+# Errors
+./bin/run <<EOF
+f = open("/nonexistent/file")
+EOF
+echo 'readline(3)' | ./bin/run
+echo 'write("/nonexistent/file", "x")' | ./bin/run
+echo "Expected: three errors"
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Run every test script with the JIT off, and with the JIT compiling on
+# first use, and check that the output is the same.
+
+dir=`dirname $0`
+status=0
+
+for t in $dir/*.sh; do
+  case $t in
+    */test_jit.sh) continue;;
+  esac
+  PARSE1_JIT=0 sh $t > /tmp/test_jit_off.$$ 2>/dev/null
+  PARSE1_JIT_THRESHOLD=1 sh $t > /tmp/test_jit_on.$$ 2>/dev/null
+  if cmp -s /tmp/test_jit_off.$$ /tmp/test_jit_on.$$; then
+    echo "same: $t"
+  else
+    echo "DIFFERENT: $t"
+    diff /tmp/test_jit_off.$$ /tmp/test_jit_on.$$
+    status=1
+  fi
+done
+rm -f /tmp/test_jit_off.$$ /tmp/test_jit_on.$$
+
+echo 'i = 0
+while i < 500
+  i = i + 1
+end
+println(i)' | PARSE1_JIT_THRESHOLD=1 ./bin/test_exec 2 2>&1 | grep -E "Compiled|^500"
+echo "Expected: Compiled parse1_loop_addr4, 500"
+
+# Inline int code falls back to the handlers for floats and on overflow
+echo 'i = 0
+f = 0.5
+n = 65536
+while i < 10
+  f = f + i
+  i = i + 1
+end
+println(f)
+while i < 20
+  n = n * n
+  i = i + 1
+end' | PARSE1_JIT_THRESHOLD=1 ./bin/run 2>&1
+echo "Expected: 45.5, Integer overflow: 4294967296 * 4294967296"
+
+exit $status
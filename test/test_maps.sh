@@ -0,0 +1,105 @@
+#!/bin/sh
+
+# Literals, indexing, and sharing by assignment
+./bin/run <<EOF
+m = {"one": 1, "two": 2.5, 3: "three"}
+println(m["one"])
+println(m[3])
+m["one"] = m["one"] + 10
+m["four"] = [4, 4]
+n = m
+n["five"] = {"x": 5}
+println(len(m))
+println(m["five"])
+println({})
+EOF
+echo "Expected: 1; three; 5; {\"x\": 5}; {}"
+
+# get, set, has, delete and keys
+./bin/run <<EOF
+m = {}
+println(set(m, "k", 7))
+println(get(m, "k"))
+println(get(m, "missing", 0 - 1))
+println(has(m, "k"))
+println(delete(m, "k"))
+println(delete(m, "k"))
+println(has(m, "k"))
+println(keys({"a": 1}))
+EOF
+echo "Expected: 7; 7; -1; 1; 1; 0; 0; [\"a\"]"
+
+# Many keys, so the table grows, and deletes shift entries back
+./bin/run <<EOF
+m = {}
+i = 0
+while i < 20000
+  m[i * 7] = i
+  m["k" + i] = i
+  i = i + 1
+end
+t = 0
+i = 0
+while i < 20000
+  t = t + m[i * 7] + get(m, "k" + i)
+  delete(m, i * 7)
+  i = i + 2
+end
+println(t)
+println(len(m))
+println(has(m, 14) + has(m, 7) * 10)
+EOF
+echo "Expected: 199980000; 30000; 10"
+
+# Short string values are kept in the table, and move with their slots
+./bin/run <<EOF
+m = {}
+i = 0
+while i < 1000
+  m[i] = "v" + i
+  i = i + 1
+end
+i = 0
+while i < 1000
+  delete(m, i)
+  i = i + 3
+end
+println(m[998] + m[500] + m[1])
+println(len(m))
+EOF
+echo "Expected: v998v500v1; 666"
+
+# keys() of a map with string and int keys is a mixed array
+./bin/run <<EOF 2>&1
+m = {"a": 1, 2: "b", "c": 3}
+k = keys(m)
+println(len(k))
+println(k[1] + k[1])
+k[0] = 2.5
+println(k)
+println(sum(k))
+EOF
+echo "Expected: 3; aa; [2.5, \"a\", 2]; Expected an array of numbers, got a mixed array"
+
+# Maps print in full too, with nesting cut off
+./bin/run <<EOF | wc -c
+m = {}
+i = 0
+while i < 500
+  set(m, i, range(5))
+  i = i + 1
+end
+println(m)
+EOF
+echo 'm = {"a": 1}
+set(m, "m", m)
+println(m)' | ./bin/run
+echo 'Expected: 10891; the map 5 deep, then {...}'
+
+# Errors
+echo 'm = {"a": 1}
+println(m["b"])' | ./bin/run
+echo 'm = {[1]: 1}' | ./bin/run
+echo 'println(has(1, 2))' | ./bin/run
+echo 'm = {"a" 1}' | ./bin/run
+echo "Expected: key not found; bad key type; not a map; missing ':'"
@@ -0,0 +1,19 @@
+#!/bin/sh
+
+# Natives read their arguments in place, in order
+./bin/run <<EOF
+m = {"a": 1}
+set(m, "b", len("xyz"))
+println(get(m, "b") + get(m, "c", 10))
+println(len("ab" + "cd"))
+EOF
+echo "Expected: 13; 4"
+
+# A function added with exec_addfunc2() still gets a list
+printf 'a = funcA(5)\nb = funcA(funcA(6 + 6))\nprintln(a + b)\n' | ./bin/test_exec 0
+echo "Expected: 17, then a=5 and b=12"
+
+# Argument errors
+echo 'println(len())' | ./bin/run
+echo 'println(len(nothing))' | ./bin/run
+echo "Expected: two errors, for the count and the undefined variable"
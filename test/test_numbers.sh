@@ -0,0 +1,58 @@
+#!/bin/sh
+
+# 64-bit ints, floats, and promotion of mixed operands
+./bin/run <<EOF
+println(9223372036854775 * 1000)
+println(7 / 2)
+println(7 / 2.0)
+println(0.1 + 0.2)
+println(1 / 3.0)
+println(100.0 * 3)
+println(3 < 3.5)
+println(2 == 2.0)
+println("price: " + 2.5)
+total = 0
+i = 1
+while i < 5
+  total = total + i * 0.25
+  i = i + 1
+end
+println(total)
+EOF
+echo "Expected: 9223372036854775000; 3; 3.5; 0.30000000000000004; 0.3333333333333333; 300.0; 1; 1; price: 2.5; 2.5"
+
+# Overflow and division by zero are errors
+echo 'println(999999999999999999 * 10)' | ./bin/run
+echo 'println(1 / 0)' | ./bin/run
+./bin/run <<EOF
+i = 9223372036854775
+while i > 0
+  i = i + 999999999999999999
+end
+EOF
+echo "Expected: three errors, for *, / and +"
+
+# Ints and floats print in their shortest form that reads back the same
+./bin/run <<EOF
+n = 3037000499 * 3037000499
+println(0 - n)
+println(0.0 - 0.0)
+println(0.0001)
+println(0.00001)
+println(123456.789)
+println(1.0 / 7)
+println(100000000.0 * 10000000)
+println("" + 0.5 + " " + (0 - 12) + " " + 0.1 * 3)
+EOF
+echo "Expected: -9223372030926249001; 0.0; 0.0001; 1e-05; 123456.789; 0.14285714285714285; 1e+15; 0.5 -12 0.30000000000000004"
+
+# A float local returned from a function outlives its frame
+./bin/run <<EOF
+func h(x)
+  y = x * 1.5
+  return y
+end
+println(h(2))
+println(h(3) + 1)
+EOF
+echo "Expected: 3.0; 5.5"
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# Chunks read the globals, and their results are summed; ints stay ints
+PARSE1_THREADS=4 ./bin/run <<EOF
+records = range(100000)
+names = ["a", "bb", "ccc"]
+func work(i)
+  s = names[i - i / 3 * 3]
+  s = s + "!"
+  return records[i] * 3 + len(s)
+end
+println(parallel_for(0, 100000, "work"))
+func half(i)
+  return i / 2.0
+end
+println(parallel_for(0, 10, "half"))
+println(parallel_for(5, 5, "work"))
+EOF
+echo "Expected: 15000149999; 22.5; 0"
+
+# Output comes out in range order, whatever ran first
+PARSE1_THREADS=3 ./bin/run <<EOF
+func show(i)
+  println("item " + i)
+end
+println(parallel_for(0, 5, "show"))
+names = push(["a"], "b")
+println(names)
+EOF
+echo "Expected: item 0 to item 4; 0; [\"a\", \"b\"]"
+
+# Globals can't be written from the chunks, however they are reached
+for body in 'total = total + 1' 'name = name + "x"' 'push(arr, i)' 'm["k"] = i'; do
+  printf 'total = 0\nname = "abc"\narr = [1]\nm = {"k": arr}\nfunc f(i)\n  %s\nend\nparallel_for(0, 100, "f")\n' "$body" | ./bin/run 2>&1 | grep -v TODO | sort -u
+done
+echo "Expected: can't assign total; can't assign name; can't change a frozen array; can't change a frozen map"
+
+# Errors
+echo 'func f(i)
+  return "s"
+end
+parallel_for(0, 10, "f")' | ./bin/run 2>&1 | sort -u
+echo 'func f(i)
+  return parallel_for(0, 2, "f")
+end
+parallel_for(0, 10, "f")' | ./bin/run 2>&1 | sort -u
+echo 'func f(a, b)
+  return a
+end
+parallel_for(0, 10, "f")' | ./bin/run
+echo 'parallel_for(0, 10, "nope")' | ./bin/run
+echo "Expected: not a number; can't nest; 1 argument; not defined"
@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# run -p: scan, parse and run a script at once, a statement at a time.
+
+./bin/run -p <<EOF
+func sq(n)
+  return n * n
+end
+i = 0
+t = 0
+while i < 5000
+  t = t + sq(i)
+  i = i + 1
+end
+println("t " + t)
+s = ""
+while len(s) < 8
+  s = s + "ab"
+end
+println(s)
+if t > 0
+  println("positive")
+else
+  println("not")
+end
+EOF
+echo "rc $?"
+echo "Expected: t 41654167500; abababab; positive; rc 0"
+
+# A script of any length, with no limit on its icodes
+i=0
+while [ $i -lt 3000 ]; do
+  echo "x = $i"
+  echo "y = [x, x + 1]"
+  i=$((i + 1))
+done > /tmp/test_pipeline.$$
+echo 'println(x + y[1])' >> /tmp/test_pipeline.$$
+./bin/run -p < /tmp/test_pipeline.$$
+rm -f /tmp/test_pipeline.$$
+echo "Expected: 5999"
+
+# Statements run as they are parsed: a function has to be defined first,
+# and a syntax error stops the run after the statements before it
+./bin/run -p 2>&1 <<EOF
+println("before")
+f()
+func f()
+  println("f")
+end
+EOF
+echo "rc $?"
+./bin/run -p 2>&1 <<EOF
+println("before")
+if 1 % 2
+  println("after")
+end
+EOF
+echo "rc $?"
+echo "Expected: before, f() is not defined, rc 1; a syntax error on line 2, before, rc 1"
+
+# A failed script exits with 1 with or without -p
+echo 'println(1 / 0)' | ./bin/run 2>/dev/null
+echo "rc $?"
+echo 'println(1 / 0)' | ./bin/run -p 2>/dev/null
+echo "rc $?"
+echo 'm = {"a" 1}' | ./bin/run 2>/dev/null
+echo "rc $?"
+echo 'println("ok")' | ./bin/run
+echo "rc $?"
+echo "Expected: rc 1, rc 1, rc 1, ok, rc 0"
+
+# Tasks run at a yield, and the statements after it run once they're done
+./bin/run -p <<EOF
+func worker(name)
+  println(name)
+  yield
+  println(name + " again")
+end
+spawn worker("a")
+spawn worker("b")
+yield
+println("main")
+yield
+println("main again")
+EOF
+echo "rc $?"
+echo "Expected: a; b; main; a again; b again; main again; rc 0"
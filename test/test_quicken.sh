@@ -0,0 +1,21 @@
+#!/bin/sh
+
+prog='func add(a, b)
+  return a + b
+end
+println(add(1, 2))
+println(add(3, 4))
+println(add("a", "b"))
+println(add("c", 5))
+println(add(5, 6))
+i = 0
+while i < 3
+  println(i * 2 - 1)
+  i = i + 1
+end
+'
+
+echo "$prog" | ./bin/run
+echo "Expected: 3, 7, ab, c5, 11, -1, 1, 3"
+
+echo "$prog" | ./bin/test_exec 3 2>&1 | grep -E "Quickening|Deoptimizing"
@@ -0,0 +1,110 @@
+#!/bin/sh
+#
+# run -s: a pre-forked server with libraries loaded, and bin/client, which
+# sends it scripts.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+sock=$dir/sock
+
+cat > $dir/lib.txt <<EOF
+func sq(n)
+  return n * n
+end
+func greet(name)
+  return "Hello, " + name
+end
+limit = 10
+mode = "fast"
+speeds = {"fast": 3}
+func is_fast(m)
+  return m == "fast"
+end
+println("library loaded")
+EOF
+
+./bin/run -s $sock -w 2 -n 2 $dir/lib.txt > $dir/out 2> $dir/log &
+server=$!
+while [ ! -S $sock ]; do sleep 0.1; done
+cat $dir/out
+
+./bin/client $sock <<EOF
+println(greet("client") + ", " + sq(limit))
+EOF
+echo "Expected: library loaded; Hello, client, 100"
+
+# A request's strings equal the libraries' ones, though each has a string table
+./bin/client $sock <<EOF
+println(mode == "fast")
+println(is_fast("fast"))
+x = "fast"
+println(x == mode)
+println(speeds["fast"])
+m = {"fast": 4}
+println(m[mode])
+EOF
+echo "Expected: 1, 1, 1, 3, 4"
+
+# Each request starts from the libraries' state, whichever worker runs it
+i=1
+while [ $i -le 5 ]; do
+  ./bin/client $sock <<EOF
+i = 0
+while i < $i
+  i = i + 1
+end
+func add(a, b)
+  return a + b
+end
+println(add(i, sq(i)))
+EOF
+  i=$((i + 1))
+done
+echo 'println(add(1, 2))' | ./bin/client $sock
+echo "Expected: 2, 6, 12, 20, 30; add() is not defined"
+
+./bin/client $sock <<EOF
+limit = 3
+EOF
+./bin/client $sock <<EOF
+speeds["slow"] = 1
+EOF
+./bin/client $sock <<EOF
+if 1 % 2
+end
+EOF
+echo "Expected: can't assign global limit; can't change a frozen map; a syntax error"
+
+# The client exits with 1 when the script fails, or the worker running it dies
+echo 'println(1 / 0)' | ./bin/client $sock 2>&1
+echo "rc $?"
+echo 'nope()' | ./bin/client $sock 2>/dev/null
+echo "rc $?"
+echo 'println("ran")' | ./bin/client $sock
+echo "rc $?"
+echo 'a = b' | ./bin/client $sock 2>&1
+echo "rc $?"
+echo "Expected: divide by zero, rc 1; rc 1; ran, rc 0; the server didn't finish, rc 1"
+
+# A reload; one that fails keeps the libraries loaded before
+sed -i 's/return n \* n/return n * n * n/' $dir/lib.txt
+kill -HUP $server
+while ! grep -q reloaded $dir/log; do sleep 0.1; done
+echo 'println(sq(3))' | ./bin/client $sock
+echo 'func broken(' >> $dir/lib.txt
+kill -HUP $server
+while ! grep -q "reload failed" $dir/log; do sleep 0.1; done
+echo 'println(sq(4))' | ./bin/client $sock
+echo "Expected: 27, 64"
+
+kill $server
+wait $server
+echo "status $?"
+[ -S $sock ] || echo "socket removed"
+grep -v recycled $dir/log | sed "s#$dir/##"
+grep -q recycled $dir/log && echo "server: recycled workers"
+echo "Expected: status 0; socket removed; listening, a worker failed, reloaded, a syntax error in broken(), reload failed, stopped; recycled workers"
+
+./bin/client $sock < /dev/null 2>&1 | sed "s#$dir/##"
+./bin/run -s
+echo "Expected: can't connect, then usage"
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# run -d: a script's function run on the lines of an input, in shards, on
+# worker processes, forked or started with run -r.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+cat > $dir/count.txt <<EOF
+println("loading")
+extra = 1
+func map(s)
+  if len(s) > 7
+    println("long: " + s)
+  end
+  return len(s) + extra
+end
+func half(s)
+  return len(s) / 2.0
+end
+EOF
+i=1
+while [ $i -le 200 ]; do
+  echo "line $i" >> $dir/lines.txt
+  i=$((i + 1))
+done
+
+./bin/run -d $dir/count.txt $dir/lines.txt -w 2 2>&1 | sed -n '1,2p;101,$p'
+./bin/run -d $dir/count.txt $dir/lines.txt -w 3 -k 7 2>/dev/null | tail -1
+./bin/run -d $dir/count.txt $dir/lines.txt -w 1 -k 1 -f half 2>&1
+echo "Expected: long: line 100, line 101, line 200, 1692, on 8 shards; 1692 for any split; 746.0 on 1 shard"
+
+# A worker killed mid-run: its shard goes to the other one
+cat > $dir/slow.txt <<EOF
+func map(s)
+  sleep(50)
+  println(s)
+  return 1
+end
+EOF
+./bin/run -r $dir/w1 2> $dir/w1.log &
+w1=$!
+./bin/run -r $dir/w2 2> $dir/w2.log &
+w2=$!
+while [ ! -S $dir/w1 ] || [ ! -S $dir/w2 ]; do sleep 0.1; done
+head -40 $dir/lines.txt > $dir/some.txt
+(sleep 0.5; kill $w1) &
+./bin/run -d $dir/slow.txt $dir/some.txt -k 20 -a $dir/w1 -a $dir/w2 > $dir/out 2> $dir/log
+echo "status $?"
+sed -n '1p;$p' $dir/out
+wc -l < $dir/out
+grep -q " [1-9][0-9]* retried" $dir/log && echo "retried"
+kill $w2
+wait
+echo "Expected: status 0; line 1, 40; 41 lines; retried"
+
+# A TCP worker given only a port listens on 127.0.0.1
+port=$((20000 + $$ % 10000))
+./bin/run -r :$port 2> $dir/w3.log &
+w3=$!
+while ! grep -q listening $dir/w3.log; do sleep 0.1; done
+./bin/run -d $dir/count.txt $dir/lines.txt -a 127.0.0.1:$port 2>/dev/null | tail -1
+kill $w3
+wait
+echo "Expected: 1692"
+
+# Script errors fail the run, without retries
+./bin/run -d $dir/count.txt $dir/lines.txt -w 1 -f nope 2>&1
+echo "status $?"
+printf 'func map(s)\n  return s\nend\n' > $dir/str.txt
+./bin/run -d $dir/str.txt $dir/lines.txt -w 1 2>&1
+echo "status $?"
+./bin/run -d $dir/count.txt $dir/lines.txt -a $dir/none 2>&1 | sed "s#$dir/##"
+./bin/run -d $dir/count.txt
+echo "Expected: nope() not defined; map() returned a string; can't connect, no workers; usage"
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# Run the same script in many interpreters at once, each parsing it, then
+# all sharing one loaded program
+./bin/stress 4 10 | head -1
+./bin/stress 4 10 | grep -c "runs/s"
+echo "Expected: result: 96651; 4"
+
+./bin/stress 0
+echo "Expected: usage"
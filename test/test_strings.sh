@@ -0,0 +1,33 @@
+#!/bin/sh
+
+# String equality compares contents, whether interned or built at run time
+./bin/run <<EOF
+a = "abc"
+b = "ab" + "c"
+c = "abc"
+if a == b
+  println("a == b")
+end
+if a == c
+  println("a == c")
+end
+if a != "abd"
+  println("a != abd")
+end
+if a == 0
+  println("wrong: a == 0")
+end
+if "" == ""
+  println("empty")
+end
+x = "a long string that is not inline"
+y = "a long string that is not" + " inline"
+if x == y
+  println("x == y")
+end
+y = y + "!"
+if x != y
+  println("x != y")
+end
+EOF
+echo "Expected: a == b; a == c; a != abd; empty; x == y; x != y"
@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# Tasks take turns at each yield, after the main task yields or ends
+./bin/run <<EOF
+func worker(name, n)
+  i = 0
+  while i < n
+    println(name + " " + i)
+    i = i + 1
+    yield
+  end
+end
+a = spawn worker("a", 3)
+b = spawn worker("b", 2)
+println("spawned " + a + " " + b)
+yield
+println("main")
+EOF
+echo "Expected: spawned 1 2; a 0; b 0; main; a 1; b 1; a 2"
+
+# A yield in a nested call suspends the whole task, and tasks can spawn
+./bin/run <<EOF
+func pause(name)
+  println(name + " pauses")
+  yield
+  println(name + " resumes")
+  return 1
+end
+func child()
+  println("child")
+end
+func parent()
+  x = pause("parent")
+  spawn child()
+  println("parent " + x)
+end
+spawn parent()
+println("main ends")
+EOF
+echo "Expected: main ends; parent pauses; parent resumes; parent 1; child"
+
+# Errors
+echo 'spawn println("x")' | ./bin/run 2>&1
+echo 'func f(a)
+end
+spawn f()' | ./bin/run 2>&1
+echo 'spawn g()' | ./bin/run 2>&1
+echo 'func f()
+  x = 1 + "a" * 2
+end
+spawn f()
+yield
+println("not reached")' | ./bin/run 2>&1
+echo "Expected: can't spawn native println; f expects 1 argument; undefined g; error in the task"